@@ -18,12 +18,14 @@
 
 #include <sys/epoll.h>
 
+#include <chrono>
+#include <cstdint>
 #include <memory>
 #include <mutex>
 #include <optional>
-#include <set>
 #include <shared_mutex>
 #include <string>
+#include <vector>
 
 #include "common/libs/fs/shared_fd.h"
 #include "common/libs/utils/result.h"
@@ -51,7 +53,9 @@ Epoll::Epoll(Epoll&& other) {
   std::lock(own_watched, own_epoll, other_epoll, other_watched);
 
   epoll_fd_ = std::move(other.epoll_fd_);
+  ids_ = std::move(other.ids_);
   watched_ = std::move(other.watched_);
+  next_id_ = other.next_id_;
 }
 
 Epoll& Epoll::operator=(Epoll&& other) {
@@ -62,7 +66,9 @@ Epoll& Epoll::operator=(Epoll&& other) {
   std::lock(own_watched, own_epoll, other_epoll, other_watched);
 
   epoll_fd_ = std::move(other.epoll_fd_);
+  ids_ = std::move(other.ids_);
   watched_ = std::move(other.watched_);
+  next_id_ = other.next_id_;
   return *this;
 }
 
@@ -72,12 +78,13 @@ Result<void> Epoll::Add(SharedFD fd, uint32_t events) {
   std::lock(watched_lock, epoll_lock);
   CF_EXPECT(epoll_fd_->IsOpen(), "Empty Epoll instance");
 
-  if (watched_.count(fd) != 0) {
+  if (ids_.count(fd) != 0) {
     return CF_ERRNO("Watched set already contains fd");
   }
+  uint64_t id = next_id_++;
   epoll_event event;
   event.events = events;
-  event.data.fd = fd->fd_;
+  event.data.u64 = id;
   int success = epoll_ctl(epoll_fd_->fd_, EPOLL_CTL_ADD, fd->fd_, &event);
   if (success != 0 && errno == EEXIST) {
     // We're already tracking this fd, don't drop it from the set.
@@ -85,7 +92,8 @@ Result<void> Epoll::Add(SharedFD fd, uint32_t events) {
   } else if (success != 0) {
     return CF_ERRNO("epoll_ctl: Add failed");
   }
-  watched_.insert(fd);
+  ids_[fd] = id;
+  watched_[id] = fd;
   return {};
 }
 
@@ -95,16 +103,19 @@ Result<void> Epoll::AddOrModify(SharedFD fd, uint32_t events) {
   std::lock(watched_lock, epoll_lock);
   CF_EXPECT(epoll_fd_->IsOpen(), "Empty Epoll instance");
 
+  auto it = ids_.find(fd);
+  int operation = it == ids_.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  uint64_t id = it == ids_.end() ? next_id_++ : it->second;
   epoll_event event;
   event.events = events;
-  event.data.fd = fd->fd_;
-  int operation = watched_.count(fd) == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  event.data.u64 = id;
   int success = epoll_ctl(epoll_fd_->fd_, operation, fd->fd_, &event);
   if (success != 0) {
     std::string operation_str = operation == EPOLL_CTL_ADD ? "add" : "modify";
     return CF_ERRNO("epoll_ctl: Operation " << operation_str << " failed");
   }
-  watched_.insert(fd);
+  ids_[fd] = id;
+  watched_[id] = fd;
   return {};
 }
 
@@ -114,12 +125,13 @@ Result<void> Epoll::Modify(SharedFD fd, uint32_t events) {
   std::lock(watched_lock, epoll_lock);
   CF_EXPECT(epoll_fd_->IsOpen(), "Empty Epoll instance");
 
-  if (watched_.count(fd) == 0) {
+  auto it = ids_.find(fd);
+  if (it == ids_.end()) {
     return CF_ERR("Watched set did not contain fd");
   }
   epoll_event event;
   event.events = events;
-  event.data.fd = fd->fd_;
+  event.data.u64 = it->second;
   int success = epoll_ctl(epoll_fd_->fd_, EPOLL_CTL_MOD, fd->fd_, &event);
   if (success != 0) {
     return CF_ERRNO("epoll_ctl: Modify failed");
@@ -133,48 +145,58 @@ Result<void> Epoll::Delete(SharedFD fd) {
   std::lock(watched_lock, epoll_lock);
   CF_EXPECT(epoll_fd_->IsOpen(), "Empty Epoll instance");
 
-  if (watched_.count(fd) == 0) {
+  auto it = ids_.find(fd);
+  if (it == ids_.end()) {
     return CF_ERR("Watched set did not contain fd");
   }
   int success = epoll_ctl(epoll_fd_->fd_, EPOLL_CTL_DEL, fd->fd_, nullptr);
   if (success != 0) {
     return CF_ERRNO("epoll_ctl: Delete failed");
   }
-  watched_.erase(fd);
+  watched_.erase(it->second);
+  ids_.erase(it);
   return {};
 }
 
 Result<std::optional<EpollEvent>> Epoll::Wait() {
-  epoll_event event;
-  int success;
+  auto events = CF_EXPECT(Wait(1, std::nullopt));
+  if (events.empty()) {
+    return {};
+  }
+  return std::move(events[0]);
+}
+
+Result<std::vector<EpollEvent>> Epoll::Wait(
+    size_t max_events, std::optional<std::chrono::milliseconds> timeout) {
+  CF_EXPECT(max_events > 0, "Can't wait for zero events");
+  std::vector<epoll_event> raw_events(max_events);
+  int timeout_ms = timeout ? static_cast<int>(timeout->count()) : -1;
+  int count;
   {
     std::shared_lock lock(epoll_mutex_);
     CF_EXPECT(epoll_fd_->IsOpen(), "Empty Epoll instance");
-    success = TEMP_FAILURE_RETRY(epoll_wait(epoll_fd_->fd_, &event, 1, -1));
+    count = TEMP_FAILURE_RETRY(epoll_wait(
+        epoll_fd_->fd_, raw_events.data(), raw_events.size(), timeout_ms));
   }
-  if (success == -1) {
+  if (count == -1) {
     return CF_ERRNO("epoll_wait failed");
-  } else if (success == 0) {
-    return {};
-  } else if (success != 1) {
-    return CF_ERR("epoll_wait returned an unexpected value");
   }
-  EpollEvent ret;
-  ret.events = event.events;
+  std::vector<EpollEvent> events;
+  events.reserve(count);
   std::shared_lock lock(watched_mutex_);
-  for (const auto& watched : watched_) {
-    if (watched->fd_ == event.data.fd) {
-      ret.fd = watched;
-      break;
+  for (int i = 0; i < count; i++) {
+    auto it = watched_.find(raw_events[i].data.u64);
+    if (it == watched_.end()) {
+      // The file descriptor was deleted after the event was queued. Treat
+      // this as a spurious wakeup.
+      continue;
     }
+    EpollEvent event;
+    event.fd = it->second;
+    event.events = raw_events[i].events;
+    events.emplace_back(std::move(event));
   }
-  if (!ret.fd->IsOpen()) {
-    // Couldn't find the matching SharedFD to the file descriptor. We probably
-    // lost the race to lock watched_mutex_ against a delete call. Treat this
-    // as a spurious wakeup.
-    return {};
-  }
-  return ret;
+  return events;
 }
 
 }  // namespace cuttlefish
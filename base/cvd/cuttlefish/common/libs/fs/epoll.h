@@ -18,10 +18,14 @@
 
 #include <sys/epoll.h>
 
+#include <chrono>
+#include <cstdint>
+#include <map>
 #include <memory>
 #include <optional>
-#include <set>
 #include <shared_mutex>
+#include <unordered_map>
+#include <vector>
 
 #include "common/libs/fs/shared_fd.h"
 #include "common/libs/utils/result.h"
@@ -45,6 +49,12 @@ class Epoll {
   Result<void> AddOrModify(SharedFD fd, uint32_t events);
   Result<void> Delete(SharedFD fd);
   Result<std::optional<EpollEvent>> Wait();
+  /**
+   * Returns up to `max_events` events from a single epoll_wait call, or none
+   * if `timeout` passes first. Waits indefinitely without a timeout.
+   */
+  Result<std::vector<EpollEvent>> Wait(
+      size_t max_events, std::optional<std::chrono::milliseconds> timeout);
 
  private:
   Epoll(SharedFD);
@@ -61,11 +71,19 @@ class Epoll {
   std::shared_mutex epoll_mutex_;
   SharedFD epoll_fd_;
   /**
-   * This read-write mutex is read-locked when interacting with it as a const
-   * std::set, and write-locked when interacting with it as a std::set.
+   * This read-write mutex is read-locked when looking up watched file
+   * descriptors, and write-locked when changing the watched set.
    */
   std::shared_mutex watched_mutex_;
-  std::set<SharedFD> watched_;
+  /**
+   * Every registration gets an id which is stored in the epoll_data of its
+   * events. Ids are never reused, so an event that was already queued when
+   * its file descriptor was deleted can't be mistaken for an event on a newer
+   * registration that reuses the same file descriptor number.
+   */
+  std::map<SharedFD, uint64_t> ids_;
+  std::unordered_map<uint64_t, SharedFD> watched_;
+  uint64_t next_id_ = 0;
 };
 
 }  // namespace cuttlefish
@@ -14,6 +14,10 @@
  * limitations under the License.
  */
 
+#include <limits.h>
+#include <sys/uio.h>
+
+#include <algorithm>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -47,6 +51,42 @@ ssize_t WriteAll(SharedFD fd, const char* buf, size_t size) {
   return total_written;
 }
 
+ssize_t WriteAll(SharedFD fd, std::vector<struct iovec> buffers) {
+  size_t total_size = 0;
+  for (const auto& buffer : buffers) {
+    total_size += buffer.iov_len;
+  }
+  size_t total_written = 0;
+  size_t next = 0;
+  while (total_written < total_size) {
+    while (buffers[next].iov_len == 0) {
+      next++;
+    }
+    int count = std::min<size_t>(buffers.size() - next, IOV_MAX);
+    ssize_t written = fd->Writev(&buffers[next], count);
+    if (written <= 0) {
+      if (written < 0) {
+        errno = fd->GetErrno();
+        return written;
+      }
+      return total_written;
+    }
+    total_written += written;
+    // Skip the buffers written completely, and the written part of the next.
+    for (size_t remaining = written; remaining > 0; next++) {
+      if (buffers[next].iov_len > remaining) {
+        buffers[next].iov_base =
+            static_cast<char*>(buffers[next].iov_base) + remaining;
+        buffers[next].iov_len -= remaining;
+        break;
+      }
+      remaining -= buffers[next].iov_len;
+      buffers[next].iov_len = 0;
+    }
+  }
+  return total_written;
+}
+
 ssize_t ReadExact(SharedFD fd, char* buf, size_t size) {
   size_t total_read = 0;
   ssize_t read = 0;
@@ -15,6 +15,8 @@
  */
 #pragma once
 
+#include <sys/uio.h>
+
 #include <string>
 #include <thread>
 #include <vector>
@@ -140,6 +142,20 @@ ssize_t WriteAll(SharedFD fd, const std::vector<char>& buf);
  */
 ssize_t WriteAll(SharedFD fd, const char* buf, size_t size);
 
+/**
+ * Writes to fd until writing all bytes in all of the buffers, in order.
+ *
+ * Each call to the underlying writev(2) gathers as many of the buffers as the
+ * system allows, so a large number of small buffers doesn't turn into a large
+ * number of writes.
+ *
+ * On a successful write, returns the total size of the buffers.
+ *
+ * If a write error is encountered, returns -1. Some data may have already been
+ * written to fd at that point.
+ */
+ssize_t WriteAll(SharedFD fd, std::vector<struct iovec> buffers);
+
 /**
  * Writes to fd until `sizeof(T)` bytes are written from binary_data.
  *
@@ -411,6 +411,19 @@ SharedFD SharedFD::Event(int initval, int flags) {
   int fd = eventfd(initval, flags);
   return std::shared_ptr<FileInstance>(new FileInstance(fd, errno));
 }
+
+SharedFD SharedFD::TimerFd(int clockid, int flags) {
+  errno = 0;
+  int fd = timerfd_create(clockid, flags);
+  return std::shared_ptr<FileInstance>(new FileInstance(fd, errno));
+}
+
+SharedFD SharedFD::PidFd(pid_t pid) {
+  errno = 0;
+  // pidfds are always close-on-exec.
+  int fd = syscall(SYS_pidfd_open, pid, 0);
+  return std::shared_ptr<FileInstance>(new FileInstance(fd, errno));
+}
 #endif
 
 SharedFD SharedFD::MemfdCreate(const std::string& name, unsigned int flags) {
@@ -936,6 +949,14 @@ int FileInstance::EventfdRead(eventfd_t* value) {
   errno_ = errno;
   return rval;
 }
+
+int FileInstance::TimerfdRead(uint64_t* expirations) {
+  errno = 0;
+  ssize_t rval =
+      TEMP_FAILURE_RETRY(read(fd_, expirations, sizeof(*expirations)));
+  errno_ = errno;
+  return rval == sizeof(*expirations) ? 0 : -1;
+}
 #endif
 
 ssize_t FileInstance::Send(const void* buf, size_t len, int flags) {
@@ -1035,6 +1056,13 @@ ssize_t FileInstance::Write(const void* buf, size_t count) {
   return rval;
 }
 
+ssize_t FileInstance::Writev(const struct iovec* iov, int iovcnt) {
+  errno = 0;
+  ssize_t rval = TEMP_FAILURE_RETRY(writev(fd_, iov, iovcnt));
+  errno_ = errno;
+  return rval;
+}
+
 #ifdef __linux__
 int FileInstance::EventfdWrite(eventfd_t value) {
   errno = 0;
@@ -1042,6 +1070,13 @@ int FileInstance::EventfdWrite(eventfd_t value) {
   errno_ = errno;
   return rval;
 }
+
+int FileInstance::TimerfdSet(const struct itimerspec& value) {
+  errno = 0;
+  int rval = timerfd_settime(fd_, 0, &value, nullptr);
+  errno_ = errno;
+  return rval;
+}
 #endif
 
 bool FileInstance::IsATTY() {
@@ -22,6 +22,7 @@
 #ifdef __linux__
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #endif
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
@@ -151,6 +152,10 @@ class SharedFD {
   static bool Pipe(SharedFD* fd0, SharedFD* fd1);
 #ifdef __linux__
   static SharedFD Event(int initval = 0, int flags = 0);
+  static SharedFD TimerFd(int clockid = CLOCK_MONOTONIC,
+                          int flags = TFD_CLOEXEC);
+  // Readable once the process exits. Fails with ENOSYS before Linux 5.3.
+  static SharedFD PidFd(pid_t pid);
 #endif
   static SharedFD MemfdCreate(const std::string& name, unsigned int flags = 0);
   static SharedFD MemfdCreateWithData(const std::string& name, const std::string& data, unsigned int flags = 0);
@@ -353,6 +358,8 @@ class FileInstance {
   ssize_t Read(void* buf, size_t count);
 #ifdef __linux__
   int EventfdRead(eventfd_t* value);
+  // Reads the number of expirations since the last read.
+  int TimerfdRead(uint64_t* expirations);
 #endif
   ssize_t Send(const void* buf, size_t len, int flags);
   ssize_t SendMsg(const struct msghdr* msg, int flags);
@@ -384,8 +391,11 @@ class FileInstance {
    *
    */
   ssize_t Write(const void* buf, size_t count);
+  // Gathers the buffers into a single write, see writev(2).
+  ssize_t Writev(const struct iovec* iov, int iovcnt);
 #ifdef __linux__
   int EventfdWrite(eventfd_t value);
+  int TimerfdSet(const struct itimerspec& value);
 #endif
   bool IsATTY();
 
@@ -26,6 +26,7 @@
 #include <android-base/strings.h>
 
 #include "common/libs/utils/subprocess.h"
+#include "common/libs/utils/trace.h"
 
 namespace cuttlefish {
 namespace {
@@ -80,6 +81,7 @@ bool Archive::ExtractAll(const std::string& target_directory) {
 
 bool Archive::ExtractFiles(const std::vector<std::string>& to_extract,
                            const std::string& target_directory) {
+  TraceSpan trace("Archive::ExtractFiles", file_);
   Command bsdtar_cmd("/usr/bin/bsdtar");
   bsdtar_cmd.AddParameter("-x");
   bsdtar_cmd.AddParameter("-v");
@@ -105,6 +107,7 @@ bool Archive::ExtractFiles(const std::vector<std::string>& to_extract,
 }
 
 std::string Archive::ExtractToMemory(const std::string& path) {
+  TraceSpan trace("Archive::ExtractToMemory", path);
   Command bsdtar_cmd("/usr/bin/bsdtar");
   bsdtar_cmd.AddParameter("-xf");
   bsdtar_cmd.AddParameter(file_);
@@ -19,17 +19,14 @@
 #ifdef __linux__
 #include <linux/fiemap.h>
 #include <linux/fs.h>
-#include <sys/inotify.h>
 #include <sys/sendfile.h>
 #endif
 
 #include <dirent.h>
 #include <fcntl.h>
-#include <ftw.h>
 #include <libgen.h>
 #include <sched.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -38,21 +35,29 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cerrno>
 #include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <future>
 #include <ios>
 #include <iosfwd>
 #include <istream>
 #include <memory>
+#include <mutex>
 #include <numeric>
+#include <optional>
 #include <ostream>
 #include <ratio>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -64,7 +69,7 @@
 #include "common/libs/fs/shared_buf.h"
 #include "common/libs/fs/shared_fd.h"
 #include "common/libs/utils/contains.h"
-#include "common/libs/utils/inotify.h"
+#include "common/libs/utils/readiness_waiter.h"
 #include "common/libs/utils/result.h"
 #include "common/libs/utils/subprocess.h"
 #include "common/libs/utils/users.h"
@@ -180,38 +185,114 @@ bool IsDirectoryEmpty(const std::string& path) {
   return true;
 }
 
-bool RecursivelyRemoveDirectory(const std::string& path) {
-  // Copied from libbase TemporaryDir destructor.
-  auto callback = [](const char* child, const struct stat*, int file_type,
-                     struct FTW*) -> int {
-    switch (file_type) {
-      case FTW_D:
-      case FTW_DP:
-      case FTW_DNR:
-        if (rmdir(child) == -1) {
-          PLOG(ERROR) << "rmdir " << child;
-        }
-        break;
-      case FTW_NS:
-      default:
-        if (rmdir(child) != -1) {
-          break;
-        }
-        // FALLTHRU (for gcc, lint, pcc, etc; and following for clang)
-        FALLTHROUGH_INTENDED;
-      case FTW_F:
-      case FTW_SL:
-      case FTW_SLN:
-        if (unlink(child) == -1) {
-          PLOG(ERROR) << "unlink " << child;
-        }
-        break;
+namespace {
+
+bool IsDotOrDotDot(const char* name) {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// The listing gives the type on most file systems, only entries of unknown
+// type and symbolic links that may be followed need a stat.
+bool IsDirectoryEntry(int dir_fd, const struct dirent& entry,
+                      bool follow_symlinks) {
+  if (entry.d_type == DT_DIR) {
+    return true;
+  }
+  if (entry.d_type != DT_UNKNOWN &&
+      !(follow_symlinks && entry.d_type == DT_LNK)) {
+    return false;
+  }
+  struct stat st {};
+  int flags = follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW;
+  return fstatat(dir_fd, entry.d_name, &st, flags) == 0 && S_ISDIR(st.st_mode);
+}
+
+int OpenDirectoryAt(int dir_fd, const char* name, bool follow_symlinks) {
+  int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+  if (!follow_symlinks) {
+    flags |= O_NOFOLLOW;
+  }
+  return openat(dir_fd, name, flags);
+}
+
+// Calls `f(dir_fd, name, is_directory)` for the entries of the directory
+// open at `fd` until it returns false. Takes ownership of `fd`.
+template <typename F>
+void ForEachDirectoryEntry(int fd, bool follow_symlinks, F f) {
+  DIR* dir = fdopendir(fd);
+  if (dir == nullptr) {
+    close(fd);
+    return;
+  }
+  while (struct dirent* entry = readdir(dir)) {
+    if (IsDotOrDotDot(entry->d_name)) {
+      continue;
     }
-    return 0;
-  };
+    bool is_directory = IsDirectoryEntry(dirfd(dir), *entry, follow_symlinks);
+    if (!f(dirfd(dir), entry->d_name, is_directory)) {
+      break;
+    }
+  }
+  closedir(dir);
+}
+
+// Removes everything under the directory open at `fd`, without crossing into
+// other file systems. Takes ownership of `fd`.
+void RemoveDirectoryContents(int fd, dev_t dev, const std::string& path) {
+  // Entries are removed after reading the whole directory, unlinking while
+  // readdir is in progress may skip entries.
+  std::vector<std::pair<std::string, bool>> entries;
+  int dir_fd = dup(fd);
+  ForEachDirectoryEntry(fd, /* follow_symlinks */ false,
+                        [&entries](int, const char* name, bool is_directory) {
+                          entries.emplace_back(name, is_directory);
+                          return true;
+                        });
+  if (dir_fd < 0) {
+    PLOG(ERROR) << "dup " << path;
+    return;
+  }
+  for (const auto& [name, is_directory] : entries) {
+    if (is_directory) {
+      int child_fd = OpenDirectoryAt(dir_fd, name.c_str(), false);
+      struct stat st {};
+      if (child_fd >= 0 && fstat(child_fd, &st) == 0 && st.st_dev == dev) {
+        RemoveDirectoryContents(child_fd, dev, path + "/" + name);
+      } else if (child_fd >= 0) {
+        close(child_fd);
+      }
+      if (unlinkat(dir_fd, name.c_str(), AT_REMOVEDIR) == -1) {
+        PLOG(ERROR) << "rmdir " << path << "/" << name;
+      }
+    } else if (unlinkat(dir_fd, name.c_str(), 0) == -1) {
+      PLOG(ERROR) << "unlink " << path << "/" << name;
+    }
+  }
+  close(dir_fd);
+}
 
-  return nftw(path.c_str(), callback, 128, FTW_DEPTH | FTW_MOUNT | FTW_PHYS) ==
-         0;
+}  // namespace
+
+bool RecursivelyRemoveDirectory(const std::string& path) {
+  struct stat st {};
+  if (lstat(path.c_str(), &st) == -1) {
+    return false;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    if (unlink(path.c_str()) == -1) {
+      PLOG(ERROR) << "unlink " << path;
+    }
+    return true;
+  }
+  int fd = OpenDirectoryAt(AT_FDCWD, path.c_str(), false);
+  if (fd >= 0) {
+    RemoveDirectoryContents(fd, st.st_dev, path);
+  }
+  if (rmdir(path.c_str()) == -1) {
+    PLOG(ERROR) << "rmdir " << path;
+  }
+  return true;
 }
 
 namespace {
@@ -511,155 +592,283 @@ std::string FindImage(const std::string& search_path,
 
 std::string FindFile(const std::string& path, const std::string& target_name) {
   std::string ret;
-  WalkDirectory(path,
-                [&ret, &target_name](const std::string& filename) mutable {
-                  if (cpp_basename(filename) == target_name) {
-                    ret = filename;
-                  }
-                  return true;
-                });
+  WalkOptions options;
+  options.follow_symlinks = true;
+  auto callback = [&ret, &target_name](const WalkedFile& file) {
+    if (file.name == target_name) {
+      ret = file.path;
+      return WalkAction::kStop;
+    }
+    return WalkAction::kContinue;
+  };
+  WalkDirectoryTree(path, options, callback);
   return ret;
 }
 
-// Recursively enumerate files in |dir|, and invoke the callback function with
-// path to each file/directory.
 Result<void> WalkDirectory(
     const std::string& dir,
     const std::function<bool(const std::string&)>& callback) {
-  const auto files = CF_EXPECT(DirectoryContents(dir));
-  for (const auto& filename : files) {
-    if (filename == "." || filename == "..") {
-      continue;
-    }
-    auto file_path = dir + "/";
-    file_path.append(filename);
-    callback(file_path);
-    if (DirectoryExists(file_path)) {
-      WalkDirectory(file_path, callback);
-    }
-  }
+  WalkOptions options;
+  options.follow_symlinks = true;
+  auto walk_callback = [&callback](const WalkedFile& file) {
+    return callback(file.path) ? WalkAction::kContinue : WalkAction::kStop;
+  };
+  CF_EXPECT(WalkDirectoryTree(dir, options, walk_callback));
   return {};
 }
 
-#ifdef __linux__
-class InotifyWatcher {
+namespace {
+
+// Depth first, opening each directory relative to its parent and extending a
+// single path buffer.
+class DirectoryWalker {
  public:
-  InotifyWatcher(int inotify, const std::string& path, int watch_mode)
-      : inotify_(inotify) {
-    watch_ = inotify_add_watch(inotify_, path.c_str(), watch_mode);
+  DirectoryWalker(const WalkOptions& options,
+                  const std::function<WalkAction(const WalkedFile&)>& callback)
+      : options_(options), callback_(callback) {}
+
+  // Walks the directory open at `fd`, whose path is in `path`. Returns false
+  // once the callback stops the walk. Takes ownership of `fd`.
+  bool Walk(int fd, std::string& path) {
+    bool keep_going = true;
+    ForEachDirectoryEntry(
+        fd, options_.follow_symlinks,
+        [this, &path, &keep_going](int dir_fd, const char* name,
+                                   bool is_directory) {
+          if (options_.filter && !options_.filter(name, is_directory)) {
+            return true;
+          }
+          size_t path_size = path.size();
+          path.append("/").append(name);
+          WalkAction action = callback_({path, name, is_directory});
+          if (action == WalkAction::kStop) {
+            keep_going = false;
+          } else if (is_directory && action != WalkAction::kSkipDirectory) {
+            int child_fd = OpenDirectoryAt(dir_fd, name,
+                                           options_.follow_symlinks);
+            if (child_fd >= 0) {
+              keep_going = Walk(child_fd, path);
+            }
+          }
+          path.resize(path_size);
+          return keep_going;
+        });
+    return keep_going;
   }
-  virtual ~InotifyWatcher() { inotify_rm_watch(inotify_, watch_); }
 
  private:
-  int inotify_;
-  int watch_;
+  const WalkOptions& options_;
+  const std::function<WalkAction(const WalkedFile&)>& callback_;
 };
 
-static Result<void> WaitForFileInternal(const std::string& path, int timeoutSec,
-                                        int inotify) {
-  CF_EXPECT_NE(path, "", "Path is empty");
-
-  if (FileExists(path, true)) {
-    return {};
+// Each thread works through its own stack of directories and steals from the
+// others when it runs out.
+class ParallelDirectoryWalker {
+ public:
+  ParallelDirectoryWalker(
+      const WalkOptions& options,
+      const std::function<WalkAction(const WalkedFile&)>& callback)
+      : options_(options), callback_(callback), queues_(options.threads) {}
+
+  // Takes ownership of `fd`, the directory `dir` open already.
+  void Walk(int fd, const std::string& dir) {
+    // Queues the subdirectories of the root for the workers to start with.
+    ReadDirectory(0, fd, dir);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < queues_.size(); i++) {
+      threads.emplace_back([this, i]() { Work(i); });
+    }
+    Work(0);
+    for (auto& thread : threads) {
+      thread.join();
+    }
   }
 
-  const auto targetTime =
-      std::chrono::system_clock::now() + std::chrono::seconds(timeoutSec);
-
-  const auto parentPath = cpp_dirname(path);
-  const auto filename = cpp_basename(path);
-
-  CF_EXPECT(WaitForFile(parentPath, timeoutSec),
-            "Error while waiting for parent directory creation");
-
-  auto watcher = InotifyWatcher(inotify, parentPath.c_str(), IN_CREATE);
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::string> directories;
+  };
 
-  if (FileExists(path, true)) {
+  void Push(size_t worker, std::string dir) {
+    unfinished_++;
+    {
+      std::lock_guard lock(queues_[worker].mutex);
+      queues_[worker].directories.emplace_back(std::move(dir));
+    }
+    queued_++;
+    // Taking the mutex orders this against a worker checking queued_ before
+    // it waits, so the notification can't be missed.
+    { std::lock_guard lock(idle_mutex_); }
+    idle_cv_.notify_one();
+  }
+
+  std::optional<std::string> Pop(size_t worker) {
+    for (size_t i = 0; i < queues_.size(); i++) {
+      auto& queue = queues_[(worker + i) % queues_.size()];
+      std::lock_guard lock(queue.mutex);
+      if (queue.directories.empty()) {
+        continue;
+      }
+      std::string dir;
+      // The owner takes the deepest directory, thieves the shallowest, which
+      // is likely to hold more work.
+      if (i == 0) {
+        dir = std::move(queue.directories.back());
+        queue.directories.pop_back();
+      } else {
+        dir = std::move(queue.directories.front());
+        queue.directories.pop_front();
+      }
+      queued_--;
+      return dir;
+    }
     return {};
   }
 
-  while (true) {
-    const auto currentTime = std::chrono::system_clock::now();
-
-    if (currentTime >= targetTime) {
-      return CF_ERR("Timed out");
+  void Work(size_t worker) {
+    while (true) {
+      auto dir = Pop(worker);
+      if (!dir) {
+        std::unique_lock lock(idle_mutex_);
+        idle_cv_.wait(lock, [this]() {
+          return stop_ || unfinished_ == 0 || queued_ > 0;
+        });
+        if (stop_ || unfinished_ == 0) {
+          return;
+        }
+        continue;
+      }
+      if (!stop_) {
+        ReadDirectory(worker, *dir);
+      }
+      if (--unfinished_ == 0) {
+        std::lock_guard lock(idle_mutex_);
+        idle_cv_.notify_all();
+      }
     }
+  }
 
-    const auto timeRemain =
-        std::chrono::duration_cast<std::chrono::microseconds>(targetTime -
-                                                              currentTime)
-            .count();
-    const auto secondInUsec =
-        std::chrono::microseconds(std::chrono::seconds(1)).count();
-    struct timeval timeout;
-
-    timeout.tv_sec = timeRemain / secondInUsec;
-    timeout.tv_usec = timeRemain % secondInUsec;
-
-    fd_set readfds;
-
-    FD_ZERO(&readfds);
-    FD_SET(inotify, &readfds);
-
-    auto ret = select(inotify + 1, &readfds, NULL, NULL, &timeout);
-
-    if (ret == 0) {
-      return CF_ERR("select() timed out");
-    } else if (ret < 0) {
-      return CF_ERRNO("select() failed");
+  void ReadDirectory(size_t worker, const std::string& dir) {
+    int fd = OpenDirectoryAt(AT_FDCWD, dir.c_str(), options_.follow_symlinks);
+    if (fd >= 0) {
+      ReadDirectory(worker, fd, dir);
     }
+  }
 
-    auto names = GetCreatedFileListFromInotifyFd(inotify);
+  void ReadDirectory(size_t worker, int fd, const std::string& dir) {
+    std::string path = dir + "/";
+    const size_t dir_size = path.size();
+    ForEachDirectoryEntry(
+        fd, options_.follow_symlinks,
+        [this, worker, &path, dir_size](int, const char* name,
+                                        bool is_directory) {
+          if (stop_) {
+            return false;
+          }
+          if (options_.filter && !options_.filter(name, is_directory)) {
+            return true;
+          }
+          path.resize(dir_size);
+          path.append(name);
+          WalkAction action = callback_({path, name, is_directory});
+          if (action == WalkAction::kStop) {
+            std::lock_guard lock(idle_mutex_);
+            stop_ = true;
+            idle_cv_.notify_all();
+            return false;
+          }
+          if (is_directory && action != WalkAction::kSkipDirectory) {
+            Push(worker, path);
+          }
+          return true;
+        });
+  }
+
+  const WalkOptions& options_;
+  const std::function<WalkAction(const WalkedFile&)>& callback_;
+  std::vector<Queue> queues_;
+  // Directories queued or being read.
+  std::atomic<size_t> unfinished_ = 0;
+  std::atomic<size_t> queued_ = 0;
+  std::atomic<bool> stop_ = false;
+  std::mutex idle_mutex_;
+  std::condition_variable idle_cv_;
+};
 
-    CF_EXPECT(names.size() > 0,
-              "Failed to get names from inotify " << strerror(errno));
+}  // namespace
 
-    if (Contains(names, filename)) {
-      return {};
-    }
+Result<void> WalkDirectoryTree(
+    const std::string& dir, const WalkOptions& options,
+    const std::function<WalkAction(const WalkedFile&)>& callback) {
+  int fd = OpenDirectoryAt(AT_FDCWD, dir.c_str(), /* follow_symlinks */ true);
+  CF_EXPECTF(fd >= 0, "Could not read from dir \"{}\": {}", dir,
+             strerror(errno));
+  if (options.threads > 1) {
+    ParallelDirectoryWalker(options, callback).Walk(fd, dir);
+  } else {
+    std::string path = dir;
+    DirectoryWalker(options, callback).Walk(fd, path);
   }
-
-  return CF_ERR("This shouldn't be executed");
+  return {};
 }
 
-auto WaitForFile(const std::string& path, int timeoutSec)
-    -> decltype(WaitForFileInternal(path, timeoutSec, 0)) {
-  android::base::unique_fd inotify(inotify_init1(IN_CLOEXEC));
+#ifdef __linux__
+namespace {
 
-  CF_EXPECT(WaitForFileInternal(path, timeoutSec, inotify.get()));
+struct SharedReadinessWaiter {
+  pid_t owner;
+  Result<std::unique_ptr<ReadinessWaiter>> waiter;
+};
 
+// Shared by all callers so concurrent waits use a single inotify instance and
+// thread. Leaked on purpose, waits may still be pending at exit.
+const SharedReadinessWaiter& GetSharedReadinessWaiter() {
+  static auto& shared =
+      *new SharedReadinessWaiter{getpid(), ReadinessWaiter::Create()};
+  return shared;
+}
+
+Result<void> WaitForReadiness(const std::string& path, bool unix_socket,
+                              int timeoutSec) {
+  const auto deadline =
+      ReadinessWaiter::Clock::now() + std::chrono::seconds(timeoutSec);
+  const auto& shared = GetSharedReadinessWaiter();
+  // A forked child, like the one running the prerequisites of a Command,
+  // doesn't have the shared waiter's thread and uses its own waiter instead.
+  std::unique_ptr<ReadinessWaiter> own_waiter;
+  ReadinessWaiter* waiter = nullptr;
+  if (shared.owner == getpid()) {
+    CF_EXPECTF(shared.waiter.ok(), "Failed to create the readiness waiter: {}",
+               shared.waiter.error().Message());
+    waiter = shared.waiter->get();
+  } else {
+    own_waiter = CF_EXPECT(ReadinessWaiter::Create());
+    waiter = own_waiter.get();
+  }
+  auto ready = unix_socket ? waiter->WaitForUnixSocket(path, deadline)
+                           : waiter->WaitForFile(path, deadline);
+  CF_EXPECTF(ready.wait_until(deadline) == std::future_status::ready,
+             "Timed out waiting for \"{}\"", path);
+  CF_EXPECT(ready.get());
   return {};
 }
 
-Result<void> WaitForUnixSocket(const std::string& path, int timeoutSec) {
-  const auto targetTime =
-      std::chrono::system_clock::now() + std::chrono::seconds(timeoutSec);
-
-  CF_EXPECT(WaitForFile(path, timeoutSec),
-            "Waiting for socket path creation failed");
-  CF_EXPECT(FileIsSocket(path), "Specified path is not a socket");
-
-  while (true) {
-    const auto currentTime = std::chrono::system_clock::now();
-
-    if (currentTime >= targetTime) {
-      return CF_ERR("Timed out");
-    }
-
-    const auto timeRemain = std::chrono::duration_cast<std::chrono::seconds>(
-                                targetTime - currentTime)
-                                .count();
-    auto testConnect =
-        SharedFD::SocketLocalClient(path, false, SOCK_STREAM, timeRemain);
-
-    if (testConnect->IsOpen()) {
-      return {};
-    }
+}  // namespace
 
-    sched_yield();
+Result<void> WaitForFile(const std::string& path, int timeoutSec) {
+  CF_EXPECT_NE(path, "", "Path is empty");
+  if (FileExists(path, true)) {
+    return {};
   }
+  CF_EXPECT(WaitForReadiness(path, /* unix_socket */ false, timeoutSec));
+  return {};
+}
 
-  return CF_ERR("This shouldn't be executed");
+Result<void> WaitForUnixSocket(const std::string& path, int timeoutSec) {
+  CF_EXPECT_NE(path, "", "Path is empty");
+  CF_EXPECT(WaitForReadiness(path, /* unix_socket */ true, timeoutSec));
+  return {};
 }
 #endif
 
@@ -19,8 +19,10 @@
 #include <sys/types.h>
 
 #include <chrono>
+#include <functional>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "common/libs/utils/result.h"
@@ -77,10 +79,59 @@ FileSizes SparseFileSizes(const std::string& path);
 // found file(if any)
 std::string FindFile(const std::string& path, const std::string& target_name);
 
+// Recursively enumerates the files in `dir`, invoking the callback with the
+// path to each file and directory. Stops when the callback returns false.
 Result<void> WalkDirectory(
     const std::string& dir,
     const std::function<bool(const std::string&)>& callback);
 
+// An entry found by WalkDirectoryTree.
+struct WalkedFile {
+  // The walked directory joined with the path of the entry relative to it.
+  const std::string& path;
+  std::string_view name;
+  // Symbolic links to directories only count when they are followed.
+  bool is_directory;
+};
+
+enum class WalkAction {
+  kContinue,
+  // Don't descend into the directory passed to the callback.
+  kSkipDirectory,
+  // End the walk.
+  kStop,
+};
+
+struct WalkOptions {
+  // Descends into symbolic links to directories, beware of cycles.
+  bool follow_symlinks = false;
+  // Skips the entries it returns false for, without building their path or
+  // descending into them.
+  std::function<bool(std::string_view name, bool is_directory)> filter;
+  // Reads up to this many directories at a time. With more than one thread
+  // the callback runs concurrently, and the order of the entries is
+  // unspecified beyond directories being visited before their contents.
+  size_t threads = 1;
+};
+
+/**
+ * Walks the tree under `dir`, invoking the callback for each entry with a
+ * directory visited before its contents.
+ *
+ * Directories are read relative to their parent's file descriptor, and the
+ * type of entries comes from the directory listing whenever the file system
+ * provides it, so most entries don't need a stat. Subdirectories that can't
+ * be read are skipped, only failing to read `dir` is an error. `dir` itself
+ * may be a symbolic link to a directory.
+ *
+ * With more than one thread, subdirectories are reopened by their full path
+ * instead, so renaming a directory while it is walked affects what is read
+ * below it.
+ */
+Result<void> WalkDirectoryTree(
+    const std::string& dir, const WalkOptions& options,
+    const std::function<WalkAction(const WalkedFile&)>& callback);
+
 #ifdef __linux__
 Result<void> WaitForFile(const std::string& path, int timeoutSec);
 Result<void> WaitForUnixSocket(const std::string& path, int timeoutSec);
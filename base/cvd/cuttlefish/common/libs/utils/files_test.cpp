@@ -15,6 +15,17 @@
 
 #include "common/libs/utils/files_test_helper.h"
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
 namespace cuttlefish {
 
 TEST_P(EmulateAbsolutePathBase, NoHomeNoPwd) {
@@ -53,20 +64,20 @@ TEST_P(EmulateAbsolutePathWithPwd, NoHomeYesPwd) {
 
 INSTANTIATE_TEST_SUITE_P(
     CommonUtilsTest, EmulateAbsolutePathWithPwd,
-    testing::Values(InputOutput{.working_dir_ = "/x/y/z",
-                                .path_to_convert_ = "",
+    testing::Values(InputOutput{.path_to_convert_ = "",
+                                .working_dir_ = "/x/y/z",
                                 .expected_ = ""},
-                    InputOutput{.working_dir_ = "/x/y/z",
-                                .path_to_convert_ = "a",
+                    InputOutput{.path_to_convert_ = "a",
+                                .working_dir_ = "/x/y/z",
                                 .expected_ = "/x/y/z/a"},
-                    InputOutput{.working_dir_ = "/x/y/z",
-                                .path_to_convert_ = ".",
+                    InputOutput{.path_to_convert_ = ".",
+                                .working_dir_ = "/x/y/z",
                                 .expected_ = "/x/y/z"},
-                    InputOutput{.working_dir_ = "/x/y/z",
-                                .path_to_convert_ = "..",
+                    InputOutput{.path_to_convert_ = "..",
+                                .working_dir_ = "/x/y/z",
                                 .expected_ = "/x/y"},
-                    InputOutput{.working_dir_ = "/x/y/z",
-                                .path_to_convert_ = "./k/../../t/./q",
+                    InputOutput{.path_to_convert_ = "./k/../../t/./q",
+                                .working_dir_ = "/x/y/z",
                                 .expected_ = "/x/y/t/q"}));
 
 TEST_P(EmulateAbsolutePathWithHome, YesHomeNoPwd) {
@@ -84,20 +95,128 @@ TEST_P(EmulateAbsolutePathWithHome, YesHomeNoPwd) {
 
 INSTANTIATE_TEST_SUITE_P(
     CommonUtilsTest, EmulateAbsolutePathWithHome,
-    testing::Values(InputOutput{.home_dir_ = "/x/y/z",
-                                .path_to_convert_ = "~",
+    testing::Values(InputOutput{.path_to_convert_ = "~",
+                                .home_dir_ = "/x/y/z",
                                 .expected_ = "/x/y/z"},
-                    InputOutput{.home_dir_ = "/x/y/z",
-                                .path_to_convert_ = "~/a",
+                    InputOutput{.path_to_convert_ = "~/a",
+                                .home_dir_ = "/x/y/z",
                                 .expected_ = "/x/y/z/a"},
-                    InputOutput{.home_dir_ = "/x/y/z",
-                                .path_to_convert_ = "~/.",
+                    InputOutput{.path_to_convert_ = "~/.",
+                                .home_dir_ = "/x/y/z",
                                 .expected_ = "/x/y/z"},
-                    InputOutput{.home_dir_ = "/x/y/z",
-                                .path_to_convert_ = "~/..",
+                    InputOutput{.path_to_convert_ = "~/..",
+                                .home_dir_ = "/x/y/z",
                                 .expected_ = "/x/y"},
-                    InputOutput{.home_dir_ = "/x/y/z",
-                                .path_to_convert_ = "~/k/../../t/./q",
+                    InputOutput{.path_to_convert_ = "~/k/../../t/./q",
+                                .home_dir_ = "/x/y/z",
                                 .expected_ = "/x/y/t/q"}));
 
+class WalkDirectoryTreeTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    root_ = temp_dir_.path;
+    ASSERT_EQ(mkdir((root_ + "/a").c_str(), 0755), 0);
+    ASSERT_EQ(mkdir((root_ + "/a/b").c_str(), 0755), 0);
+    ASSERT_EQ(mkdir((root_ + "/c").c_str(), 0755), 0);
+    for (const char* file : {"/x", "/a/y", "/a/b/z", "/c/w"}) {
+      ASSERT_TRUE(android::base::WriteStringToFile("", root_ + file));
+    }
+    ASSERT_EQ(symlink("a", (root_ + "/link").c_str()), 0);
+  }
+
+  std::vector<std::string> Walk(const WalkOptions& options,
+                                WalkAction directory_action) {
+    std::mutex mutex;
+    std::vector<std::string> paths;
+    auto callback = [&](const WalkedFile& file) {
+      std::lock_guard lock(mutex);
+      paths.emplace_back(file.path.substr(root_.size()));
+      return file.is_directory ? directory_action : WalkAction::kContinue;
+    };
+    auto result = WalkDirectoryTree(root_, options, callback);
+    EXPECT_TRUE(result.ok()) << result.error().Trace();
+    std::sort(paths.begin(), paths.end());
+    return paths;
+  }
+
+  TemporaryDir temp_dir_;
+  std::string root_;
+};
+
+TEST_F(WalkDirectoryTreeTest, WalksAllEntries) {
+  std::vector<std::string> expected = {"/a",  "/a/b", "/a/b/z", "/a/y",
+                                       "/c",  "/c/w", "/link",   "/x"};
+  ASSERT_EQ(Walk(WalkOptions(), WalkAction::kContinue), expected);
+
+  WalkOptions parallel;
+  parallel.threads = 4;
+  ASSERT_EQ(Walk(parallel, WalkAction::kContinue), expected);
+}
+
+TEST_F(WalkDirectoryTreeTest, FollowsSymlinks) {
+  WalkOptions options;
+  options.follow_symlinks = true;
+  std::vector<std::string> expected = {
+      "/a",    "/a/b",        "/a/b/z",    "/a/y", "/c", "/c/w",
+      "/link", "/link/b", "/link/b/z", "/link/y", "/x"};
+  ASSERT_EQ(Walk(options, WalkAction::kContinue), expected);
+}
+
+TEST_F(WalkDirectoryTreeTest, WalksSymlinkedRoot) {
+  root_ += "/link";
+  std::vector<std::string> expected = {"/b", "/b/z", "/y"};
+  for (size_t threads : {1, 4}) {
+    WalkOptions options;
+    options.threads = threads;
+    ASSERT_EQ(Walk(options, WalkAction::kContinue), expected) << threads;
+  }
+}
+
+TEST_F(WalkDirectoryTreeTest, SkipsDirectories) {
+  std::vector<std::string> expected = {"/a", "/c", "/link", "/x"};
+  ASSERT_EQ(Walk(WalkOptions(), WalkAction::kSkipDirectory), expected);
+
+  WalkOptions options;
+  options.filter = [](std::string_view name, bool is_directory) {
+    return name != "a" && !(name == "w" && !is_directory);
+  };
+  ASSERT_EQ(Walk(options, WalkAction::kContinue),
+            (std::vector<std::string>{"/c", "/link", "/x"}));
+}
+
+TEST_F(WalkDirectoryTreeTest, Stops) {
+  for (size_t threads : {1, 4}) {
+    WalkOptions options;
+    options.threads = threads;
+    // Stops at the first directory, before anything is queued.
+    auto paths = Walk(options, WalkAction::kStop);
+    ASSERT_EQ(std::count(paths.begin(), paths.end(), "/a") +
+                  std::count(paths.begin(), paths.end(), "/c"),
+              1);
+    for (const auto& path : paths) {
+      ASSERT_EQ(path.rfind('/'), 0) << path;
+    }
+  }
+}
+
+TEST_F(WalkDirectoryTreeTest, FailsOnMissingDirectory) {
+  auto callback = [](const WalkedFile&) { return WalkAction::kContinue; };
+  ASSERT_FALSE(
+      WalkDirectoryTree(root_ + "/missing", WalkOptions(), callback).ok());
+}
+
+TEST_F(WalkDirectoryTreeTest, FindFile) {
+  ASSERT_EQ(FindFile(root_, "w"), root_ + "/c/w");
+  ASSERT_EQ(FindFile(root_, "missing"), "");
+}
+
+TEST_F(WalkDirectoryTreeTest, RecursivelyRemoveDirectory) {
+  ASSERT_TRUE(RecursivelyRemoveDirectory(root_ + "/link"));
+  ASSERT_TRUE(FileExists(root_ + "/a/b/z"));
+  ASSERT_TRUE(RecursivelyRemoveDirectory(root_));
+  ASSERT_FALSE(FileExists(root_, /* follow_symlinks */ false));
+  ASSERT_FALSE(RecursivelyRemoveDirectory(root_));
+  ASSERT_EQ(mkdir(root_.c_str(), 0755), 0);
+}
+
 }  // namespace cuttlefish
@@ -26,6 +26,7 @@
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <tuple>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
@@ -333,6 +334,150 @@ std::vector<std::string> ArgsToVec(int argc, char** argv) {
   return args;
 }
 
+FlagMatcher::FlagMatcher(const std::vector<Flag>& flags) : flags_(flags) {
+  for (const auto& flag : flags_) {
+    for (const auto& alias : flag.aliases_) {
+      names_.emplace_back(alias.name);
+      std::replace(names_.back().begin(), names_.back().end(), '-', '_');
+    }
+  }
+  // `names_` doesn't change from here on, so views into it stay valid.
+  size_t name_index = 0;
+  for (size_t i = 0; i < flags_.size(); i++) {
+    const auto& aliases = flags_[i].aliases_;
+    for (size_t j = 0; j < aliases.size(); j++) {
+      std::string_view name = names_[name_index++];
+      AliasRef ref{i, j};
+      if (aliases[j].mode != FlagAliasMode::kFlagPrefix) {
+        exact_[name].push_back(ref);
+      } else if (!name.empty() && name.back() == '=') {
+        prefix_[name].push_back(ref);
+      } else {
+        other_prefix_.emplace_back(name, ref);
+      }
+    }
+  }
+}
+
+void FlagMatcher::Lookup(const std::string& arg, std::string& normalized,
+                         std::vector<AliasRef>& refs) const {
+  normalized.assign(arg);
+  std::replace(normalized.begin(), normalized.end(), '-', '_');
+  std::string_view view = normalized;
+  if (auto it = exact_.find(view); it != exact_.end()) {
+    refs.insert(refs.end(), it->second.begin(), it->second.end());
+  }
+  for (auto eq = view.find('='); eq != std::string_view::npos;
+       eq = view.find('=', eq + 1)) {
+    if (auto it = prefix_.find(view.substr(0, eq + 1)); it != prefix_.end()) {
+      refs.insert(refs.end(), it->second.begin(), it->second.end());
+    }
+  }
+  for (const auto& [name, ref] : other_prefix_) {
+    if (view.substr(0, name.size()) == name) {
+      refs.push_back(ref);
+    }
+  }
+}
+
+/* Flags are applied one at a time in order like `Flag::Parse` does, since a
+ * flag consuming its value or an earlier flag removing arguments changes what
+ * the next flag sees. Each flag only visits the arguments it matched in the
+ * lookup, and removed arguments are unlinked instead of erased. */
+Result<void> FlagMatcher::Consume(std::vector<std::string>& args) const {
+  const size_t n = args.size();
+
+  // The arguments matched by each flag, with the first alias that matched.
+  std::vector<std::vector<std::pair<size_t, size_t>>> matches(flags_.size());
+  std::vector<AliasRef> refs;
+  std::string normalized;
+  for (size_t i = 0; i < n; i++) {
+    refs.clear();
+    Lookup(args[i], normalized, refs);
+    std::sort(refs.begin(), refs.end(), [](const auto& a, const auto& b) {
+      return std::tie(a.flag, a.alias) < std::tie(b.flag, b.alias);
+    });
+    for (size_t j = 0; j < refs.size(); j++) {
+      if (j == 0 || refs[j].flag != refs[j - 1].flag) {
+        matches[refs[j].flag].emplace_back(i, refs[j].alias);
+      }
+    }
+  }
+
+  // Circular list of the remaining arguments, with `n` as the head.
+  std::vector<size_t> next(n + 1);
+  std::vector<size_t> prev(n + 1);
+  for (size_t i = 0; i <= n; i++) {
+    next[i] = (i + 1) % (n + 1);
+    prev[i] = (i + n) % (n + 1);
+  }
+  std::vector<bool> removed(n, false);
+  size_t remaining = n;
+  auto remove = [&](size_t i) {
+    next[prev[i]] = next[i];
+    prev[next[i]] = prev[i];
+    removed[i] = true;
+    remaining--;
+  };
+  auto compact = android::base::make_scope_guard([&args, &removed, n]() {
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (!removed[i]) {
+        if (kept != i) {
+          args[kept] = std::move(args[i]);
+        }
+        kept++;
+      }
+    }
+    args.resize(kept);
+  });
+
+  for (size_t f = 0; f < flags_.size(); f++) {
+    const auto& flag = flags_[f];
+    if (!flag.setter_ && flag.aliases_.size() > 0 && remaining > 0) {
+      return CF_ERRF("No setter for flag with alias {}", flag.aliases_[0].name);
+    }
+    for (const auto& [i, alias_index] : matches[f]) {
+      if (removed[i]) {
+        continue;
+      }
+      const auto& arg = args[i];
+      const auto& alias = flag.aliases_[alias_index];
+      const auto& setter = *flag.setter_;
+      switch (alias.mode) {
+        case FlagAliasMode::kFlagConsumesArbitrary:
+          while (next[i] != n && !LikelyFlag(args[next[i]])) {
+            CF_EXPECTF(setter({arg, args[next[i]]}),
+                       "Processing \"{}\" \"{}\" failed", arg, args[next[i]]);
+            remove(next[i]);
+          }
+          CF_EXPECTF(setter({arg, ""}), "Processing \"{}\" failed", arg);
+          remove(i);
+          break;
+        case FlagAliasMode::kFlagConsumesFollowing:
+          CF_EXPECTF(next[i] != n, "Expected an argument after \"{}\"", arg);
+          CF_EXPECTF(setter({arg, args[next[i]]}),
+                     "Processing \"{}\" \"{}\" failed", arg, args[next[i]]);
+          remove(next[i]);
+          remove(i);
+          break;
+        case FlagAliasMode::kFlagExact:
+          CF_EXPECTF(setter({arg, arg}), "Processing \"{}\" failed", arg);
+          remove(i);
+          break;
+        case FlagAliasMode::kFlagPrefix:
+          CF_EXPECTF(setter({alias.name, arg.substr(alias.name.size())}),
+                     "Processing \"{}\" failed", arg);
+          remove(i);
+          break;
+        default:
+          return CF_ERRF("Unknown flag alias mode: {}", (int)alias.mode);
+      }
+    }
+  }
+  return {};
+}
+
 struct Separated {
   std::vector<std::string> args_before_mark;
   std::vector<std::string> args_after_mark;
@@ -358,17 +503,13 @@ static Separated SeparateByEndOfOptionMark(std::vector<std::string> args) {
 
 static Result<void> ConsumeFlagsImpl(const std::vector<Flag>& flags,
                                      std::vector<std::string>& args) {
-  for (const auto& flag : flags) {
-    CF_EXPECT(flag.Parse(args));
-  }
+  CF_EXPECT(FlagMatcher(flags).Consume(args));
   return {};
 }
 
 static Result<void> ConsumeFlagsImpl(const std::vector<Flag>& flags,
                                      std::vector<std::string>&& args) {
-  for (const auto& flag : flags) {
-    CF_EXPECT(flag.Parse(args));
-  }
+  CF_EXPECT(FlagMatcher(flags).Consume(args));
   return {};
 }
 
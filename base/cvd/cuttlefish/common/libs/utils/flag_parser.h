@@ -21,6 +21,9 @@
 #include <optional>
 #include <ostream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "common/libs/utils/result.h"
@@ -117,6 +120,7 @@ class Flag {
   bool HasAlias(const FlagAlias&) const;
 
   friend std::ostream& operator<<(std::ostream&, const Flag&);
+  friend class FlagMatcher;
   friend Flag InvalidFlagGuard();
   friend Flag UnexpectedArgumentGuard();
 
@@ -132,6 +136,40 @@ std::vector<std::string> ArgsToVec(int argc, char** argv);
 
 Result<bool> ParseBool(const std::string& value, const std::string& name);
 
+/* Matches a list of arguments against a fixed list of flags with the same
+ * results as calling `Flag::Parse` for each flag in order, without rescanning
+ * the arguments for every flag. The aliases are normalized once into lookup
+ * tables, the arguments are looked up once, and the unmatched arguments are
+ * compacted in place at the end.
+ *
+ * Keeps references to the flags, which must outlive the matcher. */
+class FlagMatcher {
+ public:
+  explicit FlagMatcher(const std::vector<Flag>& flags);
+
+  Result<void> Consume(std::vector<std::string>& args) const;
+
+ private:
+  struct AliasRef {
+    size_t flag;
+    size_t alias;
+  };
+
+  /* Appends the aliases matching `arg` to `refs`. */
+  void Lookup(const std::string& arg, std::string& normalized,
+              std::vector<AliasRef>& refs) const;
+
+  const std::vector<Flag>& flags_;
+  /* Normalized alias names, backing the keys of the tables below. */
+  std::vector<std::string> names_;
+  /* Aliases that match the whole argument. */
+  std::unordered_map<std::string_view, std::vector<AliasRef>> exact_;
+  /* Prefix aliases ending in "=", keyed by the name including the "=". */
+  std::unordered_map<std::string_view, std::vector<AliasRef>> prefix_;
+  /* Prefix aliases without the trailing "=", e.g. from `InvalidFlagGuard`. */
+  std::vector<std::pair<std::string_view, AliasRef>> other_prefix_;
+};
+
 /* Handles a list of flags. Flags are matched in the order given in case two
  * flags match the same argument. Matched flags are removed, leaving only
  * unmatched arguments. */
@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "common/libs/utils/flag_parser.h"
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+
+namespace cuttlefish {
+namespace {
+
+// About as many flags as launch_cvd has, a third of each type.
+constexpr int kNumFlags = 240;
+
+struct FlagSet {
+  FlagSet() {
+    for (int i = 0; i < kNumFlags / 3; i++) {
+      flags.emplace_back(GflagsCompatFlag("string_flag_" + std::to_string(i),
+                                          strings.emplace_back()));
+      flags.emplace_back(GflagsCompatFlag("int_flag_" + std::to_string(i),
+                                          ints.emplace_back()));
+      flags.emplace_back(GflagsCompatFlag("bool_flag_" + std::to_string(i),
+                                          bools.emplace_back()));
+    }
+  }
+
+  // Stable addresses for the flags to write to.
+  std::deque<std::string> strings;
+  std::deque<std::int32_t> ints;
+  std::deque<bool> bools;
+  std::vector<Flag> flags;
+};
+
+const FlagSet& Flags() {
+  static auto flags = new FlagSet();
+  return *flags;
+}
+
+// Sets `count` flags spread over the whole set, in all the accepted forms,
+// with a couple of arguments for the next parser.
+std::vector<std::string> Arguments(int count) {
+  std::vector<std::string> args = {"positional"};
+  for (int i = 0; i < count; i++) {
+    int n = i * kNumFlags / 3 / count;
+    switch (i % 4) {
+      case 0:
+        args.emplace_back("--string_flag_" + std::to_string(n) + "=value");
+        break;
+      case 1:
+        args.emplace_back("-int-flag-" + std::to_string(n));
+        args.emplace_back(std::to_string(i));
+        break;
+      case 2:
+        args.emplace_back("--bool_flag_" + std::to_string(n));
+        break;
+      case 3:
+        args.emplace_back("--nobool_flag_" + std::to_string(n));
+        break;
+    }
+  }
+  args.emplace_back("--unknown_flag=1");
+  return args;
+}
+
+void BM_ConsumeFlags(benchmark::State& state) {
+  const auto& flags = Flags().flags;
+  const auto args = Arguments(state.range(0));
+  for (auto _ : state) {
+    auto remaining = args;
+    CHECK(ConsumeFlags(flags, remaining).ok());
+    CHECK_EQ(remaining.size(), 2);
+  }
+}
+BENCHMARK(BM_ConsumeFlags)->Arg(0)->Arg(10)->Arg(100);
+
+// A matcher built once and kept for several argument lists normalizes the
+// aliases only once.
+void BM_FlagMatcherConsume(benchmark::State& state) {
+  const FlagMatcher matcher(Flags().flags);
+  const auto args = Arguments(state.range(0));
+  for (auto _ : state) {
+    auto remaining = args;
+    CHECK(matcher.Consume(remaining).ok());
+    CHECK_EQ(remaining.size(), 2);
+  }
+}
+BENCHMARK(BM_FlagMatcherConsume)->Arg(0)->Arg(10)->Arg(100);
+
+}  // namespace
+}  // namespace cuttlefish
@@ -400,6 +400,61 @@ TEST(FlagParser, EndOfOptionMark) {
   ASSERT_TRUE(flag);
 }
 
+TEST(FlagParser, ConsumeFlagsInFlagOrder) {
+  std::string first;
+  std::string second;
+  std::vector<Flag> flags{GflagsCompatFlag("first", first),
+                          GflagsCompatFlag("second", second)};
+  // "-first" takes its value before "-second" looks for one.
+  std::vector<std::string> args{"-second", "-first", "a", "b"};
+  ASSERT_THAT(ConsumeFlags(flags, args), IsOk());
+  ASSERT_EQ(first, "a");
+  ASSERT_EQ(second, "b");
+  ASSERT_EQ(args, std::vector<std::string>{});
+}
+
+TEST(FlagParser, ConsumeFlagsKeepsUnmatchedOrder) {
+  bool flag = false;
+  std::vector<std::string> list;
+  std::vector<Flag> flags{GflagsCompatFlag("flag", flag),
+                          GflagsCompatFlag("list", list)};
+  std::vector<std::string> args{"a", "--flag", "b", "--list=x,y", "c", "-d"};
+  ASSERT_THAT(ConsumeFlags(flags, args), IsOk());
+  ASSERT_TRUE(flag);
+  ASSERT_EQ(list, (std::vector<std::string>{"x", "y"}));
+  ASSERT_EQ(args, (std::vector<std::string>{"a", "b", "c", "-d"}));
+}
+
+TEST(FlagParser, ConsumeFlagsReportsFirstFlagError) {
+  std::int32_t first = 0;
+  std::int32_t second = 0;
+  std::vector<Flag> flags{GflagsCompatFlag("first", first),
+                          GflagsCompatFlag("second", second)};
+  std::vector<std::string> args{"-second=x", "-first=y"};
+  auto result = ConsumeFlags(flags, args);
+  ASSERT_THAT(result, IsError());
+  ASSERT_THAT(result.error().FormatForEnv(), testing::HasSubstr("\"y\""));
+  ASSERT_EQ(args, (std::vector<std::string>{"-second=x", "-first=y"}));
+}
+
+TEST(FlagParser, ConsumeFlagsArbitraryAfterRemovedFlag) {
+  std::string other;
+  std::vector<std::string> values;
+  auto arbitrary =
+      Flag()
+          .Alias({FlagAliasMode::kFlagConsumesArbitrary, "--flag"})
+          .Setter([&values](const FlagMatch& match) -> Result<void> {
+            values.push_back(match.value);
+            return {};
+          });
+  std::vector<Flag> flags{GflagsCompatFlag("other", other), arbitrary};
+  std::vector<std::string> args{"--flag", "--other=a", "v", "--next"};
+  ASSERT_THAT(ConsumeFlags(flags, args), IsOk());
+  ASSERT_EQ(other, "a");
+  ASSERT_EQ(values, (std::vector<std::string>{"v", ""}));
+  ASSERT_EQ(args, std::vector<std::string>{"--next"});
+}
+
 class FlagConsumesArbitraryTest : public ::testing::Test {
  protected:
   void SetUp() override {
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/libs/utils/readiness_waiter.h"
+
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <set>
+
+#include <android-base/logging.h>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/contains.h"
+#include "common/libs/utils/files.h"
+
+namespace cuttlefish {
+namespace {
+
+// How often to retry connecting to a socket file that exists but doesn't
+// accept connections yet. Listening doesn't generate inotify events.
+constexpr auto kSocketRetryPeriod = std::chrono::milliseconds(10);
+
+constexpr uint32_t kWatchMask = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR;
+
+Result<void> TimedOut(const std::string& path) {
+  return CF_ERR("Timed out waiting for \"" << path << "\"");
+}
+
+Result<void> NotASocket(const std::string& path) {
+  return CF_ERR("\"" << path << "\" is not a socket");
+}
+
+Result<void> Destroyed(const std::string& path) {
+  return CF_ERR("Stopped waiting for \"" << path << "\"");
+}
+
+Result<void> WatchFailed(const std::string& directory, int error) {
+  return CF_ERRF("Failed to watch \"{}\": {}", directory, strerror(error));
+}
+
+}  // namespace
+
+Result<std::unique_ptr<ReadinessWaiter>> ReadinessWaiter::Create() {
+  android::base::unique_fd epoll(epoll_create1(EPOLL_CLOEXEC));
+  CF_EXPECTF(epoll.get() >= 0, "epoll_create1 failed: {}", strerror(errno));
+  android::base::unique_fd inotify(inotify_init1(IN_CLOEXEC | IN_NONBLOCK));
+  CF_EXPECTF(inotify.get() >= 0, "inotify_init1 failed: {}", strerror(errno));
+  android::base::unique_fd wakeup(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  CF_EXPECTF(wakeup.get() >= 0, "eventfd failed: {}", strerror(errno));
+  for (int fd : {inotify.get(), wakeup.get()}) {
+    struct epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    CF_EXPECTF(epoll_ctl(epoll.get(), EPOLL_CTL_ADD, fd, &event) == 0,
+               "epoll_ctl failed: {}", strerror(errno));
+  }
+  return std::unique_ptr<ReadinessWaiter>(new ReadinessWaiter(
+      std::move(epoll), std::move(inotify), std::move(wakeup)));
+}
+
+ReadinessWaiter::ReadinessWaiter(android::base::unique_fd epoll,
+                                 android::base::unique_fd inotify,
+                                 android::base::unique_fd wakeup)
+    : epoll_(std::move(epoll)),
+      inotify_(std::move(inotify)),
+      wakeup_(std::move(wakeup)) {
+  thread_ = std::thread([this]() { Loop(); });
+}
+
+ReadinessWaiter::~ReadinessWaiter() {
+  {
+    std::lock_guard lock(incoming_mutex_);
+    stopping_ = true;
+  }
+  eventfd_write(wakeup_.get(), 1);
+  thread_.join();
+}
+
+void ReadinessWaiter::WaitForFile(const std::string& path,
+                                  Clock::time_point deadline,
+                                  Callback callback) {
+  Add(Request{path, false, deadline, std::move(callback)});
+}
+
+std::future<Result<void>> ReadinessWaiter::WaitForFile(
+    const std::string& path, Clock::time_point deadline) {
+  return AddWithFuture(path, false, deadline);
+}
+
+void ReadinessWaiter::WaitForUnixSocket(const std::string& path,
+                                        Clock::time_point deadline,
+                                        Callback callback) {
+  Add(Request{path, true, deadline, std::move(callback)});
+}
+
+std::future<Result<void>> ReadinessWaiter::WaitForUnixSocket(
+    const std::string& path, Clock::time_point deadline) {
+  return AddWithFuture(path, true, deadline);
+}
+
+Result<void> ReadinessWaiter::WaitForAll(
+    std::vector<std::future<Result<void>>> futures) {
+  Result<void> first_error;
+  for (auto& future : futures) {
+    auto result = future.get();
+    if (!result.ok() && first_error.ok()) {
+      first_error = std::move(result);
+    }
+  }
+  CF_EXPECT(std::move(first_error));
+  return {};
+}
+
+std::future<Result<void>> ReadinessWaiter::AddWithFuture(
+    const std::string& path, bool unix_socket, Clock::time_point deadline) {
+  auto promise = std::make_shared<std::promise<Result<void>>>();
+  auto future = promise->get_future();
+  Add(Request{path, unix_socket, deadline, [promise](Result<void> result) {
+                promise->set_value(std::move(result));
+              }});
+  return future;
+}
+
+void ReadinessWaiter::Add(Request request) {
+  {
+    std::lock_guard lock(incoming_mutex_);
+    incoming_.emplace_back(std::move(request));
+  }
+  eventfd_write(wakeup_.get(), 1);
+}
+
+void ReadinessWaiter::Loop() {
+  while (true) {
+    std::vector<Request> incoming;
+    bool stopping;
+    {
+      std::lock_guard lock(incoming_mutex_);
+      incoming = std::move(incoming_);
+      incoming_.clear();
+      stopping = stopping_;
+    }
+    if (stopping) {
+      for (auto& request : incoming) {
+        request.callback(Destroyed(request.path));
+      }
+      for (auto& request : pending_) {
+        Unwatch(request);
+        request.callback(Destroyed(request.path));
+      }
+      pending_.clear();
+      return;
+    }
+    for (auto& request : incoming) {
+      if (!Evaluate(request)) {
+        pending_.emplace_back(std::move(request));
+      }
+    }
+
+    int timeout_ms = -1;
+    if (!pending_.empty()) {
+      auto next = Clock::time_point::max();
+      for (const auto& request : pending_) {
+        next = std::min(next, request.deadline);
+        if (request.retry_at) {
+          next = std::min(next, *request.retry_at);
+        }
+      }
+      auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+          next - Clock::now());
+      timeout_ms = std::clamp<int64_t>(remaining.count(), 0, INT_MAX);
+    }
+
+    struct epoll_event events[2];
+    int num_events =
+        TEMP_FAILURE_RETRY(epoll_wait(epoll_.get(), events, 2, timeout_ms));
+    if (num_events < 0) {
+      PLOG(ERROR) << "epoll_wait failed";
+    }
+    std::set<int> fired;
+    std::set<int> removed;
+    for (int i = 0; i < num_events; i++) {
+      if (events[i].data.fd == wakeup_.get()) {
+        eventfd_t value;
+        eventfd_read(wakeup_.get(), &value);
+        continue;
+      }
+      struct inotify_event* event;
+      alignas(struct inotify_event) char buffer[4096];
+      ssize_t length;
+      while ((length = read(inotify_.get(), buffer, sizeof(buffer))) > 0) {
+        for (char* ptr = buffer; ptr < buffer + length;
+             ptr += sizeof(struct inotify_event) + event->len) {
+          event = reinterpret_cast<struct inotify_event*>(ptr);
+          fired.insert(event->wd);
+          if (event->mask & IN_IGNORED) {
+            removed.insert(event->wd);
+          }
+        }
+      }
+    }
+    // The watched directory was removed, its requests need a new ancestor.
+    for (int watch : removed) {
+      watches_.erase(watch);
+    }
+
+    const auto now = Clock::now();
+    for (auto it = pending_.begin(); it != pending_.end();) {
+      bool done = false;
+      if (Contains(removed, it->watch)) {
+        it->watch = -1;
+      }
+      if (it->watch == -1 || Contains(fired, it->watch) ||
+          (it->retry_at && *it->retry_at <= now)) {
+        it->retry_at.reset();
+        done = Evaluate(*it);
+      }
+      if (!done && it->deadline <= now) {
+        Unwatch(*it);
+        it->callback(TimedOut(it->path));
+        done = true;
+      }
+      it = done ? pending_.erase(it) : std::next(it);
+    }
+  }
+}
+
+bool ReadinessWaiter::Evaluate(Request& request) {
+  while (true) {
+    if (FileExists(request.path)) {
+      if (!request.unix_socket) {
+        Unwatch(request);
+        request.callback({});
+        return true;
+      }
+      if (!FileIsSocket(request.path)) {
+        Unwatch(request);
+        request.callback(NotASocket(request.path));
+        return true;
+      }
+      auto connection =
+          SharedFD::SocketLocalClient(request.path, false, SOCK_STREAM);
+      if (connection->IsOpen()) {
+        Unwatch(request);
+        request.callback({});
+        return true;
+      }
+      request.retry_at = Clock::now() + kSocketRetryPeriod;
+      return false;
+    }
+    // Wait on the closest ancestor that exists, and move down the tree as the
+    // missing directories get created.
+    std::string directory = cpp_dirname(request.path);
+    while (!DirectoryExists(directory)) {
+      auto parent = cpp_dirname(directory);
+      if (parent == directory) {
+        break;
+      }
+      directory = parent;
+    }
+    int watch = inotify_add_watch(inotify_.get(), directory.c_str(), kWatchMask);
+    if (watch < 0) {
+      Unwatch(request);
+      request.callback(WatchFailed(directory, errno));
+      return true;
+    }
+    if (watch == request.watch) {
+      return false;
+    }
+    Unwatch(request);
+    auto& watched = watches_[watch];
+    watched.path = directory;
+    watched.requests++;
+    request.watch = watch;
+    // Check again, the path may have been created before the watch was added.
+  }
+}
+
+void ReadinessWaiter::Unwatch(Request& request) {
+  if (request.watch == -1) {
+    return;
+  }
+  auto it = watches_.find(request.watch);
+  if (it != watches_.end() && --it->second.requests == 0) {
+    inotify_rm_watch(inotify_.get(), request.watch);
+    watches_.erase(it);
+  }
+  request.watch = -1;
+}
+
+}  // namespace cuttlefish
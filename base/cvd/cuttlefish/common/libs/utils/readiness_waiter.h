@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+/**
+ * Waits for many files and unix sockets to become available at once.
+ *
+ * A single thread multiplexes one inotify instance and an epoll instance over
+ * every pending wait, so waiting on N paths doesn't cost N inotify fds or N
+ * threads. Directories that don't exist yet are waited for by watching their
+ * closest existing ancestor.
+ *
+ * Completion callbacks run on the waiter thread and must not block.
+ */
+class ReadinessWaiter {
+ public:
+  using Clock = std::chrono::steady_clock;
+  using Callback = std::function<void(Result<void>)>;
+
+  static Result<std::unique_ptr<ReadinessWaiter>> Create();
+  // Fails the waits that are still pending.
+  ~ReadinessWaiter();
+
+  // Completes once `path` exists, following symlinks.
+  void WaitForFile(const std::string& path, Clock::time_point deadline,
+                   Callback callback);
+  std::future<Result<void>> WaitForFile(const std::string& path,
+                                        Clock::time_point deadline);
+
+  // Completes once `path` is a unix socket accepting connections.
+  void WaitForUnixSocket(const std::string& path, Clock::time_point deadline,
+                         Callback callback);
+  std::future<Result<void>> WaitForUnixSocket(const std::string& path,
+                                              Clock::time_point deadline);
+
+  // Blocks until all the futures complete, returning the first error.
+  static Result<void> WaitForAll(std::vector<std::future<Result<void>>>);
+
+ private:
+  struct Request {
+    std::string path;
+    bool unix_socket;
+    Clock::time_point deadline;
+    Callback callback;
+    int watch = -1;
+    // Sockets may exist before they listen, in which case connecting is
+    // retried at this time.
+    std::optional<Clock::time_point> retry_at;
+  };
+
+  ReadinessWaiter(android::base::unique_fd epoll,
+                  android::base::unique_fd inotify,
+                  android::base::unique_fd wakeup);
+
+  void Add(Request request);
+  std::future<Result<void>> AddWithFuture(const std::string& path,
+                                          bool unix_socket,
+                                          Clock::time_point deadline);
+  void Loop();
+  // Returns true when the request completed.
+  bool Evaluate(Request& request);
+  void Unwatch(Request& request);
+
+  android::base::unique_fd epoll_;
+  android::base::unique_fd inotify_;
+  android::base::unique_fd wakeup_;
+
+  std::mutex incoming_mutex_;
+  std::vector<Request> incoming_;
+  bool stopping_ = false;
+
+  // Only accessed from the waiter thread.
+  std::list<Request> pending_;
+  struct WatchedDirectory {
+    std::string path;
+    size_t requests;
+  };
+  std::map<int, WatchedDirectory> watches_;
+
+  std::thread thread_;
+};
+
+}  // namespace cuttlefish
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/libs/utils/readiness_waiter.h"
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/files.h"
+
+namespace cuttlefish {
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+std::future_status Poll(std::future<Result<void>>& future) {
+  return future.wait_for(milliseconds(50));
+}
+
+}  // namespace
+
+TEST(ReadinessWaiter, ExistingFile) {
+  TemporaryDir dir;
+  const std::string path = std::string(dir.path) + "/file";
+  ASSERT_TRUE(android::base::WriteStringToFile("", path));
+
+  auto waiter = ReadinessWaiter::Create();
+  ASSERT_TRUE(waiter.ok()) << waiter.error().Trace();
+  auto result = (*waiter)
+                    ->WaitForFile(path, ReadinessWaiter::Clock::now() + seconds(5))
+                    .get();
+  EXPECT_TRUE(result.ok()) << result.error().Trace();
+}
+
+TEST(ReadinessWaiter, ManyFilesInMissingDirectories) {
+  TemporaryDir dir;
+  const std::string root = dir.path;
+  auto waiter = ReadinessWaiter::Create();
+  ASSERT_TRUE(waiter.ok()) << waiter.error().Trace();
+
+  const auto deadline = ReadinessWaiter::Clock::now() + seconds(10);
+  std::vector<std::future<Result<void>>> futures;
+  futures.emplace_back((*waiter)->WaitForFile(root + "/a/b/c/first", deadline));
+  futures.emplace_back((*waiter)->WaitForFile(root + "/a/b/second", deadline));
+  futures.emplace_back((*waiter)->WaitForFile(root + "/third", deadline));
+  for (auto& future : futures) {
+    ASSERT_EQ(Poll(future), std::future_status::timeout);
+  }
+
+  ASSERT_TRUE(EnsureDirectoryExists(root + "/a/b/c").ok());
+  ASSERT_EQ(Poll(futures[0]), std::future_status::timeout);
+  ASSERT_TRUE(android::base::WriteStringToFile("", root + "/a/b/c/first"));
+  ASSERT_TRUE(android::base::WriteStringToFile("", root + "/a/b/second"));
+  // Moving into place must also be noticed.
+  ASSERT_TRUE(android::base::WriteStringToFile("", root + "/tmp"));
+  ASSERT_EQ(rename((root + "/tmp").c_str(), (root + "/third").c_str()), 0);
+
+  auto result = ReadinessWaiter::WaitForAll(std::move(futures));
+  EXPECT_TRUE(result.ok()) << result.error().Trace();
+}
+
+TEST(ReadinessWaiter, UnixSocket) {
+  TemporaryDir dir;
+  const std::string path = std::string(dir.path) + "/socket";
+  auto waiter = ReadinessWaiter::Create();
+  ASSERT_TRUE(waiter.ok()) << waiter.error().Trace();
+
+  auto future = (*waiter)->WaitForUnixSocket(
+      path, ReadinessWaiter::Clock::now() + seconds(10));
+  ASSERT_EQ(Poll(future), std::future_status::timeout);
+
+  auto server = SharedFD::SocketLocalServer(path, false, SOCK_STREAM, 0600);
+  ASSERT_TRUE(server->IsOpen()) << server->StrError();
+
+  auto result = future.get();
+  EXPECT_TRUE(result.ok()) << result.error().Trace();
+}
+
+TEST(ReadinessWaiter, NotASocket) {
+  TemporaryDir dir;
+  const std::string path = std::string(dir.path) + "/file";
+  ASSERT_TRUE(android::base::WriteStringToFile("", path));
+  auto waiter = ReadinessWaiter::Create();
+  ASSERT_TRUE(waiter.ok()) << waiter.error().Trace();
+
+  auto result = (*waiter)
+                    ->WaitForUnixSocket(
+                        path, ReadinessWaiter::Clock::now() + seconds(5))
+                    .get();
+  EXPECT_FALSE(result.ok());
+}
+
+TEST(ReadinessWaiter, Timeout) {
+  TemporaryDir dir;
+  auto waiter = ReadinessWaiter::Create();
+  ASSERT_TRUE(waiter.ok()) << waiter.error().Trace();
+
+  const auto start = ReadinessWaiter::Clock::now();
+  auto result = (*waiter)
+                    ->WaitForFile(std::string(dir.path) + "/missing",
+                                  start + milliseconds(100))
+                    .get();
+  EXPECT_FALSE(result.ok());
+  EXPECT_GE(ReadinessWaiter::Clock::now() - start, milliseconds(100));
+}
+
+TEST(ReadinessWaiter, DestroyFailsPendingWaits) {
+  TemporaryDir dir;
+  auto waiter = ReadinessWaiter::Create();
+  ASSERT_TRUE(waiter.ok()) << waiter.error().Trace();
+
+  auto future = (*waiter)->WaitForFile(
+      std::string(dir.path) + "/missing",
+      ReadinessWaiter::Clock::now() + seconds(60));
+  waiter->reset();
+  EXPECT_FALSE(future.get().ok());
+}
+
+TEST(ReadinessWaiter, WaitForFileInForkedChild) {
+  TemporaryDir dir;
+  const std::string first = std::string(dir.path) + "/first";
+  const std::string second = std::string(dir.path) + "/second";
+  // Starts the process-wide waiter, whose thread the child won't have.
+  std::thread writer([&first]() {
+    std::this_thread::sleep_for(milliseconds(100));
+    android::base::WriteStringToFile("", first);
+  });
+  auto result = WaitForFile(first, 10);
+  writer.join();
+  ASSERT_TRUE(result.ok()) << result.error().Trace();
+
+  pid_t child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    // Fails the test instead of hanging it.
+    alarm(30);
+    if (!WaitForFile(second, 10).ok()) {
+      _exit(1);
+    }
+    _exit(WaitForFile(std::string(dir.path) + "/missing", 1).ok() ? 2 : 0);
+  }
+  std::this_thread::sleep_for(milliseconds(100));
+  ASSERT_TRUE(android::base::WriteStringToFile("", second));
+  int status = 0;
+  ASSERT_EQ(waitpid(child, &status, 0), child);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+}
+
+}  // namespace cuttlefish
@@ -18,6 +18,7 @@
 #include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -26,43 +27,30 @@
 #include <android-base/result.h>
 
 namespace cuttlefish {
+namespace {
 
-StackTraceEntry::StackTraceEntry(std::string file, size_t line,
-                                 std::string pretty_function,
-                                 std::string function)
-    : file_(std::move(file)),
-      line_(line),
-      pretty_function_(std::move(pretty_function)),
-      function_(std::move(function)) {}
+std::string_view ShortFile(std::string_view file) {
+  auto last_slash = file.rfind('/');
+  return file.substr(last_slash == std::string_view::npos ? 0 : last_slash + 1);
+}
 
-StackTraceEntry::StackTraceEntry(std::string file, size_t line,
-                                 std::string pretty_function,
-                                 std::string function, std::string expression)
-    : file_(std::move(file)),
-      line_(line),
-      pretty_function_(std::move(pretty_function)),
-      function_(std::move(function)),
-      expression_(std::move(expression)) {}
+}  // namespace
 
-StackTraceEntry::StackTraceEntry(const StackTraceEntry& other)
-    : file_(other.file_),
-      line_(other.line_),
-      pretty_function_(other.pretty_function_),
-      function_(other.function_),
-      expression_(other.expression_),
-      message_(other.message_.str()) {}
+StackTraceEntry::StackTraceEntry(const char* file, size_t line,
+                                 const char* pretty_function,
+                                 const char* function)
+    : StackTraceEntry(file, line, pretty_function, function, "") {}
 
-StackTraceEntry& StackTraceEntry::operator=(const StackTraceEntry& other) {
-  file_ = other.file_;
-  line_ = other.line_;
-  pretty_function_ = other.pretty_function_;
-  function_ = other.function_;
-  expression_ = other.expression_;
-  message_.str(other.message_.str());
-  return *this;
-}
+StackTraceEntry::StackTraceEntry(const char* file, size_t line,
+                                 const char* pretty_function,
+                                 const char* function, const char* expression)
+    : file_(file),
+      line_(line),
+      pretty_function_(pretty_function),
+      function_(function),
+      expression_(expression) {}
 
-bool StackTraceEntry::HasMessage() const { return !message_.str().empty(); }
+bool StackTraceEntry::HasMessage() const { return !message_.empty(); }
 
 /*
  * Print a single stack trace entry out of a list of format specifiers.
@@ -95,7 +83,7 @@ fmt::format_context::iterator StackTraceEntry::format(
         continue;
       case FormatSpecifier::kLongExpression:
       case FormatSpecifier::kShortExpression:
-        if (expression_.empty()) {
+        if (*expression_ == '\0') {
           continue;
         }
         break;
@@ -166,10 +154,10 @@ fmt::format_context::iterator StackTraceEntry::format(
         break;
       case FormatSpecifier::kMessage:
         if (color) {
-          out = fmt::format_to(out, "{}{}{}", kTerminalBoldRed, message_.str(),
+          out = fmt::format_to(out, "{}{}{}", kTerminalBoldRed, message_,
                                kTerminalReset);
         } else {
-          out = fmt::format_to(out, "{}", message_.str());
+          out = fmt::format_to(out, "{}", message_);
         }
         break;
       case FormatSpecifier::kPrettyFunction:
@@ -181,13 +169,11 @@ fmt::format_context::iterator StackTraceEntry::format(
         }
         break;
       case FormatSpecifier::kShort: {
-        auto last_slash = file_.rfind("/");
-        auto short_file =
-            file_.substr(last_slash == std::string::npos ? 0 : last_slash + 1);
+        auto short_file = ShortFile(file_);
         std::string last;
         if (HasMessage()) {
-          last = color ? kTerminalBoldRed + message_.str() + kTerminalReset
-                       : message_.str();
+          last = color ? kTerminalBoldRed + message_ + kTerminalReset
+                       : message_;
         }
         if (color) {
           out = fmt::format_to(out, "{}{}{}:{}{}{} | {}{}{} | {}",
@@ -204,9 +190,7 @@ fmt::format_context::iterator StackTraceEntry::format(
         out = fmt::format_to(out, "{}", expression_);
         break;
       case FormatSpecifier::kShortLocation: {
-        auto last_slash = file_.rfind("/");
-        auto short_file =
-            file_.substr(last_slash == std::string::npos ? 0 : last_slash + 1);
+        auto short_file = ShortFile(file_);
         if (color) {
           out = fmt::format_to(out, "{}{}{}:{}{}{}", kTerminalUnderline,
                                short_file, kTerminalReset, kTerminalYellow,
@@ -15,10 +15,12 @@
 
 #pragma once
 
+#include <iterator>
 #include <optional>
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -80,26 +82,25 @@ class StackTraceEntry {
       FormatSpecifier::kMessage,
   };
 
-  StackTraceEntry(std::string file, size_t line, std::string pretty_function,
-                  std::string function);
-
-  StackTraceEntry(std::string file, size_t line, std::string pretty_function,
-                  std::string function, std::string expression);
-
-  StackTraceEntry(const StackTraceEntry& other);
+  /*
+   * The strings are not copied, and must outlive the entry.
+   * CF_STACK_TRACE_ENTRY passes string literals and `__func__`, which live as
+   * long as the program.
+   */
+  StackTraceEntry(const char* file, size_t line, const char* pretty_function,
+                  const char* function);
 
-  StackTraceEntry(StackTraceEntry&&) = default;
-  StackTraceEntry& operator=(const StackTraceEntry& other);
-  StackTraceEntry& operator=(StackTraceEntry&&) = default;
+  StackTraceEntry(const char* file, size_t line, const char* pretty_function,
+                  const char* function, const char* expression);
 
   template <typename T>
   StackTraceEntry& operator<<(T&& message_ext) & {
-    message_ << std::forward<T>(message_ext);
+    AppendMessage(std::forward<T>(message_ext));
     return *this;
   }
   template <typename T>
   StackTraceEntry operator<<(T&& message_ext) && {
-    message_ << std::forward<T>(message_ext);
+    AppendMessage(std::forward<T>(message_ext));
     return std::move(*this);
   }
 
@@ -121,12 +122,38 @@ class StackTraceEntry {
       std::optional<int> index) const;
 
  private:
-  std::string file_;
+  /*
+   * Strings and integers are appended directly, only other types go through a
+   * stream. Most entries have no message and never allocate.
+   */
+  template <typename T>
+  void AppendMessage(T&& value) {
+    using U = std::decay_t<T>;
+    if constexpr (std::is_same_v<U, std::string> &&
+                  !std::is_lvalue_reference_v<T>) {
+      if (message_.empty()) {
+        message_ = std::move(value);
+      } else {
+        message_ += value;
+      }
+    } else if constexpr (std::is_convertible_v<const U&, std::string_view>) {
+      message_ += std::string_view(value);
+    } else if constexpr (std::is_integral_v<U> && sizeof(U) > 1 &&
+                         !std::is_same_v<U, bool>) {
+      fmt::format_to(std::back_inserter(message_), "{}", value);
+    } else {
+      std::ostringstream stream;
+      stream << std::forward<T>(value);
+      message_ += stream.str();
+    }
+  }
+
+  const char* file_;
   size_t line_;
-  std::string pretty_function_;
-  std::string function_;
-  std::string expression_;
-  std::stringstream message_;
+  const char* pretty_function_;
+  const char* function_;
+  const char* expression_;
+  std::string message_;
 };
 
 std::string ResultErrorFormat(bool color);
@@ -355,22 +382,24 @@ auto ErrorFromType(Result<T>& value) {
 
 template <typename T>
 auto ErrorFromType(Result<T>&& value) {
-  return value.error();
+  return std::move(value.error());
 }
 
 #define CF_EXPECT_OVERLOAD(_1, _2, NAME, ...) NAME
 
-#define CF_EXPECT2(RESULT, MSG)                               \
-  ({                                                          \
-    decltype(RESULT)&& macro_intermediate_result = RESULT;    \
-    if (!TypeIsSuccess(macro_intermediate_result)) {          \
-      auto current_entry = CF_STACK_TRACE_ENTRY(#RESULT);     \
-      current_entry << MSG;                                   \
-      auto error = ErrorFromType(macro_intermediate_result);  \
-      error.PushEntry(std::move(current_entry));              \
-      return std::move(error);                                \
-    };                                                        \
-    OutcomeDereference(std::move(macro_intermediate_result)); \
+#define CF_EXPECT2(RESULT, MSG)                                              \
+  ({                                                                         \
+    decltype(RESULT)&& macro_intermediate_result = RESULT;                   \
+    using macro_intermediate_type = decltype(macro_intermediate_result);     \
+    if (!TypeIsSuccess(macro_intermediate_result)) {                         \
+      auto current_entry = CF_STACK_TRACE_ENTRY(#RESULT);                    \
+      current_entry << MSG;                                                  \
+      auto error = ErrorFromType(                                            \
+          std::forward<macro_intermediate_type>(macro_intermediate_result)); \
+      error.PushEntry(std::move(current_entry));                             \
+      return std::move(error);                                               \
+    };                                                                       \
+    OutcomeDereference(std::move(macro_intermediate_result));                \
   })
 
 #define CF_EXPECT1(RESULT) CF_EXPECT2(RESULT, "")
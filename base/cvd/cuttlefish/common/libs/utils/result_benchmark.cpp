@@ -0,0 +1,72 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "common/libs/utils/result.h"
+
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+namespace cuttlefish {
+namespace {
+
+// Kept out of line so that every frame is a real call, like the lock probes
+// and pid lookups that fail as a matter of course.
+[[gnu::noinline]] Result<int> Leaf(int value, const std::string& name) {
+  CF_EXPECTF(value >= 0, "Invalid value {} for \"{}\"", value, name);
+  return value;
+}
+
+[[gnu::noinline]] Result<int> Frame(int depth, int value,
+                                    const std::string& name) {
+  if (depth == 1) {
+    int result = CF_EXPECT(Leaf(value, name), "Failed at depth " << depth);
+    return result;
+  }
+  int result = CF_EXPECT(Frame(depth - 1, value, name),
+                         "Failed at depth " << depth << " for " << name);
+  return result;
+}
+
+void BM_Success(benchmark::State& state) {
+  const std::string name = "instance";
+  for (auto _ : state) {
+    auto result = Frame(state.range(0), 1, name);
+    benchmark::DoNotOptimize(result.ok());
+  }
+}
+BENCHMARK(BM_Success)->Arg(1)->Arg(4);
+
+void BM_Failure(benchmark::State& state) {
+  const std::string name = "instance";
+  for (auto _ : state) {
+    auto result = Frame(state.range(0), -1, name);
+    benchmark::DoNotOptimize(result.ok());
+  }
+}
+BENCHMARK(BM_Failure)->Arg(1)->Arg(4);
+
+// Rendering is only paid for by the errors that get reported.
+void BM_FailureAndFormat(benchmark::State& state) {
+  const std::string name = "instance";
+  for (auto _ : state) {
+    auto result = Frame(state.range(0), -1, name);
+    benchmark::DoNotOptimize(result.error().FormatForEnv(false));
+  }
+}
+BENCHMARK(BM_FailureAndFormat)->Arg(1)->Arg(4);
+
+}  // namespace
+}  // namespace cuttlefish
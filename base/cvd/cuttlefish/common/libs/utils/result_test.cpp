@@ -115,6 +115,20 @@ TEST(ResultTest, ExpectWithResultBadWithMessage) {
                           HasSubstr("ExpectWithResultBadWithMessage message")));
 }
 
+TEST(ResultTest, ExpectWithResultBadKeepsInnerMessage) {
+  const auto result = []() -> Result<std::string> {
+    const auto inner_result = []() -> Result<std::string> {
+      return CF_ERRF("inner {}", "bad");
+    };
+    CF_EXPECT(inner_result(),
+              "outer " << 1 << ' ' << 2.5 << std::string(" bad"));
+    return "okay";
+  }();
+  ASSERT_THAT(result, IsError());
+  ASSERT_EQ(result.error().Stack().size(), 2);
+  EXPECT_EQ(result.error().Message(), "outer 1 2.5 bad\ninner bad");
+}
+
 TEST(ResultTest, ExpectEqGoodNoMessage) {
   const auto result = []() -> Result<std::string> {
     CF_EXPECT_EQ(1, 1);
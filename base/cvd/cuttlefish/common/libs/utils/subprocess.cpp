@@ -17,19 +17,24 @@
 #include "common/libs/utils/subprocess.h"
 
 #ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
 #endif
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <map>
 #include <optional>
@@ -47,6 +52,7 @@
 
 #include "common/libs/fs/shared_buf.h"
 #include "common/libs/utils/files.h"
+#include "common/libs/utils/trace.h"
 
 extern char** environ;
 
@@ -199,12 +205,21 @@ int Subprocess::Wait() {
   }
   int wstatus = 0;
   auto pid = pid_.load();  // Wait will set pid_ to -1 after waiting
-  auto wait_ret = waitpid(pid, &wstatus, 0);
+  TraceSpan trace("Subprocess::Wait",
+                  TraceEnabled() ? std::to_string(pid) : std::string());
+  struct rusage usage {};
+  auto wait_ret = wait4(pid, &wstatus, 0, &usage);
   if (wait_ret < 0) {
     auto error = errno;
     LOG(ERROR) << "Error on call to waitpid: " << strerror(error);
     return wait_ret;
   }
+  if (TraceEnabled()) {
+    TraceSpan::AddChildCpuTime(
+        std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+        std::chrono::microseconds(usage.ru_utime.tv_usec +
+                                  usage.ru_stime.tv_usec));
+  }
   int retval = 0;
   if (WIFEXITED(wstatus)) {
     pid_ = -1;
@@ -389,6 +404,7 @@ Command Command::AddPrerequisite(
 }
 
 Subprocess Command::Start(SubprocessOptions options) const {
+  TraceSpan trace("Command::Start", command_[0]);
   auto cmd = ToCharPointers(command_);
 
   if (!options.Strace().empty()) {
@@ -425,6 +441,33 @@ Subprocess Command::Start(SubprocessOptions options) const {
     cmd.insert(cmd.begin(), sbox_ptrs.begin(), sbox_ptrs.end());
   }
 
+#ifdef __linux__
+  // Prerequisites are arbitrary code, which can't run in a child that shares
+  // the parent's memory, so they still need a full fork.
+  pid_t pid = prerequisites_.empty() ? VforkAndExec(cmd, options)
+                                     : ForkAndExec(cmd, options);
+#else
+  pid_t pid = ForkAndExec(cmd, options);
+#endif
+  if (pid == -1) {
+    LOG(ERROR) << "fork failed (" << strerror(errno) << ")";
+  }
+  if (options.Verbose()) { // "more verbose", and LOG(DEBUG) > LOG(VERBOSE)
+    LOG(DEBUG) << "Started (pid: " << pid << "): " << cmd[0];
+    for (int i = 1; cmd[i]; i++) {
+      LOG(DEBUG) << cmd[i];
+    }
+  } else {
+    LOG(VERBOSE) << "Started (pid: " << pid << "): " << cmd[0];
+    for (int i = 1; cmd[i]; i++) {
+      LOG(VERBOSE) << cmd[i];
+    }
+  }
+  return Subprocess(pid, subprocess_stopper_);
+}
+
+pid_t Command::ForkAndExec(const std::vector<const char*>& cmd,
+                           const SubprocessOptions& options) const {
   pid_t pid = fork();
   if (!pid) {
 #ifdef __linux__
@@ -479,22 +522,142 @@ Subprocess Command::Start(SubprocessOptions options) const {
                << "\" failed (" << strerror(errno) << ")";
     exit(rval);
   }
-  if (pid == -1) {
-    LOG(ERROR) << "fork failed (" << strerror(errno) << ")";
+  return pid;
+}
+
+#ifdef __linux__
+namespace {
+
+// Everything the vfork child needs, prepared by the parent so that the child
+// doesn't allocate memory or take locks while it shares the parent's address
+// space.
+struct VforkChildArgs {
+  const char* executable;
+  const char* const* argv;
+  const char* const* envp;
+  std::vector<std::pair<int, int>> redirects;  // (source fd, stdio channel)
+  std::vector<int> inherited_fds;
+  int working_directory;  // -1 when unset
+  bool exit_with_parent;
+  bool in_group;
+  sigset_t parent_signal_mask;
+  // Written by the child, read by the parent once the child exec'd or exited.
+  // The first setup call that failed, the child still tries to exec.
+  const char* failed_call = nullptr;
+  int failed_errno = 0;
+  // Kept apart from failed_errno so neither failure hides the other's cause.
+  int exec_errno = 0;
+};
+
+int VforkChild(void* raw_args) {
+  auto args = reinterpret_cast<VforkChildArgs*>(raw_args);
+  auto record_error = [args](const char* call) {
+    if (!args->failed_call) {
+      args->failed_call = call;
+      args->failed_errno = errno;
+    }
+  };
+  // The parent's signal handlers would run on this stack and touch the shared
+  // memory, reset them before unblocking signals. The handler table is not
+  // shared without CLONE_SIGHAND, so this doesn't affect the parent.
+  for (int sig = 1; sig < NSIG; sig++) {
+    struct sigaction action;
+    if (sigaction(sig, nullptr, &action) == 0 &&
+        action.sa_handler != SIG_IGN && action.sa_handler != SIG_DFL) {
+      action.sa_handler = SIG_DFL;
+      action.sa_flags = 0;
+      sigemptyset(&action.sa_mask);
+      sigaction(sig, &action, nullptr);
+    }
   }
-  if (options.Verbose()) { // "more verbose", and LOG(DEBUG) > LOG(VERBOSE)
-    LOG(DEBUG) << "Started (pid: " << pid << "): " << cmd[0];
-    for (int i = 1; cmd[i]; i++) {
-      LOG(DEBUG) << cmd[i];
+  sigprocmask(SIG_SETMASK, &args->parent_signal_mask, nullptr);
+
+  if (args->exit_with_parent) {
+    prctl(PR_SET_PDEATHSIG, SIGHUP);  // Die when parent dies
+  }
+  for (const auto& [fd, channel] : args->redirects) {
+    TEMP_FAILURE_RETRY(dup2(fd, channel));
+  }
+  if (args->in_group && setpgid(0, 0) != 0) {
+    record_error("setpgid");
+  }
+  for (int fd : args->inherited_fds) {
+    if (fcntl(fd, F_SETFD, 0)) {
+      record_error("fcntl");
     }
-  } else {
-    LOG(VERBOSE) << "Started (pid: " << pid << "): " << cmd[0];
-    for (int i = 1; cmd[i]; i++) {
-      LOG(VERBOSE) << cmd[i];
+  }
+  if (args->working_directory >= 0 && fchdir(args->working_directory) != 0) {
+    record_error("fchdir");
+  }
+  int rval = execvpe(args->executable, const_cast<char* const*>(args->argv),
+                     const_cast<char* const*>(args->envp));
+  args->exec_errno = errno;
+  _exit(rval);
+}
+
+}  // namespace
+
+pid_t Command::VforkAndExec(const std::vector<const char*>& cmd,
+                            const SubprocessOptions& options) const {
+  auto envp = ToCharPointers(env_);
+  VforkChildArgs args;
+  args.executable = executable_ ? executable_->c_str() : cmd[0];
+  args.argv = cmd.data();
+  args.envp = envp.data();
+  for (const auto& [channel, fd] : redirects_) {
+    args.redirects.emplace_back(fd, static_cast<int>(channel));
+  }
+  for (const auto& entry : inherited_fds_) {
+    args.inherited_fds.push_back(entry.second);
+  }
+  args.working_directory = -1;
+  if (working_directory_->IsOpen()) {
+    args.working_directory = working_directory_->Fcntl(F_DUPFD_CLOEXEC, 3);
+  }
+  args.exit_with_parent = options.ExitWithParent();
+  args.in_group = options.InGroup();
+
+  // execvpe may copy argv on the stack to run scripts through /bin/sh.
+  const size_t stack_size = 64 * 1024 + cmd.size() * sizeof(char*);
+  void* stack = mmap(nullptr, stack_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to allocate the child stack, falling back to fork";
+    if (args.working_directory >= 0) {
+      close(args.working_directory);
     }
+    return ForkAndExec(cmd, options);
   }
-  return Subprocess(pid, subprocess_stopper_);
+
+  sigset_t all_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &args.parent_signal_mask);
+  // The parent is suspended until the child calls exec or exits, so args and
+  // the stack stay valid for the child's lifetime in the shared address space.
+  pid_t pid = clone(VforkChild, reinterpret_cast<char*>(stack) + stack_size,
+                    CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+  int clone_errno = errno;
+  pthread_sigmask(SIG_SETMASK, &args.parent_signal_mask, nullptr);
+  munmap(stack, stack_size);
+  if (args.working_directory >= 0) {
+    close(args.working_directory);
+  }
+
+  if (pid == -1) {
+    errno = clone_errno;
+    return pid;
+  }
+  if (args.failed_call) {
+    LOG(ERROR) << args.failed_call << " failed ("
+               << strerror(args.failed_errno) << ")";
+  }
+  if (args.exec_errno) {
+    LOG(ERROR) << "exec of " << cmd[0] << " with path \"" << args.executable
+               << "\" failed (" << strerror(args.exec_errno) << ")";
+  }
+  return pid;
 }
+#endif
 
 std::string Command::AsBashScript(
     const std::string& redirected_stdio_path) const {
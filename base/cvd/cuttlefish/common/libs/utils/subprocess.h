@@ -311,6 +311,15 @@ class Command {
   std::string AsBashScript(const std::string& redirected_stdio_path = "") const;
 
  private:
+  pid_t ForkAndExec(const std::vector<const char*>& cmd,
+                    const SubprocessOptions& options) const;
+#ifdef __linux__
+  // Starts the child with clone(CLONE_VM | CLONE_VFORK), which avoids copying
+  // the page tables of the parent. Only usable without prerequisites.
+  pid_t VforkAndExec(const std::vector<const char*>& cmd,
+                     const SubprocessOptions& options) const;
+#endif
+
   std::optional<std::string> executable_;  // When unset, use command_[0]
   std::vector<std::string> command_;
   std::vector<std::function<Result<void>()>> prerequisites_;
@@ -0,0 +1,65 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "common/libs/utils/subprocess.h"
+
+#include <cstddef>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+namespace {
+
+// Grows the resident set of this process to `mib` MiB, the page tables of
+// which fork() has to copy.
+void SetParentRss(size_t mib) {
+  static auto ballast = new std::vector<char>();
+  *ballast = std::vector<char>(mib << 20, 1);
+  benchmark::DoNotOptimize(ballast->data());
+}
+
+void StartAndWait(const Command& command) {
+  auto subprocess = command.Start();
+  CHECK(subprocess.Started());
+  CHECK_EQ(subprocess.Wait(), 0);
+}
+
+// Commands without prerequisites start through clone(CLONE_VM|CLONE_VFORK).
+void BM_StartVfork(benchmark::State& state) {
+  SetParentRss(state.range(0));
+  Command command("/bin/true");
+  for (auto _ : state) {
+    StartAndWait(command);
+  }
+}
+BENCHMARK(BM_StartVfork)->Arg(0)->Arg(256)->Arg(1024)->UseRealTime();
+
+// Commands with prerequisites start through fork().
+void BM_StartFork(benchmark::State& state) {
+  SetParentRss(state.range(0));
+  Command command("/bin/true");
+  command.AddPrerequisite([]() -> Result<void> { return {}; });
+  for (auto _ : state) {
+    StartAndWait(command);
+  }
+}
+BENCHMARK(BM_StartFork)->Arg(0)->Arg(256)->Arg(1024)->UseRealTime();
+
+}  // namespace
+}  // namespace cuttlefish
@@ -16,18 +16,24 @@
 #include "tee_logging.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <chrono>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstring>
 #include <ctime>
 #include <memory>
+#include <mutex>
 #include <ostream>
-#include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -130,10 +136,6 @@ LogSeverity LogFileSeverity() {
   return GuessSeverity("CF_FILE_SEVERITY", android::base::DEBUG);
 }
 
-TeeLogger::TeeLogger(const std::vector<SeverityTarget>& destinations,
-                     const std::string& prefix)
-    : destinations_(destinations), prefix_(prefix) {}
-
 // Copied from system/libbase/logging_splitters.h
 static std::pair<int, int> CountSizeAndNewLines(const char* message) {
   int size = 0;
@@ -205,20 +207,234 @@ std::string StderrOutputGenerator(const struct tm& now, int pid, uint64_t tid,
 
 // TODO(schuffelen): Do something less primitive.
 std::string StripColorCodes(const std::string& str) {
-  std::stringstream sstream;
+  std::string output;
+  output.reserve(str.size());
   bool in_color_code = false;
   for (char c : str) {
     if (c == '\033') {
       in_color_code = true;
     }
     if (!in_color_code) {
-      sstream << c;
+      output.push_back(c);
     }
     if (c == 'm') {
       in_color_code = false;
     }
   }
-  return sstream.str();
+  return output;
+}
+
+namespace {
+
+std::atomic<pid_t> current_pid = 0;
+
+void RefreshCurrentPid() {
+  current_pid.store(getpid(), std::memory_order_relaxed);
+}
+
+// getpid() is a system call, cache it and refresh it in forked children.
+pid_t CurrentPid() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    RefreshCurrentPid();
+    pthread_atfork(nullptr, nullptr, RefreshCurrentPid);
+  });
+  return current_pid.load(std::memory_order_relaxed);
+}
+
+}  // namespace
+
+/**
+ * Bounded multi-producer, single-consumer ring buffer of formatted log lines,
+ * drained by a dedicated writer thread.
+ *
+ * Producers claim slots with a compare-and-swap on the enqueue position and
+ * publish them through a per-slot sequence number, so logging threads never
+ * take a lock unless the writer thread is asleep and has to be woken up.
+ *
+ * The writer thread doesn't exist in a forked child, which writes its
+ * messages directly instead and never touches the queue or its mutex.
+ */
+class TeeLogger::AsyncWriter {
+ public:
+  static constexpr size_t kCapacity = 4096;  // must be a power of two
+
+  AsyncWriter(std::vector<SharedFD> targets)
+      : targets_(std::move(targets)),
+        slots_(new Slot[kCapacity]),
+        owner_pid_(CurrentPid()) {
+    for (size_t i = 0; i < kCapacity; i++) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    writer_thread_ = std::thread([this]() { WriterLoop(); });
+  }
+
+  ~AsyncWriter() {
+    if (Forked()) {
+      writer_thread_.detach();
+      return;
+    }
+    {
+      std::lock_guard lock(mutex_);
+      stopping_ = true;
+    }
+    wake_writer_.notify_one();
+    writer_thread_.join();
+  }
+
+  // `destinations` is a bitmask of indices into the targets vector.
+  void Push(uint32_t destinations, std::string text, LogSeverity severity) {
+    if (Forked()) {
+      WriteNow(destinations, text);
+      return;
+    }
+    while (!TryPush(destinations, text)) {
+      if (severity < android::base::ERROR) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      // Errors are not dropped, wait for the writer to make room instead.
+      WakeWriter();
+      std::this_thread::yield();
+    }
+    WakeWriter();
+  }
+
+  void Flush() {
+    if (Forked()) {
+      return;
+    }
+    const size_t target = enqueue_pos_.load(std::memory_order_acquire);
+    WakeWriter();
+    std::unique_lock lock(mutex_);
+    drained_.wait(lock, [this, target]() {
+      return written_pos_.load(std::memory_order_acquire) >= target;
+    });
+  }
+
+  void WriteNow(uint32_t destinations, const std::string& text) {
+    for (size_t i = 0; i < targets_.size(); i++) {
+      if (destinations & (1u << i)) {
+        WriteAll(targets_[i], text);
+      }
+    }
+  }
+
+ private:
+  bool Forked() const { return CurrentPid() != owner_pid_; }
+
+  struct Slot {
+    std::atomic<size_t> sequence;
+    uint32_t destinations;
+    std::string text;
+  };
+
+  bool TryPush(uint32_t destinations, std::string& text) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+      slot = &slots_[pos & (kCapacity - 1)];
+      size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;  // full
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    slot->destinations = destinations;
+    slot->text = std::move(text);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Only called from the writer thread.
+  bool TryPop(uint32_t& destinations, std::string& text) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Slot& slot = slots_[pos & (kCapacity - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+      return false;
+    }
+    destinations = slot.destinations;
+    text = std::move(slot.text);
+    slot.text.clear();
+    slot.sequence.store(pos + kCapacity, std::memory_order_release);
+    dequeue_pos_.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool Empty() const {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    return slots_[pos & (kCapacity - 1)].sequence.load(
+               std::memory_order_acquire) != pos + 1;
+  }
+
+  void WakeWriter() {
+    // Pairs with the store to writer_sleeping_ in WriterLoop: either the
+    // writer sees the new slot before sleeping, or we see it asleep.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writer_sleeping_.load(std::memory_order_seq_cst)) {
+      std::lock_guard lock(mutex_);
+      wake_writer_.notify_one();
+    }
+  }
+
+  void WriterLoop() {
+    uint32_t destinations;
+    std::string text;
+    for (;;) {
+      while (TryPop(destinations, text)) {
+        WriteNow(destinations, text);
+        // Only count a message as flushed once it has reached its targets.
+        written_pos_.fetch_add(1, std::memory_order_release);
+      }
+      if (auto dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+        WriteNow(~0u, fmt::format("[{} log messages dropped]\n", dropped));
+      }
+      std::unique_lock lock(mutex_);
+      drained_.notify_all();
+      if (stopping_ && Empty()) {
+        return;
+      }
+      writer_sleeping_.store(true, std::memory_order_seq_cst);
+      wake_writer_.wait_for(lock, std::chrono::milliseconds(100),
+                            [this]() { return stopping_ || !Empty(); });
+      writer_sleeping_.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  std::vector<SharedFD> targets_;
+  std::unique_ptr<Slot[]> slots_;
+  const pid_t owner_pid_;
+  alignas(64) std::atomic<size_t> enqueue_pos_ = 0;
+  alignas(64) std::atomic<size_t> dequeue_pos_ = 0;
+  std::atomic<size_t> written_pos_ = 0;
+  std::atomic<size_t> dropped_ = 0;
+  std::atomic<bool> writer_sleeping_ = false;
+  std::mutex mutex_;
+  std::condition_variable wake_writer_;
+  std::condition_variable drained_;
+  bool stopping_ = false;
+  std::thread writer_thread_;
+};
+
+TeeLogger::TeeLogger(const std::vector<SeverityTarget>& destinations,
+                     const std::string& prefix, LogWriteMode mode)
+    : destinations_(destinations), prefix_(prefix) {
+  CHECK(destinations_.size() <= 32) << "Too many log destinations";
+  std::vector<SharedFD> targets;
+  for (const auto& destination : destinations_) {
+    destination_is_tty_.push_back(destination.target->IsATTY());
+    targets.push_back(destination.target);
+  }
+  if (mode == LogWriteMode::ASYNCHRONOUS) {
+    async_writer_ = std::make_shared<AsyncWriter>(std::move(targets));
+  }
 }
 
 void TeeLogger::operator()(
@@ -228,32 +444,74 @@ void TeeLogger::operator()(
     const char* file,
     unsigned int line,
     const char* message) {
-  for (const auto& destination : destinations_) {
-    std::string msg_with_prefix = prefix_ + message;
-    std::string output_string;
-    switch (destination.metadata_level) {
-      case MetadataLevel::ONLY_MESSAGE:
-        output_string = msg_with_prefix + std::string("\n");
-        break;
-      case MetadataLevel::TAG_AND_MESSAGE:
-        output_string = fmt::format("{}] {}{}", tag, msg_with_prefix, "\n");
-        break;
-      default:
-        struct tm now;
-        time_t t = time(nullptr);
-        localtime_r(&t, &now);
-        output_string =
-            StderrOutputGenerator(now, getpid(), GetThreadId(), severity, tag,
-                                  file, line, msg_with_prefix.c_str());
-        break;
+  // One output variant per metadata level, with and without color codes.
+  // Each variant is formatted at most once, and only if some destination
+  // accepts this severity.
+  constexpr size_t kVariants = 3 * 2;
+  std::array<std::string, kVariants> outputs;
+  std::array<uint32_t, kVariants> destination_masks{};
+  std::string msg_with_prefix;
+  for (size_t i = 0; i < destinations_.size(); i++) {
+    const auto& destination = destinations_[i];
+    if (severity < destination.severity) {
+      continue;
     }
-    if (severity >= destination.severity) {
-      if (destination.target->IsATTY()) {
-        WriteAll(destination.target, output_string);
-      } else {
-        WriteAll(destination.target, StripColorCodes(output_string));
+    const auto level = static_cast<size_t>(destination.metadata_level);
+    const size_t variant = level * 2 + (destination_is_tty_[i] ? 0 : 1);
+    if (destination_masks[variant] == 0) {
+      std::string& raw = outputs[level * 2];
+      if (raw.empty()) {
+        if (msg_with_prefix.empty()) {
+          msg_with_prefix = prefix_ + message;
+        }
+        switch (destination.metadata_level) {
+          case MetadataLevel::ONLY_MESSAGE:
+            raw = msg_with_prefix + std::string("\n");
+            break;
+          case MetadataLevel::TAG_AND_MESSAGE:
+            raw = fmt::format("{}] {}{}", tag, msg_with_prefix, "\n");
+            break;
+          default:
+            struct tm now;
+            time_t t = time(nullptr);
+            localtime_r(&t, &now);
+            raw = StderrOutputGenerator(now, getpid(), GetThreadId(),
+                                        severity, tag, file, line,
+                                        msg_with_prefix.c_str());
+            break;
+        }
+      }
+      if (variant != level * 2) {
+        outputs[variant] = StripColorCodes(raw);
       }
     }
+    destination_masks[variant] |= 1u << i;
+  }
+
+  for (size_t variant = 0; variant < kVariants; variant++) {
+    const uint32_t mask = destination_masks[variant];
+    if (mask == 0) {
+      continue;
+    }
+    if (!async_writer_) {
+      for (size_t i = 0; i < destinations_.size(); i++) {
+        if (mask & (1u << i)) {
+          WriteAll(destinations_[i].target, outputs[variant]);
+        }
+      }
+    } else if (severity >= FATAL) {
+      // The process is about to abort, make sure nothing queued is lost.
+      async_writer_->Flush();
+      async_writer_->WriteNow(mask, outputs[variant]);
+    } else {
+      async_writer_->Push(mask, std::move(outputs[variant]), severity);
+    }
+  }
+}
+
+void TeeLogger::Flush() {
+  if (async_writer_) {
+    async_writer_->Flush();
   }
 }
 
@@ -274,18 +532,18 @@ static std::vector<SeverityTarget> SeverityTargetsForFiles(
 }
 
 TeeLogger LogToFiles(const std::vector<std::string>& files,
-                     const std::string& prefix) {
-  return TeeLogger(SeverityTargetsForFiles(files), prefix);
+                     const std::string& prefix, LogWriteMode mode) {
+  return TeeLogger(SeverityTargetsForFiles(files), prefix, mode);
 }
 
 TeeLogger LogToStderrAndFiles(const std::vector<std::string>& files,
                               const std::string& prefix,
-                              MetadataLevel stderr_level) {
+                              MetadataLevel stderr_level, LogWriteMode mode) {
   std::vector<SeverityTarget> log_severities = SeverityTargetsForFiles(files);
   log_severities.push_back(SeverityTarget{ConsoleSeverity(),
                                           SharedFD::Dup(/* stderr */ 2),
                                           stderr_level});
-  return TeeLogger(log_severities, prefix);
+  return TeeLogger(log_severities, prefix, mode);
 }
 
 } // namespace cuttlefish
@@ -15,6 +15,7 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -48,27 +49,51 @@ struct SeverityTarget {
   MetadataLevel metadata_level;
 };
 
+enum class LogWriteMode {
+  // Messages are written to the destinations on the logging thread.
+  SYNCHRONOUS,
+  // Messages are queued in a bounded ring buffer and written by a background
+  // thread. When the buffer is full, messages below ERROR are dropped and the
+  // number of dropped messages is reported once space frees up. FATAL messages
+  // flush the queue and are written synchronously.
+  ASYNCHRONOUS,
+};
+
 class TeeLogger {
 private:
   std::vector<SeverityTarget> destinations_;
 public:
  TeeLogger(const std::vector<SeverityTarget>& destinations,
-           const std::string& log_prefix = "");
+           const std::string& log_prefix = "",
+           LogWriteMode mode = LogWriteMode::SYNCHRONOUS);
  ~TeeLogger() = default;
 
  void operator()(android::base::LogId log_id,
                  android::base::LogSeverity severity, const char* tag,
                  const char* file, unsigned int line, const char* message);
 
+ // Blocks until every message queued so far has been written. No-op in
+ // SYNCHRONOUS mode.
+ void Flush();
+
 private:
+ class AsyncWriter;
+
  std::string prefix_;
+ std::vector<bool> destination_is_tty_;
+ // Shared because android::base::SetLogger copies the logger around. The
+ // writer thread is stopped, after draining the queue, when the last copy is
+ // destroyed.
+ std::shared_ptr<AsyncWriter> async_writer_;
 };
 
 TeeLogger LogToFiles(const std::vector<std::string>& files,
-                     const std::string& log_prefix = "");
+                     const std::string& log_prefix = "",
+                     LogWriteMode mode = LogWriteMode::SYNCHRONOUS);
 TeeLogger LogToStderrAndFiles(const std::vector<std::string>& files,
                               const std::string& log_prefix = "",
-                              MetadataLevel stderr_level = MetadataLevel::ONLY_MESSAGE);
+                              MetadataLevel stderr_level = MetadataLevel::ONLY_MESSAGE,
+                              LogWriteMode mode = LogWriteMode::SYNCHRONOUS);
 
 std::string StripColorCodes(const std::string& str);
 
@@ -0,0 +1,173 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "common/libs/utils/tee_logging.h"
+
+#include <fcntl.h>
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "common/libs/fs/shared_fd.h"
+
+namespace cuttlefish {
+namespace {
+
+using android::base::ERROR;
+using android::base::FATAL;
+using android::base::INFO;
+using android::base::LogId;
+
+constexpr int kThreads = 4;
+// More than the queue holds, so producers wait for the writer.
+constexpr int kMessagesPerThread = 5000;
+
+class TeeLoggerTest : public testing::Test {
+ protected:
+  TeeLogger AsyncLogger() {
+    auto fd = SharedFD::Open(file_.path, O_WRONLY | O_APPEND);
+    EXPECT_TRUE(fd->IsOpen()) << fd->StrError();
+    return TeeLogger(
+        {{android::base::VERBOSE, fd, MetadataLevel::ONLY_MESSAGE}}, "",
+        LogWriteMode::ASYNCHRONOUS);
+  }
+
+  std::vector<std::string> Lines() {
+    std::string contents;
+    EXPECT_TRUE(android::base::ReadFileToString(file_.path, &contents));
+    auto lines = android::base::Split(contents, "\n");
+    // After the last newline.
+    EXPECT_EQ(lines.back(), "");
+    lines.pop_back();
+    return lines;
+  }
+
+  static void Log(TeeLogger& logger, android::base::LogSeverity severity,
+                  const std::string& message) {
+    logger(LogId::DEFAULT, severity, "tag", __FILE__, __LINE__,
+           message.c_str());
+  }
+
+  // Logs "<thread> <n>" from each thread.
+  static void LogFromThreads(TeeLogger& logger,
+                             android::base::LogSeverity severity) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.emplace_back([&logger, severity, t]() {
+        for (int n = 0; n < kMessagesPerThread; n++) {
+          Log(logger, severity, std::to_string(t) + " " + std::to_string(n));
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  TemporaryFile file_;
+};
+
+TEST_F(TeeLoggerTest, AsyncWritesEveryErrorInOrder) {
+  {
+    auto logger = AsyncLogger();
+    LogFromThreads(logger, ERROR);
+  }
+
+  std::vector<int> next(kThreads, 0);
+  for (const auto& line : Lines()) {
+    auto fields = android::base::Split(line, " ");
+    ASSERT_EQ(fields.size(), 2) << line;
+    int t, n;
+    ASSERT_TRUE(android::base::ParseInt(fields[0], &t, 0, kThreads - 1));
+    ASSERT_TRUE(android::base::ParseInt(fields[1], &n));
+    ASSERT_EQ(n, next[t]) << "thread " << t;
+    next[t]++;
+  }
+  EXPECT_EQ(next, std::vector<int>(kThreads, kMessagesPerThread));
+}
+
+TEST_F(TeeLoggerTest, AsyncAccountsForDroppedMessages) {
+  {
+    auto logger = AsyncLogger();
+    LogFromThreads(logger, INFO);
+  }
+
+  std::vector<int> last(kThreads, -1);
+  int written = 0;
+  int dropped = 0;
+  for (const auto& line : Lines()) {
+    int count;
+    if (sscanf(line.c_str(), "[%d log messages dropped]", &count) == 1) {
+      dropped += count;
+      continue;
+    }
+    auto fields = android::base::Split(line, " ");
+    ASSERT_EQ(fields.size(), 2) << line;
+    int t, n;
+    ASSERT_TRUE(android::base::ParseInt(fields[0], &t, 0, kThreads - 1));
+    ASSERT_TRUE(android::base::ParseInt(fields[1], &n));
+    // Messages may be missing, but not reordered.
+    ASSERT_GT(n, last[t]) << "thread " << t;
+    last[t] = n;
+    written++;
+  }
+  EXPECT_EQ(written + dropped, kThreads * kMessagesPerThread);
+}
+
+TEST_F(TeeLoggerTest, AsyncFlushesBeforeFatal) {
+  auto logger = AsyncLogger();
+  for (int n = 0; n < 100; n++) {
+    Log(logger, INFO, "before " + std::to_string(n));
+  }
+
+  // Aborting is left to LOG(FATAL), the logger only writes.
+  Log(logger, FATAL, "fatal");
+
+  auto lines = Lines();
+  ASSERT_EQ(lines.size(), 101);
+  for (int n = 0; n < 100; n++) {
+    EXPECT_EQ(lines[n], "before " + std::to_string(n));
+  }
+  EXPECT_EQ(lines.back(), "fatal");
+}
+
+TEST_F(TeeLoggerTest, AsyncFlushesOnLogFatal) {
+  EXPECT_DEATH(
+      {
+        android::base::SetLogger(AsyncLogger());
+        for (int n = 0; n < 100; n++) {
+          LOG(ERROR) << "before " << n;
+        }
+        LOG(FATAL) << "fatal";
+      },
+      "");
+
+  auto lines = Lines();
+  ASSERT_EQ(lines.size(), 101);
+  EXPECT_EQ(lines.front(), "before 0");
+  EXPECT_EQ(lines[99], "before 99");
+  EXPECT_EQ(lines.back(), "fatal");
+}
+
+}  // namespace
+}  // namespace cuttlefish
@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common/libs/utils/trace.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/threads.h>
+#include <android-base/unique_fd.h>
+#include <fmt/format.h>
+
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+namespace {
+
+constexpr size_t kMaxProcessNameLength = 80;
+
+void AppendJsonString(std::string& out, std::string_view value) {
+  out += '"';
+  for (char c : value) {
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          out += fmt::format("\\u{:04x}", c);
+        } else {
+          out += c;
+        }
+    }
+  }
+  out += '"';
+}
+
+// The innermost open span of the thread, if tracing is on.
+thread_local TraceSpan* innermost_span = nullptr;
+
+std::chrono::microseconds ThreadCpuTime() {
+  struct timespec ts {};
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec));
+}
+
+int64_t Micros(std::chrono::steady_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+// The command line, which tells apart the many processes named "cvd".
+std::string ProcessName() {
+  std::string cmdline;
+  if (!android::base::ReadFileToString("/proc/self/cmdline", &cmdline)) {
+    return std::to_string(getpid());
+  }
+  while (!cmdline.empty() && cmdline.back() == '\0') {
+    cmdline.pop_back();
+  }
+  std::replace(cmdline.begin(), cmdline.end(), '\0', ' ');
+  if (cmdline.size() > kMaxProcessNameLength) {
+    cmdline.resize(kMaxProcessNameLength);
+  }
+  return cmdline;
+}
+
+/**
+ * The file is shared by the whole process tree. Each event is written with a
+ * single O_APPEND write, so the events of concurrent writers don't interleave.
+ *
+ * The JSON array is left open: the trace viewers accept a missing "]".
+ */
+class TraceFile {
+ public:
+  // nullptr when tracing is off.
+  static TraceFile* Get() {
+    static TraceFile* trace_file = Open();
+    return trace_file;
+  }
+
+  // A negative `cpu_us` leaves out the CPU time.
+  void Write(std::string_view name, int64_t start_us, int64_t duration_us,
+             int64_t cpu_us, std::string_view detail) {
+    thread_local const uint64_t tid = android::base::GetThreadId();
+    thread_local std::string event;
+    event.clear();
+    event += "{\"name\":";
+    AppendJsonString(event, name);
+    event += fmt::format(
+        ",\"cat\":\"cvd\",\"ph\":\"X\",\"ts\":{},\"dur\":{},\"pid\":{},"
+        "\"tid\":{}",
+        start_us, duration_us, pid_, tid);
+    if (cpu_us >= 0) {
+      event += fmt::format(",\"tdur\":{}", cpu_us);
+    }
+    if (!detail.empty()) {
+      event += ",\"args\":{\"detail\":";
+      AppendJsonString(event, detail);
+      event += '}';
+    }
+    event += "},\n";
+    WriteEvent(event);
+  }
+
+ private:
+  explicit TraceFile(android::base::unique_fd fd)
+      : fd_(std::move(fd)), pid_(getpid()) {}
+
+  static TraceFile* Open() {
+    const char* path = getenv(kTraceFileEnv);
+    if (path == nullptr || *path == '\0') {
+      return nullptr;
+    }
+    android::base::unique_fd fd(
+        open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644));
+    if (fd.get() < 0) {
+      PLOG(WARNING) << "Not tracing, failed to open \"" << path << "\"";
+      return nullptr;
+    }
+    auto trace_file = new TraceFile(std::move(fd));
+    trace_file->Begin();
+    return trace_file;
+  }
+
+  // Starts the array if this is the first process to use the file, and names
+  // this process.
+  void Begin() {
+    if (flock(fd_.get(), LOCK_EX) == 0) {
+      struct stat st;
+      if (fstat(fd_.get(), &st) == 0 && st.st_size == 0) {
+        WriteEvent("[\n");
+      }
+      flock(fd_.get(), LOCK_UN);
+    }
+    std::string event =
+        fmt::format("{{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":{},"
+                    "\"args\":{{\"name\":",
+                    pid_);
+    AppendJsonString(event, ProcessName());
+    event += "}},\n";
+    WriteEvent(event);
+  }
+
+  void WriteEvent(std::string_view event) {
+    if (!android::base::WriteFully(fd_.get(), event.data(), event.size())) {
+      PLOG(VERBOSE) << "Failed to write a trace event";
+    }
+  }
+
+  android::base::unique_fd fd_;
+  const pid_t pid_;
+};
+
+}  // namespace
+
+Result<void> StartTraceFile(const std::string& path) {
+  CF_EXPECTF(android::base::WriteStringToFile("", path),
+             "Failed to truncate trace file \"{}\": {}", path,
+             strerror(errno));
+  CF_EXPECTF(setenv(kTraceFileEnv, path.c_str(), /* overwrite */ 1) == 0,
+             "setenv failed: {}", strerror(errno));
+  return {};
+}
+
+bool TraceEnabled() { return TraceFile::Get() != nullptr; }
+
+void TraceComplete(std::string_view name,
+                   std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::time_point end,
+                   std::string_view detail) {
+  auto trace_file = TraceFile::Get();
+  if (trace_file == nullptr) {
+    return;
+  }
+  trace_file->Write(name, Micros(start), Micros(end) - Micros(start), -1,
+                    detail);
+}
+
+TraceSpan::TraceSpan(std::string_view name, std::string_view detail)
+    : enabled_(TraceEnabled()) {
+  if (!enabled_) {
+    return;
+  }
+  name_ = name;
+  detail_ = detail;
+  start_ = std::chrono::steady_clock::now();
+  start_cpu_time_ = ThreadCpuTime();
+  child_cpu_time_ = std::chrono::microseconds(0);
+  parent_ = innermost_span;
+  innermost_span = this;
+}
+
+TraceSpan::~TraceSpan() {
+  if (!enabled_) {
+    return;
+  }
+  const auto end = std::chrono::steady_clock::now();
+  const auto cpu_time = ThreadCpuTime() - start_cpu_time_ + child_cpu_time_;
+  innermost_span = parent_;
+  auto trace_file = TraceFile::Get();
+  if (trace_file != nullptr) {
+    trace_file->Write(name_, Micros(start_), Micros(end) - Micros(start_),
+                      cpu_time.count(), detail_);
+  }
+}
+
+void TraceSpan::AddChildCpuTime(std::chrono::microseconds cpu_time) {
+  for (auto span = innermost_span; span != nullptr; span = span->parent_) {
+    span->child_cpu_time_ += cpu_time;
+  }
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <string_view>
+
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+/**
+ * Timing spans in the Chrome Trace Event format, readable by
+ * chrome://tracing and ui.perfetto.dev.
+ *
+ * Tracing is on when CVD_TRACE_FILE names a file. Every process started with
+ * that variable appends its events to the same file, so the spans of the cvd
+ * subprocesses line up with their parent on one timeline. The variable is
+ * read once, on the first use of any function here.
+ *
+ * Spans also record the CPU time they used as the "tdur" of the event: the
+ * CPU time of the calling thread plus that of the subprocesses it waited for.
+ *
+ * When tracing is off a span costs a check of a static and no allocation.
+ */
+constexpr char kTraceFileEnv[] = "CVD_TRACE_FILE";
+
+// Truncates `path` and exports it as CVD_TRACE_FILE. Has no effect on this
+// process if anything was traced before.
+Result<void> StartTraceFile(const std::string& path);
+
+bool TraceEnabled();
+
+// Records a span that already ended.
+void TraceComplete(std::string_view name,
+                   std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::time_point end,
+                   std::string_view detail = "");
+
+// Records the time from construction to destruction on the calling thread.
+class TraceSpan {
+ public:
+  explicit TraceSpan(std::string_view name, std::string_view detail = "");
+  ~TraceSpan();
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  // Charges the CPU time of a reaped subprocess to the spans open on the
+  // calling thread.
+  static void AddChildCpuTime(std::chrono::microseconds cpu_time);
+
+ private:
+  const bool enabled_;
+  std::string name_;
+  std::string detail_;
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::microseconds start_cpu_time_;
+  std::chrono::microseconds child_cpu_time_;
+  // The span that was innermost on this thread when this one started.
+  TraceSpan* parent_;
+};
+
+}  // namespace cuttlefish
@@ -16,10 +16,15 @@
 
 #pragma once
 
+#include <cstddef>
 #include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <set>
 #include <type_traits>
 #include <unordered_set>
 #include <utility>
@@ -93,6 +98,16 @@ class UniqueResourceAllocator {
     }
   };
   using ReservationSet = std::unordered_set<Reservation, ReservationHash>;
+
+  struct AvailableRangeStats {
+    // number of available resources
+    std::size_t available;
+    // number of maximal runs of consecutive available resources
+    std::size_t ranges;
+    // length of the longest run, the most UniqueConsecutiveItems can give
+    std::size_t largest_range;
+  };
+
   /*
    * Creates the singleton object.
    *
@@ -120,6 +135,7 @@ class UniqueResourceAllocator {
         not_selected.emplace_back(std::move(new_item));
         continue;
       }
+      MarkAvailable(new_item);
       available_resources_.insert(std::move(new_item));
     }
     return not_selected;
@@ -161,6 +177,12 @@ class UniqueResourceAllocator {
     return {std::move(result)};
   }
 
+  /*
+   * Gives n consecutive integers from the pool
+   *
+   * Picks the smallest run of available integers that fits n, the lowest one
+   * among runs of the same length, to keep long runs for larger requests.
+   */
   template <typename V = T>
   std::enable_if_t<std::is_integral<V>::value, std::optional<ReservationSet>>
   UniqueConsecutiveItems(const int n) {
@@ -170,16 +192,26 @@ class UniqueResourceAllocator {
       return std::nullopt;
     }
 
-    for (const auto& available_resource : available_resources_) {
-      auto start_inclusive = available_resource;
-      auto resources_opt =
-          TakeRangeInternal(start_inclusive, start_inclusive + n);
-      if (!resources_opt) {
-        continue;
-      }
-      return resources_opt;
+    auto best_fit = ranges_by_length_.lower_bound(
+        {static_cast<std::size_t>(n), std::numeric_limits<T>::min()});
+    if (best_fit == ranges_by_length_.end()) {
+      return std::nullopt;
     }
-    return std::nullopt;
+    const T start_inclusive = best_fit->second;
+    return TakeRangeInternal(start_inclusive, start_inclusive + n);
+  }
+
+  template <typename V = T>
+  std::enable_if_t<std::is_integral<V>::value, AvailableRangeStats>
+  RangeStats() {
+    static_assert(std::is_same<T, V>::value);
+    std::lock_guard<std::mutex> lock(mutex_);
+    AvailableRangeStats stats;
+    stats.available = available_resources_.size();
+    stats.ranges = ranges_by_length_.size();
+    stats.largest_range =
+        ranges_by_length_.empty() ? 0 : ranges_by_length_.rbegin()->first;
+    return stats;
   }
 
   // takes t if available
@@ -227,7 +259,11 @@ class UniqueResourceAllocator {
  private:
   template <typename Container>
   UniqueResourceAllocator(const Container& items)
-      : available_resources_{items.cbegin(), items.cend()} {}
+      : available_resources_{items.cbegin(), items.cend()} {
+    for (const auto& item : available_resources_) {
+      MarkAvailable(item);
+    }
+  }
 
   bool operator==(const UniqueResourceAllocator& other) const {
     return std::addressof(*this) == std::addressof(other);
@@ -248,6 +284,7 @@ class UniqueResourceAllocator {
     }
     T tmp = std::move(*itr);
     allocated_resources_.erase(itr);
+    MarkAvailable(tmp);
     available_resources_.insert(std::move(tmp));
   }
 
@@ -261,10 +298,15 @@ class UniqueResourceAllocator {
   std::enable_if_t<std::is_integral<V>::value, std::optional<ReservationSet>>
   TakeRangeInternal(const T& start_inclusive, const T& end_exclusive) {
     static_assert(std::is_same<T, V>::value);
-    for (auto cursor = start_inclusive; cursor < end_exclusive; cursor++) {
-      if (!Contains(available_resources_, cursor)) {
-        return std::nullopt;
-      }
+    if (start_inclusive >= end_exclusive) {
+      // An empty range is always available.
+      return ReservationSet{};
+    }
+    // The whole range must be inside a single run of available integers
+    auto range = free_ranges_.upper_bound(start_inclusive);
+    if (range == free_ranges_.begin() ||
+        std::prev(range)->second < end_exclusive - 1) {
+      return std::nullopt;
     }
     ReservationSet resources;
     for (auto cursor = start_inclusive; cursor < end_exclusive; cursor++) {
@@ -282,13 +324,73 @@ class UniqueResourceAllocator {
    * The itr must belong to available_resources_.
    */
   const T* RemoveFromPool(const typename std::unordered_set<T>::iterator itr) {
+    MarkUnavailable(*itr);
     T tmp = std::move(*itr);
     available_resources_.erase(itr);
     const auto [new_itr, _] = allocated_resources_.insert(std::move(tmp));
     return std::addressof(*new_itr);
   }
+
+  /*
+   * For integral resources, keeps the available ones as maximal runs of
+   * consecutive integers so that consecutive allocations are O(log n).
+   * No-ops for other types.
+   */
+  void MarkAvailable(const T& t) {
+    if constexpr (std::is_integral<T>::value) {
+      T first = t;
+      T last = t;
+      if (t != std::numeric_limits<T>::max()) {
+        auto next = free_ranges_.find(t + 1);
+        if (next != free_ranges_.end()) {
+          last = next->second;
+          EraseFreeRange(next);
+        }
+      }
+      auto prev = free_ranges_.lower_bound(t);
+      if (prev != free_ranges_.begin() && std::prev(prev)->second + 1 == t) {
+        --prev;
+        first = prev->first;
+        EraseFreeRange(prev);
+      }
+      InsertFreeRange(first, last);
+    }
+  }
+
+  void MarkUnavailable(const T& t) {
+    if constexpr (std::is_integral<T>::value) {
+      auto range = std::prev(free_ranges_.upper_bound(t));
+      const T first = range->first;
+      const T last = range->second;
+      EraseFreeRange(range);
+      if (first < t) {
+        InsertFreeRange(first, t - 1);
+      }
+      if (t < last) {
+        InsertFreeRange(t + 1, last);
+      }
+    }
+  }
+
+  void InsertFreeRange(const T& first, const T& last) {
+    free_ranges_.emplace(first, last);
+    ranges_by_length_.emplace(static_cast<std::size_t>(last - first) + 1,
+                              first);
+  }
+
+  void EraseFreeRange(typename std::map<T, T>::iterator range) {
+    ranges_by_length_.erase(
+        {static_cast<std::size_t>(range->second - range->first) + 1,
+         range->first});
+    free_ranges_.erase(range);
+  }
+
   std::unordered_set<T> available_resources_;
   std::unordered_set<T> allocated_resources_;
+  // first -> last, both inclusive
+  std::map<T, T> free_ranges_;
+  // (length, first) of every free range
+  std::set<std::pair<std::size_t, T>> ranges_by_length_;
   std::mutex mutex_;
 };
 
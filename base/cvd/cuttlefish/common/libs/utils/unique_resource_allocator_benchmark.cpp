@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "common/libs/utils/unique_resource_allocator.h"
+
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+
+namespace cuttlefish {
+namespace {
+
+using Allocator = UniqueResourceAllocator<int>;
+
+// Items left free at the end of the pool, in a single run.
+constexpr int kFreeTail = 64;
+
+// A pool of `size` items where every third one is taken, except for the last
+// kFreeTail, so that the free items form runs of two plus one long run.
+struct FragmentedPool {
+  explicit FragmentedPool(int size) {
+    std::vector<int> items(size);
+    std::iota(items.begin(), items.end(), 0);
+    allocator = Allocator::New(items);
+    held.reserve(size / 3 + 1);
+    for (int i = 0; i < size - kFreeTail; i += 3) {
+      auto reservation = allocator->Take(i);
+      CHECK(reservation.has_value());
+      held.emplace_back(std::move(*reservation));
+    }
+  }
+
+  std::unique_ptr<Allocator> allocator;
+  std::vector<Allocator::Reservation> held;
+};
+
+void BM_UniqueItem(benchmark::State& state) {
+  FragmentedPool pool(state.range(0));
+  for (auto _ : state) {
+    auto reservation = pool.allocator->UniqueItem();
+    benchmark::DoNotOptimize(reservation->Get());
+  }
+}
+BENCHMARK(BM_UniqueItem)->Arg(1 << 10)->Arg(1 << 14)->Arg(1 << 18);
+
+// Only the run at the end is long enough, among thousands of shorter ones.
+void BM_UniqueConsecutiveItems(benchmark::State& state) {
+  FragmentedPool pool(state.range(0));
+  for (auto _ : state) {
+    auto reservations = pool.allocator->UniqueConsecutiveItems(4);
+    CHECK(reservations.has_value());
+    benchmark::DoNotOptimize(reservations->size());
+  }
+}
+BENCHMARK(BM_UniqueConsecutiveItems)->Arg(1 << 10)->Arg(1 << 14)->Arg(1 << 18);
+
+// Returns the taken items one at a time, each one joining two free runs.
+void BM_Reclaim(benchmark::State& state) {
+  constexpr int kBatch = 1024;
+  std::optional<FragmentedPool> pool;
+  pool.emplace(state.range(0));
+  std::vector<Allocator::Reservation> batch;
+  batch.reserve(kBatch);
+  for (auto _ : state) {
+    state.PauseTiming();
+    if (pool->held.size() < kBatch) {
+      // The reservations have to go before their allocator.
+      pool.reset();
+      pool.emplace(state.range(0));
+    }
+    for (int i = 0; i < kBatch; i++) {
+      batch.emplace_back(std::move(pool->held.back()));
+      pool->held.pop_back();
+    }
+    state.ResumeTiming();
+    batch.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+BENCHMARK(BM_Reclaim)->Arg(1 << 14)->Arg(1 << 18);
+
+}  // namespace
+}  // namespace cuttlefish
@@ -102,6 +102,61 @@ TEST_F(CvdIdAllocatorTest, Consecutive) {
   ASSERT_FALSE(allocator->UniqueItem()) << "one or more left";
 }
 
+TEST_F(CvdIdAllocatorTest, ConsecutiveBestFit) {
+  std::vector<unsigned> inputs{1, 2, 3, 4, 5, 6, 7, 8, 10, 11, 12, 20, 21};
+  auto allocator = UniqueResourceAllocator<unsigned>::New(inputs);
+  if (!allocator) {
+    GTEST_SKIP() << "Memory allocation failed but we aren't testing it.";
+  }
+
+  auto two_consecutive = allocator->UniqueConsecutiveItems(2);
+  auto three_consecutive = allocator->UniqueConsecutiveItems(3);
+
+  // the smallest runs that fit are used, leaving 1..8 whole
+  ASSERT_TRUE(two_consecutive);
+  ASSERT_TRUE(three_consecutive);
+  std::unordered_set<unsigned> taken;
+  for (const auto& reservation : *two_consecutive) {
+    taken.insert(reservation.Get());
+  }
+  ASSERT_EQ(taken, (std::unordered_set<unsigned>{20, 21}));
+  taken.clear();
+  for (const auto& reservation : *three_consecutive) {
+    taken.insert(reservation.Get());
+  }
+  ASSERT_EQ(taken, (std::unordered_set<unsigned>{10, 11, 12}));
+  auto stats = allocator->RangeStats();
+  ASSERT_EQ(stats.available, 8);
+  ASSERT_EQ(stats.ranges, 1);
+  ASSERT_EQ(stats.largest_range, 8);
+}
+
+TEST_F(CvdIdAllocatorTest, ReclaimMergesRanges) {
+  std::vector<unsigned> inputs{1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  auto allocator = UniqueResourceAllocator<unsigned>::New(inputs);
+  if (!allocator) {
+    GTEST_SKIP() << "Memory allocation failed but we aren't testing it.";
+  }
+  {
+    auto take_4_7 = allocator->TakeRange(4, 7);
+    auto take_9 = allocator->Take(9);
+    ASSERT_TRUE(take_4_7);
+    ASSERT_TRUE(take_9);
+
+    auto stats = allocator->RangeStats();
+    ASSERT_EQ(stats.available, 6);
+    ASSERT_EQ(stats.ranges, 3);
+    ASSERT_EQ(stats.largest_range, 3);
+    ASSERT_FALSE(allocator->UniqueConsecutiveItems(4));
+  }
+
+  auto stats = allocator->RangeStats();
+  ASSERT_EQ(stats.available, 10);
+  ASSERT_EQ(stats.ranges, 1);
+  ASSERT_EQ(stats.largest_range, 10);
+  ASSERT_TRUE(allocator->UniqueConsecutiveItems(10));
+}
+
 TEST_F(CvdIdAllocatorTest, Take) {
   std::vector<unsigned> inputs{4, 5, 9};
   auto allocator = UniqueResourceAllocator<unsigned>::New(inputs);
@@ -152,6 +207,25 @@ TEST_F(CvdIdAllocatorTest, TakeRange) {
   ASSERT_FALSE(take_range_2_4);
 }
 
+TEST_F(CvdIdAllocatorTest, TakeEmptyRange) {
+  std::vector<unsigned> inputs{1, 2, 4, 5};
+  auto allocator = UniqueResourceAllocator<unsigned>::New(inputs);
+  if (!allocator) {
+    GTEST_SKIP() << "Memory allocation failed but we aren't testing it.";
+  }
+
+  // 3 isn't in the pool, but an empty range takes nothing.
+  auto take_range_3_3 = allocator->TakeRange(3, 3);
+  auto take_range_5_4 = allocator->TakeRange(5, 4);
+
+  ASSERT_TRUE(take_range_3_3);
+  ASSERT_TRUE(take_range_3_3->empty());
+  ASSERT_TRUE(take_range_5_4);
+  ASSERT_TRUE(take_range_5_4->empty());
+  ASSERT_TRUE(allocator->TakeRange(1, 3));
+  ASSERT_TRUE(allocator->TakeRange(4, 6));
+}
+
 TEST_F(CvdIdAllocatorTest, Reclaim) {
   std::vector<unsigned> inputs{1, 2, 4, 5, 6, 7, 8, 9, 10, 11};
   auto allocator = UniqueResourceAllocator<unsigned>::New(inputs);
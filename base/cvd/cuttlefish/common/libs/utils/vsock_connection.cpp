@@ -20,13 +20,17 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 
+#include <algorithm>
+#include <cstring>
 #include <functional>
 #include <future>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <new>
 #include <ostream>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -34,12 +38,112 @@
 #include <android-base/logging.h>
 #include <json/json.h>
 
+#include "common/libs/fs/epoll.h"
 #include "common/libs/fs/shared_buf.h"
 #include "common/libs/fs/shared_select.h"
 
 namespace cuttlefish {
+namespace {
 
-VsockConnection::~VsockConnection() { Disconnect(); }
+// Reads from the socket are at least this large, unless the caller needs a
+// larger contiguous block.
+constexpr size_t kReadChunkSize = 64 * 1024;
+
+/**
+ * Completes the asynchronous reads of all connections from a single thread.
+ *
+ * File descriptors are watched for one event at a time, the callback is
+ * dropped before it runs and has to watch the file descriptor again when it
+ * needs more data.
+ */
+class AsyncReadLoop {
+ public:
+  static AsyncReadLoop& Get() {
+    static auto loop = new AsyncReadLoop();
+    return *loop;
+  }
+
+  bool Watch(SharedFD fd, std::function<void()> callback) {
+    std::lock_guard lock(mutex_);
+    auto res = epoll_.AddOrModify(fd, EPOLLIN | EPOLLONESHOT);
+    if (!res.ok()) {
+      LOG(ERROR) << "Failed to watch vsock connection: "
+                 << res.error().FormatForEnv();
+      return false;
+    }
+    callbacks_[fd] = std::move(callback);
+    return true;
+  }
+
+  // The callback may still be running when this returns.
+  void Forget(SharedFD fd) {
+    std::lock_guard lock(mutex_);
+    if (callbacks_.erase(fd) == 0) {
+      return;
+    }
+    auto res = epoll_.Delete(fd);
+    if (!res.ok()) {
+      LOG(ERROR) << "Failed to stop watching vsock connection: "
+                 << res.error().FormatForEnv();
+    }
+  }
+
+ private:
+  AsyncReadLoop() {
+    auto epoll = Epoll::Create();
+    CHECK(epoll.ok()) << epoll.error().FormatForEnv();
+    epoll_ = std::move(*epoll);
+    std::thread([this]() { Run(); }).detach();
+  }
+
+  void Run() {
+    while (true) {
+      auto events = epoll_.Wait(16, std::nullopt);
+      if (!events.ok()) {
+        LOG(ERROR) << events.error().FormatForEnv();
+        continue;
+      }
+      for (const auto& event : *events) {
+        std::function<void()> callback;
+        {
+          std::lock_guard lock(mutex_);
+          auto it = callbacks_.find(event.fd);
+          if (it == callbacks_.end()) {
+            continue;
+          }
+          callback = std::move(it->second);
+          callbacks_.erase(it);
+        }
+        callback();
+      }
+    }
+  }
+
+  Epoll epoll_;
+  std::mutex mutex_;
+  std::map<SharedFD, std::function<void()>> callbacks_;
+};
+
+Json::Value ParseJsonMessage(const std::vector<char>& msg) {
+  Json::CharReaderBuilder builder;
+  std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+  Json::Value json_msg;
+  std::string errors;
+  if (!reader->parse(msg.data(), msg.data() + msg.size(), &json_msg, &errors)) {
+    return {};
+  }
+  return json_msg;
+}
+
+}  // namespace
+
+VsockConnection::~VsockConnection() {
+  {
+    std::lock_guard lock(async_read_target_->mutex);
+    async_read_target_->connection = nullptr;
+  }
+  Disconnect();
+}
 
 std::future<bool> VsockConnection::ConnectAsync(
     unsigned int port, unsigned int cid,
@@ -56,6 +160,9 @@ void VsockConnection::Disconnect() {
   std::lock_guard<std::recursive_mutex> write_lock(write_mutex_);
 
   LOG(INFO) << "Disconnecting with fd status:" << fd_->StrError();
+  AsyncReadLoop::Get().Forget(fd_);
+  FailReads();
+  read_begin_ = read_end_ = 0;
   fd_->Shutdown(SHUT_RDWR);
   if (disconnect_callback_) {
     disconnect_callback_();
@@ -82,15 +189,61 @@ bool VsockConnection::DataAvailable() {
   std::lock_guard<std::recursive_mutex> read_lock(read_mutex_);
   std::lock_guard<std::recursive_mutex> write_lock(write_mutex_);
 
+  if (Buffered() > 0) {
+    return true;
+  }
   read_set.Set(fd_);
   struct timeval timeout = {0, 0};
   return Select(&read_set, nullptr, nullptr, &timeout) > 0;
 }
 
+ssize_t VsockConnection::FillReadBuffer(size_t size, int flags) {
+  if (read_begin_ == read_end_) {
+    read_begin_ = read_end_ = 0;
+  } else if (read_buffer_.size() - read_end_ < size) {
+    std::memmove(read_buffer_.data(), read_buffer_.data() + read_begin_,
+                 Buffered());
+    read_end_ -= read_begin_;
+    read_begin_ = 0;
+  }
+  if (read_buffer_.size() - read_end_ < size) {
+    read_buffer_.resize(read_end_ + std::max(size, kReadChunkSize));
+  }
+  char* dst = read_buffer_.data() + read_end_;
+  size_t available = read_buffer_.size() - read_end_;
+  ssize_t read = flags == 0 ? fd_->Read(dst, available)
+                            : fd_->Recv(dst, available, flags);
+  if (read > 0) {
+    read_end_ += read;
+  }
+  return read;
+}
+
+bool VsockConnection::ReadBuffered(char* data, size_t size) {
+  std::lock_guard<std::recursive_mutex> lock(read_mutex_);
+  while (true) {
+    size_t from_buffer = std::min(size, Buffered());
+    std::memcpy(data, read_buffer_.data() + read_begin_, from_buffer);
+    read_begin_ += from_buffer;
+    data += from_buffer;
+    size -= from_buffer;
+    if (size == 0) {
+      return true;
+    }
+    if (size >= kReadChunkSize) {
+      // Large enough to skip the buffer
+      return ReadExact(fd_, data, size) == size;
+    }
+    if (FillReadBuffer(kReadChunkSize, 0) <= 0) {
+      return false;
+    }
+  }
+}
+
 int32_t VsockConnection::Read() {
   std::lock_guard<std::recursive_mutex> lock(read_mutex_);
   int32_t result;
-  if (ReadExactBinary(fd_, &result) != sizeof(result)) {
+  if (!ReadBuffered(reinterpret_cast<char*>(&result), sizeof(result))) {
     Disconnect();
     return 0;
   }
@@ -99,7 +252,7 @@ int32_t VsockConnection::Read() {
 
 bool VsockConnection::Read(std::vector<char>& data) {
   std::lock_guard<std::recursive_mutex> lock(read_mutex_);
-  return ReadExact(fd_, &data) == data.size();
+  return ReadBuffered(data.data(), data.size());
 }
 
 std::vector<char> VsockConnection::Read(size_t size) {
@@ -108,7 +261,7 @@ std::vector<char> VsockConnection::Read(size_t size) {
   }
   std::lock_guard<std::recursive_mutex> lock(read_mutex_);
   std::vector<char> result(size);
-  if (ReadExact(fd_, &result) != size) {
+  if (!ReadBuffered(result.data(), size)) {
     Disconnect();
     return {};
   }
@@ -116,7 +269,16 @@ std::vector<char> VsockConnection::Read(size_t size) {
 }
 
 std::future<std::vector<char>> VsockConnection::ReadAsync(size_t size) {
-  return std::async(std::launch::async, [this, size]() { return Read(size); });
+  auto promise = std::make_shared<std::promise<std::vector<char>>>();
+  auto future = promise->get_future();
+  if (size == 0) {
+    promise->set_value({});
+    return future;
+  }
+  QueueRead(PendingRead{size, [promise](std::vector<char> data) {
+                          promise->set_value(std::move(data));
+                        }});
+  return future;
 }
 
 // Message format is buffer size followed by buffer data
@@ -142,23 +304,128 @@ bool VsockConnection::ReadMessage(std::vector<char>& data) {
 }
 
 std::future<std::vector<char>> VsockConnection::ReadMessageAsync() {
-  return std::async(std::launch::async, [this]() { return ReadMessage(); });
+  auto promise = std::make_shared<std::promise<std::vector<char>>>();
+  auto future = promise->get_future();
+  QueueRead(PendingRead{std::nullopt, [promise](std::vector<char> data) {
+                          promise->set_value(std::move(data));
+                        }});
+  return future;
 }
 
 Json::Value VsockConnection::ReadJsonMessage() {
-  auto msg = ReadMessage();
-  Json::CharReaderBuilder builder;
-  std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
-  Json::Value json_msg;
-  std::string errors;
-  if (!reader->parse(msg.data(), msg.data() + msg.size(), &json_msg, &errors)) {
-    return {};
-  }
-  return json_msg;
+  return ParseJsonMessage(ReadMessage());
 }
 
 std::future<Json::Value> VsockConnection::ReadJsonMessageAsync() {
-  return std::async(std::launch::async, [this]() { return ReadJsonMessage(); });
+  auto promise = std::make_shared<std::promise<Json::Value>>();
+  auto future = promise->get_future();
+  QueueRead(PendingRead{std::nullopt, [promise](std::vector<char> data) {
+                          promise->set_value(ParseJsonMessage(data));
+                        }});
+  return future;
+}
+
+void VsockConnection::QueueRead(PendingRead read) {
+  std::lock_guard<std::recursive_mutex> lock(read_mutex_);
+  if (!fd_->IsOpen()) {
+    read.complete({});
+    return;
+  }
+  pending_reads_.emplace_back(std::move(read));
+  if (CompleteReads()) {
+    WatchReadable();
+  }
+}
+
+std::optional<size_t> VsockConnection::CompleteReads() {
+  while (!pending_reads_.empty()) {
+    auto& read = pending_reads_.front();
+    size_t header_size = 0;
+    size_t size = 0;
+    if (read.size) {
+      size = *read.size;
+    } else {
+      int32_t message_size;
+      header_size = sizeof(message_size);
+      if (Buffered() < header_size) {
+        return header_size;
+      }
+      std::memcpy(&message_size, read_buffer_.data() + read_begin_,
+                  header_size);
+      if (message_size < 0) {
+        Disconnect();
+        return std::nullopt;
+      }
+      size = message_size;
+    }
+    if (Buffered() < header_size + size) {
+      return header_size + size;
+    }
+    auto begin = read_buffer_.begin() + read_begin_ + header_size;
+    std::vector<char> data(begin, begin + size);
+    read_begin_ += header_size + size;
+    auto complete = std::move(read.complete);
+    pending_reads_.pop_front();
+    complete(std::move(data));
+  }
+  return std::nullopt;
+}
+
+void VsockConnection::FailReads() {
+  auto pending_reads = std::move(pending_reads_);
+  pending_reads_.clear();
+  for (auto& read : pending_reads) {
+    read.complete({});
+  }
+}
+
+void VsockConnection::WatchReadable() {
+  auto target = async_read_target_;
+  bool watching = AsyncReadLoop::Get().Watch(fd_, [target]() {
+    std::function<void()> disconnect_callback;
+    {
+      std::lock_guard lock(target->mutex);
+      if (target->connection) {
+        disconnect_callback = target->connection->OnReadable();
+      }
+    }
+    // Without the lock, so that the callback may destroy the connection.
+    if (disconnect_callback) {
+      disconnect_callback();
+    }
+  });
+  if (!watching) {
+    Disconnect();
+  }
+}
+
+std::function<void()> VsockConnection::OnReadable() {
+  std::lock_guard<std::recursive_mutex> lock(read_mutex_);
+  // Disconnected since the event arrived
+  if (pending_reads_.empty()) {
+    return nullptr;
+  }
+  // Held back while reading, it's for the caller to run.
+  auto disconnect_callback = std::exchange(disconnect_callback_, nullptr);
+  ReadAvailable();
+  disconnect_callback_ = disconnect_callback;
+  return fd_->IsOpen() ? nullptr : disconnect_callback;
+}
+
+void VsockConnection::ReadAvailable() {
+  auto needed = CompleteReads();
+  if (!needed) {
+    return;
+  }
+  auto read = FillReadBuffer(*needed - Buffered(), MSG_DONTWAIT);
+  if (read == 0 || (read < 0 && fd_->GetErrno() != EAGAIN &&
+                    fd_->GetErrno() != EWOULDBLOCK)) {
+    Disconnect();
+    return;
+  }
+  if (CompleteReads()) {
+    WatchReadable();
+  }
 }
 
 bool VsockConnection::Write(int32_t data) {
@@ -183,14 +450,30 @@ bool VsockConnection::Write(const std::vector<char>& data) {
   return Write(data.data(), data.size());
 }
 
+bool VsockConnection::WriteBuffers(std::vector<struct iovec> buffers) {
+  size_t size = 0;
+  for (const auto& buffer : buffers) {
+    size += buffer.iov_len;
+  }
+  std::lock_guard<std::recursive_mutex> lock(write_mutex_);
+  if (WriteAll(fd_, std::move(buffers)) != size) {
+    Disconnect();
+    return false;
+  }
+  return true;
+}
+
 // Message format is buffer size followed by buffer data
 bool VsockConnection::WriteMessage(const std::string& data) {
-  return Write(data.size()) && Write(data.c_str(), data.length());
+  int32_t size = data.size();
+  return WriteBuffers({{&size, sizeof(size)},
+                       {const_cast<char*>(data.data()), data.size()}});
 }
 
 bool VsockConnection::WriteMessage(const std::vector<char>& data) {
-  std::lock_guard<std::recursive_mutex> lock(write_mutex_);
-  return Write(data.size()) && Write(data);
+  int32_t size = data.size();
+  return WriteBuffers({{&size, sizeof(size)},
+                       {const_cast<char*>(data.data()), data.size()}});
 }
 
 bool VsockConnection::WriteMessage(const Json::Value& data) {
@@ -201,13 +484,13 @@ bool VsockConnection::WriteMessage(const Json::Value& data) {
 
 bool VsockConnection::WriteStrides(const char* data, unsigned int size,
                                    unsigned int num_strides, int stride_size) {
+  std::vector<struct iovec> buffers;
+  buffers.reserve(num_strides);
   const char* src = data;
   for (unsigned int i = 0; i < num_strides; ++i, src += stride_size) {
-    if (!Write(src, size)) {
-      return false;
-    }
+    buffers.push_back({const_cast<char*>(src), size});
   }
-  return true;
+  return WriteBuffers(std::move(buffers));
 }
 
 bool VsockClientConnection::Connect(unsigned int port, unsigned int cid,
@@ -17,9 +17,12 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -29,6 +32,16 @@
 
 namespace cuttlefish {
 
+/**
+ * Exchanges data, and messages framed by a 32 bit size, over a socket.
+ *
+ * Reads are buffered, data is read from the socket in large chunks and the
+ * messages are parsed out of the buffer. The asynchronous reads don't get a
+ * thread each, they are completed in order by a single thread shared by all
+ * connections as data arrives. Mixing them with synchronous reads on the same
+ * connection at the same time leaves the order in which they get the data
+ * undefined.
+ */
 class VsockConnection {
  public:
   virtual ~VsockConnection();
@@ -66,6 +79,43 @@ class VsockConnection {
   std::recursive_mutex write_mutex_;
   std::function<void()> disconnect_callback_;
   SharedFD fd_;
+
+ private:
+  struct PendingRead {
+    // A size prefixed message is read when not set.
+    std::optional<size_t> size;
+    std::function<void(std::vector<char>)> complete;
+  };
+  // Lets the thread completing the asynchronous reads reach the connection
+  // for as long as it exists.
+  struct AsyncReadTarget {
+    std::mutex mutex;
+    VsockConnection* connection;
+  };
+
+  bool ReadBuffered(char* data, size_t size);
+  size_t Buffered() const { return read_end_ - read_begin_; }
+  // Makes room for at least `size` bytes past the buffered data and reads
+  // into it, returns the result of the read.
+  ssize_t FillReadBuffer(size_t size, int flags);
+  void QueueRead(PendingRead read);
+  // Completes the pending reads the buffered data is enough for, returns the
+  // number of buffered bytes the next one needs.
+  std::optional<size_t> CompleteReads();
+  void FailReads();
+  void WatchReadable();
+  // Returns the disconnect callback if the connection was lost, to be run
+  // once the caller holds no locks.
+  std::function<void()> OnReadable();
+  void ReadAvailable();
+  bool WriteBuffers(std::vector<struct iovec> buffers);
+
+  std::vector<char> read_buffer_;
+  size_t read_begin_ = 0;
+  size_t read_end_ = 0;
+  std::deque<PendingRead> pending_reads_;
+  std::shared_ptr<AsyncReadTarget> async_read_target_{
+      new AsyncReadTarget{{}, this}};
 };
 
 class VsockClientConnection : public VsockConnection {
@@ -0,0 +1,146 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "common/libs/utils/vsock_connection.h"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+
+#include "common/libs/fs/shared_fd.h"
+
+namespace cuttlefish {
+namespace {
+
+// One end of a socket pair, which has the same stream semantics as vsock
+// without needing a hypervisor.
+class SocketPairConnection : public VsockConnection {
+ public:
+  explicit SocketPairConnection(SharedFD fd) { fd_ = std::move(fd); }
+
+  bool Connect(unsigned int, unsigned int, std::optional<int>) override {
+    return false;
+  }
+};
+
+struct ConnectionPair {
+  ConnectionPair() {
+    SharedFD fd0, fd1;
+    CHECK(SharedFD::SocketPair(AF_UNIX, SOCK_STREAM, 0, &fd0, &fd1));
+    local.emplace(fd0);
+    remote.emplace(fd1);
+  }
+
+  std::optional<SocketPairConnection> local;
+  std::optional<SocketPairConnection> remote;
+};
+
+// Message sizes of sensor events, display frame chunks and whole frames.
+void MessageSizes(benchmark::internal::Benchmark* benchmark) {
+  benchmark->Arg(64)->Arg(4 * 1024)->Arg(256 * 1024);
+}
+
+void BM_WriteMessage(benchmark::State& state) {
+  ConnectionPair pair;
+  // An empty message tells the reader to stop.
+  std::thread reader([&pair]() {
+    while (!pair.remote->ReadMessage().empty()) {
+    }
+  });
+  const std::vector<char> message(state.range(0), 'x');
+  for (auto _ : state) {
+    CHECK(pair.local->WriteMessage(message));
+  }
+  CHECK(pair.local->WriteMessage(std::vector<char>()));
+  reader.join();
+  state.SetBytesProcessed(state.iterations() * message.size());
+}
+BENCHMARK(BM_WriteMessage)->Apply(MessageSizes)->UseRealTime();
+
+void BM_WriteStrides(benchmark::State& state) {
+  // Rows of a 32 bit frame buffer with a padded stride.
+  constexpr unsigned int kRowSize = 720 * 4;
+  constexpr int kStride = 768 * 4;
+  const unsigned int num_rows = state.range(0);
+  ConnectionPair pair;
+  std::thread reader([&pair, num_rows]() {
+    while (pair.remote->Read() > 0) {
+      pair.remote->Read(num_rows * kRowSize);
+    }
+  });
+  const std::vector<char> frame(num_rows * kStride, 'x');
+  for (auto _ : state) {
+    CHECK(pair.local->Write(1));
+    CHECK(pair.local->WriteStrides(frame.data(), kRowSize, num_rows, kStride));
+  }
+  CHECK(pair.local->Write(0));
+  reader.join();
+  state.SetBytesProcessed(state.iterations() * num_rows * kRowSize);
+}
+BENCHMARK(BM_WriteStrides)->Arg(16)->Arg(1280)->UseRealTime();
+
+// Starts a thread on the remote end sending every message back until an empty
+// one arrives.
+std::thread StartEcho(ConnectionPair& pair) {
+  return std::thread([&pair]() {
+    while (true) {
+      auto message = pair.remote->ReadMessage();
+      CHECK(pair.remote->WriteMessage(message));
+      if (message.empty()) {
+        return;
+      }
+    }
+  });
+}
+
+void BM_PingPong(benchmark::State& state) {
+  ConnectionPair pair;
+  auto echo = StartEcho(pair);
+  const std::vector<char> message(state.range(0), 'x');
+  for (auto _ : state) {
+    CHECK(pair.local->WriteMessage(message));
+    benchmark::DoNotOptimize(pair.local->ReadMessage());
+  }
+  CHECK(pair.local->WriteMessage(std::vector<char>()));
+  pair.local->ReadMessage();
+  echo.join();
+  state.SetBytesProcessed(state.iterations() * message.size() * 2);
+}
+BENCHMARK(BM_PingPong)->Apply(MessageSizes)->UseRealTime();
+
+void BM_PingPongAsync(benchmark::State& state) {
+  ConnectionPair pair;
+  auto echo = StartEcho(pair);
+  const std::vector<char> message(state.range(0), 'x');
+  for (auto _ : state) {
+    auto reply = pair.local->ReadMessageAsync();
+    CHECK(pair.local->WriteMessage(message));
+    benchmark::DoNotOptimize(reply.get());
+  }
+  CHECK(pair.local->WriteMessage(std::vector<char>()));
+  pair.local->ReadMessage();
+  echo.join();
+  state.SetBytesProcessed(state.iterations() * message.size() * 2);
+}
+BENCHMARK(BM_PingPongAsync)->Apply(MessageSizes)->UseRealTime();
+
+}  // namespace
+}  // namespace cuttlefish
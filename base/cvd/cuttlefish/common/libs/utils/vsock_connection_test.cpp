@@ -0,0 +1,275 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "common/libs/utils/vsock_connection.h"
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/fs/shared_fd.h"
+
+namespace cuttlefish {
+namespace {
+
+// Matches the size of the reads from the socket in vsock_connection.cpp.
+constexpr size_t kReadChunkSize = 64 * 1024;
+constexpr auto kTimeout = std::chrono::seconds(10);
+
+// One end of a socket pair, which has the same stream semantics as vsock
+// without needing a hypervisor.
+class SocketPairConnection : public VsockConnection {
+ public:
+  explicit SocketPairConnection(SharedFD fd) { fd_ = std::move(fd); }
+
+  bool Connect(unsigned int, unsigned int, std::optional<int>) override {
+    return false;
+  }
+};
+
+std::vector<char> Message(size_t size, char seed) {
+  std::vector<char> message(size);
+  for (size_t i = 0; i < size; i++) {
+    message[i] = static_cast<char>(seed + i * 7);
+  }
+  return message;
+}
+
+// A size prefixed frame, as WriteMessage sends it.
+std::string Frame(const std::vector<char>& message) {
+  int32_t size = message.size();
+  std::string frame(reinterpret_cast<const char*>(&size), sizeof(size));
+  frame.append(message.begin(), message.end());
+  return frame;
+}
+
+class VsockConnectionTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    SharedFD local_fd;
+    ASSERT_TRUE(
+        SharedFD::SocketPair(AF_UNIX, SOCK_STREAM, 0, &local_fd, &remote_fd_));
+    local_ = std::make_unique<SocketPairConnection>(local_fd);
+  }
+
+  // Writes `data` to the other end a few bytes at a time, so that the
+  // connection sees every possible partial read.
+  void WriteSlowly(const std::string& data, size_t step) {
+    for (size_t i = 0; i < data.size(); i += step) {
+      size_t size = std::min(step, data.size() - i);
+      ASSERT_EQ(WriteAll(remote_fd_, data.data() + i, size), size);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  std::unique_ptr<SocketPairConnection> local_;
+  SharedFD remote_fd_;
+};
+
+TEST_F(VsockConnectionTest, ReadsPartialFrames) {
+  const auto first = Message(10, 'a');
+  const auto second = Message(300, 'b');
+  std::thread writer(
+      [&]() { WriteSlowly(Frame(first) + Frame(second), 3); });
+
+  EXPECT_EQ(local_->ReadMessage(), first);
+  EXPECT_EQ(local_->ReadMessage(), second);
+  writer.join();
+}
+
+TEST_F(VsockConnectionTest, ReadsFramesAcrossBufferBoundary) {
+  // Headers and bodies straddle the end of the 64 KiB read buffer at
+  // different offsets.
+  std::vector<std::vector<char>> messages;
+  std::string data;
+  for (size_t size : {kReadChunkSize - 6, size_t{1}, kReadChunkSize - 2,
+                      kReadChunkSize, 3 * kReadChunkSize + 5, size_t{0},
+                      size_t{17}}) {
+    messages.emplace_back(Message(size, messages.size()));
+    data += Frame(messages.back());
+  }
+  std::thread writer([&]() {
+    ASSERT_EQ(WriteAll(remote_fd_, data.data(), data.size()), data.size());
+  });
+
+  for (const auto& message : messages) {
+    std::vector<char> read;
+    ASSERT_TRUE(local_->ReadMessage(read));
+    EXPECT_EQ(read, message);
+  }
+  writer.join();
+}
+
+TEST_F(VsockConnectionTest, ReadsRawDataAfterBufferedFrame) {
+  const auto message = Message(100, 'm');
+  const auto raw = Message(2 * kReadChunkSize + 1, 'r');
+  std::thread writer([&]() {
+    std::string data = Frame(message);
+    data.append(raw.begin(), raw.end());
+    ASSERT_EQ(WriteAll(remote_fd_, data.data(), data.size()), data.size());
+  });
+
+  EXPECT_EQ(local_->ReadMessage(), message);
+  // Part of it is buffered already, the rest bypasses the buffer.
+  EXPECT_EQ(local_->Read(raw.size()), raw);
+  writer.join();
+}
+
+TEST_F(VsockConnectionTest, WritesLargerThanSocketBuffer) {
+  // Larger than the socket buffers, so the writes are partial.
+  const auto message = Message(8 * 1024 * 1024, 'w');
+  SocketPairConnection remote(remote_fd_);
+  std::thread writer([&]() { EXPECT_TRUE(local_->WriteMessage(message)); });
+
+  EXPECT_EQ(remote.ReadMessage(), message);
+  writer.join();
+}
+
+TEST_F(VsockConnectionTest, WritesStrides) {
+  const std::vector<char> data = {'a', 'b', 'x', 'c', 'd', 'x', 'e', 'f'};
+  SocketPairConnection remote(remote_fd_);
+
+  ASSERT_TRUE(local_->WriteStrides(data.data(), 2, 3, 3));
+  EXPECT_EQ(remote.Read(6), std::vector<char>({'a', 'b', 'c', 'd', 'e', 'f'}));
+}
+
+TEST_F(VsockConnectionTest, CompletesAsyncReadsInOrder) {
+  const auto first = Message(kReadChunkSize - 1, '1');
+  const auto second = Message(5, '2');
+  const auto third = Message(2 * kReadChunkSize, '3');
+  auto first_read = local_->ReadMessageAsync();
+  auto second_read = local_->ReadAsync(second.size());
+  auto third_read = local_->ReadMessageAsync();
+
+  std::string data = Frame(first);
+  data.append(second.begin(), second.end());
+  data += Frame(third);
+  std::thread writer([&]() { WriteSlowly(data, 4099); });
+
+  ASSERT_EQ(first_read.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_EQ(first_read.get(), first);
+  ASSERT_EQ(second_read.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_EQ(second_read.get(), second);
+  ASSERT_EQ(third_read.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_EQ(third_read.get(), third);
+  writer.join();
+}
+
+TEST_F(VsockConnectionTest, CompletesAsyncReadFromBufferedData) {
+  const auto first = Message(10, '1');
+  const auto second = Message(20, '2');
+  std::string data = Frame(first) + Frame(second);
+  ASSERT_EQ(WriteAll(remote_fd_, data.data(), data.size()), data.size());
+
+  // Reads both frames into the buffer.
+  EXPECT_EQ(local_->ReadMessage(), first);
+  auto read = local_->ReadMessageAsync();
+  ASSERT_EQ(read.wait_for(std::chrono::seconds(0)), std::future_status::ready);
+  EXPECT_EQ(read.get(), second);
+}
+
+TEST_F(VsockConnectionTest, FailsAsyncReadsWhenPeerCloses) {
+  // Outlives the connection, whose destructor runs the callback again.
+  auto disconnected = std::make_shared<std::promise<void>>();
+  auto called = std::make_shared<std::atomic<bool>>(false);
+  local_->SetDisconnectCallback([disconnected, called]() {
+    if (!called->exchange(true)) {
+      disconnected->set_value();
+    }
+  });
+  auto read = local_->ReadMessageAsync();
+  // Half a header.
+  ASSERT_EQ(WriteAll(remote_fd_, "\x10\x00", 2), 2);
+
+  remote_fd_->Close();
+
+  ASSERT_EQ(read.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_TRUE(read.get().empty());
+  ASSERT_EQ(disconnected->get_future().wait_for(kTimeout),
+            std::future_status::ready);
+  EXPECT_FALSE(local_->IsConnected());
+}
+
+TEST_F(VsockConnectionTest, FailsAsyncReadsOnNegativeSize) {
+  auto read = local_->ReadMessageAsync();
+  int32_t size = -1;
+  ASSERT_EQ(WriteAllBinary(remote_fd_, &size), sizeof(size));
+
+  ASSERT_EQ(read.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_TRUE(read.get().empty());
+  EXPECT_FALSE(local_->IsConnected());
+}
+
+TEST_F(VsockConnectionTest, FailsAsyncReadsOnDisconnect) {
+  auto first = local_->ReadMessageAsync();
+  auto second = local_->ReadAsync(10);
+
+  local_->Disconnect();
+
+  ASSERT_EQ(first.wait_for(std::chrono::seconds(0)),
+            std::future_status::ready);
+  EXPECT_TRUE(first.get().empty());
+  ASSERT_EQ(second.wait_for(std::chrono::seconds(0)),
+            std::future_status::ready);
+  EXPECT_TRUE(second.get().empty());
+  // Reads after the disconnect fail right away.
+  auto third = local_->ReadMessageAsync();
+  ASSERT_EQ(third.wait_for(std::chrono::seconds(0)),
+            std::future_status::ready);
+  EXPECT_TRUE(third.get().empty());
+}
+
+TEST_F(VsockConnectionTest, DisconnectCallbackMayWaitForDestruction) {
+  auto disconnected = std::make_shared<std::promise<void>>();
+  std::promise<void> destroyed;
+  auto destroyed_future = destroyed.get_future().share();
+  auto called = std::make_shared<std::atomic<bool>>(false);
+  auto waited = std::make_shared<std::promise<std::future_status>>();
+  // Runs on the thread completing the asynchronous reads, and blocks it
+  // until the connection is destroyed on this one.
+  local_->SetDisconnectCallback(
+      [disconnected, destroyed_future, called, waited]() {
+        if (!called->exchange(true)) {
+          disconnected->set_value();
+          waited->set_value(destroyed_future.wait_for(kTimeout));
+        }
+      });
+  auto read = local_->ReadMessageAsync();
+
+  remote_fd_->Close();
+
+  ASSERT_EQ(disconnected->get_future().wait_for(kTimeout),
+            std::future_status::ready);
+  local_.reset();
+  destroyed.set_value();
+  EXPECT_EQ(waited->get_future().get(), std::future_status::ready);
+  ASSERT_EQ(read.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_TRUE(read.get().empty());
+}
+
+}  // namespace
+}  // namespace cuttlefish
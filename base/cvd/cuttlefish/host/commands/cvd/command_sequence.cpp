@@ -17,7 +17,10 @@
 
 #include <memory>
 
+#include <android-base/strings.h>
+
 #include "common/libs/fs/shared_buf.h"
+#include "common/libs/utils/trace.h"
 #include "host/commands/cvd/request_context.h"
 #include "host/commands/cvd/server_client.h"
 #include "host/commands/cvd/types.h"
@@ -93,7 +96,15 @@ Result<std::vector<cvd::Response>> CommandSequenceExecutor::Execute(
 
     auto handler = CF_EXPECT(RequestHandler(request, server_handlers_));
     handler_stack_.push_back(handler);
-    auto response = CF_EXPECT(handler->Handle(request));
+    cvd::Response response;
+    {
+      TraceSpan trace("CommandSequenceExecutor::Execute",
+                      TraceEnabled() && inner_proto.has_command_request()
+                          ? android::base::Join(
+                                inner_proto.command_request().args(), " ")
+                          : std::string());
+      response = CF_EXPECT(handler->Handle(request));
+    }
     handler_stack_.pop_back();
 
     CF_EXPECT(response.status().code() == cvd::Status::OK,
@@ -184,6 +184,10 @@ std::string PerUserDir() {
 }
 
 std::string InstanceDatabasePath() {
+  return fmt::format("{}/instance_database_v2.binpb", PerUserDir());
+}
+
+std::string LegacyInstanceDatabasePath() {
   return fmt::format("{}/instance_database.binpb", PerUserDir());
 }
 
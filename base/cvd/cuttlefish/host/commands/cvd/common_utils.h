@@ -100,4 +100,7 @@ std::string PerUserDir();
 
 std::string InstanceDatabasePath();
 
+// Where cvd versions without the instance database journal keep it.
+std::string LegacyInstanceDatabasePath();
+
 }  // namespace cuttlefish
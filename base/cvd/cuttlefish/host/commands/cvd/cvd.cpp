@@ -18,9 +18,11 @@
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/strings.h>
 
 #include "common/libs/utils/environment.h"
 #include "common/libs/utils/result.h"
+#include "common/libs/utils/trace.h"
 #include "cvd_server.pb.h"
 #include "host/commands/cvd/instance_lock.h"
 #include "host/commands/cvd/instance_manager.h"
@@ -62,6 +64,9 @@ Result<cvd::Response> Cvd::HandleCommand(
     const std::vector<std::string>& cvd_process_args,
     const std::unordered_map<std::string, std::string>& env,
     const std::vector<std::string>& selector_args) {
+  TraceSpan trace("Cvd::HandleCommand",
+                  TraceEnabled() ? android::base::Join(cvd_process_args, " ")
+                                 : std::string());
   cvd::Request request = MakeRequest({.cmd_args = cvd_process_args,
                                       .env = env,
                                       .selector_args = selector_args},
@@ -16,7 +16,16 @@
 
 #include "host/commands/cvd/epoll_loop.h"
 
+#include <sys/epoll.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
 #include <android-base/errors.h>
+#include <android-base/logging.h>
 
 #include "common/libs/fs/epoll.h"
 #include "common/libs/fs/shared_fd.h"
@@ -24,6 +33,20 @@
 #include "common/libs/utils/result.h"
 
 namespace cuttlefish {
+namespace {
+
+// Enough to drain a busy loop in one syscall without a large stack frame.
+constexpr size_t kMaxEventsPerWait = 64;
+
+timespec ToTimespec(std::chrono::nanoseconds duration) {
+  timespec ret;
+  auto seconds = std::chrono::duration_cast<std::chrono::seconds>(duration);
+  ret.tv_sec = seconds.count();
+  ret.tv_nsec = (duration - seconds).count();
+  return ret;
+}
+
+}  // namespace
 
 EpollPool::EpollPool() {
   auto epoll = Epoll::Create();
@@ -36,27 +59,108 @@ EpollPool::EpollPool() {
 
 Result<void> EpollPool::Register(SharedFD fd, uint32_t events,
                                  EpollCallback callback) {
+  CF_EXPECT(Add(fd, events | EPOLLONESHOT, std::move(callback), false));
+  return {};
+}
+
+Result<void> EpollPool::RegisterPersistent(SharedFD fd, uint32_t events,
+                                           EpollCallback callback) {
+  CF_EXPECT(Add(fd, events, std::move(callback), true));
+  return {};
+}
+
+Result<SharedFD> EpollPool::AddTimer(std::chrono::nanoseconds interval,
+                                     bool repeating, EpollCallback callback) {
+  CF_EXPECT(interval.count() > 0, "Timer interval must be positive");
+  auto timer = SharedFD::TimerFd();
+  CF_EXPECTF(timer->IsOpen(), "timerfd_create failed: {}", timer->StrError());
+  itimerspec spec{};
+  spec.it_value = ToTimespec(interval);
+  if (repeating) {
+    spec.it_interval = spec.it_value;
+  }
+  CF_EXPECTF(timer->TimerfdSet(spec) == 0, "timerfd_settime failed: {}",
+             timer->StrError());
+  auto on_expired = [callback = std::move(callback)](
+                        EpollEvent event) -> Result<void> {
+    // Clears the readiness, otherwise a repeating timer fires continuously.
+    uint64_t expirations;
+    CF_EXPECTF(event.fd->TimerfdRead(&expirations) == 0,
+               "Failed to read timerfd: {}", event.fd->StrError());
+    return callback(event);
+  };
+  CF_EXPECT(Add(timer, EPOLLIN | (repeating ? 0 : EPOLLONESHOT),
+                std::move(on_expired), repeating));
+  return timer;
+}
+
+Result<SharedFD> EpollPool::WatchProcess(pid_t pid, EpollCallback callback) {
+  auto pidfd = SharedFD::PidFd(pid);
+  CF_EXPECTF(pidfd->IsOpen(), "pidfd_open({}) failed: {}", pid,
+             pidfd->StrError());
+  CF_EXPECT(Register(pidfd, EPOLLIN, std::move(callback)));
+  return pidfd;
+}
+
+Result<void> EpollPool::Add(SharedFD fd, uint32_t events,
+                            EpollCallback callback, bool persistent) {
   std::lock_guard callbacks_lock(callbacks_mutex_);
   CF_EXPECT(!Contains(callbacks_, fd), "Already have a callback created");
-  CF_EXPECT(epoll_.AddOrModify(fd, events | EPOLLONESHOT));
-  callbacks_[fd] = std::move(callback);
+  CF_EXPECT(epoll_.AddOrModify(fd, events));
+  Registration registration;
+  registration.callback =
+      std::make_shared<EpollCallback>(std::move(callback));
+  registration.persistent = persistent;
+  callbacks_[fd] = std::move(registration);
   return {};
 }
 
 Result<void> EpollPool::HandleEvent() {
-  auto event = CF_EXPECT(epoll_.Wait());
-  if (!event) {
-    return {};
-  }
-  EpollCallback callback;
-  {
-    std::lock_guard callbacks_lock(callbacks_mutex_);
-    auto it = callbacks_.find(event->fd);
-    CF_EXPECT(it != callbacks_.end(), "Could not find event callback");
-    callback = std::move(it->second);
-    callbacks_.erase(it);
+  auto events = CF_EXPECT(epoll_.Wait(kMaxEventsPerWait, std::nullopt));
+  // Errors don't return right away, the rest of the callbacks still run.
+  Result<void> first_error = {};
+  auto record = [&first_error](Result<void> result) {
+    if (result.ok()) {
+      return;
+    }
+    if (first_error.ok()) {
+      first_error = std::move(result);
+    } else {
+      LOG(ERROR) << result.error().FormatForEnv();
+    }
+  };
+  for (const auto& event : events) {
+    std::shared_ptr<EpollCallback> callback;
+    bool persistent;
+    {
+      std::lock_guard callbacks_lock(callbacks_mutex_);
+      auto it = callbacks_.find(event.fd);
+      if (it == callbacks_.end()) {
+        // Removed by a callback that ran earlier in this batch.
+        continue;
+      }
+      callback = it->second.callback;
+      persistent = it->second.persistent;
+      if (!persistent) {
+        callbacks_.erase(it);
+      }
+    }
+    auto result = (*callback)(event);
+    if (result.ok()) {
+      continue;
+    }
+    record(std::move(result));
+    if (persistent) {
+      std::lock_guard callbacks_lock(callbacks_mutex_);
+      auto it = callbacks_.find(event.fd);
+      if (it != callbacks_.end() && it->second.callback == callback) {
+        // Stop the events, the callback won't be invoked again.
+        record(epoll_.Delete(event.fd));
+        callbacks_.erase(it);
+      }
+    }
   }
-  CF_EXPECT(callback(*event));
+  CF_EXPECT(std::move(first_error));
   return {};
 }
 
@@ -14,8 +14,12 @@
  * limitations under the License.
  */
 
+#include <sys/types.h>
+
+#include <chrono>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 
 #include "common/libs/fs/epoll.h"
@@ -43,13 +47,47 @@ class EpollPool {
    * re-registered.
    */
   Result<void> Register(SharedFD fd, uint32_t events, EpollCallback callback);
+  /**
+   * Like `Register`, but the callback stays registered and is invoked for
+   * every event until the fd is `Remove`d or the callback returns an error.
+   * This saves re-arming the fd after every event for long lived sockets.
+   */
+  Result<void> RegisterPersistent(SharedFD fd, uint32_t events,
+                                  EpollCallback callback);
+  /**
+   * Invokes `callback` after `interval`, and then every `interval` if
+   * `repeating`. Returns the timer's fd, which can be passed to `Remove`.
+   */
+  Result<SharedFD> AddTimer(std::chrono::nanoseconds interval, bool repeating,
+                            EpollCallback callback);
+  /**
+   * Invokes `callback` once when the child `pid` exits. The child still has
+   * to be reaped by the caller. Returns the pidfd, which can be passed to
+   * `Remove`.
+   */
+  Result<SharedFD> WatchProcess(pid_t pid, EpollCallback callback);
+  /**
+   * Waits for events and invokes the callbacks of all the events returned by
+   * a single epoll_wait call. Every ready callback runs even when an earlier
+   * one fails, and the first error is returned.
+   */
   Result<void> HandleEvent();
   Result<void> Remove(SharedFD fd);
 
  private:
+  struct Registration {
+    // Shared so that a persistent callback can run while unlocked, and even
+    // `Remove` itself.
+    std::shared_ptr<EpollCallback> callback;
+    bool persistent;
+  };
+
+  Result<void> Add(SharedFD fd, uint32_t events, EpollCallback callback,
+                   bool persistent);
+
   Epoll epoll_;
   std::mutex callbacks_mutex_;
-  std::map<SharedFD, EpollCallback> callbacks_;
+  std::map<SharedFD, Registration> callbacks_;
 };
 
 }  // namespace cuttlefish
@@ -24,6 +24,7 @@
 #include <iterator>
 #include <memory>
 #include <optional>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -40,6 +41,7 @@
 #include "common/libs/utils/files.h"
 #include "common/libs/utils/result.h"
 #include "common/libs/utils/tee_logging.h"
+#include "common/libs/utils/trace.h"
 #include "host/commands/cvd/fetch/fetch_cvd_parser.h"
 #include "host/libs/config/fetcher_config.h"
 #include "host/libs/image_aggregator/sparse_image_utils.h"
@@ -55,6 +57,19 @@ namespace {
 
 constexpr mode_t kRwxAllMode = S_IRWXU | S_IRWXG | S_IRWXO;
 constexpr bool kOverrideEntries = true;
+constexpr char kFetcherConfigFile[] = "fetcher_config.json";
+
+// Steps of FetchTarget whose files are recorded in the fetcher config, so that
+// --incremental can skip them when they already ran for the same build.
+constexpr char kDefaultImgZipStep[] = "default_img_zip";
+constexpr char kDefaultTargetFilesStep[] = "default_target_files";
+constexpr char kSystemTargetFilesStep[] = "system_target_files";
+constexpr char kSystemImagesStep[] = "system_images";
+constexpr char kKernelStep[] = "kernel";
+constexpr char kBootStep[] = "boot";
+constexpr char kBootloaderStep[] = "bootloader";
+constexpr char kAndroidEfiLoaderStep[] = "android_efi_loader";
+constexpr char kOtatoolsStep[] = "otatools";
 
 struct BuildStrings {
   std::optional<BuildString> default_build;
@@ -182,6 +197,7 @@ bool ConvertToRawImageNoBinary(const std::string& image_path) {
     return false;
   }
 
+  TraceSpan trace("DeAndroidSparse", image_path);
   std::string tmp_raw_image_path = image_path + ".raw";
 
   //simg2img logic to convert sparse image to raw image.
@@ -293,6 +309,7 @@ Result<void> EnsureDirectoriesExist(const std::string& target_directory,
 Result<void> FetchHostPackage(BuildApi& build_api, const Build& build,
                               const std::string& target_dir,
                               const bool keep_archives) {
+  TraceSpan trace("FetchHostPackage");
   std::string host_tools_filepath = CF_EXPECT(
       build_api.DownloadFile(build, target_dir, "cvd-host_package.tar.gz"));
   CF_EXPECT(
@@ -429,13 +446,82 @@ Result<Build> GetHostBuild(BuildApi& build_api, HostToolsTarget& host_target,
   return host_package_build.value_or(*fallback_host_build);
 }
 
+std::string BootStep(const Build& build) {
+  auto filepath = GetFilepath(build);
+  return filepath ? std::string(kBootStep) + ":" + *filepath : kBootStep;
+}
+
+std::string AndroidEfiLoaderStep(const Build& build) {
+  auto filepath = GetFilepath(build);
+  return filepath ? std::string(kAndroidEfiLoaderStep) + ":" + *filepath
+                  : kAndroidEfiLoaderStep;
+}
+
+// The steps of FetchTarget that will run for these builds.
+std::set<std::string> FetchSteps(const Builds& builds,
+                                 const DownloadFlags& flags) {
+  std::set<std::string> steps;
+  if (builds.default_build && flags.download_img_zip) {
+    steps.insert(kDefaultImgZipStep);
+  }
+  if (builds.default_build &&
+      (builds.system || flags.download_target_files_zip)) {
+    steps.insert(kDefaultTargetFilesStep);
+  }
+  if (builds.system) {
+    steps.insert(kSystemTargetFilesStep);
+    if (flags.download_img_zip) {
+      steps.insert(kSystemImagesStep);
+    }
+  }
+  if (builds.kernel) {
+    steps.insert(kKernelStep);
+  }
+  if (builds.boot) {
+    steps.insert(BootStep(*builds.boot));
+  }
+  if (builds.bootloader) {
+    steps.insert(kBootloaderStep);
+  }
+  if (builds.android_efi_loader) {
+    steps.insert(AndroidEfiLoaderStep(*builds.android_efi_loader));
+  }
+  if (builds.otatools) {
+    steps.insert(kOtatoolsStep);
+  }
+  return steps;
+}
+
+// The config of the last fetch into `target_directory` with --incremental,
+// otherwise an empty config, which makes every step run.
+FetcherConfig PreviousFetcherConfig(const std::string& target_directory,
+                                    const bool incremental) {
+  FetcherConfig previous;
+  std::string fetcher_path = target_directory + "/" + kFetcherConfigFile;
+  if (!incremental || !FileExists(fetcher_path)) {
+    return previous;
+  }
+  if (!previous.LoadFromFile(fetcher_path)) {
+    LOG(WARNING) << "Fetching all files again, unable to load \""
+                 << fetcher_path << "\"";
+    return FetcherConfig();
+  }
+  return previous;
+}
+
+// Only incremental fetches pay for fingerprinting, which reads every fetched
+// file, so only they can be reused by the next incremental fetch.
 Result<void> SaveConfig(FetcherConfig& config,
-                        const std::string& target_directory) {
+                        const std::string& target_directory,
+                        const bool incremental) {
   // Due to constraints of the build system, artifacts intentionally cannot
   // determine their own build id. So it's unclear which build number fetch_cvd
   // itself was built at.
   // https://android.googlesource.com/platform/build/+/979c9f3/Changes.md#build_number
-  std::string fetcher_path = target_directory + "/fetcher_config.json";
+  std::string fetcher_path = target_directory + "/" + kFetcherConfigFile;
+  if (incremental) {
+    CF_EXPECT(config.FingerprintFiles(target_directory));
+  }
   CF_EXPECT(config.AddFilesToConfig(FileSource::GENERATED, "", "",
                                     {fetcher_path}, target_directory));
   config.SaveToFile(fetcher_path);
@@ -451,7 +537,23 @@ Result<void> FetchTarget(BuildApi& build_api, LuciBuildApi& luci_build_api,
                          const TargetDirectories& target_directories,
                          const DownloadFlags& flags,
                          const bool keep_downloaded_archives,
-                         FetcherConfig& config) {
+                         const FetcherConfig& previous, FetcherConfig& config) {
+  TraceSpan trace("FetchTarget", target_directories.root);
+  const std::set<std::string> steps = FetchSteps(builds, flags);
+  auto reuse = [&](const std::string& step, FileSource source,
+                   const Build& build)
+      -> Result<std::optional<std::vector<std::string>>> {
+    const auto [build_id, build_target] = GetBuildIdAndTarget(build);
+    auto reused = CF_EXPECT(
+        config.ReuseFetchStep(previous, target_directories.root, step, source,
+                              build_id, build_target, steps));
+    if (reused) {
+      LOG(INFO) << "Reusing the files of \"" << step << "\" from " << build
+                << ", unchanged since the last fetch";
+    }
+    return reused;
+  };
+
   if (builds.default_build) {
     const auto [default_build_id, default_build_target] =
         GetBuildIdAndTarget(*builds.default_build);
@@ -467,7 +569,9 @@ Result<void> FetchTarget(BuildApi& build_api, LuciBuildApi& luci_build_api,
           kOverrideEntries));
     }
 
-    if (flags.download_img_zip) {
+    if (flags.download_img_zip &&
+        !CF_EXPECT(reuse(kDefaultImgZipStep, FileSource::DEFAULT_BUILD,
+                         *builds.default_build))) {
       std::string img_zip_name = GetBuildZipName(*builds.default_build, "img");
       std::string default_img_zip_filepath = CF_EXPECT(build_api.DownloadFile(
           *builds.default_build, target_directories.root, img_zip_name));
@@ -478,13 +582,16 @@ Result<void> FetchTarget(BuildApi& build_api, LuciBuildApi& luci_build_api,
       for (auto& file : image_files) {
         LOG(VERBOSE) << file;
       }
-      CF_EXPECT(config.AddFilesToConfig(FileSource::DEFAULT_BUILD,
-                                        default_build_id, default_build_target,
-                                        image_files, target_directories.root));
+      CF_EXPECT(config.AddFilesToConfig(
+          FileSource::DEFAULT_BUILD, default_build_id, default_build_target,
+          image_files, target_directories.root, !kOverrideEntries,
+          kDefaultImgZipStep));
       DeAndroidSparse(image_files);
     }
 
-    if (builds.system || flags.download_target_files_zip) {
+    if ((builds.system || flags.download_target_files_zip) &&
+        !CF_EXPECT(reuse(kDefaultTargetFilesStep, FileSource::DEFAULT_BUILD,
+                         *builds.default_build))) {
       std::string target_files_name =
           GetBuildZipName(*builds.default_build, "target_files");
       std::string target_files = CF_EXPECT(build_api.DownloadFile(
@@ -493,22 +600,32 @@ Result<void> FetchTarget(BuildApi& build_api, LuciBuildApi& luci_build_api,
       LOG(INFO) << "Adding target files for default build";
       CF_EXPECT(config.AddFilesToConfig(
           FileSource::DEFAULT_BUILD, default_build_id, default_build_target,
-          {target_files}, target_directories.root));
+          {target_files}, target_directories.root, !kOverrideEntries,
+          kDefaultTargetFilesStep));
     }
   }
 
   if (builds.system) {
-    std::string target_files_name =
-        GetBuildZipName(*builds.system, "target_files");
-    std::string target_files = CF_EXPECT(build_api.DownloadFile(
-        *builds.system, target_directories.system_target_files,
-        target_files_name));
     const auto [system_id, system_target] = GetBuildIdAndTarget(*builds.system);
-    CF_EXPECT(config.AddFilesToConfig(FileSource::SYSTEM_BUILD, system_id,
-                                      system_target, {target_files},
-                                      target_directories.root));
+    std::string target_files;
+    auto reused_target_files = CF_EXPECT(reuse(
+        kSystemTargetFilesStep, FileSource::SYSTEM_BUILD, *builds.system));
+    if (reused_target_files && reused_target_files->size() == 1) {
+      target_files = (*reused_target_files)[0];
+    } else {
+      std::string target_files_name =
+          GetBuildZipName(*builds.system, "target_files");
+      target_files = CF_EXPECT(build_api.DownloadFile(
+          *builds.system, target_directories.system_target_files,
+          target_files_name));
+      CF_EXPECT(config.AddFilesToConfig(
+          FileSource::SYSTEM_BUILD, system_id, system_target, {target_files},
+          target_directories.root, kOverrideEntries, kSystemTargetFilesStep));
+    }
 
-    if (flags.download_img_zip) {
+    if (flags.download_img_zip &&
+        !CF_EXPECT(reuse(kSystemImagesStep, FileSource::SYSTEM_BUILD,
+                         *builds.system))) {
       std::vector<std::string> system_images;
       Result<std::string> extracted_system = ExtractImage(
           target_files, target_directories.root, "IMAGES/system.img");
@@ -559,12 +676,13 @@ Result<void> FetchTarget(BuildApi& build_api, LuciBuildApi& luci_build_api,
 
       CF_EXPECT(config.AddFilesToConfig(
           FileSource::SYSTEM_BUILD, system_id, system_target, system_images,
-          target_directories.root, kOverrideEntries));
+          target_directories.root, kOverrideEntries, kSystemImagesStep));
       DeAndroidSparse(system_images);
     }
   }
 
-  if (builds.kernel) {
+  if (builds.kernel &&
+      !CF_EXPECT(reuse(kKernelStep, FileSource::KERNEL_BUILD, *builds.kernel))) {
     std::string kernel_filepath = target_directories.root + "/kernel";
     // If the kernel is from an arm/aarch64 build, the artifact will be called
     // Image.
@@ -573,9 +691,9 @@ Result<void> FetchTarget(BuildApi& build_api, LuciBuildApi& luci_build_api,
             *builds.kernel, target_directories.root, "bzImage", "Image"));
     CF_EXPECT(RenameFile(downloaded_kernel_filepath, kernel_filepath));
     const auto [kernel_id, kernel_target] = GetBuildIdAndTarget(*builds.kernel);
-    CF_EXPECT(config.AddFilesToConfig(FileSource::KERNEL_BUILD, kernel_id,
-                                      kernel_target, {kernel_filepath},
-                                      target_directories.root));
+    CF_EXPECT(config.AddFilesToConfig(
+        FileSource::KERNEL_BUILD, kernel_id, kernel_target, {kernel_filepath},
+        target_directories.root, !kOverrideEntries, kKernelStep));
     DeAndroidSparse({kernel_filepath});
 
     // Certain kernel builds do not have corresponding ramdisks.
@@ -584,12 +702,14 @@ Result<void> FetchTarget(BuildApi& build_api, LuciBuildApi& luci_build_api,
     if (initramfs_img_result.ok()) {
       CF_EXPECT(config.AddFilesToConfig(
           FileSource::KERNEL_BUILD, kernel_id, kernel_target,
-          {initramfs_img_result.value()}, target_directories.root));
+          {initramfs_img_result.value()}, target_directories.root,
+          !kOverrideEntries, kKernelStep));
       DeAndroidSparse({initramfs_img_result.value()});
     }
   }
 
-  if (builds.boot) {
+  if (builds.boot && !CF_EXPECT(reuse(BootStep(*builds.boot),
+                                      FileSource::BOOT_BUILD, *builds.boot))) {
     std::string boot_img_zip_name = GetBuildZipName(*builds.boot, "img");
     std::string downloaded_boot_filepath;
     std::optional<std::string> boot_filepath = GetFilepath(*builds.boot);
@@ -626,11 +746,13 @@ Result<void> FetchTarget(BuildApi& build_api, LuciBuildApi& luci_build_api,
     const auto [boot_id, boot_target] = GetBuildIdAndTarget(*builds.boot);
     CF_EXPECT(config.AddFilesToConfig(
         FileSource::BOOT_BUILD, boot_id, boot_target, boot_files,
-        target_directories.root, kOverrideEntries));
+        target_directories.root, kOverrideEntries, BootStep(*builds.boot)));
     DeAndroidSparse(boot_files);
   }
 
-  if (builds.bootloader) {
+  if (builds.bootloader &&
+      !CF_EXPECT(reuse(kBootloaderStep, FileSource::BOOTLOADER_BUILD,
+                       *builds.bootloader))) {
     std::string bootloader_filepath = target_directories.root + "/bootloader";
     // If the bootloader is from an arm/aarch64 build, the artifact will be of
     // filetype bin.
@@ -643,11 +765,15 @@ Result<void> FetchTarget(BuildApi& build_api, LuciBuildApi& luci_build_api,
         GetBuildIdAndTarget(*builds.bootloader);
     CF_EXPECT(config.AddFilesToConfig(
         FileSource::BOOTLOADER_BUILD, bootloader_id, bootloader_target,
-        {bootloader_filepath}, target_directories.root, kOverrideEntries));
+        {bootloader_filepath}, target_directories.root, kOverrideEntries,
+        kBootloaderStep));
     DeAndroidSparse({bootloader_filepath});
   }
 
-  if (builds.android_efi_loader) {
+  if (builds.android_efi_loader &&
+      !CF_EXPECT(reuse(AndroidEfiLoaderStep(*builds.android_efi_loader),
+                       FileSource::ANDROID_EFI_LOADER_BUILD,
+                       *builds.android_efi_loader))) {
     std::string android_efi_loader_target_filepath =
         target_directories.root + "/android_efi_loader.efi";
     std::optional<std::string> android_efi_loader_filepath =
@@ -665,11 +791,14 @@ Result<void> FetchTarget(BuildApi& build_api, LuciBuildApi& luci_build_api,
     CF_EXPECT(config.AddFilesToConfig(
         FileSource::ANDROID_EFI_LOADER_BUILD, android_efi_loader_id,
         android_efi_loader_target, {android_efi_loader_target_filepath},
-        target_directories.root, kOverrideEntries));
+        target_directories.root, kOverrideEntries,
+        AndroidEfiLoaderStep(*builds.android_efi_loader)));
     DeAndroidSparse({android_efi_loader_target_filepath});
   }
 
-  if (builds.otatools) {
+  if (builds.otatools && !CF_EXPECT(reuse(kOtatoolsStep,
+                                          FileSource::DEFAULT_BUILD,
+                                          *builds.otatools))) {
     std::string otatools_filepath = CF_EXPECT(build_api.DownloadFile(
         *builds.otatools, target_directories.root, "otatools.zip"));
     std::vector<std::string> ota_tools_files = CF_EXPECT(
@@ -679,7 +808,8 @@ Result<void> FetchTarget(BuildApi& build_api, LuciBuildApi& luci_build_api,
         GetBuildIdAndTarget(*builds.otatools);
     CF_EXPECT(config.AddFilesToConfig(
         FileSource::DEFAULT_BUILD, otatools_build_id, otatools_build_target,
-        ota_tools_files, target_directories.root));
+        ota_tools_files, target_directories.root, !kOverrideEntries,
+        kOtatoolsStep));
     DeAndroidSparse(ota_tools_files);
   }
 
@@ -729,11 +859,14 @@ Result<void> Fetch(const FetchFlags& flags, HostToolsTarget& host_target,
                    std::cref(flags.keep_downloaded_archives));
     for (const auto& target : targets) {
       LOG(INFO) << "Starting fetch to \"" << target.directories.root << "\"";
+      const FetcherConfig previous =
+          PreviousFetcherConfig(target.directories.root, flags.incremental);
       FetcherConfig config;
       CF_EXPECT(FetchTarget(build_api, luci_build_api, target.builds,
                             target.directories, target.download_flags,
-                            flags.keep_downloaded_archives, config));
-      CF_EXPECT(SaveConfig(config, target.directories.root));
+                            flags.keep_downloaded_archives, previous, config));
+      CF_EXPECT(
+          SaveConfig(config, target.directories.root, flags.incremental));
       LOG(INFO) << "Completed fetch to \"" << target.directories.root << "\"";
     }
     CF_EXPECT(host_package_future.get());
@@ -754,14 +887,19 @@ Result<void> FetchCvdMain(int argc, char** argv) {
   HostToolsTarget host_target = GetHostToolsTarget(flags, append_subdirectory);
   CF_EXPECT(EnsureDirectoriesExist(flags.target_directory,
                                    host_target.host_tools_directory, targets));
-  android::base::SetLogger(
-      LogToStderrAndFiles({flags.target_directory + "/fetch.log"}));
+  // Fetch logs per downloaded chunk and extracted file at higher verbosities,
+  // keep the writes off the fetching threads.
+  android::base::SetLogger(LogToStderrAndFiles(
+      {flags.target_directory + "/fetch.log"}, "",
+      MetadataLevel::ONLY_MESSAGE, LogWriteMode::ASYNCHRONOUS));
   android::base::SetMinimumLogSeverity(flags.verbosity);
 
   auto result = Fetch(flags, host_target, targets);
   if (!result.ok()) {
     LOG(ERROR) << result.error().FormatForEnv();
   }
+  // Replacing the logger drains the queued messages and stops the writer.
+  android::base::SetLogger(android::base::StderrLogger);
   return result;
 }
 
@@ -70,6 +70,11 @@ std::vector<Flag> GetFlagsVector(FetchFlags& fetch_flags,
   flags.emplace_back(GflagsCompatFlag("keep_downloaded_archives",
                                       fetch_flags.keep_downloaded_archives)
                          .Help("Keep downloaded zip/tar."));
+  flags.emplace_back(
+      GflagsCompatFlag("incremental", fetch_flags.incremental)
+          .Help("Skip the artifacts that the last incremental fetch into "
+                "the target directory already fetched from the same build, as "
+                "long as their files are unchanged."));
   flags.emplace_back(VerbosityFlag(fetch_flags.verbosity));
   flags.emplace_back(
       GflagsCompatFlag("target_subdirectory", fetch_flags.target_subdirectory)
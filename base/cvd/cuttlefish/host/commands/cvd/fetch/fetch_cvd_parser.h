@@ -47,6 +47,7 @@ inline constexpr bool kDefaultDownloadImgZip = true;
 inline constexpr bool kDefaultDownloadTargetFilesZip = false;
 inline constexpr char kDefaultTargetDirectory[] = "";
 inline constexpr bool kDefaultKeepDownloadedArchives = false;
+inline constexpr bool kDefaultIncremental = false;
 
 inline constexpr char kDefaultBuildTarget[] =
     "aosp_cf_x86_64_phone-trunk_staging-userdebug";
@@ -85,6 +86,7 @@ struct FetchFlags {
   std::vector<std::string> target_subdirectory;
   std::optional<BuildString> host_package_build;
   bool keep_downloaded_archives = kDefaultKeepDownloadedArchives;
+  bool incremental = kDefaultIncremental;
   android::base::LogSeverity verbosity = android::base::INFO;
   bool helpxml = false;
   BuildApiFlags build_api_flags;
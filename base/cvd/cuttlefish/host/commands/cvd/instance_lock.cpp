@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <cstring>
+#include <mutex>
 #include <regex>
 #include <sstream>
 #include <string>
@@ -111,12 +112,8 @@ Result<std::set<InstanceLockFile>> InstanceLockFileManager::TryAcquireLocks(
 
 Result<std::vector<InstanceLockFile>>
 InstanceLockFileManager::LockAllAvailable() {
-  if (!all_instance_nums_) {
-    all_instance_nums_ = CF_EXPECT(FindPotentialInstanceNumsFromNetDevices());
-  }
-
   std::vector<InstanceLockFile> acquired_lock_files;
-  for (const auto num : *all_instance_nums_) {
+  for (const auto num : CF_EXPECT(AllInstanceNums())) {
     auto lock_result = TryAcquireLock(num);
     if (!lock_result.ok()) {
       LOG(DEBUG) << "Unable to open lock file for ID #" << num << " but "
@@ -225,13 +222,17 @@ cvd-wtap-02:       0       0    0    0    0     0          0         0        0
   return result;
 }
 
-Result<std::optional<InstanceLockFile>>
-InstanceLockFileManager::TryAcquireUnusedLock() {
+Result<std::set<int>> InstanceLockFileManager::AllInstanceNums() {
+  std::lock_guard lock(all_instance_nums_mutex_);
   if (!all_instance_nums_) {
     all_instance_nums_ = CF_EXPECT(FindPotentialInstanceNumsFromNetDevices());
   }
+  return *all_instance_nums_;
+}
 
-  for (const auto num : *all_instance_nums_) {
+Result<std::optional<InstanceLockFile>>
+InstanceLockFileManager::TryAcquireUnusedLock() {
+  for (const auto num : CF_EXPECT(AllInstanceNums())) {
     auto lock = CF_EXPECT(TryAcquireLock(num));
     if (lock && CF_EXPECT(lock->Status()) == InUseState::kNotInUse) {
       return std::move(*lock);
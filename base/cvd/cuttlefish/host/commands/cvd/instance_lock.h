@@ -15,6 +15,8 @@
  */
 #pragma once
 
+#include <mutex>
+#include <optional>
 #include <set>
 #include <string>
 
@@ -68,7 +70,11 @@ class InstanceLockFileManager {
    * Generate value to initialize
    */
   Result<std::set<int>> FindPotentialInstanceNumsFromNetDevices();
+  Result<std::set<int>> AllInstanceNums();
   static Result<std::string> LockFilePath(int instance_num);
+  // Guards the lazy initialization, cvd batch shares the manager across
+  // threads.
+  std::mutex all_instance_nums_mutex_;
   std::optional<std::set<int>> all_instance_nums_;
   LockFileManager lock_file_manager_;
 };
@@ -18,11 +18,16 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -34,6 +39,7 @@
 #include "common/libs/utils/environment.h"
 #include "common/libs/utils/files.h"
 #include "common/libs/utils/subprocess.h"
+#include "common/libs/utils/trace.h"
 #include "host/commands/cvd/client.h"
 #include "host/commands/cvd/cvd.h"
 #include "host/commands/cvd/common_utils.h"
@@ -44,11 +50,63 @@
 // #include "host/commands/cvd/metrics/cvd_metrics_api.h"
 #include "host/commands/cvd/run_server.h"
 #include "host/commands/cvd/server_constants.h"
+#include "host/commands/cvd/trash.h"
 #include "host/libs/config/host_tools_version.h"
 
 namespace cuttlefish {
 namespace {
 
+/**
+ * Reports how long each phase of the driver startup took.
+ *
+ * Enabled by setting CVD_TRACE_STARTUP=1, prints to stderr when destroyed.
+ * The phases are also recorded as spans when tracing to a file.
+ */
+class StartupTrace {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  StartupTrace()
+      : enabled_(StringFromEnv("CVD_TRACE_STARTUP", "") == "1"),
+        start_(Clock::now()),
+        last_(start_) {}
+
+  ~StartupTrace() {
+    if (!enabled_) {
+      return;
+    }
+    Mark("command");
+    for (const auto& [phase, duration] : phases_) {
+      std::cerr << "cvd startup: " << phase << " " << Millis(duration)
+                << " ms\n";
+    }
+    std::cerr << "cvd startup: total " << Millis(last_ - start_) << " ms"
+              << std::endl;
+  }
+
+  // Ends the current phase, attributing the time since the previous mark to
+  // it.
+  void Mark(std::string phase) {
+    if (!enabled_ && !TraceEnabled()) {
+      return;
+    }
+    auto now = Clock::now();
+    TraceComplete("startup", last_, now, phase);
+    phases_.emplace_back(std::move(phase), now - last_);
+    last_ = now;
+  }
+
+ private:
+  static double Millis(Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+  }
+
+  const bool enabled_;
+  const Clock::time_point start_;
+  Clock::time_point last_;
+  std::vector<std::pair<std::string, Clock::duration>> phases_;
+};
+
 /**
  * Returns --verbosity value if ever exist in the entire commandline args
  *
@@ -80,6 +138,45 @@ android::base::LogSeverity CvdVerbosityOption(const int argc, char** argv) {
   return (encoded_verbosity.ok() ? *encoded_verbosity : GetMinimumVerbosity());
 }
 
+/**
+ * Starts tracing to the --trace_file value and drops the flag from `args`
+ *
+ * Unlike --verbosity, the flag is only looked for among the driver flags
+ * ahead of the subcommand, so that a --trace_file meant for a subtool (e.g.
+ * cvd start --trace_file=...) is passed on to it untouched.
+ * The cvd subprocesses inherit CVD_TRACE_FILE and append to the same trace.
+ */
+Result<void> ConsumeTraceFileFlag(cvd_common::Args& args) {
+  std::size_t driver_args_end = 1;
+  while (driver_args_end < args.size()) {
+    const std::string& arg = args[driver_args_end];
+    if (arg == "--" || !android::base::StartsWith(arg, "-")) {
+      break;
+    }
+    driver_args_end++;
+    // The value of "--trace_file <path>" is not a subcommand.
+    if (arg == "--trace_file" || arg == "-trace_file") {
+      driver_args_end = std::min(driver_args_end + 1, args.size());
+    }
+  }
+  cvd_common::Args driver_args(args.begin() + 1,
+                               args.begin() + driver_args_end);
+  const std::size_t driver_args_size = driver_args.size();
+
+  std::string trace_file;
+  std::vector<Flag> trace_file_flag{
+      GflagsCompatFlag("trace_file", trace_file)};
+  CF_EXPECT(ConsumeFlags(trace_file_flag, driver_args));
+  if (driver_args.size() != driver_args_size) {
+    args.erase(args.begin() + 1, args.begin() + driver_args_end);
+    args.insert(args.begin() + 1, driver_args.begin(), driver_args.end());
+  }
+  if (!trace_file.empty()) {
+    CF_EXPECT(StartTraceFile(trace_file));
+  }
+  return {};
+}
+
 /**
  * Terminates a cvd server listening on "cvd_server"
  *
@@ -163,13 +260,32 @@ void IncreaseFileLimit() {
 }
 
 Result<void> CvdMain(int argc, char** argv, char** envp,
-                     const android::base::LogSeverity verbosity) {
+                     const android::base::LogSeverity verbosity,
+                     StartupTrace& trace) {
+  cvd_common::Args all_args = ArgsToVec(argc, argv);
+  CF_EXPECT(!all_args.empty());
+
+  // Started by RemoveDirectoryInBackground, doesn't need any of the setup.
+  if (android::base::Basename(all_args[0]) == kEmptyTrashCommand) {
+    // Exits right away to be reaped by the caller, and leaves the work to a
+    // child that init adopts.
+    pid_t pid = fork();
+    CF_EXPECTF(pid >= 0, "Failed to fork: {}", strerror(errno));
+    if (pid == 0) {
+      LowerTrashReaperPriority();
+      CF_EXPECT(EmptyTrash());
+    }
+    return {};
+  }
+
   CF_EXPECT(EnsureCvdDirectoriesExist());
+  trace.Mark("ensure_directories");
 
+  // The server probes run on every invocation. An older cvd can start a
+  // server at any time, and the server sockets are abstract, so there's
+  // nothing cheaper than the connect attempt itself to tell whether one runs.
   CF_EXPECT(KillOldServer());
-
-  cvd_common::Args all_args = ArgsToVec(argc, argv);
-  CF_EXPECT(!all_args.empty());
+  trace.Mark("kill_old_server");
 
   if (IsServerModeExpected(all_args[0])) {
     // Persist previous server's instance database to file.
@@ -185,7 +301,7 @@ Result<void> CvdMain(int argc, char** argv, char** envp,
     // database.
     TryInheritServerDatabase();
   }
-
+  trace.Mark("inherit_server_database");
 
   auto env = EnvpToMap(envp);
   // TODO(315772518) Re-enable once metrics send is skipped in a env
@@ -198,14 +314,17 @@ Result<void> CvdMain(int argc, char** argv, char** envp,
   }
 
   IncreaseFileLimit();
+  trace.Mark("increase_file_limit");
 
   InstanceLockFileManager instance_lockfile_manager;
   auto host_tool_target_manager = NewHostToolTargetManager();
-  selector::InstanceDatabase instance_db(InstanceDatabasePath());
+  selector::InstanceDatabase instance_db(InstanceDatabasePath(),
+                                         LegacyInstanceDatabasePath());
   InstanceManager instance_manager(instance_lockfile_manager,
                                    *host_tool_target_manager, instance_db);
   Cvd cvd(verbosity, instance_lockfile_manager, instance_manager,
           *host_tool_target_manager);
+  trace.Mark("setup");
 
   // TODO(b/206893146): Make this decision inside the server.
   if (android::base::Basename(all_args[0]) == "acloud") {
@@ -266,13 +385,32 @@ std::string ColoredUrl(const std::string& url) {
 }  // namespace cuttlefish
 
 int main(int argc, char** argv, char** envp) {
+  std::vector<std::string> args = cuttlefish::ArgsToVec(argc, argv);
+  auto trace_flag = cuttlefish::ConsumeTraceFileFlag(args);
+  std::vector<char*> trace_argv;
+  if (trace_flag.ok() && args.size() != argc) {
+    for (auto& arg : args) {
+      trace_argv.push_back(arg.data());
+    }
+    trace_argv.push_back(nullptr);
+    argc = args.size();
+    argv = trace_argv.data();
+    // Picks up CVD_TRACE_FILE for the subprocesses.
+    envp = environ;
+  }
+  cuttlefish::StartupTrace trace;
+  cuttlefish::TraceSpan main_span("cvd");
   android::base::LogSeverity verbosity =
       cuttlefish::CvdVerbosityOption(argc, argv);
   android::base::InitLogging(argv, android::base::StderrLogger);
   // set verbosity for this process
   cuttlefish::SetMinimumVerbosity(verbosity);
+  if (!trace_flag.ok()) {
+    LOG(ERROR) << "Not tracing: " << trace_flag.error().FormatForEnv();
+  }
+  trace.Mark("init_logging");
 
-  auto result = cuttlefish::CvdMain(argc, argv, envp, verbosity);
+  auto result = cuttlefish::CvdMain(argc, argv, envp, verbosity, trace);
   if (result.ok()) {
     return 0;
   } else {
@@ -19,9 +19,12 @@
 
 #include "common/libs/utils/files.h"
 #include "common/libs/utils/flag_parser.h"
+#include "host/commands/cvd/common_utils.h"
 #include "host/commands/cvd/metrics/cvd_metrics_api.h"
+#include "host/commands/cvd/metrics/metrics_spool.h"
 #include "host/commands/cvd/metrics/utils.h"
 #include "host/commands/metrics/metrics_defs.h"
+#include "host/libs/web/http_client/http_client.h"
 
 namespace cuttlefish {
 
@@ -70,27 +73,64 @@ std::unique_ptr<AtestLogEventInternal> BuildAtestLogEvent(
   return event;
 }
 
-std::unique_ptr<LogRequest> BuildAtestLogRequest(
-    uint64_t now_ms, AtestLogEventInternal* cfEvent) {
+// Returns the serialized LogEvent, or an empty string on failure.
+std::string BuildAtestLogEventRecord(uint64_t now_ms,
+                                     AtestLogEventInternal* cfEvent) {
+  std::string atest_log_event;
+  if (!cfEvent->SerializeToString(&atest_log_event)) {
+    LOG(ERROR) << "Serialization failed for atest event";
+    return "";
+  }
+
+  LogEvent logEvent;
+  logEvent.set_event_time_ms(now_ms);
+  logEvent.set_source_extension(atest_log_event);
+
+  std::string record;
+  if (!logEvent.SerializeToString(&record)) {
+    LOG(ERROR) << "Serialization failed for LogEvent";
+    return "";
+  }
+  return record;
+}
+
+// One LogRequest carries all the spooled events of a batch.
+Result<std::string> BuildAtestLogRequest(
+    uint64_t now_ms, const std::vector<std::string>& records) {
   // "log_request" is the top level LogRequest
-  auto log_request = std::make_unique<LogRequest>();
-  log_request->set_request_time_ms(now_ms);
-  log_request->set_log_source_name(kLogSourceStr);
+  LogRequest log_request;
+  log_request.set_request_time_ms(now_ms);
+  log_request.set_log_source_name(kLogSourceStr);
 
-  ClientInfo* client_info = log_request->mutable_client_info();
+  ClientInfo* client_info = log_request.mutable_client_info();
   client_info->set_client_type(kCppClientType);
 
-  std::string atest_log_event;
-  if (!cfEvent->SerializeToString(&atest_log_event)) {
-    LOG(ERROR) << "Serialization failed for atest event";
-    return nullptr;
+  for (const auto& record : records) {
+    if (!log_request.add_log_event()->ParseFromString(record)) {
+      LOG(WARNING) << "Dropping unparseable spooled metrics event";
+      log_request.mutable_log_event()->RemoveLast();
+    }
   }
 
-  LogEvent* logEvent = log_request->add_log_event();
-  logEvent->set_event_time_ms(now_ms);
-  logEvent->set_source_extension(atest_log_event);
+  std::string log_request_str;
+  CF_EXPECT(log_request.SerializeToString(&log_request_str),
+            "Serialization failed for atest LogRequest");
+  return log_request_str;
+}
+
+Result<void> PostAtestLogRequest(const std::vector<std::string>& records) {
+  auto log_request =
+      CF_EXPECT(BuildAtestLogRequest(metrics::GetEpochTimeMs(), records));
+  auto http_client = HttpClient::CurlClient();
+  auto response = CF_EXPECT(http_client->PostToString(
+      metrics::ClearcutServerUrl(metrics::kProd), log_request));
+  CF_EXPECT(response.HttpSuccess(),
+            "Metrics upload failed with http code " << response.http_code);
+  return {};
+}
 
-  return log_request;
+MetricsSpool CvdMetricsSpool() {
+  return MetricsSpool(PerUserDir() + "/metrics_spool", MetricsSpool::Options{});
 }
 
 std::string createCommandLine(const std::vector<std::string>& args) {
@@ -147,18 +187,25 @@ int CvdMetrics::SendLaunchCommand(const std::string& command_line) {
   uint64_t now_ms = metrics::GetEpochTimeMs();
   auto cfEvent = BuildAtestLogEvent(command_line);
 
-  auto logRequest = BuildAtestLogRequest(now_ms, cfEvent.get());
-  if (!logRequest) {
-    LOG(ERROR) << "Failed to build atest LogRequest";
+  auto record = BuildAtestLogEventRecord(now_ms, cfEvent.get());
+  if (record.empty()) {
+    LOG(ERROR) << "Failed to build atest LogEvent";
     return MetricsExitCodes::kMetricsError;
   }
 
-  std::string logRequestStr;
-  if (!logRequest->SerializeToString(&logRequestStr)) {
-    LOG(ERROR) << "Serialization failed for atest LogRequest";
+  // Only touches local files, the upload happens in a detached process.
+  auto spool = CvdMetricsSpool();
+  auto appended = spool.Append(record);
+  if (!appended.ok()) {
+    LOG(DEBUG) << appended.error().FormatForEnv();
+    return MetricsExitCodes::kMetricsError;
+  }
+  auto started = spool.UploadInBackground(PostAtestLogRequest);
+  if (!started.ok()) {
+    LOG(DEBUG) << started.error().FormatForEnv();
     return MetricsExitCodes::kMetricsError;
   }
-  return metrics::PostRequest(logRequestStr, metrics::kProd);
+  return MetricsExitCodes::kSuccess;
 }
 
 int CvdMetrics::SendCvdMetrics(const std::vector<std::string>& args) {
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/metrics/metrics_spool.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/logging.h>
+
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+namespace {
+
+// Each record is stored as a little endian 32 bit length and the bytes.
+constexpr size_t kLengthSize = sizeof(uint32_t);
+
+void EncodeRecord(const std::string& record, std::string& out) {
+  uint32_t length = record.size();
+  for (size_t i = 0; i < kLengthSize; i++) {
+    out += static_cast<char>((length >> (8 * i)) & 0xff);
+  }
+  out += record;
+}
+
+// A truncated record at the end, left by a crashed writer, is dropped.
+std::vector<std::string> DecodeRecords(const std::string& data) {
+  std::vector<std::string> records;
+  size_t pos = 0;
+  while (data.size() - pos >= kLengthSize) {
+    uint32_t length = 0;
+    for (size_t i = 0; i < kLengthSize; i++) {
+      length |= static_cast<uint32_t>(static_cast<uint8_t>(data[pos + i]))
+                << (8 * i);
+    }
+    pos += kLengthSize;
+    if (data.size() - pos < length) {
+      LOG(WARNING) << "Dropping truncated metrics record";
+      break;
+    }
+    records.emplace_back(data.substr(pos, length));
+    pos += length;
+  }
+  return records;
+}
+
+Result<SharedFD> OpenLocked(const std::string& path, int lock) {
+  auto fd = SharedFD::Open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  CF_EXPECTF(fd->IsOpen(), "Failed to open \"{}\": {}", path, fd->StrError());
+  CF_EXPECT(fd->Flock(lock));
+  return fd;
+}
+
+Result<std::string> ReadFromStart(SharedFD fd) {
+  CF_EXPECT(fd->LSeek(0, SEEK_SET) == 0, fd->StrError());
+  std::string data;
+  CF_EXPECT(ReadAll(fd, &data) >= 0, fd->StrError());
+  return data;
+}
+
+}  // namespace
+
+MetricsSpool::MetricsSpool(std::string path, Options options)
+    : path_(std::move(path)), lock_path_(path_ + ".lock"), options_(options) {}
+
+Result<void> MetricsSpool::Append(const std::string& record) {
+  auto fd = CF_EXPECT(OpenLocked(path_, LOCK_EX));
+  off_t size = fd->LSeek(0, SEEK_END);
+  CF_EXPECT(size >= 0, fd->StrError());
+  CF_EXPECTF(size + kLengthSize + record.size() <= options_.max_bytes,
+             "Metrics spool \"{}\" is full, dropping the record", path_);
+  std::string encoded;
+  EncodeRecord(record, encoded);
+  CF_EXPECT_EQ(WriteAll(fd, encoded), encoded.size(), fd->StrError());
+  return {};
+}
+
+Result<std::vector<std::string>> MetricsSpool::Records() {
+  auto fd = CF_EXPECT(OpenLocked(path_, LOCK_SH));
+  return DecodeRecords(CF_EXPECT(ReadFromStart(fd)));
+}
+
+Result<std::vector<std::string>> MetricsSpool::Take(size_t max_records) {
+  auto fd = CF_EXPECT(OpenLocked(path_, LOCK_EX));
+  auto records = DecodeRecords(CF_EXPECT(ReadFromStart(fd)));
+  size_t taken = std::min(max_records, records.size());
+  std::string rest;
+  for (size_t i = taken; i < records.size(); i++) {
+    EncodeRecord(records[i], rest);
+  }
+  records.resize(taken);
+  CF_EXPECT(fd->Truncate(0) == 0, fd->StrError());
+  CF_EXPECT(fd->LSeek(0, SEEK_SET) == 0, fd->StrError());
+  CF_EXPECT_EQ(WriteAll(fd, rest), rest.size(), fd->StrError());
+  return records;
+}
+
+Result<void> MetricsSpool::PutBack(const std::vector<std::string>& records) {
+  auto fd = CF_EXPECT(OpenLocked(path_, LOCK_EX));
+  std::string data;
+  for (const auto& record : records) {
+    EncodeRecord(record, data);
+  }
+  data += CF_EXPECT(ReadFromStart(fd));
+  CF_EXPECT(fd->Truncate(0) == 0, fd->StrError());
+  CF_EXPECT(fd->LSeek(0, SEEK_SET) == 0, fd->StrError());
+  CF_EXPECT_EQ(WriteAll(fd, data), data.size(), fd->StrError());
+  return {};
+}
+
+Result<void> MetricsSpool::Upload(const Uploader& uploader) {
+  auto lock = SharedFD::Open(lock_path_, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  CF_EXPECTF(lock->IsOpen(), "Failed to open \"{}\": {}", lock_path_,
+             lock->StrError());
+  if (!lock->Flock(LOCK_EX | LOCK_NB).ok()) {
+    LOG(DEBUG) << "Metrics spool \"" << path_ << "\" is already uploading";
+    return {};
+  }
+
+  int failures = 0;
+  auto backoff = options_.initial_backoff;
+  while (true) {
+    auto batch = CF_EXPECT(Take(options_.batch_size));
+    if (batch.empty()) {
+      return {};
+    }
+    auto uploaded = uploader(batch);
+    if (uploaded.ok()) {
+      failures = 0;
+      backoff = options_.initial_backoff;
+      continue;
+    }
+    CF_EXPECT(PutBack(batch));
+    if (++failures >= options_.max_attempts) {
+      CF_EXPECT(std::move(uploaded), "Giving up on uploading metrics after "
+                                         << failures << " attempts");
+    }
+    LOG(DEBUG) << "Metrics upload failed, retrying in " << backoff.count()
+               << " ms: " << uploaded.error().FormatForEnv();
+    std::this_thread::sleep_for(backoff);
+    backoff = std::min(backoff * 2, options_.max_backoff);
+  }
+}
+
+Result<void> MetricsSpool::UploadInBackground(const Uploader& uploader) {
+  {
+    auto lock = SharedFD::Open(lock_path_, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock->IsOpen() && !lock->Flock(LOCK_EX | LOCK_NB).ok()) {
+      // The running uploader keeps going until the spool is empty.
+      return {};
+    }
+  }
+  pid_t child = fork();
+  CF_EXPECTF(child >= 0, "fork failed: {}", strerror(errno));
+  if (child == 0) {
+    // Detached, so the uploader outlives the command without becoming its
+    // zombie and doesn't write to its terminal.
+    setsid();
+    if (fork() == 0) {
+      int dev_null = open("/dev/null", O_RDWR);
+      if (dev_null >= 0) {
+        dup2(dev_null, STDIN_FILENO);
+        dup2(dev_null, STDOUT_FILENO);
+        dup2(dev_null, STDERR_FILENO);
+      }
+      _exit(Upload(uploader).ok() ? 0 : 1);
+    }
+    _exit(0);
+  }
+  CF_EXPECTF(TEMP_FAILURE_RETRY(waitpid(child, nullptr, 0)) == child,
+             "waitpid failed: {}", strerror(errno));
+  return {};
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+/**
+ * Local queue of metrics records waiting to be uploaded.
+ *
+ * Reporting a record is one locked append to a local file, so commands never
+ * wait on the network. The spool is drained in batches by an uploader, which
+ * normally runs in a detached process and retries with exponential backoff.
+ * Records that still fail stay in the spool for the next uploader.
+ */
+class MetricsSpool {
+ public:
+  struct Options {
+    // Records appended past this size are dropped.
+    size_t max_bytes = 1 << 20;
+    size_t batch_size = 64;
+    // Consecutive failed uploads before giving up until the next run.
+    int max_attempts = 5;
+    std::chrono::milliseconds initial_backoff = std::chrono::seconds(1);
+    std::chrono::milliseconds max_backoff = std::chrono::seconds(60);
+  };
+  using Uploader =
+      std::function<Result<void>(const std::vector<std::string>& batch)>;
+
+  MetricsSpool(std::string path, Options options);
+
+  Result<void> Append(const std::string& record);
+  Result<std::vector<std::string>> Records();
+
+  // Uploads everything in the spool. Returns right away when another process
+  // is already uploading it.
+  Result<void> Upload(const Uploader& uploader);
+  // Runs Upload in a detached process. Call it before starting threads, the
+  // uploader runs in a fork of this process.
+  Result<void> UploadInBackground(const Uploader& uploader);
+
+ private:
+  // Removes up to `max_records` records from the front of the spool.
+  Result<std::vector<std::string>> Take(size_t max_records);
+  // Returns records from Take to the front of the spool. They had room before,
+  // so they go back even when records appended since fill it past the cap.
+  Result<void> PutBack(const std::vector<std::string>& records);
+
+  std::string path_;
+  std::string lock_path_;
+  Options options_;
+};
+
+}  // namespace cuttlefish
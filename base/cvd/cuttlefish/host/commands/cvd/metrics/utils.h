@@ -35,6 +35,7 @@ std::string GetMacAddress();
 std::string GetCompany();
 std::string GetVmmVersion();
 uint64_t GetEpochTimeMs();
+std::string ClearcutServerUrl(ClearcutServer server);
 std::string ProtoToString(cuttlefish::LogEvent* event);
 cuttlefish::MetricsExitCodes PostRequest(const std::string& output,
                                          ClearcutServer server);
@@ -29,6 +29,7 @@
 #include "host/commands/cvd/server_command/acloud_command.h"
 #include "host/commands/cvd/server_command/acloud_mixsuperimage.h"
 #include "host/commands/cvd/server_command/acloud_translator.h"
+#include "host/commands/cvd/server_command/batch.h"
 #include "host/commands/cvd/server_command/cmd_list.h"
 #include "host/commands/cvd/server_command/display.h"
 #include "host/commands/cvd/server_command/env.h"
@@ -65,9 +66,15 @@ RequestContext::RequestContext(
       instance_manager_(instance_manager),
       host_tool_target_manager_(host_tool_target_manager),
       command_sequence_executor_(this->request_handlers_) {
+  // All handlers are built up front: RequestHandler checks that exactly one
+  // of them accepts a request, and help and the command sequence executor
+  // walk the whole list. The constructors only capture references.
   request_handlers_.emplace_back(NewAcloudCommand(command_sequence_executor_));
   request_handlers_.emplace_back(NewAcloudMixSuperImageCommand());
   request_handlers_.emplace_back(NewAcloudTranslatorCommand(instance_manager_));
+  request_handlers_.emplace_back(
+      NewCvdBatchCommandHandler(instance_lockfile_manager_, instance_manager_,
+                                host_tool_target_manager_));
   request_handlers_.emplace_back(
       NewCvdCmdlistHandler(command_sequence_executor_));
   request_handlers_.emplace_back(
@@ -16,14 +16,20 @@
 
 #include "host/commands/cvd/reset_client_utils.h"
 
+#include <fcntl.h>
 #include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <chrono>
 #include <iomanip>   // std::setw
 #include <iostream>  // std::endl
 #include <regex>
 #include <sstream>
+#include <thread>
 #include <unordered_set>
 
 #include <android-base/file.h>
@@ -31,6 +37,7 @@
 #include <android-base/strings.h>
 #include <fmt/core.h>
 
+#include "common/libs/fs/shared_fd.h"
 #include "common/libs/utils/contains.h"
 #include "common/libs/utils/environment.h"
 #include "common/libs/utils/files.h"
@@ -43,6 +50,53 @@
 #include "host/libs/config/config_constants.h"
 
 namespace cuttlefish {
+namespace {
+
+// stop_cvd mostly waits on the devices to shut down, so many groups are
+// stopped at once.
+constexpr size_t kMaxParallelGroupStops = 16;
+// Time for stop_cvd to stop a group, after which it is killed and the
+// group's run_cvd processes are SIGKILLed.
+constexpr auto kStopGroupTimeout = std::chrono::seconds(30);
+constexpr auto kStopCvdPollPeriod = std::chrono::milliseconds(20);
+
+}  // namespace
+
+Result<int> RunUntil(Command command,
+                     std::chrono::steady_clock::time_point deadline) {
+  auto dev_null = SharedFD::Open("/dev/null", O_RDWR);
+  command.RedirectStdIO(Subprocess::StdIOChannel::kStdOut, dev_null);
+  command.RedirectStdIO(Subprocess::StdIOChannel::kStdErr, dev_null);
+  auto subprocess = command.Start(SubprocessOptions().InGroup(true));
+  CF_EXPECT(subprocess.Started(), "Failed to start " << command.Executable());
+  const pid_t pid = subprocess.pid();
+  while (true) {
+    siginfo_t info;
+    CF_EXPECTF(subprocess.Wait(&info, WEXITED | WNOHANG) == 0,
+               "waitid failed: {}", strerror(errno));
+    if (info.si_pid == pid) {
+      return info.si_code == CLD_EXITED ? info.si_status : -1;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      break;
+    }
+    std::this_thread::sleep_for(
+        std::min<std::chrono::steady_clock::duration>(kStopCvdPollPeriod,
+                                                      deadline - now));
+  }
+  kill(-pid, SIGKILL);
+  subprocess.Wait();
+  return CF_ERRF("{} timed out and was killed", command.Executable());
+}
+
+int KillProcessTree(const pid_t pid) {
+  const pid_t group = getpgid(pid);
+  if (group == pid && group != getpgrp()) {
+    return kill(-group, SIGKILL);
+  }
+  return kill(pid, SIGKILL);
+}
 
 Result<RunCvdProcessManager> RunCvdProcessManager::Get() {
   RunCvdProcessCollector run_cvd_collector =
@@ -70,7 +124,8 @@ static Command CreateStopCvdCommand(const std::string& stopper_path,
 }
 
 Result<void> RunCvdProcessManager::RunStopCvd(const GroupProcInfo& group_info,
-                                              bool clear_runtime_dirs) {
+                                              bool clear_runtime_dirs,
+                                              Clock::time_point deadline) {
   const auto& stopper_path = group_info.stop_cvd_path_;
   int ret_code = 0;
   cvd_common::Envs stop_cvd_envs;
@@ -91,11 +146,8 @@ Result<void> RunCvdProcessManager::RunStopCvd(const GroupProcInfo& group_info,
         stopper_path, stop_cvd_envs, {"--clear_instance_dirs=true"});
     LOG(ERROR) << "Running HOME=" << stop_cvd_envs.at("HOME") << " "
                << stopper_path << " --clear_instance_dirs=true";
-    std::string stdout_str;
-    std::string stderr_str;
-    ret_code = RunWithManagedStdio(std::move(first_stop_cvd), nullptr,
-                                   std::addressof(stdout_str),
-                                   std::addressof(stderr_str));
+    // A timeout isn't retried, there is no time left for it.
+    ret_code = CF_EXPECT(RunUntil(std::move(first_stop_cvd), deadline));
     // TODO(kwstephenkim): deletes manually if `stop_cvd --clear_instance_dirs`
     // failed.
   }
@@ -110,11 +162,7 @@ Result<void> RunCvdProcessManager::RunStopCvd(const GroupProcInfo& group_info,
         CreateStopCvdCommand(stopper_path, stop_cvd_envs, {});
     LOG(ERROR) << "Running HOME=" << stop_cvd_envs.at("HOME") << " "
                << stopper_path;
-    std::string stdout_str;
-    std::string stderr_str;
-    ret_code = RunWithManagedStdio(std::move(second_stop_cvd), nullptr,
-                                   std::addressof(stdout_str),
-                                   std::addressof(stderr_str));
+    ret_code = CF_EXPECT(RunUntil(std::move(second_stop_cvd), deadline));
   }
   if (ret_code != 0) {
     std::stringstream error;
@@ -127,18 +175,18 @@ Result<void> RunCvdProcessManager::RunStopCvd(const GroupProcInfo& group_info,
   return {};
 }
 
-Result<void> RunCvdProcessManager::RunStopCvdAll(bool cvd_server_children_only,
-                                                 bool clear_instance_dirs) {
-  for (const auto& group_info : run_cvd_process_collector_.CfGroups()) {
-    if (cvd_server_children_only && !group_info.is_cvd_server_started_) {
-      continue;
-    }
-    auto stop_cvd_result = RunStopCvd(group_info, clear_instance_dirs);
-    if (!stop_cvd_result.ok()) {
-      LOG(ERROR) << stop_cvd_result.error().FormatForEnv();
-      continue;
-    }
+Result<void> RunCvdProcessManager::StopGroup(bool cvd_server_children_only,
+                                             bool clear_runtime_dirs,
+                                             const GroupProcInfo& group) {
+  if (cvd_server_children_only && !group.is_cvd_server_started_) {
+    return {};
   }
+  auto stop_cvd_result = RunStopCvd(group, clear_runtime_dirs,
+                                    Clock::now() + kStopGroupTimeout);
+  if (!stop_cvd_result.ok()) {
+    LOG(ERROR) << stop_cvd_result.error().FormatForEnv();
+  }
+  CF_EXPECT(ForcefullyStopGroup(cvd_server_children_only, group));
   return {};
 }
 
@@ -170,7 +218,7 @@ Result<void> RunCvdProcessManager::SendSignal(bool cvd_server_children_only,
       if (!IsStillRunCvd(parent_run_cvd_pid)) {
         continue;
       }
-      if (kill(parent_run_cvd_pid, SIGKILL) == 0) {
+      if (KillProcessTree(parent_run_cvd_pid) == 0) {
         LOG(VERBOSE) << "Successfully SIGKILL'ed " << parent_run_cvd_pid;
       } else {
         failed_pids.push_back(parent_run_cvd_pid);
@@ -274,17 +322,46 @@ Result<void> KillCvdServerProcess() {
 
 Result<void> RunCvdProcessManager::KillAllCuttlefishInstances(
     bool cvd_server_children_only, bool clear_runtime_dirs) {
-  auto stop_cvd_result =
-      RunStopCvdAll(cvd_server_children_only, clear_runtime_dirs);
-  if (!stop_cvd_result.ok()) {
-    LOG(ERROR) << stop_cvd_result.error().FormatForEnv();
+  const auto& groups = run_cvd_process_collector_.CfGroups();
+  if (groups.empty()) {
+    return {};
+  }
+  const auto start = Clock::now();
+  std::vector<Result<void>> results(groups.size());
+  std::atomic<size_t> next_group = 0;
+  auto stop_groups = [&, this]() {
+    for (size_t i = next_group++; i < groups.size(); i = next_group++) {
+      results[i] =
+          StopGroup(cvd_server_children_only, clear_runtime_dirs, groups[i]);
+    }
+  };
+  std::vector<std::thread> workers;
+  const size_t worker_count = std::min(kMaxParallelGroupStops, groups.size());
+  for (size_t i = 1; i < worker_count; i++) {
+    workers.emplace_back(stop_groups);
   }
-  for (const auto& group_info : run_cvd_process_collector_.CfGroups()) {
-    auto result = ForcefullyStopGroup(cvd_server_children_only, group_info);
-    if (!result.ok()) {
-      LOG(ERROR) << result.error().FormatForEnv();
+  stop_groups();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  std::vector<std::string> failed_homes;
+  for (size_t i = 0; i < groups.size(); i++) {
+    if (!results[i].ok()) {
+      LOG(ERROR) << results[i].error().FormatForEnv();
+      failed_homes.push_back(groups[i].home_);
     }
   }
+  const auto elapsed =
+      std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() -
+                                                            start);
+  LOG(INFO) << "Stopped " << groups.size() - failed_homes.size() << " of "
+            << groups.size() << " instance groups in " << elapsed.count()
+            << " ms";
+  if (!failed_homes.empty()) {
+    LOG(ERROR) << "Failed to stop the groups at HOME="
+               << android::base::Join(failed_homes, ", ");
+  }
   return {};
 }
 
@@ -18,12 +18,14 @@
 
 #include <sys/types.h>
 
+#include <chrono>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
 
 #include "common/libs/utils/result.h"
+#include "common/libs/utils/subprocess.h"
 #include "host/commands/cvd/run_cvd_proc_collector.h"
 
 namespace cuttlefish {
@@ -43,10 +45,14 @@ class RunCvdProcessManager {
  private:
   RunCvdProcessManager() = delete;
   RunCvdProcessManager(RunCvdProcessCollector&&);
+  using Clock = std::chrono::steady_clock;
+
   static Result<void> RunStopCvd(const GroupProcInfo& run_cvd_info,
-                                 bool clear_runtime_dirs);
-  Result<void> RunStopCvdAll(bool cvd_server_children_only,
-                             bool clear_runtime_dirs);
+                                 bool clear_runtime_dirs,
+                                 Clock::time_point deadline);
+  // Runs stop_cvd for the group, then SIGKILLs whatever is left of it.
+  Result<void> StopGroup(bool cvd_server_children_only, bool clear_runtime_dirs,
+                         const GroupProcInfo& group);
   Result<void> SendSignal(bool cvd_server_children_only, const GroupProcInfo&);
   Result<void> DeleteLockFile(bool cvd_server_children_only,
                               const GroupProcInfo&);
@@ -72,4 +78,16 @@ Result<void> KillAllCuttlefishInstances(const DeviceClearOptions& options);
 
 Result<void> KillCvdServerProcess();
 
+/*
+ * Runs `command` in its own process group, returning the exit code.
+ *
+ * If it is still running at `deadline`, the whole process group is killed.
+ */
+Result<int> RunUntil(Command command,
+                     std::chrono::steady_clock::time_point deadline);
+
+// SIGKILLs `pid`, and also its children when it leads its own process group
+// (other than the caller's). Returns the result of kill(2).
+int KillProcessTree(pid_t pid);
+
 }  // namespace cuttlefish
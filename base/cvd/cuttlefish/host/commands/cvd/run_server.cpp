@@ -120,7 +120,8 @@ Result<void> ImportResourcesImpl(const ParseResult& param) {
   signal(SIGPIPE, SIG_IGN);
   auto host_tool_target_manager = NewHostToolTargetManager();
   InstanceLockFileManager lock_manager;
-  selector::InstanceDatabase instance_database(InstanceDatabasePath());
+  selector::InstanceDatabase instance_database(InstanceDatabasePath(),
+                                               LegacyInstanceDatabasePath());
   InstanceManager instance_manager(lock_manager, *host_tool_target_manager,
                                    instance_database);
   cvd::Response response;
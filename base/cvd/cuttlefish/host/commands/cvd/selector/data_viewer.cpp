@@ -16,11 +16,142 @@
 
 #include "host/commands/cvd/selector/data_viewer.h"
 
+#include <fcntl.h>
+
+#include <algorithm>
+#include <optional>
+#include <string_view>
+
+#include <android-base/logging.h>
+
+#include "common/libs/utils/files.h"
+
 namespace cuttlefish {
 namespace selector {
+namespace {
+
+constexpr char kLockFileSuffix[] = ".lock";
+constexpr char kJournalSuffix[] = ".journal";
+constexpr char kTempSnapshotSuffix[] = ".tmp";
+
+// Journal entries are framed by their size as a 32 bit little endian integer.
+constexpr size_t kEntryHeaderSize = 4;
+
+// The journal is also compacted when it outgrows the snapshot, this keeps a
+// small database from being rewritten on almost every change.
+constexpr size_t kMinJournalSizeToCompact = 16 * 1024;
+
+std::string FrameEntry(const std::string& entry) {
+  std::string framed(kEntryHeaderSize, '\0');
+  for (size_t i = 0; i < kEntryHeaderSize; i++) {
+    framed[i] = static_cast<char>((entry.size() >> (8 * i)) & 0xff);
+  }
+  return framed + entry;
+}
+
+std::optional<size_t> EntrySize(std::string_view journal) {
+  if (journal.size() < kEntryHeaderSize) {
+    return std::nullopt;
+  }
+  size_t size = 0;
+  for (size_t i = 0; i < kEntryHeaderSize; i++) {
+    size |= static_cast<size_t>(static_cast<unsigned char>(journal[i]))
+            << (8 * i);
+  }
+  if (journal.size() - kEntryHeaderSize < size) {
+    return std::nullopt;
+  }
+  return size;
+}
+
+// Describes how to go from `before` to `after` in terms of removed and
+// appended groups. Groups kept in place are matched greedily, so changes
+// made by appending and erasing groups produce small entries, while any
+// other change still produces a correct one.
+cvd::PersistentDataJournalEntry JournalEntry(const cvd::PersistentData& before,
+                                             const cvd::PersistentData& after) {
+  cvd::PersistentDataJournalEntry entry;
+  entry.set_journal_id(before.journal_id());
+  entry.set_acloud_translator_optout(after.acloud_translator_optout());
+  int next = 0;
+  for (int i = 0; i < before.instance_groups_size(); i++) {
+    if (next < after.instance_groups_size() &&
+        before.instance_groups(i).SerializeAsString() ==
+            after.instance_groups(next).SerializeAsString()) {
+      next++;
+    } else {
+      entry.add_removed_instance_groups(i);
+    }
+  }
+  for (; next < after.instance_groups_size(); next++) {
+    *entry.add_added_instance_groups() = after.instance_groups(next);
+  }
+  return entry;
+}
+
+Result<void> ApplyJournalEntry(const cvd::PersistentDataJournalEntry& entry,
+                               cvd::PersistentData& data) {
+  CF_EXPECT_EQ(entry.journal_id(), data.journal_id());
+  const auto& removed = entry.removed_instance_groups();
+  for (int i = 0; i < removed.size(); i++) {
+    CF_EXPECT_LT(removed[i], data.instance_groups_size());
+    CF_EXPECT(i == 0 || removed[i - 1] < removed[i],
+              "Removed group indices are not in increasing order");
+  }
+  if (!removed.empty()) {
+    auto groups = data.mutable_instance_groups();
+    int kept = 0;
+    int next_removed = 0;
+    for (int i = 0; i < groups->size(); i++) {
+      if (next_removed < removed.size() && removed[next_removed] == i) {
+        next_removed++;
+        continue;
+      }
+      groups->SwapElements(kept++, i);
+    }
+    groups->DeleteSubrange(kept, groups->size() - kept);
+  }
+  for (const auto& group : entry.added_instance_groups()) {
+    *data.add_instance_groups() = group;
+  }
+  data.set_acloud_translator_optout(entry.acloud_translator_optout());
+  return {};
+}
+
+Result<std::optional<std::string>> ReadIfExists(const std::string& path) {
+  auto fd = SharedFD::Open(path, O_RDONLY | O_CLOEXEC);
+  if (!fd->IsOpen() && fd->GetErrno() == ENOENT) {
+    return std::nullopt;
+  }
+  CF_EXPECTF(fd->IsOpen(), "Failed to open \"{}\": {}", path, fd->StrError());
+  std::string str;
+  CF_EXPECTF(ReadAll(fd, &str) >= 0, "Failed to read from \"{}\": {}", path,
+             fd->StrError());
+  return str;
+}
+
+// Older cvd versions rewrite their database in place while holding a shared
+// lock on it, only an exclusive lock keeps them from changing it mid-read.
+Result<std::optional<std::string>> ReadLegacyDatabase(const std::string& path) {
+  auto fd = SharedFD::Open(path, O_RDONLY | O_CLOEXEC);
+  if (!fd->IsOpen() && fd->GetErrno() == ENOENT) {
+    return std::nullopt;
+  }
+  CF_EXPECTF(fd->IsOpen(), "Failed to open \"{}\": {}", path, fd->StrError());
+  CF_EXPECTF(fd->Flock(LOCK_EX), "Failed to lock \"{}\": {}", path,
+             fd->StrError());
+  std::string str;
+  CF_EXPECTF(ReadAll(fd, &str) >= 0, "Failed to read from \"{}\": {}", path,
+             fd->StrError());
+  return str;
+}
+
+}  // namespace
+
 Result<SharedFD> DataViewer::LockBackingFile(int op) const {
-  auto fd = SharedFD::Open(backing_file_, O_CREAT | O_RDWR, 0640);
-  CF_EXPECTF(fd->IsOpen(), "Failed to open instance database backing file: {}",
+  auto fd =
+      SharedFD::Open(backing_file_ + kLockFileSuffix, O_CREAT | O_RDWR, 0640);
+  CF_EXPECTF(fd->IsOpen(), "Failed to open instance database lock file: {}",
              fd->StrError());
   CF_EXPECTF(fd->Flock(op),
              "Failed to acquire lock for instance database backing file: {}",
@@ -28,22 +159,116 @@ Result<SharedFD> DataViewer::LockBackingFile(int op) const {
   return fd;
 }
 
-Result<cvd::PersistentData> DataViewer::LoadData(SharedFD fd) const {
-  std::string str;
-  auto read_size = ReadAll(fd, &str);
-  CF_EXPECTF(read_size >= 0, "Failed to read from backing file: {}",
+Result<DataViewer::LoadedData> DataViewer::LoadData() const {
+  LoadedData loaded;
+  auto snapshot = CF_EXPECT(ReadIfExists(backing_file_));
+  if (snapshot) {
+    loaded.snapshot_size = snapshot->size();
+    loaded.data.ParseFromString(*snapshot);
+  }
+  auto journal = CF_EXPECT(ReadIfExists(backing_file_ + kJournalSuffix));
+  if (!snapshot && (!journal || journal->empty()) && !legacy_file_.empty()) {
+    auto legacy = CF_EXPECT(ReadLegacyDatabase(legacy_file_));
+    if (legacy) {
+      loaded.data.ParseFromString(*legacy);
+      // Only meaningful to the journal next to it, if any.
+      loaded.data.clear_journal_id();
+      loaded.from_legacy = true;
+    }
+  }
+  if (!journal) {
+    return loaded;
+  }
+  loaded.journal_file_size = journal->size();
+  std::string_view remaining = *journal;
+  while (auto size = EntrySize(remaining)) {
+    cvd::PersistentDataJournalEntry entry;
+    if (!entry.ParseFromArray(remaining.data() + kEntryHeaderSize, *size)) {
+      break;
+    }
+    // Entries left over from before the last snapshot was written, or written
+    // after a crash tore the journal, don't apply to this snapshot.
+    if (!ApplyJournalEntry(entry, loaded.data).ok()) {
+      break;
+    }
+    remaining.remove_prefix(kEntryHeaderSize + *size);
+    loaded.journal_size = journal->size() - remaining.size();
+  }
+  return loaded;
+}
+
+Result<void> DataViewer::StoreData(const LoadedData& loaded,
+                                   const cvd::PersistentData& data) {
+  auto entry = JournalEntry(loaded.data, data);
+  if (entry.removed_instance_groups().empty() &&
+      entry.added_instance_groups().empty() &&
+      entry.acloud_translator_optout() ==
+          loaded.data.acloud_translator_optout()) {
+    return {};
+  }
+  std::string serialized;
+  CF_EXPECT(entry.SerializeToString(&serialized), "Failed to serialize data");
+  auto framed = FrameEntry(serialized);
+  // Journal entries only apply to a snapshot, the imported data must be
+  // written as one first.
+  if (loaded.from_legacy ||
+      loaded.journal_size + framed.size() >
+          std::max(loaded.snapshot_size, kMinJournalSizeToCompact)) {
+    CF_EXPECT(WriteSnapshot(loaded, data));
+  } else {
+    CF_EXPECT(AppendToJournal(loaded, framed));
+  }
+  return {};
+}
+
+Result<void> DataViewer::AppendToJournal(const LoadedData& loaded,
+                                         const std::string& entry) {
+  auto fd = SharedFD::Open(backing_file_ + kJournalSuffix,
+                           O_CREAT | O_WRONLY | O_CLOEXEC, 0640);
+  CF_EXPECTF(fd->IsOpen(), "Failed to open instance database journal: {}",
+             fd->StrError());
+  // Drop stale or torn entries, they would hide the new one from readers.
+  if (loaded.journal_file_size != loaded.journal_size) {
+    CF_EXPECTF(fd->Truncate(loaded.journal_size) >= 0,
+               "Failed to truncate journal: {}", fd->StrError());
+  }
+  CF_EXPECTF(fd->LSeek(loaded.journal_size, SEEK_SET) >= 0,
+             "Failed to seek in journal: {}", fd->StrError());
+  auto write_size = WriteAll(fd, entry);
+  CF_EXPECTF(write_size == entry.size(), "Failed to write to journal: {}",
              fd->StrError());
-  cvd::PersistentData data;
-  data.ParseFromString(str);
-  return std::move(data);
+  return {};
 }
 
-Result<void> DataViewer::StoreData(SharedFD fd, cvd::PersistentData data) {
+Result<void> DataViewer::WriteSnapshot(const LoadedData& loaded,
+                                       cvd::PersistentData data) {
+  // The new journal id leaves any entries that survive a crash between the
+  // rename and the truncation below out of the new snapshot.
+  data.set_journal_id(loaded.data.journal_id() + 1);
   std::string str;
   CF_EXPECT(data.SerializeToString(&str), "Failed to serialize data");
+
+  const std::string temp_file = backing_file_ + kTempSnapshotSuffix;
+  auto fd = SharedFD::Open(temp_file, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                           0640);
+  CF_EXPECTF(fd->IsOpen(), "Failed to open \"{}\": {}", temp_file,
+             fd->StrError());
   auto write_size = WriteAll(fd, str);
-  CF_EXPECTF(write_size == str.size(), "Failed to write to backing file: {}",
+  CF_EXPECTF(write_size == str.size(), "Failed to write to \"{}\": {}",
+             temp_file, fd->StrError());
+  CF_EXPECTF(fd->Fsync() == 0, "Failed to sync \"{}\": {}", temp_file,
              fd->StrError());
+  CF_EXPECT(RenameFile(temp_file, backing_file_));
+
+  if (loaded.journal_file_size > 0) {
+    auto journal = SharedFD::Open(backing_file_ + kJournalSuffix,
+                                  O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (!journal->IsOpen()) {
+      // Harmless, the stale entries will be ignored and dropped later.
+      LOG(WARNING) << "Failed to truncate instance database journal: "
+                   << journal->StrError();
+    }
+  }
   return {};
 }
 
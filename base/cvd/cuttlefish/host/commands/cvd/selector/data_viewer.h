@@ -18,8 +18,10 @@
 
 #include <signal.h>
 
+#include <cstddef>
 #include <functional>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <unordered_map>
 #include <vector>
@@ -38,10 +40,29 @@ namespace selector {
  *
  * Guarantees atomic access to the information stored in the backing file at
  * the cost of high lock contention.
+ *
+ * The data is kept in a snapshot, the backing file, and a journal of changes
+ * made after the snapshot was written. Writers append one small entry to the
+ * journal instead of rewriting the whole database, and only once the journal
+ * outgrows the snapshot they fold it into a new snapshot, written to a
+ * temporary file and renamed over the old one. Readers replay the journal on
+ * top of the snapshot. A journal entry torn by a crash is ignored and dropped
+ * by the next writer.
+ *
+ * Since the snapshot is replaced by renaming, the locks are taken on a
+ * separate lock file.
+ *
+ * Older cvd versions lock and rewrite their database in place and know
+ * nothing of the journal, so they can't share these files. They keep theirs
+ * at `legacy_file`, which is imported once, by the first change made while
+ * neither the snapshot nor the journal exist. The two copies are independent
+ * from then on.
  * */
 class DataViewer {
  public:
-  DataViewer(const std::string& backing_file) : backing_file_(backing_file) {}
+  DataViewer(const std::string& backing_file,
+             const std::string& legacy_file = "")
+      : backing_file_(backing_file), legacy_file_(legacy_file) {}
 
   /**
    * Provides read-only access to the data while holding a shared lock.
@@ -55,8 +76,8 @@ class DataViewer {
       std::function<Result<R>(const cvd::PersistentData&)> task) const {
     DeadlockProtector dp(*this);
     auto fd = CF_EXPECT(LockBackingFile(LOCK_SH));
-    auto data = CF_EXPECT(LoadData(fd));
-    return task(data);
+    auto loaded = CF_EXPECT(LoadData());
+    return task(loaded.data);
   }
 
   /**
@@ -71,35 +92,49 @@ class DataViewer {
   Result<R> WithExclusiveLock(
       std::function<Result<R>(cvd::PersistentData&)> task) {
     DeadlockProtector dp(*this);
-    auto fd = CF_EXPECT(LockBackingFile(LOCK_SH));
-    auto data = CF_EXPECT(LoadData(fd));
+    auto fd = CF_EXPECT(LockBackingFile(LOCK_EX));
+    auto loaded = CF_EXPECT(LoadData());
+    cvd::PersistentData data = loaded.data;
     auto res = task(data);
     if (!res.ok()) {
       // Don't update if there is an error
       return res;
     }
-    // Block signals while writing to the instance database file. This reduces
-    // the chances of corrupting the file.
+    // Block signals while writing to the instance database files. This
+    // reduces the chances of corrupting them.
     sigset_t all_signals;
     sigfillset(&all_signals);
     SignalMasker blocker(all_signals);
-    // Overwrite the file contents, don't append
-    CF_EXPECTF(fd->Truncate(0) >= 0, "Failed to truncate fd: {}",
-               fd->StrError());
-    CF_EXPECTF(fd->LSeek(0, SEEK_SET) >= 0, "Failed to seek to 0: {}",
-               fd->StrError());
-    CF_EXPECT(StoreData(fd, std::move(data)));
+    CF_EXPECT(StoreData(loaded, data));
     return res;
   }
 
  private:
-  // Opens and locks the backing file. The lock will be dropped when the file
+  struct LoadedData {
+    // The snapshot with the journal applied
+    cvd::PersistentData data;
+    size_t snapshot_size = 0;
+    // Length of the journal prefix that applies to the snapshot, anything
+    // after it is stale or incomplete.
+    size_t journal_size = 0;
+    size_t journal_file_size = 0;
+    // Read from the legacy file, to be written as the first snapshot.
+    bool from_legacy = false;
+  };
+
+  // Opens and locks the lock file. The lock will be dropped when the file
   // descriptor closes.
   Result<SharedFD> LockBackingFile(int op) const;
 
-  Result<cvd::PersistentData> LoadData(SharedFD fd) const;
+  Result<LoadedData> LoadData() const;
 
-  Result<void> StoreData(SharedFD fd, cvd::PersistentData data);
+  // Persists the changes from loaded.data to data.
+  Result<void> StoreData(const LoadedData& loaded,
+                         const cvd::PersistentData& data);
+  Result<void> AppendToJournal(const LoadedData& loaded,
+                               const std::string& entry);
+  Result<void> WriteSnapshot(const LoadedData& loaded,
+                             cvd::PersistentData data);
 
   /**
    * Utility class to prevent deadlocks due to function reentry.
@@ -122,6 +157,7 @@ class DataViewer {
   mutable std::unordered_map<std::thread::id, bool> lock_held_by_;
 
   std::string backing_file_;
+  std::string legacy_file_;
 };
 
 }  // namespace selector
@@ -40,8 +40,9 @@ constexpr const char kJsonGroups[] = "Groups";
 
 }  // namespace
 
-InstanceDatabase::InstanceDatabase(const std::string& backing_file)
-    : viewer_(backing_file) {}
+InstanceDatabase::InstanceDatabase(const std::string& backing_file,
+                                   const std::string& legacy_backing_file)
+    : viewer_(backing_file, legacy_backing_file) {}
 
 Result<bool> InstanceDatabase::IsEmpty() const {
   return viewer_.WithSharedLock<bool>([](const cvd::PersistentData& data) {
@@ -34,7 +34,10 @@ namespace selector {
 
 class InstanceDatabase {
  public:
-  InstanceDatabase(const std::string& backing_file);
+  // The database of older cvd versions at `legacy_backing_file` is imported
+  // if there is none at `backing_file` yet.
+  InstanceDatabase(const std::string& backing_file,
+                   const std::string& legacy_backing_file = "");
 
   Result<bool> IsEmpty() const;
 
@@ -17,7 +17,6 @@
 #include "host/commands/cvd/selector/instance_database_utils.h"
 
 #include <regex>
-#include <set>
 #include <sstream>
 #include <string_view>
 #include <vector>
@@ -101,20 +100,14 @@ bool PotentiallyHostArtifactsPath(const std::string& host_artifacts_path) {
   if (host_artifacts_path.empty() || !DirectoryExists(host_artifacts_path)) {
     return false;
   }
-  const auto host_bin_path = host_artifacts_path + "/bin";
-  auto contents_result = DirectoryContents(host_bin_path);
-  if (!contents_result.ok()) {
-    return false;
+  const auto host_bin_path = host_artifacts_path + "/bin/";
+  // Looking the launchers up directly avoids listing a large bin directory.
+  for (const char* launcher : {"cvd", "launch_cvd"}) {
+    if (FileExists(host_bin_path + launcher, /* follow_symlinks */ false)) {
+      return true;
+    }
   }
-  std::vector<std::string> contents = std::move(*contents_result);
-  std::set<std::string> contents_set{std::move_iterator(contents.begin()),
-                                     std::move_iterator(contents.end())};
-  std::set<std::string> launchers = {"cvd", "launch_cvd"};
-  std::vector<std::string> result;
-  std::set_intersection(launchers.cbegin(), launchers.cend(),
-                        contents_set.cbegin(), contents_set.cend(),
-                        std::back_inserter(result));
-  return !result.empty();
+  return false;
 }
 
 std::string GenerateTooManyInstancesErrorMsg(const int n,
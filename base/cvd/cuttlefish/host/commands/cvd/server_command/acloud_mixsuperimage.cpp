@@ -31,6 +31,7 @@
 #include "host/commands/cvd/server_command/utils.h"
 #include "host/commands/cvd/types.h"
 #include "host/libs/config/config_utils.h"
+#include "host/libs/image_aggregator/super_image_builder.h"
 
 namespace cuttlefish {
 
@@ -202,11 +203,29 @@ class AcloudMixSuperImageCommand : public CvdServerHandler {
   }
  private:
   /*
-   * Use build_super_image to create a super image.
+   * Write the super image directly when the layout is supported, which avoids
+   * copying every partition image through lpmake.
    */
   Result<void> BuildSuperImage(
       const std::string& output_path, const std::string& misc_info_path,
       const std::function<Result<std::string>(const std::string&)>& get_image) {
+    auto layout = SuperImageLayoutFromMiscInfo(misc_info_path, get_image);
+    if (layout.ok()) {
+      CF_EXPECT(cuttlefish::BuildSuperImage(*layout, output_path));
+      return {};
+    }
+    LOG(INFO) << "Falling back to build_super_image: "
+              << layout.error().Message();
+    CF_EXPECT(RunBuildSuperImage(output_path, misc_info_path, get_image));
+    return {};
+  }
+
+  /*
+   * Use build_super_image to create a super image.
+   */
+  Result<void> RunBuildSuperImage(
+      const std::string& output_path, const std::string& misc_info_path,
+      const std::function<Result<std::string>(const std::string&)>& get_image) {
     std::string build_super_image_binary;
     std::string lpmake_binary;
     std::string otatools_path;
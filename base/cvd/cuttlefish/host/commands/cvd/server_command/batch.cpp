@@ -0,0 +1,390 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/server_command/batch.h"
+
+#include <fcntl.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <fmt/format.h>
+#include <json/json.h>
+
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/flag_parser.h"
+#include "common/libs/utils/json.h"
+#include "common/libs/utils/result.h"
+#include "cvd_server.pb.h"
+#include "host/commands/cvd/common_utils.h"
+#include "host/commands/cvd/request_context.h"
+#include "host/commands/cvd/server_client.h"
+#include "host/commands/cvd/server_command/server_handler.h"
+#include "host/commands/cvd/server_command/utils.h"
+#include "host/commands/cvd/types.h"
+
+namespace cuttlefish {
+namespace {
+
+constexpr char kSummaryHelpText[] =
+    R"(Run many cvd commands in one process, read as JSON lines)";
+
+constexpr char kDetailedHelpText[] = R"(
+Usage:
+cvd batch [--input=FILE] [--jobs=N]
+
+Reads one JSON object per line from FILE, or from stdin when FILE is "-", and
+runs each one as a cvd command inside this process. The setup of the cvd
+driver and the host tool and instance database state are shared by all of the
+commands instead of being repeated for each one.
+
+A command looks like
+  {"id": "s1", "args": ["--group_name=foo", "status"], "env": {"K": "V"},
+   "working_directory": "/path", "exclusive": false}
+where only "args", the command line after "cvd", is required. The environment
+and working directory of cvd batch are used when not given. "id" defaults to
+the index of the command in the batch.
+
+One JSON line is written to stdout for each command as it completes:
+  {"id": "s1", "status": "OK", "message": "", "stdout": "...", "stderr": "..."}
+Commands read their stdin from /dev/null, so the ones that ask for a
+confirmation fail unless given one by flag, e.g. cvd reset -y.
+
+--jobs=N runs up to N commands at the same time. A command with
+"exclusive": true waits for all the earlier commands to complete, and no later
+command starts before it completes. Use it for commands that create or remove
+devices, e.g. cvd start or cvd reset -y, in the middle of a concurrent batch.
+
+Fails when any of the commands fails.
+)";
+
+Result<SharedFD> CaptureFd(const std::string& name) {
+  auto fd = SharedFD::MemfdCreate(name);
+  CF_EXPECTF(fd->IsOpen(), "Failed to create \"{}\": {}", name,
+             fd->StrError());
+  return fd;
+}
+
+std::string Captured(SharedFD fd) {
+  std::string output;
+  if (fd->LSeek(0, SEEK_SET) != 0 || ReadAll(fd, &output) < 0) {
+    LOG(ERROR) << "Failed to read command output: " << fd->StrError();
+  }
+  return output;
+}
+
+// The same path `cvd <args>` takes from the command line.
+Result<cvd::Response> Handle(RequestContext& context,
+                             const BatchCommand& command, SharedFD out,
+                             SharedFD err) {
+  SharedFD dev_null = SharedFD::Open("/dev/null", O_RDWR);
+  CF_EXPECT(dev_null->IsOpen(), "Failed to open /dev/null");
+
+  MakeRequestForm form;
+  form.cmd_args = {"cvd", "process"};
+  form.env = command.env;
+  form.selector_args = {"cvd"};
+  form.selector_args.insert(form.selector_args.end(), command.args.begin(),
+                            command.args.end());
+  form.working_dir = command.working_directory;
+  RequestWithStdio request(MakeRequest(form, cvd::WAIT_BEHAVIOR_COMPLETE),
+                           {dev_null, out, err});
+  auto handler = CF_EXPECT(context.Handler(request));
+  return CF_EXPECT(handler->Handle(request));
+}
+
+Json::Value Execute(RequestContext& context, const BatchCommand& command) {
+  Json::Value response_json;
+  response_json["id"] = command.id;
+  auto out = CaptureFd("cvd_batch_stdout");
+  auto err = CaptureFd("cvd_batch_stderr");
+  auto response = out.ok() && err.ok() ? Handle(context, command, *out, *err)
+                                       : Result<cvd::Response>(CF_ERR(
+                                             "Failed to capture output"));
+  if (response.ok()) {
+    response_json["status"] = cvd::Status_Code_Name(response->status().code());
+    response_json["message"] = response->status().message();
+  } else {
+    response_json["status"] = cvd::Status_Code_Name(cvd::Status::INTERNAL);
+    response_json["message"] = response.error().FormatForEnv(false);
+  }
+  response_json["stdout"] = out.ok() ? Captured(*out) : "";
+  response_json["stderr"] = err.ok() ? Captured(*err) : "";
+  return response_json;
+}
+
+}  // namespace
+
+Result<BatchFlags> ParseBatchFlags(cvd_common::Args args) {
+  BatchFlags batch_flags;
+  std::int32_t jobs = batch_flags.jobs;
+  std::vector<Flag> flags{GflagsCompatFlag("input", batch_flags.input),
+                          GflagsCompatFlag("jobs", jobs)};
+  CF_EXPECT(ConsumeFlags(flags, args));
+  CF_EXPECTF(args.empty(), "Unexpected arguments: \"{}\"",
+             fmt::join(args, " "));
+  CF_EXPECTF(jobs >= 1, "--jobs must be at least 1, was {}", jobs);
+  batch_flags.jobs = jobs;
+  return batch_flags;
+}
+
+Result<BatchCommand> ParseBatchCommand(const std::string& line, size_t index,
+                                       const cvd_common::Envs& batch_env,
+                                       const std::string& batch_working_dir) {
+  auto json = CF_EXPECT(ParseJson(line));
+  CF_EXPECT(json.isObject(), "Expected a JSON object");
+  BatchCommand command;
+  command.id =
+      json.isMember("id") ? json["id"] : Json::Value(Json::UInt64(index));
+  CF_EXPECT(json["args"].isArray() && !json["args"].empty(),
+            "Expected a non-empty \"args\" array");
+  for (const auto& arg : json["args"]) {
+    CF_EXPECT(arg.isString(), "Expected only strings in \"args\"");
+    command.args.emplace_back(arg.asString());
+  }
+  command.env = batch_env;
+  if (json.isMember("env")) {
+    CF_EXPECT(json["env"].isObject(), "Expected \"env\" to be an object");
+    for (const auto& name : json["env"].getMemberNames()) {
+      CF_EXPECTF(json["env"][name].isString(),
+                 "Expected a string value for \"{}\" in \"env\"", name);
+      command.env[name] = json["env"][name].asString();
+    }
+  }
+  command.working_directory =
+      json.get("working_directory", batch_working_dir).asString();
+  command.exclusive = json.get("exclusive", false).asBool();
+  return command;
+}
+
+BatchRunner::ExecutorFactory RequestContextExecutors(
+    InstanceLockFileManager& instance_lockfile_manager,
+    InstanceManager& instance_manager,
+    HostToolTargetManager& host_tool_target_manager) {
+  return [&instance_lockfile_manager, &instance_manager,
+          &host_tool_target_manager]() -> BatchRunner::Executor {
+    auto context = std::make_shared<RequestContext>(
+        instance_lockfile_manager, instance_manager, host_tool_target_manager);
+    return [context](const BatchCommand& command) {
+      return Execute(*context, command);
+    };
+  };
+}
+
+LineReader::LineReader(SharedFD fd) : fd_(std::move(fd)) {}
+
+Result<std::optional<std::string>> LineReader::Next() {
+  while (true) {
+    auto newline = buffer_.find('\n');
+    if (newline != std::string::npos) {
+      std::string line = buffer_.substr(0, newline);
+      buffer_.erase(0, newline + 1);
+      return line;
+    }
+    if (eof_) {
+      if (buffer_.empty()) {
+        return std::nullopt;
+      }
+      return std::move(buffer_);
+    }
+    char chunk[4096];
+    auto read = fd_->Read(chunk, sizeof(chunk));
+    CF_EXPECTF(read >= 0, "Failed to read commands: {}", fd_->StrError());
+    eof_ = read == 0;
+    buffer_.append(chunk, read);
+  }
+}
+
+BatchRunner::BatchRunner(ExecutorFactory new_executor, SharedFD out, int jobs)
+    : new_executor_(std::move(new_executor)),
+      out_(std::move(out)),
+      jobs_(jobs) {}
+
+Result<cvd::Response> BatchRunner::Run(LineReader& reader,
+                                       const cvd_common::Envs& batch_env,
+                                       const std::string& batch_working_dir) {
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < jobs_; i++) {
+    workers.emplace_back([this]() { Work(); });
+  }
+  auto result = Dispatch(reader, batch_env, batch_working_dir);
+  {
+    std::lock_guard lock(mutex_);
+    done_ = true;
+  }
+  cv_.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  CF_EXPECT(std::move(result));
+
+  cvd::Response response;
+  response.mutable_command_response();
+  if (failures_ == 0) {
+    response.mutable_status()->set_code(cvd::Status::OK);
+  } else {
+    response.mutable_status()->set_code(cvd::Status::INTERNAL);
+    response.mutable_status()->set_message(
+        fmt::format("{} of {} commands failed", failures_, commands_));
+  }
+  return response;
+}
+
+Result<void> BatchRunner::Dispatch(LineReader& reader,
+                                   const cvd_common::Envs& batch_env,
+                                   const std::string& batch_working_dir) {
+  while (auto line = CF_EXPECT(reader.Next())) {
+    if (line->find_first_not_of(" \t\r") == std::string::npos) {
+      continue;
+    }
+    size_t index = commands_++;
+    auto command =
+        ParseBatchCommand(*line, index, batch_env, batch_working_dir);
+    if (!command.ok()) {
+      Json::Value response;
+      response["id"] = Json::UInt64(index);
+      response["status"] = cvd::Status_Code_Name(cvd::Status::INTERNAL);
+      response["message"] = fmt::format("Invalid command \"{}\": {}", *line,
+                                        command.error().Message());
+      CF_EXPECT(Respond(response));
+      continue;
+    }
+    std::unique_lock lock(mutex_);
+    if (command->exclusive) {
+      cv_.wait(lock, [this]() { return Idle(); });
+    }
+    // Waiting for a free worker keeps the input from being read too far
+    // ahead.
+    cv_.wait(lock, [this]() { return queue_.size() < jobs_; });
+    queue_.emplace_back(std::move(*command));
+    cv_.notify_all();
+    if (queue_.back().exclusive) {
+      cv_.wait(lock, [this]() { return Idle(); });
+    }
+  }
+  return {};
+}
+
+bool BatchRunner::Idle() const { return queue_.empty() && running_ == 0; }
+
+void BatchRunner::Work() {
+  auto execute = new_executor_();
+  while (true) {
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [this]() { return done_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+    auto command = std::move(queue_.front());
+    queue_.pop_front();
+    running_++;
+    lock.unlock();
+
+    auto respond_result = Respond(execute(command));
+    if (!respond_result.ok()) {
+      LOG(ERROR) << respond_result.error().FormatForEnv();
+    }
+
+    lock.lock();
+    running_--;
+    cv_.notify_all();
+  }
+}
+
+Result<void> BatchRunner::Respond(const Json::Value& response) {
+  Json::StreamWriterBuilder factory;
+  factory["indentation"] = "";
+  std::string line = Json::writeString(factory, response) + "\n";
+  std::lock_guard lock(out_mutex_);
+  if (response["status"] != cvd::Status_Code_Name(cvd::Status::OK)) {
+    failures_++;
+  }
+  CF_EXPECT_EQ(WriteAll(out_, line), line.size(), out_->StrError());
+  return {};
+}
+
+class CvdBatchCommandHandler : public CvdServerHandler {
+ public:
+  CvdBatchCommandHandler(InstanceLockFileManager& instance_lockfile_manager,
+                         InstanceManager& instance_manager,
+                         HostToolTargetManager& host_tool_target_manager)
+      : instance_lockfile_manager_(instance_lockfile_manager),
+        instance_manager_(instance_manager),
+        host_tool_target_manager_(host_tool_target_manager) {}
+
+  Result<bool> CanHandle(const RequestWithStdio& request) const override {
+    auto invocation = ParseInvocation(request.Message());
+    return invocation.command == "batch";
+  }
+
+  Result<cvd::Response> Handle(const RequestWithStdio& request) override {
+    CF_EXPECT(CanHandle(request));
+    auto [_, args] = ParseInvocation(request.Message());
+
+    auto batch_flags = CF_EXPECT(ParseBatchFlags(std::move(args)));
+
+    SharedFD input_fd = request.In();
+    if (batch_flags.input != "-") {
+      input_fd = SharedFD::Open(batch_flags.input, O_RDONLY | O_CLOEXEC);
+      CF_EXPECTF(input_fd->IsOpen(), "Failed to open \"{}\": {}",
+                 batch_flags.input, input_fd->StrError());
+    }
+    LineReader reader(input_fd);
+
+    const auto& command_request = request.Message().command_request();
+    BatchRunner runner(
+        RequestContextExecutors(instance_lockfile_manager_, instance_manager_,
+                                host_tool_target_manager_),
+        request.Out(), batch_flags.jobs);
+    return CF_EXPECT(
+        runner.Run(reader, cvd_common::ConvertToEnvs(command_request.env()),
+                   command_request.working_directory()));
+  }
+
+  cvd_common::Args CmdList() const override { return {"batch"}; }
+
+  Result<std::string> SummaryHelp() const override { return kSummaryHelpText; }
+
+  bool ShouldInterceptHelp() const override { return true; }
+
+  Result<std::string> DetailedHelp(std::vector<std::string>&) const override {
+    return kDetailedHelpText;
+  }
+
+ private:
+  InstanceLockFileManager& instance_lockfile_manager_;
+  InstanceManager& instance_manager_;
+  HostToolTargetManager& host_tool_target_manager_;
+};
+
+std::unique_ptr<CvdServerHandler> NewCvdBatchCommandHandler(
+    InstanceLockFileManager& instance_lockfile_manager,
+    InstanceManager& instance_manager,
+    HostToolTargetManager& host_tool_target_manager) {
+  return std::unique_ptr<CvdServerHandler>(new CvdBatchCommandHandler(
+      instance_lockfile_manager, instance_manager, host_tool_target_manager));
+}
+
+}  // namespace cuttlefish
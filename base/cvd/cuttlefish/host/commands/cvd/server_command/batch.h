@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include <json/json.h>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result.h"
+#include "cvd_server.pb.h"
+#include "host/commands/cvd/instance_lock.h"
+#include "host/commands/cvd/instance_manager.h"
+#include "host/commands/cvd/server_command/host_tool_target_manager.h"
+#include "host/commands/cvd/server_command/server_handler.h"
+#include "host/commands/cvd/types.h"
+
+namespace cuttlefish {
+
+struct BatchFlags {
+  std::string input = "-";
+  int jobs = 1;
+};
+
+// Parses the arguments of `cvd batch`, none may be left over.
+Result<BatchFlags> ParseBatchFlags(cvd_common::Args args);
+
+struct BatchCommand {
+  Json::Value id;
+  cvd_common::Args args;
+  cvd_common::Envs env;
+  std::string working_directory;
+  bool exclusive = false;
+};
+
+// Parses one JSON line of the batch, the `index`th command in it.
+Result<BatchCommand> ParseBatchCommand(const std::string& line, size_t index,
+                                       const cvd_common::Envs& batch_env,
+                                       const std::string& batch_working_dir);
+
+/** Splits the input into lines as it arrives. */
+class LineReader {
+ public:
+  explicit LineReader(SharedFD fd);
+
+  // Returns std::nullopt at the end of the input. The last line doesn't need
+  // to end with a newline.
+  Result<std::optional<std::string>> Next();
+
+ private:
+  SharedFD fd_;
+  std::string buffer_;
+  bool eof_ = false;
+};
+
+/**
+ * Runs the commands of a batch on a pool of worker threads, writing one JSON
+ * response line per command to `out`.
+ */
+class BatchRunner {
+ public:
+  // Runs one command and returns its response.
+  using Executor = std::function<Json::Value(const BatchCommand&)>;
+  // Called once on each worker thread, for the executor of that thread.
+  using ExecutorFactory = std::function<Executor()>;
+
+  BatchRunner(ExecutorFactory new_executor, SharedFD out, int jobs);
+
+  Result<cvd::Response> Run(LineReader& reader,
+                            const cvd_common::Envs& batch_env,
+                            const std::string& batch_working_dir);
+
+ private:
+  Result<void> Dispatch(LineReader& reader, const cvd_common::Envs& batch_env,
+                        const std::string& batch_working_dir);
+  bool Idle() const;
+  void Work();
+  Result<void> Respond(const Json::Value& response);
+
+  ExecutorFactory new_executor_;
+  SharedFD out_;
+  const size_t jobs_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<BatchCommand> queue_;
+  size_t running_ = 0;
+  bool done_ = false;
+
+  std::mutex out_mutex_;
+  size_t commands_ = 0;
+  size_t failures_ = 0;
+};
+
+/**
+ * Executors that run commands the way `cvd <args>` would, with their stdin
+ * from /dev/null and their output captured into the response.
+ *
+ * Each worker has its own RequestContext, as the handlers and the command
+ * sequence executor keep per-request state. The instance database, the lock
+ * files and the host tool information are shared.
+ */
+BatchRunner::ExecutorFactory RequestContextExecutors(
+    InstanceLockFileManager& instance_lockfile_manager,
+    InstanceManager& instance_manager,
+    HostToolTargetManager& host_tool_target_manager);
+
+std::unique_ptr<CvdServerHandler> NewCvdBatchCommandHandler(
+    InstanceLockFileManager& instance_lockfile_manager,
+    InstanceManager& instance_manager,
+    HostToolTargetManager& host_tool_target_manager);
+
+}  // namespace cuttlefish
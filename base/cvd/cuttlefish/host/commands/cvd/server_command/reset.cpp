@@ -16,8 +16,8 @@
 
 #include "host/commands/cvd/server_command/reset.h"
 
-#include <iostream>
-#include <sstream>
+#include <algorithm>
+#include <string>
 
 #include "common/libs/fs/shared_buf.h"
 #include "common/libs/utils/files.h"
@@ -111,11 +111,25 @@ static Result<ParsedFlags> ParseResetFlags(cvd_common::Args subcmd_args) {
   return parsed_flags;
 }
 
-static bool GetUserConfirm() {
-  std::cout << "Are you sure to reset all the devices, runtime files, "
-            << "and the cvd server if any [y/n]? ";
+// Asks on the request's stdio rather than the process', which are not the
+// same when the command runs inside cvd batch.
+static Result<bool> GetUserConfirm(const RequestWithStdio& request) {
+  const std::string prompt =
+      "Are you sure to reset all the devices, runtime files, "
+      "and the cvd server if any [y/n]? ";
+  CF_EXPECT_EQ(WriteAll(request.Out(), prompt), prompt.size(),
+               request.Out()->StrError());
   std::string user_confirm;
-  std::getline(std::cin, user_confirm);
+  char c;
+  ssize_t read;
+  while ((read = request.In()->Read(&c, 1)) == 1 && c != '\n') {
+    user_confirm.push_back(c);
+  }
+  CF_EXPECTF(read >= 0, "Failed to read the confirmation: {}",
+             request.In()->StrError());
+  CF_EXPECT(read == 1 || !user_confirm.empty(),
+            "No confirmation to read, run \"cvd reset -y\" to reset without "
+            "one");
   std::transform(user_confirm.begin(), user_confirm.end(), user_confirm.begin(),
                  ::tolower);
   return (user_confirm == "y" || user_confirm == "yes");
@@ -140,21 +154,30 @@ class CvdResetCommandHandler : public CvdServerHandler {
       SetMinimumVerbosity(options.log_level.value());
     }
     if (options.is_help) {
-      std::cout << kHelpMessage << std::endl;
+      const std::string help = std::string(kHelpMessage) + "\n";
+      CF_EXPECT_EQ(WriteAll(request.Out(), help), help.size(),
+                   request.Out()->StrError());
       return {};
     }
 
     // cvd reset. Give one more opportunity
-    if (!options.is_confirmed_by_flag && !GetUserConfirm()) {
-      std::cout << "For more details: " << "  cvd reset --help" << std::endl;
+    if (!options.is_confirmed_by_flag && !CF_EXPECT(GetUserConfirm(request))) {
+      const std::string details = "For more details:   cvd reset --help\n";
+      CF_EXPECT_EQ(WriteAll(request.Out(), details), details.size(),
+                   request.Out()->StrError());
       return {};
     }
 
     instance_manager_.CvdClear(request.Out(), request.Err());
-    // The instance database is obsolete now, clear it.
-    auto instance_db_deleted = RemoveFile(InstanceDatabasePath());
-    if (!instance_db_deleted) {
-      LOG(ERROR) << "Error deleting instance database file";
+    // The instance database is obsolete now, clear it. The journal goes too,
+    // or it would be replayed on top of an empty database, and so does the
+    // legacy database, or it would be imported again.
+    for (const auto& path :
+         {InstanceDatabasePath(), InstanceDatabasePath() + ".journal",
+          LegacyInstanceDatabasePath()}) {
+      if (FileExists(path) && !RemoveFile(path)) {
+        LOG(ERROR) << "Error deleting instance database file " << path;
+      }
     }
 
     // Any responsive cvd server process was stopped nicely when this process
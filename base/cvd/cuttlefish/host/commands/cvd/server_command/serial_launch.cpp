@@ -17,13 +17,18 @@
 #include "host/commands/cvd/server_command/serial_launch.h"
 
 #include <sys/types.h>
+#include <sys/wait.h>
 
+#include <algorithm>
 #include <chrono>
+#include <map>
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <fmt/format.h>
 #include "android-base/parseint.h"
 #include "android-base/strings.h"
 
@@ -31,6 +36,7 @@
 #include "common/libs/utils/files.h"
 #include "common/libs/utils/flag_parser.h"
 #include "common/libs/utils/result.h"
+#include "common/libs/utils/subprocess.h"
 #include "cvd_server.pb.h"
 #include "host/commands/cvd/instance_lock.h"
 #include "host/commands/cvd/selector/selector_constants.h"
@@ -62,9 +68,16 @@ std::vector<cvd::Request> AppendRequestVectors(
   return merged;
 }
 
+constexpr int kDefaultMaxConcurrentLaunches = 4;
+
 struct DemoCommandSequence {
   std::vector<InstanceLockFile> instance_locks;
   std::vector<RequestWithStdio> requests;
+  // With --concurrent, `requests` only create the directories and these
+  // devices are fetched and launched afterwards.
+  std::vector<ConcurrentDevice> concurrent_devices;
+  std::vector<SharedFD> fds;
+  int max_concurrent_launches = kDefaultMaxConcurrentLaunches;
 };
 
 /** Returns a `Flag` object that accepts comma-separated unsigned integers. */
@@ -103,8 +116,176 @@ std::string ParentDir(const uid_t uid) {
   return ss.str();
 }
 
+std::string Elapsed(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return fmt::format("{:.1f}s", elapsed.count());
+}
+
+Result<void> RunCvd(const cvd::Request& request,
+                    const std::vector<SharedFD>& fds) {
+  const auto& command_request = request.command_request();
+  auto args = cvd_common::ConvertToArgs(command_request.args());
+  CF_EXPECT(!args.empty());
+  Command command("/proc/self/exe");
+  command.SetName(args[0]);
+  command.SetExecutable("/proc/self/exe");
+  for (const auto& selector_arg : command_request.selector_opts().args()) {
+    command.AddParameter(selector_arg);
+  }
+  for (size_t i = 1; i < args.size(); i++) {
+    command.AddParameter(args[i]);
+  }
+  std::vector<std::string> env;
+  for (const auto& [name, value] : command_request.env()) {
+    env.emplace_back(name + "=" + value);
+  }
+  command.SetEnvironment(std::move(env));
+  if (!command_request.working_directory().empty()) {
+    command.SetWorkingDirectory(command_request.working_directory());
+  }
+  command.RedirectStdIO(Subprocess::StdIOChannel::kStdIn, fds[0]);
+  command.RedirectStdIO(Subprocess::StdIOChannel::kStdOut, fds[1]);
+  command.RedirectStdIO(Subprocess::StdIOChannel::kStdErr, fds[2]);
+
+  auto subprocess = command.Start();
+  CF_EXPECT(subprocess.Started(), "Failed to start cvd");
+  siginfo_t infop;
+  CF_EXPECTF(subprocess.Wait(&infop, WEXITED) == 0, "waitid failed: {}",
+             strerror(errno));
+  auto response = ResponseFromSiginfo(infop);
+  CF_EXPECTF(response.status().code() == cvd::Status::OK, "`{}` failed: {}",
+             android::base::Join(args, " "), response.status().message());
+  return {};
+}
+
 }  // namespace
 
+ConcurrentLauncher::ConcurrentLauncher(std::vector<ConcurrentDevice> devices,
+                                       Runner run, SharedFD report,
+                                       int max_launches)
+    : devices_(std::move(devices)),
+      run_(std::move(run)),
+      report_(std::move(report)),
+      max_launches_(std::max(max_launches, 1)),
+      fetch_states_(devices_.size(), State::kPending),
+      launch_states_(devices_.size(), State::kPending),
+      results_(devices_.size()) {
+  std::map<std::string, size_t> first_with_build;
+  for (size_t i = 0; i < devices_.size(); i++) {
+    fetched_by_.push_back(
+        first_with_build.emplace(devices_[i].build, i).first->second);
+  }
+}
+
+Result<void> ConcurrentLauncher::Run() {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < devices_.size(); i++) {
+    if (fetched_by_[i] == i) {
+      threads.emplace_back([this, i]() { FetchThread(i); });
+    }
+  }
+  for (size_t i = 0; i < devices_.size(); i++) {
+    threads.emplace_back([this, i]() { LaunchThread(i); });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<std::string> failures;
+  for (size_t i = 0; i < devices_.size(); i++) {
+    if (!results_[i].ok()) {
+      failures.emplace_back(fmt::format("{}: {}", DeviceName(i),
+                                        results_[i].error().Message()));
+    }
+  }
+  CF_EXPECTF(failures.empty(), "{} of {} devices failed to launch:\n{}",
+             failures.size(), devices_.size(),
+             android::base::Join(failures, "\n"));
+  Report(fmt::format("All {} devices launched in {}\n", devices_.size(),
+                     Elapsed(start)));
+  return {};
+}
+
+void ConcurrentLauncher::FetchThread(size_t i) {
+  auto result = Fetch(i);
+  {
+    std::lock_guard lock(mutex_);
+    fetch_states_[i] = result.ok() ? State::kDone : State::kFailed;
+  }
+  cv_.notify_all();
+}
+
+Result<void> ConcurrentLauncher::Fetch(size_t i) {
+  auto start = std::chrono::steady_clock::now();
+  Report(fmt::format("{} fetching\n", DeviceName(i)));
+  auto result = run_(devices_[i].fetch);
+  if (!result.ok()) {
+    Report(fmt::format("{} fetch failed after {}: {}\n", DeviceName(i),
+                       Elapsed(start), result.error().Message()));
+    return result;
+  }
+  Report(fmt::format("{} fetched in {}\n", DeviceName(i), Elapsed(start)));
+  return {};
+}
+
+void ConcurrentLauncher::LaunchThread(size_t i) {
+  auto result = Launch(i);
+  {
+    std::lock_guard lock(mutex_);
+    launch_states_[i] = result.ok() ? State::kDone : State::kFailed;
+    results_[i] = std::move(result);
+  }
+  cv_.notify_all();
+}
+
+Result<void> ConcurrentLauncher::Launch(size_t i) {
+  const size_t fetched_by = fetched_by_[i];
+  {
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [this, fetched_by, i]() {
+      return fetch_states_[fetched_by] != State::kPending &&
+             (i == 0 || launch_states_[0] != State::kPending);
+    });
+    CF_EXPECTF(fetch_states_[fetched_by] == State::kDone, "Failed to fetch {}",
+               devices_[i].build);
+    CF_EXPECT(i == 0 || launch_states_[0] == State::kDone,
+              "The first device failed to launch");
+    cv_.wait(lock, [this]() { return running_launches_ < max_launches_; });
+    running_launches_++;
+  }
+  auto start = std::chrono::steady_clock::now();
+  Report(fmt::format("{} launching\n", DeviceName(i)));
+  auto result = run_(devices_[i].launch);
+  {
+    std::lock_guard lock(mutex_);
+    running_launches_--;
+  }
+  cv_.notify_all();
+  CF_EXPECT(std::move(result));
+  Report(fmt::format("{} launched in {}\n", DeviceName(i), Elapsed(start)));
+  return {};
+}
+
+std::string ConcurrentLauncher::DeviceName(size_t i) const {
+  return fmt::format("[device {}/{} {}]", i + 1, devices_.size(),
+                     devices_[i].build);
+}
+
+void ConcurrentLauncher::Report(const std::string& message) {
+  std::lock_guard lock(report_mutex_);
+  if (WriteAll(report_, message) != message.size()) {
+    LOG(DEBUG) << "Failed to report progress: " << report_->StrError();
+  }
+}
+
+ConcurrentLauncher::Runner CvdSubprocessRunner(std::vector<SharedFD> fds) {
+  return [fds = std::move(fds)](const cvd::Request& request) {
+    return RunCvd(request, fds);
+  };
+}
+
 class SerialLaunchCommand : public CvdServerHandler {
  public:
   SerialLaunchCommand(CommandSequenceExecutor& executor,
@@ -124,6 +305,13 @@ class SerialLaunchCommand : public CvdServerHandler {
 
     auto commands = CF_EXPECT(CreateCommandSequence(request));
     CF_EXPECT(executor_.Execute(commands.requests, request.Err()));
+    if (!commands.concurrent_devices.empty()) {
+      ConcurrentLauncher launcher(std::move(commands.concurrent_devices),
+                                  CvdSubprocessRunner(std::move(commands.fds)),
+                                  request.Err(),
+                                  commands.max_concurrent_launches);
+      CF_EXPECT(launcher.Run());
+    }
 
     for (auto& lock : commands.instance_locks) {
       CF_EXPECT(lock.Status(InUseState::kInUse));
@@ -182,6 +370,13 @@ class SerialLaunchCommand : public CvdServerHandler {
     bool daemon = true;
     flags.emplace_back(GflagsCompatFlag("daemon", daemon));
 
+    bool concurrent = false;
+    flags.emplace_back(GflagsCompatFlag("concurrent", concurrent));
+
+    std::int32_t max_concurrent_launches = kDefaultMaxConcurrentLaunches;
+    flags.emplace_back(GflagsCompatFlag("max_concurrent_launches",
+                                        max_concurrent_launches));
+
     struct Device {
       std::string build;
       std::string home_dir;
@@ -219,7 +414,10 @@ class SerialLaunchCommand : public CvdServerHandler {
     if (help) {
       static constexpr char kHelp[] =
           "Usage: cvd experimental serial_launch [--verbose] --credentials=XYZ "
-          "--device=build/target --device=build/target";
+          "[--concurrent [--max_concurrent_launches=N]] "
+          "--device=build/target --device=build/target\n"
+          "--concurrent fetches each distinct build once, with all the "
+          "fetches in parallel, and launches up to N devices at a time.";
       CF_EXPECT(WriteAll(request.Out(), kHelp, sizeof(kHelp)) == sizeof(kHelp));
       return {};
     }
@@ -258,6 +456,11 @@ class SerialLaunchCommand : public CvdServerHandler {
 
     bool is_first = true;
 
+    // With --concurrent, the devices with the same build share the read-only
+    // artifacts fetched into the home directory of the first of them.
+    std::map<std::string, size_t> fetched_by;
+    std::vector<ConcurrentDevice> concurrent_devices;
+
     int index = 0;
     for (const auto& device : devices) {
       auto& mkdir_cmd = *req_protos.emplace_back().mutable_command_request();
@@ -266,21 +469,36 @@ class SerialLaunchCommand : public CvdServerHandler {
       mkdir_cmd.add_args("mkdir");
       mkdir_cmd.add_args(device.home_dir);
 
-      auto& fetch_cmd = *req_protos.emplace_back().mutable_command_request();
-      *fetch_cmd.mutable_env() = client_env;
-      fetch_cmd.set_working_directory(device.home_dir);
-      fetch_cmd.add_args("cvd");
-      fetch_cmd.add_args("fetch");
-      fetch_cmd.add_args("--directory=" + device.home_dir);
-      fetch_cmd.add_args("-default_build=" + device.build);
-      fetch_cmd.add_args("-credential_source=" + credentials);
+      auto fetched_by_it = fetched_by.find(device.build);
+      bool fetch_needed = !concurrent || fetched_by_it == fetched_by.end();
+      if (concurrent) {
+        concurrent_devices.emplace_back().build = device.build;
+        fetched_by.emplace(device.build, index);
+      }
+      const std::string& artifacts_dir =
+          devices[fetch_needed ? index : fetched_by_it->second].home_dir;
+
+      if (fetch_needed) {
+        auto& fetch_request = concurrent ? concurrent_devices.back().fetch
+                                         : req_protos.emplace_back();
+        auto& fetch_cmd = *fetch_request.mutable_command_request();
+        *fetch_cmd.mutable_env() = client_env;
+        fetch_cmd.set_working_directory(device.home_dir);
+        fetch_cmd.add_args("cvd");
+        fetch_cmd.add_args("fetch");
+        fetch_cmd.add_args("--directory=" + device.home_dir);
+        fetch_cmd.add_args("-default_build=" + device.build);
+        fetch_cmd.add_args("-credential_source=" + credentials);
+      }
 
-      auto& launch_cmd = *req_protos.emplace_back().mutable_command_request();
+      auto& launch_request = concurrent ? concurrent_devices.back().launch
+                                        : req_protos.emplace_back();
+      auto& launch_cmd = *launch_request.mutable_command_request();
       *launch_cmd.mutable_env() = client_env;
       launch_cmd.set_working_directory(device.home_dir);
       (*launch_cmd.mutable_env())["HOME"] = device.home_dir;
-      (*launch_cmd.mutable_env())["ANDROID_HOST_OUT"] = device.home_dir;
-      (*launch_cmd.mutable_env())["ANDROID_PRODUCT_OUT"] = device.home_dir;
+      (*launch_cmd.mutable_env())["ANDROID_HOST_OUT"] = artifacts_dir;
+      (*launch_cmd.mutable_env())["ANDROID_PRODUCT_OUT"] = artifacts_dir;
       launch_cmd.add_args("cvd");
       /* TODO(kwstephenkim): remove kAcquireFileLockOpt flag when
        * SerialLaunchCommand is re-implemented so that it does not have to
@@ -352,6 +570,9 @@ class SerialLaunchCommand : public CvdServerHandler {
     for (auto& request_proto : req_protos) {
       ret.requests.emplace_back(request_proto, fds);
     }
+    ret.concurrent_devices = std::move(concurrent_devices);
+    ret.fds = std::move(fds);
+    ret.max_concurrent_launches = max_concurrent_launches;
 
     return ret;
   }
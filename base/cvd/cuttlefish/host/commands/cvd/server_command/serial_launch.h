@@ -15,14 +15,81 @@
  */
 #pragma once
 
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result.h"
+#include "cvd_server.pb.h"
 #include "host/commands/cvd/command_sequence.h"
 #include "host/commands/cvd/instance_lock.h"
 #include "host/commands/cvd/server_command/server_handler.h"
 
 namespace cuttlefish {
 
+struct ConcurrentDevice {
+  std::string build;
+  // Only run for the first device with each build, the others use the
+  // artifacts it fetches.
+  cvd::Request fetch;
+  cvd::Request launch;
+};
+
+/**
+ * Fetches and launches the devices of `--concurrent`.
+ *
+ * Every distinct build is fetched once, and all the fetches run at the same
+ * time. Each device launches as soon as its build is fetched, with at most
+ * `max_launches` launches at a time. The first device launches before the
+ * others, which connect to its wifi and bluetooth simulators.
+ */
+class ConcurrentLauncher {
+ public:
+  // Runs one fetch or launch request, called from several threads at once.
+  using Runner = std::function<Result<void>(const cvd::Request&)>;
+
+  ConcurrentLauncher(std::vector<ConcurrentDevice> devices, Runner run,
+                     SharedFD report, int max_launches);
+
+  Result<void> Run();
+
+ private:
+  enum class State { kPending, kDone, kFailed };
+
+  void FetchThread(size_t i);
+  Result<void> Fetch(size_t i);
+  void LaunchThread(size_t i);
+  Result<void> Launch(size_t i);
+  std::string DeviceName(size_t i) const;
+  void Report(const std::string& message);
+
+  const std::vector<ConcurrentDevice> devices_;
+  // The device whose fetch provides the artifacts of each device.
+  std::vector<size_t> fetched_by_;
+  Runner run_;
+  SharedFD report_;
+  std::mutex report_mutex_;
+  const int max_launches_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<State> fetch_states_;
+  std::vector<State> launch_states_;
+  int running_launches_ = 0;
+  std::vector<Result<void>> results_;
+};
+
+/**
+ * Runs each request in a separate cvd process with the given stdio, the
+ * handlers aren't safe to run concurrently in one process.
+ */
+ConcurrentLauncher::Runner CvdSubprocessRunner(std::vector<SharedFD> fds);
+
 std::unique_ptr<CvdServerHandler> NewSerialLaunchCommand(
     CommandSequenceExecutor& executor,
     InstanceLockFileManager& lock_file_manager);
@@ -50,6 +50,7 @@
 #include "host/commands/cvd/server_command/status_fetcher.h"
 #include "host/commands/cvd/server_command/subprocess_waiter.h"
 #include "host/commands/cvd/server_command/utils.h"
+#include "host/commands/cvd/trash.h"
 #include "host/commands/cvd/types.h"
 #include "host/libs/config/config_constants.h"
 
@@ -143,7 +144,7 @@ RequestWithStdio CreateLoadCommand(const RequestWithStdio& request,
 // target to link
 Result<void> EnsureSymlink(const std::string& target, const std::string link) {
   if (DirectoryExists(link, /* follow_symlinks */ false)) {
-    CF_EXPECTF(RecursivelyRemoveDirectory(link),
+    CF_EXPECTF(RemoveDirectoryInBackground(link),
                "Failed to remove legacy directory \"{}\"", link);
   }
   if (FileExists(link, /* follow_symlinks */ false)) {
@@ -267,11 +268,10 @@ Result<void> CvdStartCommandHandler::AcloudCompatActions(
         // cvd created a symbolic link
         result_deleted = RemoveFile(acloud_compat_home);
       } else {
-        // acloud created a directory
-        // rm -fr isn't supporetd by TreeHugger, so if we fork-and-exec to
-        // literally run "rm -fr", the presubmit testing may fail if ever this
-        // code is tested in the future.
-        result_deleted = RecursivelyRemoveDirectory(acloud_compat_home);
+        // acloud created a directory, which may hold large images. Only the
+        // path needs to be free before the symbolic link replaces it.
+        result_deleted =
+            RemoveDirectoryInBackground(acloud_compat_home).ok();
       }
     }
     if (!result_deleted) {
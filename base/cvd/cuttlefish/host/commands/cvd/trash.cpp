@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/trash.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <fmt/format.h>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/files.h"
+#include "common/libs/utils/result.h"
+#include "common/libs/utils/subprocess.h"
+#include "host/commands/cvd/common_utils.h"
+
+namespace cuttlefish {
+namespace {
+
+// From linux/ioprio.h, which isn't available everywhere.
+constexpr int kIoprioWhoProcess = 1;
+constexpr int kIoprioClassIdle = 3;
+constexpr int kIoprioClassShift = 13;
+
+// Holds an entry per file system named after its device number: either the
+// trash directory itself or a symbolic link to one on that file system.
+std::string TrashRegistry(const TrashOptions& options) {
+  return options.state_dir + "/trash";
+}
+
+std::string TrashLockPath(const TrashOptions& options) {
+  return options.state_dir + "/trash.lock";
+}
+
+// Finds or creates the trash directory on the file system `dev`, which holds
+// the directory at `path`.
+Result<std::string> TrashDirectory(dev_t dev, const std::string& path,
+                                   const TrashOptions& options) {
+  const auto registry = TrashRegistry(options);
+  CF_EXPECT(EnsureDirectoryExists(registry, S_IRWXU));
+  const auto entry = fmt::format("{}/{}", registry, dev);
+  struct stat st {};
+  if (stat(entry.c_str(), &st) == 0 && S_ISDIR(st.st_mode) &&
+      st.st_dev == dev) {
+    return entry;
+  }
+  CF_EXPECTF(stat(registry.c_str(), &st) == 0, "Failed to stat \"{}\": {}",
+             registry, strerror(errno));
+  if (st.st_dev == dev) {
+    // Replaces a dangling symbolic link left by a removed trash directory.
+    unlink(entry.c_str());
+    CF_EXPECT(EnsureDirectoryExists(entry, S_IRWXU));
+    return entry;
+  }
+
+  const auto trash = android::base::Dirname(path) + "/.cvd_trash";
+  CF_EXPECT(EnsureDirectoryExists(trash, S_IRWXU));
+  CF_EXPECTF(stat(trash.c_str(), &st) == 0 && st.st_dev == dev,
+             "\"{}\" is not on the same file system as \"{}\"", trash, path);
+  // Swaps in the new link atomically in case another process uses the old.
+  const auto new_entry = fmt::format("{}.{}", entry, getpid());
+  unlink(new_entry.c_str());
+  CF_EXPECTF(symlink(trash.c_str(), new_entry.c_str()) == 0,
+             "Failed to link \"{}\": {}", new_entry, strerror(errno));
+  CF_EXPECTF(rename(new_entry.c_str(), entry.c_str()) == 0,
+             "Failed to rename \"{}\" to \"{}\": {}", new_entry, entry,
+             strerror(errno));
+  return trash;
+}
+
+Result<size_t> PendingTrash(const std::string& trash) {
+  const auto contents = CF_EXPECT(DirectoryContents(trash));
+  return contents.size() - std::count_if(contents.begin(), contents.end(),
+                                         [](const std::string& name) {
+                                           return name == "." || name == "..";
+                                         });
+}
+
+std::string TrashedName(const std::string& trash, const std::string& path) {
+  static std::atomic<size_t> counter = 0;
+  auto now = std::chrono::system_clock::now().time_since_epoch();
+  return fmt::format(
+      "{}/{}.{}.{}.{}", trash, android::base::Basename(path), getpid(),
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(),
+      counter++);
+}
+
+Result<void> StartTrashReaper(const TrashOptions& options) {
+  auto dev_null = SharedFD::Open("/dev/null", O_RDWR);
+  CF_EXPECTF(dev_null->IsOpen(), "Failed to open /dev/null: {}",
+             dev_null->StrError());
+  Command command(kEmptyTrashCommand);
+  command.SetExecutable(options.reaper_executable);
+  // The reaper may outlive this process, it must not hold on to pipes the
+  // caller waits on.
+  command.RedirectStdIO(Subprocess::StdIOChannel::kStdIn, dev_null);
+  command.RedirectStdIO(Subprocess::StdIOChannel::kStdOut, dev_null);
+  command.RedirectStdIO(Subprocess::StdIOChannel::kStdErr, dev_null);
+  SubprocessOptions subprocess_options;
+  subprocess_options.ExitWithParent(false);
+  // Out of the terminal's foreground group, so Ctrl-C doesn't reach it.
+  subprocess_options.InGroup(true);
+  auto reaper = command.Start(std::move(subprocess_options));
+  CF_EXPECT(reaper.Started(), "Failed to start the trash reaper");
+  // Only until it forks the actual reaper.
+  int exit_code = reaper.Wait();
+  CF_EXPECTF(exit_code == 0, "The trash reaper exited with {}", exit_code);
+  return {};
+}
+
+// Every directory in the trash of every file system, sorted.
+std::vector<std::string> TrashedDirectories(const TrashOptions& options) {
+  std::vector<std::string> trashed;
+  const auto registry = TrashRegistry(options);
+  auto trashes = DirectoryContents(registry);
+  if (!trashes.ok()) {
+    return trashed;
+  }
+  for (const auto& name : *trashes) {
+    if (name == "." || name == "..") {
+      continue;
+    }
+    const auto trash = registry + "/" + name;
+    auto contents = DirectoryContents(trash);
+    if (!contents.ok()) {
+      // The trash directory went away along with its file system or parent.
+      unlink(trash.c_str());
+      continue;
+    }
+    for (const auto& entry : *contents) {
+      if (entry != "." && entry != "..") {
+        trashed.emplace_back(trash + "/" + entry);
+      }
+    }
+  }
+  std::sort(trashed.begin(), trashed.end());
+  return trashed;
+}
+
+// Deletes the contents of the directories concurrently, the first level of
+// each directory being the unit of work.
+void RemoveTrashedDirectories(const std::vector<std::string>& trashed) {
+  std::vector<std::string> work;
+  for (const auto& dir : trashed) {
+    auto contents = DirectoryContents(dir);
+    if (!contents.ok()) {
+      continue;
+    }
+    for (const auto& entry : *contents) {
+      if (entry != "." && entry != "..") {
+        work.emplace_back(dir + "/" + entry);
+      }
+    }
+  }
+
+  std::atomic<size_t> next = 0;
+  auto remove = [&work, &next]() {
+    for (size_t i = next++; i < work.size(); i = next++) {
+      RecursivelyRemoveDirectory(work[i]);
+    }
+  };
+  const size_t num_threads = std::min<size_t>(
+      work.size(), std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(remove);
+  }
+  remove();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (const auto& dir : trashed) {
+    RecursivelyRemoveDirectory(dir);
+  }
+}
+
+}  // namespace
+
+TrashOptions DefaultTrashOptions() {
+  TrashOptions options;
+  options.state_dir = PerUserDir();
+  // The same cvd binary, which recognizes the name.
+  options.reaper_executable = "/proc/self/exe";
+  return options;
+}
+
+Result<void> RemoveDirectoryInBackground(const std::string& path,
+                                         const TrashOptions& options) {
+  struct stat st {};
+  CF_EXPECTF(lstat(path.c_str(), &st) == 0, "Failed to stat \"{}\": {}", path,
+             strerror(errno));
+  auto trash = TrashDirectory(st.st_dev, path, options);
+  if (!trash.ok()) {
+    LOG(DEBUG) << "No trash for \"" << path
+               << "\": " << trash.error().FormatForEnv();
+  } else if (auto pending = PendingTrash(*trash);
+             pending.ok() && *pending < kMaxPendingTrash) {
+    const auto trashed = TrashedName(*trash, path);
+    if (rename(path.c_str(), trashed.c_str()) == 0) {
+      auto reaper = StartTrashReaper(options);
+      if (!reaper.ok()) {
+        // The next removal starts another one, which picks this up.
+        LOG(ERROR) << reaper.error().FormatForEnv();
+      }
+      return {};
+    }
+    // A mount point can't be renamed, for one.
+    PLOG(DEBUG) << "Failed to move \"" << path << "\" to \"" << trashed << "\"";
+  } else {
+    LOG(DEBUG) << "The trash at \"" << *trash << "\" is full";
+  }
+  CF_EXPECTF(RecursivelyRemoveDirectory(path), "Failed to remove \"{}\"",
+             path);
+  return {};
+}
+
+void LowerTrashReaperPriority() {
+  // Applies to the threads started afterwards too.
+  if (setpriority(PRIO_PROCESS, 0, 19) == -1) {
+    PLOG(WARNING) << "Failed to lower the priority";
+  }
+  if (syscall(SYS_ioprio_set, kIoprioWhoProcess, 0,
+              kIoprioClassIdle << kIoprioClassShift) == -1) {
+    PLOG(WARNING) << "Failed to lower the I/O priority";
+  }
+}
+
+Result<void> EmptyTrash(const TrashOptions& options) {
+  const auto lock_path = TrashLockPath(options);
+  auto lock = SharedFD::Open(lock_path, O_CREAT | O_RDWR, 0600);
+  CF_EXPECTF(lock->IsOpen(), "Failed to open \"{}\": {}", lock_path,
+             lock->StrError());
+  // What deleting made no progress on, for lack of permissions for example.
+  std::vector<std::string> stuck;
+  // Anything trashed after the last look while the lock is held would be left
+  // behind by both this reaper and the one that didn't get the lock, so look
+  // again once it's released.
+  while (true) {
+    auto locked = lock->Flock(LOCK_EX | LOCK_NB);
+    if (!locked.ok() && lock->GetErrno() == EWOULDBLOCK) {
+      return {};
+    }
+    CF_EXPECT(std::move(locked));
+    auto trashed = TrashedDirectories(options);
+    while (!trashed.empty() && trashed != stuck) {
+      RemoveTrashedDirectories(trashed);
+      auto left = TrashedDirectories(options);
+      if (left == trashed) {
+        stuck = std::move(left);
+        break;
+      }
+      trashed = std::move(left);
+    }
+    CF_EXPECT(lock->Flock(LOCK_UN));
+    auto left = TrashedDirectories(options);
+    if (left.empty() || left == stuck) {
+      return {};
+    }
+  }
+}
+
+}  // namespace cuttlefish
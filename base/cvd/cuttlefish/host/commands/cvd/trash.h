@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+// argv[0] of the cvd process that empties the trash.
+constexpr char kEmptyTrashCommand[] = "cvd_internal_empty_trash";
+
+// Directories waiting in the trash of a file system past which they are
+// deleted in place, so the trash can't grow without bound when the reaper
+// falls behind or can't run.
+constexpr size_t kMaxPendingTrash = 32;
+
+struct TrashOptions {
+  // Keeps track of the trash directories and holds the reaper's lock.
+  std::string state_dir;
+  // Run as kEmptyTrashCommand to empty the trash.
+  std::string reaper_executable;
+};
+
+// Per user state, and this cvd binary as the reaper.
+TrashOptions DefaultTrashOptions();
+
+/**
+ * Removes a directory without waiting for its contents to be unlinked.
+ *
+ * The directory is renamed into a trash directory on the same file system,
+ * so the path is free as soon as this returns, and a detached low priority
+ * cvd process deletes it. Falls back to deleting it in place when it can't be
+ * moved or too many directories are already waiting in the trash.
+ *
+ * The process started here forks the reaper and exits, and is waited for, so
+ * that long running callers don't collect zombies.
+ */
+Result<void> RemoveDirectoryInBackground(
+    const std::string& path,
+    const TrashOptions& options = DefaultTrashOptions());
+
+/**
+ * Deletes everything in the trash, including what was left by an earlier run
+ * that didn't finish. Returns right away if another process is at it, and
+ * once deleting makes no more progress, leaving behind what it can't delete.
+ */
+Result<void> EmptyTrash(const TrashOptions& options = DefaultTrashOptions());
+
+// Gives the calling process the lowest CPU and the idle I/O priority, for the
+// reaper to run before EmptyTrash. This can't be undone.
+void LowerTrashReaperPriority();
+
+}  // namespace cuttlefish
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/metrics/metrics_spool.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "host/libs/web/http_client/http_client.h"
+
+namespace cuttlefish {
+namespace {
+
+using std::chrono::milliseconds;
+
+/**
+ * Stand-in for the metrics endpoint. Answers the first `failures` POSTs with
+ * 503 and records the bodies of the rest. Connections queue up from
+ * construction, but are only answered after Start.
+ */
+class FakeMetricsServer {
+ public:
+  explicit FakeMetricsServer(int failures) : failures_(failures) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), addr_len) != 0 ||
+        listen(listen_fd_, 8) != 0 ||
+        getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr),
+                    &addr_len) != 0) {
+      ADD_FAILURE() << "Failed to listen: " << strerror(errno);
+    }
+    url_ = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "/log";
+  }
+
+  ~FakeMetricsServer() {
+    shutdown(listen_fd_, SHUT_RDWR);
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    close(listen_fd_);
+  }
+
+  void Start() {
+    thread_ = std::thread([this]() { Serve(); });
+  }
+
+  const std::string& Url() const { return url_; }
+
+  std::vector<std::string> Bodies() {
+    std::lock_guard lock(mutex_);
+    return bodies_;
+  }
+
+  int Requests() const { return requests_; }
+
+ private:
+  void Serve() {
+    int client;
+    while ((client = accept(listen_fd_, nullptr, nullptr)) >= 0) {
+      std::string body = ReadBody(client);
+      bool fail = requests_++ < failures_;
+      if (!fail) {
+        std::lock_guard lock(mutex_);
+        bodies_.emplace_back(std::move(body));
+      }
+      std::string response =
+          fail ? "HTTP/1.1 503 Service Unavailable\r\n"
+               : "HTTP/1.1 200 OK\r\n";
+      response += "Content-Length: 0\r\nConnection: close\r\n\r\n";
+      android::base::WriteFully(client, response.data(), response.size());
+      close(client);
+    }
+  }
+
+  static std::string ReadBody(int client) {
+    std::string request;
+    char buf[4096];
+    size_t header_end = std::string::npos;
+    size_t content_length = 0;
+    while (true) {
+      if (header_end != std::string::npos &&
+          request.size() >= header_end + 4 + content_length) {
+        return request.substr(header_end + 4, content_length);
+      }
+      ssize_t read_bytes = read(client, buf, sizeof(buf));
+      if (read_bytes <= 0) {
+        return "";
+      }
+      request.append(buf, read_bytes);
+      if (header_end == std::string::npos) {
+        header_end = request.find("\r\n\r\n");
+        if (header_end == std::string::npos) {
+          continue;
+        }
+        for (const auto& line : android::base::Split(
+                 request.substr(0, header_end), "\r\n")) {
+          auto header = android::base::Tokenize(line, ":");
+          if (header.size() == 2 &&
+              android::base::EqualsIgnoreCase(header[0], "Content-Length")) {
+            content_length = std::stoul(android::base::Trim(header[1]));
+          }
+        }
+      }
+    }
+  }
+
+  int listen_fd_;
+  std::string url_;
+  const int failures_;
+  std::atomic<int> requests_ = 0;
+  std::mutex mutex_;
+  std::vector<std::string> bodies_;
+  std::thread thread_;
+};
+
+class MetricsSpoolTest : public testing::Test {
+ protected:
+  MetricsSpoolTest() : http_client_(HttpClient::CurlClient()) {
+    options_.batch_size = 2;
+    options_.initial_backoff = milliseconds(1);
+    options_.max_backoff = milliseconds(4);
+  }
+
+  MetricsSpool::Uploader PostTo(const std::string& url) {
+    return [this, url](const std::vector<std::string>& batch) -> Result<void> {
+      auto response = CF_EXPECT(
+          http_client_->PostToString(url, android::base::Join(batch, "\n")));
+      CF_EXPECT(response.HttpSuccess(), "Status " << response.http_code);
+      return {};
+    };
+  }
+
+  std::string SpoolPath() const { return std::string(dir_.path) + "/spool"; }
+
+  TemporaryDir dir_;
+  MetricsSpool::Options options_;
+  std::unique_ptr<HttpClient> http_client_;
+};
+
+TEST_F(MetricsSpoolTest, UploadsInBatches) {
+  FakeMetricsServer server(/* failures */ 0);
+  server.Start();
+  MetricsSpool spool(SpoolPath(), options_);
+  for (const auto& record : {"a", "b", "c", "d", "e"}) {
+    ASSERT_TRUE(spool.Append(record).ok());
+  }
+
+  auto uploaded = spool.Upload(PostTo(server.Url()));
+
+  ASSERT_TRUE(uploaded.ok()) << uploaded.error().FormatForEnv();
+  std::vector<std::string> expected{"a\nb", "c\nd", "e"};
+  ASSERT_EQ(server.Bodies(), expected);
+  auto left = spool.Records();
+  ASSERT_TRUE(left.ok());
+  ASSERT_TRUE(left->empty());
+}
+
+TEST_F(MetricsSpoolTest, RetriesWithBackoff) {
+  FakeMetricsServer server(/* failures */ 2);
+  server.Start();
+  MetricsSpool spool(SpoolPath(), options_);
+  ASSERT_TRUE(spool.Append("a").ok());
+
+  auto uploaded = spool.Upload(PostTo(server.Url()));
+
+  ASSERT_TRUE(uploaded.ok()) << uploaded.error().FormatForEnv();
+  ASSERT_EQ(server.Requests(), 3);
+  ASSERT_EQ(server.Bodies(), std::vector<std::string>{"a"});
+}
+
+TEST_F(MetricsSpoolTest, KeepsRecordsWhenUnreachable) {
+  options_.max_attempts = 2;
+  MetricsSpool spool(SpoolPath(), options_);
+  ASSERT_TRUE(spool.Append("a").ok());
+  ASSERT_TRUE(spool.Append("b").ok());
+  {
+    FakeMetricsServer down(/* failures */ 1000);
+    down.Start();
+    ASSERT_FALSE(spool.Upload(PostTo(down.Url())).ok());
+    ASSERT_EQ(down.Requests(), 2);
+  }
+  auto left = spool.Records();
+  ASSERT_TRUE(left.ok());
+  ASSERT_EQ(left->size(), 2);
+
+  FakeMetricsServer up(/* failures */ 0);
+  up.Start();
+  ASSERT_TRUE(spool.Upload(PostTo(up.Url())).ok());
+  ASSERT_EQ(up.Bodies().size(), 1);
+  ASSERT_TRUE(spool.Records()->empty());
+}
+
+TEST_F(MetricsSpoolTest, DropsRecordsPastSizeCap) {
+  options_.max_bytes = 16;
+  MetricsSpool spool(SpoolPath(), options_);
+
+  ASSERT_TRUE(spool.Append("12345678").ok());
+  ASSERT_FALSE(spool.Append("12345678").ok());
+
+  auto records = spool.Records();
+  ASSERT_TRUE(records.ok());
+  ASSERT_EQ(*records, std::vector<std::string>{"12345678"});
+}
+
+TEST_F(MetricsSpoolTest, KeepsFailedBatchWhenSpoolFillsUp) {
+  options_.max_bytes = 16;
+  options_.max_attempts = 1;
+  MetricsSpool spool(SpoolPath(), options_);
+  ASSERT_TRUE(spool.Append("1234").ok());
+  ASSERT_TRUE(spool.Append("5678").ok());
+
+  // Another command fills the spool while the batch is out.
+  auto uploaded = spool.Upload(
+      [&spool](const std::vector<std::string>&) -> Result<void> {
+        CF_EXPECT(spool.Append("abcdefghijkl"));
+        return CF_ERR("Unavailable");
+      });
+
+  ASSERT_FALSE(uploaded.ok());
+  auto records = spool.Records();
+  ASSERT_TRUE(records.ok());
+  std::vector<std::string> expected{"1234", "5678", "abcdefghijkl"};
+  ASSERT_EQ(*records, expected);
+}
+
+TEST_F(MetricsSpoolTest, UploadsInBackground) {
+  FakeMetricsServer server(/* failures */ 0);
+  MetricsSpool spool(SpoolPath(), options_);
+  ASSERT_TRUE(spool.Append("a").ok());
+
+  // Forks, so it goes before the server's thread.
+  auto started = spool.UploadInBackground(PostTo(server.Url()));
+  server.Start();
+
+  ASSERT_TRUE(started.ok()) << started.error().FormatForEnv();
+  for (int i = 0; i < 500 && server.Bodies().empty(); i++) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  ASSERT_EQ(server.Bodies(), std::vector<std::string>{"a"});
+}
+
+}  // namespace
+}  // namespace cuttlefish
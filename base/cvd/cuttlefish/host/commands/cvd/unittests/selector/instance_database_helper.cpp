@@ -19,6 +19,8 @@
 #include <cstdio>
 #include <cstdlib>
 
+#include <unistd.h>
+
 #include <android-base/file.h>
 
 #include "common/libs/fs/shared_buf.h"
@@ -68,6 +70,9 @@ CvdInstanceDatabaseTest::CvdInstanceDatabaseTest()
 CvdInstanceDatabaseTest::~CvdInstanceDatabaseTest() { 
   ClearWorkspace();
   close(db_backing_fd_);
+  for (const auto& suffix : {"", ".lock", ".journal", ".tmp"}) {
+    unlink((db_backing_path_ + suffix).c_str());
+  }
 }
 
 void CvdInstanceDatabaseTest::ClearWorkspace() {
@@ -80,6 +80,7 @@ class CvdInstanceDatabaseTest : public ::testing::Test {
   bool AddGroup(const std::string& base_name,
                 const std::vector<cvd::Instance>& instances);
   InstanceDatabase& GetDb() { return db_; }
+  const std::string& DbBackingPath() const { return db_backing_path_; }
   const SetupError& Error() const { return error_; }
 
  private:
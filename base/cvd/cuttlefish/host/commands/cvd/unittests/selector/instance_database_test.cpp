@@ -17,8 +17,11 @@
 #include <iostream>
 #include <unordered_set>
 
+#include <android-base/file.h>
 #include <gtest/gtest.h>
 
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/fs/shared_fd.h"
 #include "common/libs/utils/files.h"
 #include "common/libs/utils/json.h"
 #include "common/libs/utils/result_matchers.h"
@@ -426,6 +429,110 @@ TEST_F(CvdInstanceDatabaseTest, AddInstancesTogether) {
   ASSERT_TRUE(result_tv.ok()) << result_tv.error().Trace();
 }
 
+TEST_F(CvdInstanceDatabaseTest, ReloadFromJournal) {
+  if (!SetUpOk() || !AddGroup("miaaaw", {InstanceProto(1, "name")}) ||
+      !AddGroup("meow", {InstanceProto(2, "name")}) ||
+      !AddGroup("mjau", {InstanceProto(3, "name")})) {
+    GTEST_SKIP() << Error().msg;
+  }
+  auto& db = GetDb();
+  ASSERT_THAT(db.RemoveInstanceGroup("meow"), IsOkAndValue(true));
+  ASSERT_TRUE(db.SetAcloudTranslatorOptout(true).ok());
+
+  InstanceDatabase reloaded(DbBackingPath());
+  auto groups = reloaded.InstanceGroups();
+  ASSERT_TRUE(groups.ok()) << groups.error().Trace();
+  ASSERT_EQ(groups->size(), 2);
+  ASSERT_EQ((*groups)[0].GroupName(), "miaaaw");
+  ASSERT_EQ((*groups)[1].GroupName(), "mjau");
+  ASSERT_THAT(reloaded.GetAcloudTranslatorOptout(), IsOkAndValue(true));
+}
+
+TEST_F(CvdInstanceDatabaseTest, CompactJournal) {
+  if (!SetUpOk() || !AddGroup("mjau", {InstanceProto(1, "name")})) {
+    GTEST_SKIP() << Error().msg;
+  }
+  auto& db = GetDb();
+  // Enough changes to have the journal folded into the snapshot a few times
+  for (unsigned i = 0; i < 200; i++) {
+    const std::string name = "meow_" + std::to_string(i);
+    if (!AddGroup(name, {InstanceProto(2, name)})) {
+      GTEST_SKIP() << Error().msg;
+    }
+    ASSERT_THAT(db.RemoveInstanceGroup(name), IsOkAndValue(true));
+  }
+  ASSERT_TRUE(AddGroup("miau", {InstanceProto(3, "name")})) << Error().msg;
+
+  InstanceDatabase reloaded(DbBackingPath());
+  auto groups = reloaded.InstanceGroups();
+  ASSERT_TRUE(groups.ok()) << groups.error().Trace();
+  ASSERT_EQ(groups->size(), 2);
+  ASSERT_EQ((*groups)[0].GroupName(), "mjau");
+  ASSERT_EQ((*groups)[1].GroupName(), "miau");
+  ASSERT_LT(FileSize(DbBackingPath() + ".journal"), 16 * 1024);
+}
+
+TEST_F(CvdInstanceDatabaseTest, IgnoreTornJournalEntry) {
+  if (!SetUpOk() || !AddGroup("mjau", {InstanceProto(1, "name")})) {
+    GTEST_SKIP() << Error().msg;
+  }
+  {
+    // A crash in the middle of appending leaves an incomplete entry behind
+    auto journal =
+        SharedFD::Open(DbBackingPath() + ".journal", O_WRONLY | O_APPEND);
+    ASSERT_TRUE(journal->IsOpen()) << journal->StrError();
+    ASSERT_EQ(WriteAll(journal, std::string("\x40\0\0\0garbage", 11)), 11);
+  }
+  auto& db = GetDb();
+  auto groups = db.InstanceGroups();
+  ASSERT_TRUE(groups.ok()) << groups.error().Trace();
+  ASSERT_EQ(groups->size(), 1);
+
+  ASSERT_TRUE(AddGroup("miau", {InstanceProto(2, "name")})) << Error().msg;
+  InstanceDatabase reloaded(DbBackingPath());
+  groups = reloaded.InstanceGroups();
+  ASSERT_TRUE(groups.ok()) << groups.error().Trace();
+  ASSERT_EQ(groups->size(), 2);
+  ASSERT_EQ((*groups)[1].GroupName(), "miau");
+}
+
+TEST_F(CvdInstanceDatabaseTest, ImportLegacyDatabase) {
+  if (!SetUpOk()) {
+    GTEST_SKIP() << Error().msg;
+  }
+  const std::string legacy_path = Workspace() + "/legacy.binpb";
+  const std::string db_path = Workspace() + "/db.binpb";
+  cvd::PersistentData legacy;
+  auto& group = *legacy.add_instance_groups();
+  group.set_name("mjau");
+  group.set_home_directory(Workspace() + "/mjau");
+  group.set_host_artifacts_path(HostArtifactsPath());
+  *group.add_instances() = InstanceProto(1, "name");
+  ASSERT_TRUE(android::base::WriteStringToFile(legacy.SerializeAsString(),
+                                               legacy_path));
+
+  InstanceDatabase db(db_path, legacy_path);
+  auto groups = db.InstanceGroups();
+  ASSERT_TRUE(groups.ok()) << groups.error().Trace();
+  ASSERT_EQ(groups->size(), 1);
+  ASSERT_EQ((*groups)[0].GroupName(), "mjau");
+  // Reading doesn't import
+  ASSERT_FALSE(FileExists(db_path));
+
+  ASSERT_TRUE(db.SetAcloudTranslatorOptout(true).ok());
+  ASSERT_TRUE(FileExists(db_path));
+  // Changes made by older cvd versions don't show up after the import
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      cvd::PersistentData().SerializeAsString(), legacy_path));
+
+  InstanceDatabase reloaded(db_path, legacy_path);
+  groups = reloaded.InstanceGroups();
+  ASSERT_TRUE(groups.ok()) << groups.error().Trace();
+  ASSERT_EQ(groups->size(), 1);
+  ASSERT_EQ((*groups)[0].GroupName(), "mjau");
+  ASSERT_THAT(reloaded.GetAcloudTranslatorOptout(), IsOkAndValue(true));
+}
+
 TEST_F(CvdInstanceDatabaseJsonTest, DumpLoadDumpCompare) {
   // starting set up
   if (!SetUpOk()) {
@@ -0,0 +1,400 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "host/commands/cvd/server_command/batch.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <json/json.h>
+
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/json.h"
+#include "common/libs/utils/result_matchers.h"
+#include "host/commands/cvd/instance_lock.h"
+#include "host/commands/cvd/instance_manager.h"
+#include "host/commands/cvd/selector/instance_database.h"
+#include "host/commands/cvd/server_command/host_tool_target_manager.h"
+
+namespace cuttlefish {
+namespace {
+
+using testing::ElementsAre;
+using testing::Optional;
+
+TEST(BatchFlagsTest, Defaults) {
+  auto flags = ParseBatchFlags({});
+
+  ASSERT_THAT(flags, IsOk());
+  EXPECT_EQ(flags->input, "-");
+  EXPECT_EQ(flags->jobs, 1);
+}
+
+TEST(BatchFlagsTest, InputAndJobs) {
+  auto flags = ParseBatchFlags({"--input=/tmp/commands", "--jobs=4"});
+
+  ASSERT_THAT(flags, IsOk());
+  EXPECT_EQ(flags->input, "/tmp/commands");
+  EXPECT_EQ(flags->jobs, 4);
+}
+
+TEST(BatchFlagsTest, RejectsJobsBelowOne) {
+  EXPECT_THAT(ParseBatchFlags({"--jobs=0"}), IsError());
+  EXPECT_THAT(ParseBatchFlags({"--jobs=-2"}), IsError());
+}
+
+TEST(BatchFlagsTest, RejectsNonNumericJobs) {
+  EXPECT_THAT(ParseBatchFlags({"--jobs=many"}), IsError());
+}
+
+TEST(BatchFlagsTest, RejectsLeftoverArguments) {
+  EXPECT_THAT(ParseBatchFlags({"--jobs=2", "status"}), IsError());
+}
+
+TEST(BatchCommandTest, FullCommand) {
+  auto command = ParseBatchCommand(
+      R"({"id": "s1", "args": ["--group_name=foo", "status"],)"
+      R"( "env": {"K": "V"}, "working_directory": "/work",)"
+      R"( "exclusive": true})",
+      3, {{"K", "batch"}, {"HOME", "/home"}}, "/batch");
+
+  ASSERT_THAT(command, IsOk());
+  EXPECT_EQ(command->id, Json::Value("s1"));
+  EXPECT_THAT(command->args, ElementsAre("--group_name=foo", "status"));
+  EXPECT_EQ(command->env.at("K"), "V");
+  EXPECT_EQ(command->env.at("HOME"), "/home");
+  EXPECT_EQ(command->working_directory, "/work");
+  EXPECT_TRUE(command->exclusive);
+}
+
+TEST(BatchCommandTest, DefaultsFromTheBatch) {
+  auto command = ParseBatchCommand(R"({"args": ["version"]})", 7,
+                                   {{"HOME", "/home"}}, "/batch");
+
+  ASSERT_THAT(command, IsOk());
+  EXPECT_EQ(command->id, Json::Value(Json::UInt64(7)));
+  EXPECT_EQ(command->env.at("HOME"), "/home");
+  EXPECT_EQ(command->working_directory, "/batch");
+  EXPECT_FALSE(command->exclusive);
+}
+
+TEST(BatchCommandTest, RejectsMalformedJson) {
+  EXPECT_THAT(ParseBatchCommand(R"({"args": ["status")", 0, {}, "/"),
+              IsError());
+  EXPECT_THAT(ParseBatchCommand("status", 0, {}, "/"), IsError());
+}
+
+TEST(BatchCommandTest, RejectsNonObjects) {
+  EXPECT_THAT(ParseBatchCommand(R"(["status"])", 0, {}, "/"), IsError());
+}
+
+TEST(BatchCommandTest, RejectsMissingOrEmptyArgs) {
+  EXPECT_THAT(ParseBatchCommand(R"({"id": "s1"})", 0, {}, "/"), IsError());
+  EXPECT_THAT(ParseBatchCommand(R"({"args": []})", 0, {}, "/"), IsError());
+  EXPECT_THAT(ParseBatchCommand(R"({"args": "status"})", 0, {}, "/"),
+              IsError());
+}
+
+TEST(BatchCommandTest, RejectsNonStringArgs) {
+  EXPECT_THAT(ParseBatchCommand(R"({"args": ["status", 1]})", 0, {}, "/"),
+              IsError());
+}
+
+TEST(BatchCommandTest, RejectsMalformedEnv) {
+  EXPECT_THAT(
+      ParseBatchCommand(R"({"args": ["status"], "env": []})", 0, {}, "/"),
+      IsError());
+  EXPECT_THAT(ParseBatchCommand(R"({"args": ["status"], "env": {"K": 1}})",
+                                0, {}, "/"),
+              IsError());
+}
+
+std::vector<std::optional<std::string>> ReadLines(LineReader& reader) {
+  std::vector<std::optional<std::string>> lines;
+  while (true) {
+    auto line = reader.Next();
+    EXPECT_THAT(line, IsOk());
+    if (!line.ok()) {
+      return lines;
+    }
+    lines.emplace_back(*line);
+    if (!lines.back()) {
+      return lines;
+    }
+  }
+}
+
+TEST(LineReaderTest, SplitsLines) {
+  LineReader reader(SharedFD::MemfdCreateWithData("input", "a\nbc\n"));
+
+  EXPECT_THAT(ReadLines(reader),
+              ElementsAre(Optional(std::string("a")),
+                          Optional(std::string("bc")), std::nullopt));
+}
+
+TEST(LineReaderTest, ReturnsPartialFinalLine) {
+  LineReader reader(SharedFD::MemfdCreateWithData("input", "a\nbc"));
+
+  EXPECT_THAT(ReadLines(reader),
+              ElementsAre(Optional(std::string("a")),
+                          Optional(std::string("bc")), std::nullopt));
+}
+
+TEST(LineReaderTest, ReturnsEmptyLines) {
+  LineReader reader(SharedFD::MemfdCreateWithData("input", "\na\n\n"));
+
+  EXPECT_THAT(ReadLines(reader),
+              ElementsAre(Optional(std::string("")),
+                          Optional(std::string("a")),
+                          Optional(std::string("")), std::nullopt));
+}
+
+TEST(LineReaderTest, EmptyInput) {
+  LineReader reader(SharedFD::MemfdCreateWithData("input", ""));
+
+  EXPECT_THAT(ReadLines(reader), ElementsAre(std::nullopt));
+}
+
+TEST(LineReaderTest, JoinsLinesSplitAcrossReads) {
+  SharedFD read_end;
+  SharedFD write_end;
+  ASSERT_TRUE(SharedFD::Pipe(&read_end, &write_end));
+  std::thread writer([write_end]() mutable {
+    WriteAll(write_end, std::string("{\"args\":"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    WriteAll(write_end, std::string(" [\"status\"]}\nver"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    WriteAll(write_end, std::string("sion"));
+    write_end->Close();
+  });
+  LineReader reader(read_end);
+
+  auto lines = ReadLines(reader);
+  writer.join();
+
+  EXPECT_THAT(lines,
+              ElementsAre(Optional(std::string("{\"args\": [\"status\"]}")),
+                          Optional(std::string("version")), std::nullopt));
+}
+
+/**
+ * Records the commands that run at the same time, each command taking long
+ * enough for the others to overlap with it if the runner allows them to.
+ */
+class ConcurrencyRecorder {
+ public:
+  BatchRunner::ExecutorFactory Factory() {
+    return [this]() -> BatchRunner::Executor {
+      return [this](const BatchCommand& command) {
+        const std::string id = command.id.asString();
+        {
+          std::lock_guard lock(mutex_);
+          running_.push_back(id);
+          max_running_ = std::max(max_running_, running_.size());
+          if (running_.size() > 1) {
+            overlapped_.insert(overlapped_.end(), running_.begin(),
+                               running_.end());
+          }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        {
+          std::lock_guard lock(mutex_);
+          running_.erase(std::find(running_.begin(), running_.end(), id));
+          finished_.push_back(id);
+        }
+        Json::Value response;
+        response["id"] = command.id;
+        response["status"] = command.args[0] == "fail" ? "INTERNAL" : "OK";
+        return response;
+      };
+    };
+  }
+
+  size_t MaxRunning() const { return max_running_; }
+  bool Overlapped(const std::string& id) const {
+    return std::find(overlapped_.begin(), overlapped_.end(), id) !=
+           overlapped_.end();
+  }
+  const std::vector<std::string>& Finished() const { return finished_; }
+
+ private:
+  std::mutex mutex_;
+  std::vector<std::string> running_;
+  size_t max_running_ = 0;
+  std::vector<std::string> overlapped_;
+  std::vector<std::string> finished_;
+};
+
+std::string Commands(const std::vector<std::string>& lines) {
+  return android::base::Join(lines, "\n") + "\n";
+}
+
+std::vector<Json::Value> Responses(SharedFD out) {
+  std::string output;
+  EXPECT_EQ(out->LSeek(0, SEEK_SET), 0);
+  EXPECT_GE(ReadAll(out, &output), 0);
+  std::vector<Json::Value> responses;
+  for (const auto& line : android::base::Split(output, "\n")) {
+    if (line.empty()) {
+      continue;
+    }
+    auto json = ParseJson(line);
+    EXPECT_THAT(json, IsOk());
+    if (json.ok()) {
+      responses.emplace_back(*json);
+    }
+  }
+  return responses;
+}
+
+TEST(BatchRunnerTest, JobsLimitsConcurrency) {
+  std::vector<std::string> lines;
+  for (int i = 0; i < 12; i++) {
+    lines.emplace_back(R"({"args": ["status"]})");
+  }
+  LineReader reader(SharedFD::MemfdCreateWithData("input", Commands(lines)));
+  SharedFD out = SharedFD::MemfdCreate("output");
+  ConcurrencyRecorder recorder;
+  BatchRunner runner(recorder.Factory(), out, 3);
+
+  auto response = runner.Run(reader, {}, "/");
+
+  ASSERT_THAT(response, IsOk());
+  EXPECT_EQ(response->status().code(), cvd::Status::OK);
+  EXPECT_EQ(recorder.Finished().size(), 12);
+  EXPECT_EQ(Responses(out).size(), 12);
+  EXPECT_LE(recorder.MaxRunning(), 3);
+  EXPECT_GT(recorder.MaxRunning(), 1);
+}
+
+TEST(BatchRunnerTest, SingleJobRunsInOrder) {
+  LineReader reader(SharedFD::MemfdCreateWithData(
+      "input", Commands({R"({"id": "a", "args": ["status"]})",
+                         R"({"id": "b", "args": ["status"]})",
+                         R"({"id": "c", "args": ["status"]})"})));
+  SharedFD out = SharedFD::MemfdCreate("output");
+  ConcurrencyRecorder recorder;
+  BatchRunner runner(recorder.Factory(), out, 1);
+
+  ASSERT_THAT(runner.Run(reader, {}, "/"), IsOk());
+  EXPECT_EQ(recorder.MaxRunning(), 1);
+  EXPECT_THAT(recorder.Finished(), ElementsAre("a", "b", "c"));
+}
+
+TEST(BatchRunnerTest, ExclusiveCommandRunsAlone) {
+  LineReader reader(SharedFD::MemfdCreateWithData(
+      "input", Commands({
+                   R"({"id": "a", "args": ["status"]})",
+                   R"({"id": "b", "args": ["status"]})",
+                   R"({"id": "x", "args": ["reset"], "exclusive": true})",
+                   R"({"id": "c", "args": ["status"]})",
+                   R"({"id": "d", "args": ["status"]})",
+               })));
+  SharedFD out = SharedFD::MemfdCreate("output");
+  ConcurrencyRecorder recorder;
+  BatchRunner runner(recorder.Factory(), out, 4);
+
+  ASSERT_THAT(runner.Run(reader, {}, "/"), IsOk());
+
+  EXPECT_FALSE(recorder.Overlapped("x"));
+  const auto& finished = recorder.Finished();
+  ASSERT_EQ(finished.size(), 5);
+  auto exclusive = std::find(finished.begin(), finished.end(), "x");
+  ASSERT_NE(exclusive, finished.end());
+  // Everything before it finished first, everything after it finished later.
+  EXPECT_THAT(std::vector<std::string>(finished.begin(), exclusive),
+              testing::UnorderedElementsAre("a", "b"));
+  EXPECT_THAT(std::vector<std::string>(exclusive + 1, finished.end()),
+              testing::UnorderedElementsAre("c", "d"));
+}
+
+TEST(BatchRunnerTest, ReportsInvalidAndFailedCommands) {
+  LineReader reader(SharedFD::MemfdCreateWithData(
+      "input", Commands({R"({"id": "a", "args": ["status"]})", "",
+                         R"({"args": "status"})",
+                         R"({"id": "f", "args": ["fail"]})"})));
+  SharedFD out = SharedFD::MemfdCreate("output");
+  ConcurrencyRecorder recorder;
+  BatchRunner runner(recorder.Factory(), out, 2);
+
+  auto response = runner.Run(reader, {}, "/");
+
+  ASSERT_THAT(response, IsOk());
+  EXPECT_EQ(response->status().code(), cvd::Status::INTERNAL);
+  EXPECT_EQ(response->status().message(), "2 of 3 commands failed");
+  auto responses = Responses(out);
+  ASSERT_EQ(responses.size(), 3);
+  auto invalid = std::find_if(
+      responses.begin(), responses.end(), [](const Json::Value& response) {
+        return android::base::StartsWith(response["message"].asString(),
+                                         "Invalid command");
+      });
+  ASSERT_NE(invalid, responses.end());
+  // Numbered by its place in the batch, not counting the empty line.
+  EXPECT_EQ((*invalid)["id"].asUInt64(), 1);
+  EXPECT_EQ((*invalid)["status"], "INTERNAL");
+}
+
+TEST(BatchRunnerTest, ResetAsksOnTheCommandStdio) {
+  TemporaryDir dir;
+  InstanceLockFileManager lock_file_manager;
+  auto host_tool_target_manager = NewHostToolTargetManager();
+  selector::InstanceDatabase instance_db(dir.path + std::string("/db"));
+  InstanceManager instance_manager(lock_file_manager,
+                                   *host_tool_target_manager, instance_db);
+  // Were reset to read its confirmation from the batch input, it would take
+  // the second line as the answer.
+  LineReader reader(SharedFD::MemfdCreateWithData(
+      "input", Commands({R"({"id": "reset", "args": ["reset"]})",
+                         R"({"id": "help", "args": ["reset", "--help"]})"})));
+  SharedFD out = SharedFD::MemfdCreate("output");
+  BatchRunner runner(RequestContextExecutors(lock_file_manager,
+                                             instance_manager,
+                                             *host_tool_target_manager),
+                     out, 1);
+
+  auto response = runner.Run(reader, {}, dir.path);
+
+  ASSERT_THAT(response, IsOk());
+  EXPECT_EQ(response->status().code(), cvd::Status::INTERNAL);
+  // Nothing but the response lines reached the batch output.
+  auto responses = Responses(out);
+  ASSERT_EQ(responses.size(), 2);
+  EXPECT_EQ(responses[0]["id"], "reset");
+  EXPECT_EQ(responses[0]["status"], "INTERNAL");
+  EXPECT_THAT(responses[0]["message"].asString(),
+              testing::HasSubstr("cvd reset -y"));
+  EXPECT_THAT(responses[0]["stdout"].asString(),
+              testing::HasSubstr("Are you sure"));
+  EXPECT_EQ(responses[1]["id"], "help");
+  EXPECT_EQ(responses[1]["status"], "OK");
+  EXPECT_THAT(responses[1]["stdout"].asString(),
+              testing::HasSubstr("usage: cvd reset"));
+}
+
+}  // namespace
+}  // namespace cuttlefish
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/epoll_loop.h"
+
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <set>
+
+#include <gtest/gtest.h>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+namespace {
+
+using std::chrono::milliseconds;
+
+struct Pipe {
+  Pipe() { SharedFD::Pipe(&read, &write); }
+  SharedFD read;
+  SharedFD write;
+};
+
+TEST(EpollPoolTest, HandlesReadyEventsInOneCall) {
+  EpollPool pool;
+  Pipe pipes[3];
+  std::set<int> handled;
+  for (int i = 0; i < 3; i++) {
+    auto callback = [&handled, i](EpollEvent) -> Result<void> {
+      handled.insert(i);
+      return {};
+    };
+    ASSERT_TRUE(pool.Register(pipes[i].read, EPOLLIN, callback).ok());
+    ASSERT_EQ(pipes[i].write->Write("x", 1), 1);
+  }
+
+  ASSERT_TRUE(pool.HandleEvent().ok());
+
+  ASSERT_EQ(handled, (std::set<int>{0, 1, 2}));
+}
+
+TEST(EpollPoolTest, RunsReadyCallbacksAfterFailedDelete) {
+  EpollPool pool;
+  Pipe failing;
+  Pipe other;
+  // Closing the fd makes removing it from the epoll set fail.
+  auto failing_callback = [](EpollEvent event) -> Result<void> {
+    event.fd->Close();
+    return CF_ERR("Callback failed");
+  };
+  bool other_called = false;
+  auto other_callback = [&other_called](EpollEvent) -> Result<void> {
+    other_called = true;
+    return {};
+  };
+  ASSERT_TRUE(
+      pool.RegisterPersistent(failing.read, EPOLLIN, failing_callback).ok());
+  ASSERT_TRUE(pool.Register(other.read, EPOLLIN, other_callback).ok());
+  // The ready list is in the order the fds became ready.
+  ASSERT_EQ(failing.write->Write("x", 1), 1);
+  ASSERT_EQ(other.write->Write("x", 1), 1);
+
+  auto result = pool.HandleEvent();
+
+  ASSERT_FALSE(result.ok());
+  EXPECT_NE(result.error().Message().find("Callback failed"),
+            std::string::npos);
+  ASSERT_TRUE(other_called);
+}
+
+TEST(EpollPoolTest, PersistentCallbackStaysRegistered) {
+  EpollPool pool;
+  Pipe pipe;
+  int calls = 0;
+  auto callback = [&calls](EpollEvent event) -> Result<void> {
+    char c;
+    CF_EXPECT_EQ(event.fd->Read(&c, 1), 1);
+    calls++;
+    return {};
+  };
+  ASSERT_TRUE(pool.RegisterPersistent(pipe.read, EPOLLIN, callback).ok());
+
+  for (int i = 0; i < 3; i++) {
+    ASSERT_EQ(pipe.write->Write("x", 1), 1);
+    ASSERT_TRUE(pool.HandleEvent().ok());
+  }
+
+  ASSERT_EQ(calls, 3);
+  ASSERT_TRUE(pool.Remove(pipe.read).ok());
+}
+
+TEST(EpollPoolTest, FailingPersistentCallbackIsRemoved) {
+  EpollPool pool;
+  Pipe pipe;
+  auto callback = [](EpollEvent) -> Result<void> { return CF_ERR("failed"); };
+  ASSERT_TRUE(pool.RegisterPersistent(pipe.read, EPOLLIN, callback).ok());
+  ASSERT_EQ(pipe.write->Write("x", 1), 1);
+
+  ASSERT_FALSE(pool.HandleEvent().ok());
+
+  ASSERT_FALSE(pool.Remove(pipe.read).ok());
+}
+
+TEST(EpollPoolTest, RepeatingTimer) {
+  EpollPool pool;
+  int calls = 0;
+  auto callback = [&calls](EpollEvent) -> Result<void> {
+    calls++;
+    return {};
+  };
+  auto timer = pool.AddTimer(milliseconds(1), /* repeating */ true, callback);
+  ASSERT_TRUE(timer.ok()) << timer.error().FormatForEnv();
+
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(pool.HandleEvent().ok());
+  }
+
+  ASSERT_EQ(calls, 3);
+  ASSERT_TRUE(pool.Remove(*timer).ok());
+}
+
+TEST(EpollPoolTest, WatchProcessExit) {
+  pid_t child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    _exit(0);
+  }
+  EpollPool pool;
+  bool exited = false;
+  auto callback = [&exited](EpollEvent) -> Result<void> {
+    exited = true;
+    return {};
+  };
+  auto pidfd = pool.WatchProcess(child, callback);
+  if (!pidfd.ok()) {
+    waitpid(child, nullptr, 0);
+    GTEST_SKIP() << "pidfds unsupported: " << pidfd.error().Message();
+  }
+
+  ASSERT_TRUE(pool.HandleEvent().ok());
+
+  ASSERT_TRUE(exited);
+  ASSERT_EQ(waitpid(child, nullptr, 0), child);
+}
+
+}  // namespace
+}  // namespace cuttlefish
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/reset_client_utils.h"
+
+#include <signal.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "common/libs/utils/result.h"
+#include "common/libs/utils/result_matchers.h"
+#include "common/libs/utils/subprocess.h"
+
+namespace cuttlefish {
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+Command Shell(const std::string& script) {
+  Command command("/bin/sh");
+  command.AddParameter("-c");
+  command.AddParameter(script);
+  return command;
+}
+
+// A shell that backgrounds a sleep, which stays in the shell's process group,
+// writes the sleep's pid to `pid_file` and waits for it.
+Command ShellWithGrandchild(const std::string& pid_file) {
+  return Shell("sleep 100 & echo $! > " + pid_file + "; wait");
+}
+
+pid_t ReadPidFile(const std::string& path) {
+  const auto deadline = steady_clock::now() + seconds(10);
+  while (steady_clock::now() < deadline) {
+    std::string content;
+    pid_t pid;
+    if (android::base::ReadFileToString(path, &content) &&
+        android::base::ParseInt(android::base::Trim(content), &pid)) {
+      return pid;
+    }
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  return -1;
+}
+
+// Killed processes nobody reaps yet count as gone too.
+bool IsRunning(pid_t pid) {
+  std::string stat;
+  if (!android::base::ReadFileToString("/proc/" + std::to_string(pid) + "/stat",
+                                       &stat)) {
+    return false;
+  }
+  auto state = stat.find(") ");
+  return state != std::string::npos && stat[state + 2] != 'Z';
+}
+
+bool WaitUntilGone(pid_t pid) {
+  const auto deadline = steady_clock::now() + seconds(10);
+  while (steady_clock::now() < deadline) {
+    if (!IsRunning(pid)) {
+      return true;
+    }
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  return false;
+}
+
+TEST(RunUntilTest, ReturnsExitCode) {
+  auto deadline = steady_clock::now() + seconds(30);
+
+  EXPECT_THAT(RunUntil(Shell("exit 0"), deadline), IsOkAndValue(0));
+  EXPECT_THAT(RunUntil(Shell("exit 3"), deadline), IsOkAndValue(3));
+}
+
+TEST(RunUntilTest, KillsProcessGroupAtDeadline) {
+  TemporaryDir dir;
+  const std::string child_pid_file = std::string(dir.path) + "/child";
+  const std::string grandchild_pid_file = std::string(dir.path) + "/grandchild";
+  auto command = Shell("echo $$ > " + child_pid_file +
+                       "; sleep 100 & echo $! > " + grandchild_pid_file +
+                       "; wait");
+
+  auto start = steady_clock::now();
+  auto result = RunUntil(std::move(command), start + milliseconds(500));
+
+  EXPECT_THAT(result, IsError());
+  EXPECT_LT(steady_clock::now() - start, seconds(10));
+  pid_t child = ReadPidFile(child_pid_file);
+  pid_t grandchild = ReadPidFile(grandchild_pid_file);
+  ASSERT_GT(child, 0);
+  ASSERT_GT(grandchild, 0);
+  EXPECT_TRUE(WaitUntilGone(child));
+  EXPECT_TRUE(WaitUntilGone(grandchild));
+}
+
+TEST(KillProcessTreeTest, KillsGroupOfLeader) {
+  TemporaryDir dir;
+  const std::string pid_file = std::string(dir.path) + "/grandchild";
+  auto subprocess =
+      ShellWithGrandchild(pid_file).Start(SubprocessOptions().InGroup(true));
+  ASSERT_TRUE(subprocess.Started());
+  pid_t grandchild = ReadPidFile(pid_file);
+  ASSERT_GT(grandchild, 0);
+
+  EXPECT_EQ(KillProcessTree(subprocess.pid()), 0);
+  subprocess.Wait();
+
+  EXPECT_TRUE(WaitUntilGone(grandchild));
+}
+
+TEST(KillProcessTreeTest, KillsOnlyNonLeader) {
+  TemporaryDir dir;
+  const std::string pid_file = std::string(dir.path) + "/grandchild";
+  // Shares the test's process group, which must survive.
+  auto subprocess = ShellWithGrandchild(pid_file).Start();
+  ASSERT_TRUE(subprocess.Started());
+  pid_t grandchild = ReadPidFile(pid_file);
+  ASSERT_GT(grandchild, 0);
+
+  EXPECT_EQ(KillProcessTree(subprocess.pid()), 0);
+  subprocess.Wait();
+
+  EXPECT_TRUE(WaitUntilGone(subprocess.pid()));
+  EXPECT_TRUE(IsRunning(grandchild));
+  kill(grandchild, SIGKILL);
+}
+
+}  // namespace
+}  // namespace cuttlefish
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/server_command/serial_launch.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result.h"
+#include "common/libs/utils/result_matchers.h"
+#include "cvd_server.pb.h"
+
+namespace cuttlefish {
+namespace {
+
+using std::chrono::milliseconds;
+using testing::ElementsAre;
+using testing::HasSubstr;
+using testing::Pair;
+using testing::UnorderedElementsAre;
+
+cvd::Request CvdRequest(const std::string& subcommand,
+                        const std::string& target) {
+  cvd::Request request;
+  auto& command_request = *request.mutable_command_request();
+  command_request.add_args("cvd");
+  command_request.add_args(subcommand);
+  command_request.add_args(target);
+  return request;
+}
+
+// Fetches `build` and launches the device called `name`.
+ConcurrentDevice Device(const std::string& build, const std::string& name) {
+  ConcurrentDevice device;
+  device.build = build;
+  device.fetch = CvdRequest("fetch", build);
+  device.launch = CvdRequest("start", name);
+  return device;
+}
+
+bool IsFetch(const cvd::Request& request) {
+  return request.command_request().args(1) == "fetch";
+}
+
+const std::string& Target(const cvd::Request& request) {
+  return request.command_request().args(2);
+}
+
+SharedFD DevNull() { return SharedFD::Open("/dev/null", O_WRONLY); }
+
+TEST(ConcurrentLauncherTest, FetchesEachBuildOnce) {
+  std::mutex mutex;
+  std::map<std::string, int> fetches;
+  std::vector<std::string> launches;
+  auto run = [&](const cvd::Request& request) -> Result<void> {
+    std::lock_guard lock(mutex);
+    if (IsFetch(request)) {
+      fetches[Target(request)]++;
+    } else {
+      launches.push_back(Target(request));
+    }
+    return {};
+  };
+  ConcurrentLauncher launcher(
+      {Device("a", "1"), Device("b", "2"), Device("a", "3"), Device("b", "4"),
+       Device("a", "5")},
+      run, DevNull(), 4);
+
+  EXPECT_THAT(launcher.Run(), IsOk());
+
+  EXPECT_THAT(fetches, UnorderedElementsAre(Pair("a", 1), Pair("b", 1)));
+  EXPECT_THAT(launches, UnorderedElementsAre("1", "2", "3", "4", "5"));
+}
+
+TEST(ConcurrentLauncherTest, LaunchesOthersAfterFirstDeviceIsUp) {
+  std::mutex mutex;
+  bool first_up = false;
+  std::vector<std::string> launched_too_early;
+  auto run = [&](const cvd::Request& request) -> Result<void> {
+    if (IsFetch(request)) {
+      return {};
+    }
+    if (Target(request) == "1") {
+      // Gives the other devices time to start too early.
+      std::this_thread::sleep_for(milliseconds(100));
+      std::lock_guard lock(mutex);
+      first_up = true;
+      return {};
+    }
+    std::lock_guard lock(mutex);
+    if (!first_up) {
+      launched_too_early.push_back(Target(request));
+    }
+    return {};
+  };
+  ConcurrentLauncher launcher(
+      {Device("a", "1"), Device("b", "2"), Device("a", "3"), Device("c", "4")},
+      run, DevNull(), 4);
+
+  EXPECT_THAT(launcher.Run(), IsOk());
+
+  EXPECT_THAT(launched_too_early, ElementsAre());
+}
+
+TEST(ConcurrentLauncherTest, StaysUnderMaxConcurrentLaunches) {
+  constexpr int kMaxLaunches = 2;
+  std::mutex mutex;
+  int running = 0;
+  int max_running = 0;
+  auto run = [&](const cvd::Request& request) -> Result<void> {
+    if (IsFetch(request)) {
+      return {};
+    }
+    {
+      std::lock_guard lock(mutex);
+      running++;
+      max_running = std::max(max_running, running);
+    }
+    std::this_thread::sleep_for(milliseconds(20));
+    std::lock_guard lock(mutex);
+    running--;
+    return {};
+  };
+  std::vector<ConcurrentDevice> devices;
+  for (int i = 0; i < 8; i++) {
+    devices.push_back(Device(i % 2 ? "a" : "b", std::to_string(i)));
+  }
+  ConcurrentLauncher launcher(std::move(devices), run, DevNull(),
+                              kMaxLaunches);
+
+  EXPECT_THAT(launcher.Run(), IsOk());
+
+  EXPECT_GE(max_running, 1);
+  EXPECT_LE(max_running, kMaxLaunches);
+}
+
+TEST(ConcurrentLauncherTest, FailedFetchFailsDevicesWithThatBuild) {
+  std::mutex mutex;
+  std::vector<std::string> launches;
+  auto run = [&](const cvd::Request& request) -> Result<void> {
+    if (IsFetch(request)) {
+      CF_EXPECT(Target(request) != "b", "fetch failed");
+      return {};
+    }
+    std::lock_guard lock(mutex);
+    launches.push_back(Target(request));
+    return {};
+  };
+  ConcurrentLauncher launcher(
+      {Device("a", "1"), Device("b", "2"), Device("a", "3"), Device("b", "4")},
+      run, DevNull(), 4);
+
+  auto result = launcher.Run();
+
+  ASSERT_THAT(result, IsError());
+  EXPECT_THAT(result.error().Message(),
+              HasSubstr("2 of 4 devices failed to launch"));
+  EXPECT_THAT(launches, UnorderedElementsAre("1", "3"));
+}
+
+}  // namespace
+}  // namespace cuttlefish
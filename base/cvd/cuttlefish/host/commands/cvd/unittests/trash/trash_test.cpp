@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/trash.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "common/libs/utils/files.h"
+#include "common/libs/utils/result_matchers.h"
+
+namespace cuttlefish {
+namespace {
+
+class TrashTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    options_.state_dir = dir_.path + std::string("/state");
+    ASSERT_EQ(mkdir(options_.state_dir.c_str(), 0700), 0);
+    // Stands in for cvd, leaving the trash for the tests to empty.
+    options_.reaper_executable = "/bin/true";
+    struct stat st {};
+    ASSERT_EQ(stat(dir_.path, &st), 0);
+    trash_ = options_.state_dir + "/trash/" + std::to_string(st.st_dev);
+  }
+
+  // A directory with a few files and a subdirectory.
+  std::string MakeDirectory(const std::string& name) {
+    const auto path = dir_.path + ("/" + name);
+    EXPECT_EQ(mkdir(path.c_str(), 0700), 0);
+    EXPECT_EQ(mkdir((path + "/subdir").c_str(), 0700), 0);
+    for (const auto& file : {"/a", "/b", "/subdir/c"}) {
+      EXPECT_TRUE(android::base::WriteStringToFile(name, path + file));
+    }
+    return path;
+  }
+
+  std::vector<std::string> Trashed() {
+    std::vector<std::string> trashed;
+    auto contents = DirectoryContents(trash_);
+    if (!contents.ok()) {
+      return trashed;
+    }
+    for (const auto& name : *contents) {
+      if (name != "." && name != "..") {
+        trashed.emplace_back(name);
+      }
+    }
+    return trashed;
+  }
+
+  TemporaryDir dir_;
+  TrashOptions options_;
+  std::string trash_;
+};
+
+TEST_F(TrashTest, MovesDirectoryIntoTrash) {
+  const auto path = MakeDirectory("instance");
+
+  ASSERT_THAT(RemoveDirectoryInBackground(path, options_), IsOk());
+
+  EXPECT_FALSE(FileExists(path, false));
+  // The path is free right away.
+  EXPECT_EQ(mkdir(path.c_str(), 0700), 0);
+  auto trashed = Trashed();
+  ASSERT_EQ(trashed.size(), 1);
+  EXPECT_TRUE(android::base::StartsWith(trashed[0], "instance."));
+  std::string contents;
+  ASSERT_TRUE(android::base::ReadFileToString(
+      trash_ + "/" + trashed[0] + "/subdir/c", &contents));
+  EXPECT_EQ(contents, "instance");
+}
+
+TEST_F(TrashTest, ReapsReaper) {
+  ASSERT_THAT(RemoveDirectoryInBackground(MakeDirectory("a"), options_),
+              IsOk());
+
+  // No child is left to become a zombie.
+  EXPECT_EQ(waitpid(-1, nullptr, WNOHANG), -1);
+  EXPECT_EQ(errno, ECHILD);
+}
+
+TEST_F(TrashTest, MovesDirectoryWhenReaperFails) {
+  options_.reaper_executable = "/bin/false";
+  const auto path = MakeDirectory("a");
+
+  // The next reaper picks it up.
+  ASSERT_THAT(RemoveDirectoryInBackground(path, options_), IsOk());
+
+  EXPECT_FALSE(FileExists(path, false));
+  EXPECT_EQ(Trashed().size(), 1);
+  EXPECT_EQ(waitpid(-1, nullptr, WNOHANG), -1);
+}
+
+TEST_F(TrashTest, RemovesInPlaceWhenTrashIsFull) {
+  for (size_t i = 0; i < kMaxPendingTrash; i++) {
+    ASSERT_THAT(RemoveDirectoryInBackground(
+                    MakeDirectory("dir" + std::to_string(i)), options_),
+                IsOk());
+  }
+  ASSERT_EQ(Trashed().size(), kMaxPendingTrash);
+  const auto path = MakeDirectory("last");
+
+  ASSERT_THAT(RemoveDirectoryInBackground(path, options_), IsOk());
+
+  EXPECT_FALSE(FileExists(path, false));
+  EXPECT_EQ(Trashed().size(), kMaxPendingTrash);
+}
+
+TEST_F(TrashTest, RemovesInPlaceWhenRenameFails) {
+  // A directory can't be moved into itself.
+  const auto path = MakeDirectory("parent");
+  options_.state_dir = path + "/state";
+  ASSERT_EQ(mkdir(options_.state_dir.c_str(), 0700), 0);
+
+  ASSERT_THAT(RemoveDirectoryInBackground(path, options_), IsOk());
+
+  EXPECT_FALSE(FileExists(path, false));
+}
+
+TEST_F(TrashTest, EmptiesTrashLeftByInterruptedRun) {
+  for (const auto& name : {"a", "b", "c"}) {
+    ASSERT_THAT(RemoveDirectoryInBackground(MakeDirectory(name), options_),
+                IsOk());
+  }
+  // Partly deleted already.
+  const auto partial = trash_ + "/" + Trashed()[0];
+  ASSERT_TRUE(RecursivelyRemoveDirectory(partial + "/subdir"));
+  // Left by a trash directory that was removed.
+  const auto dangling = options_.state_dir + "/trash/12345";
+  ASSERT_EQ(symlink("/nonexistent", dangling.c_str()), 0);
+
+  ASSERT_THAT(EmptyTrash(options_), IsOk());
+
+  EXPECT_TRUE(Trashed().empty());
+  EXPECT_TRUE(DirectoryExists(trash_, false));
+  EXPECT_FALSE(FileExists(dangling, false));
+}
+
+TEST_F(TrashTest, KeepsCallerPriority) {
+  ASSERT_THAT(RemoveDirectoryInBackground(MakeDirectory("a"), options_),
+              IsOk());
+  errno = 0;
+  const int priority = getpriority(PRIO_PROCESS, 0);
+  ASSERT_EQ(errno, 0);
+
+  ASSERT_THAT(EmptyTrash(options_), IsOk());
+
+  EXPECT_TRUE(Trashed().empty());
+  errno = 0;
+  EXPECT_EQ(getpriority(PRIO_PROCESS, 0), priority);
+  EXPECT_EQ(errno, 0);
+}
+
+TEST_F(TrashTest, LeavesTrashToReaperHoldingLock) {
+  ASSERT_THAT(RemoveDirectoryInBackground(MakeDirectory("a"), options_),
+              IsOk());
+  const auto lock_path = options_.state_dir + "/trash.lock";
+  android::base::unique_fd lock(
+      open(lock_path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600));
+  ASSERT_GE(lock.get(), 0);
+  ASSERT_EQ(flock(lock.get(), LOCK_EX), 0);
+
+  ASSERT_THAT(EmptyTrash(options_), IsOk());
+
+  EXPECT_EQ(Trashed().size(), 1);
+}
+
+TEST_F(TrashTest, StopsWhenStuck) {
+  if (geteuid() == 0) {
+    GTEST_SKIP() << "Permissions don't stop root from deleting";
+  }
+  const auto path = MakeDirectory("a");
+  ASSERT_THAT(RemoveDirectoryInBackground(MakeDirectory("b"), options_),
+              IsOk());
+  ASSERT_EQ(chmod((path + "/subdir").c_str(), 0500), 0);
+  ASSERT_THAT(RemoveDirectoryInBackground(path, options_), IsOk());
+  ASSERT_EQ(Trashed().size(), 2);
+
+  ASSERT_THAT(EmptyTrash(options_), IsOk());
+
+  // Only what couldn't be deleted is left.
+  auto trashed = Trashed();
+  ASSERT_EQ(trashed.size(), 1);
+  EXPECT_TRUE(android::base::StartsWith(trashed[0], "a."));
+  const auto stuck = trash_ + "/" + trashed[0] + "/subdir";
+  EXPECT_TRUE(FileExists(stuck + "/c", false));
+  EXPECT_FALSE(FileExists(trash_ + "/" + trashed[0] + "/a", false));
+  // For TemporaryDir to clean up.
+  chmod(stuck.c_str(), 0700);
+}
+
+}  // namespace
+}  // namespace cuttlefish
@@ -16,16 +16,30 @@
 
 #include "host/libs/config/fetcher_config.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <map>
+#include <memory>
+#include <optional>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <openssl/evp.h>
+
 #include "android-base/logging.h"
 #include "android-base/strings.h"
+#include "fmt/format.h"
 #include "gflags/gflags.h"
 #include "json/json.h"
 
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/contains.h"
 #include "common/libs/utils/files.h"
 #include "common/libs/utils/result.h"
 
@@ -38,6 +52,14 @@ const char* kCvdFiles = "cvd_files";
 const char* kCvdFileSource = "source";
 const char* kCvdFileBuildId = "build_id";
 const char* kCvdFileBuildTarget = "build_target";
+const char* kCvdFileFetchStep = "fetch_step";
+const char* kCvdFileSize = "size";
+const char* kCvdFileMtimeNs = "mtime_ns";
+const char* kCvdFileSha256 = "sha256";
+const char* kFetchSteps = "fetch_steps";
+const char* kFetchStepFiles = "files";
+
+constexpr size_t kHashBufferSize = 1 << 20;
 
 FileSource SourceStringToEnum(std::string source) {
   for (auto& c : source) {
@@ -94,6 +116,84 @@ std::string SourceEnumToString(const FileSource& source) {
   }
 }
 
+int64_t MtimeNs(const struct stat& st) {
+#ifdef __linux__
+  const auto& mtime = st.st_mtim;
+#elif defined(__APPLE__)
+  const auto& mtime = st.st_mtimespec;
+#else
+#error "Unsupported operating system"
+#endif
+  return static_cast<int64_t>(mtime.tv_sec) * 1000000000 + mtime.tv_nsec;
+}
+
+Result<std::string> Sha256File(const std::string& path) {
+  auto fd = SharedFD::Open(path, O_RDONLY);
+  CF_EXPECTF(fd->IsOpen(), "Failed to open \"{}\": {}", path, fd->StrError());
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> context(
+      EVP_MD_CTX_new(), EVP_MD_CTX_free);
+  CF_EXPECT(context != nullptr);
+  CF_EXPECT(EVP_DigestInit_ex(context.get(), EVP_sha256(), nullptr) == 1);
+  std::vector<char> buffer(kHashBufferSize);
+  ssize_t bytes_read;
+  while ((bytes_read = fd->Read(buffer.data(), buffer.size())) > 0) {
+    CF_EXPECT(EVP_DigestUpdate(context.get(), buffer.data(), bytes_read) == 1);
+  }
+  CF_EXPECTF(bytes_read == 0, "Failed to read \"{}\": {}", path,
+             fd->StrError());
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_size = 0;
+  CF_EXPECT(EVP_DigestFinal_ex(context.get(), digest, &digest_size) == 1);
+  std::string hex;
+  for (unsigned int i = 0; i < digest_size; i++) {
+    hex += fmt::format("{:02x}", digest[i]);
+  }
+  return hex;
+}
+
+Result<FileFingerprint> Fingerprint(const std::string& path) {
+  struct stat st;
+  CF_EXPECTF(stat(path.c_str(), &st) == 0, "stat(\"{}\") failed: {}", path,
+             strerror(errno));
+  FileFingerprint fingerprint;
+  fingerprint.size = st.st_size;
+  fingerprint.mtime_ns = MtimeNs(st);
+  fingerprint.sha256 = CF_EXPECT(Sha256File(path));
+  return fingerprint;
+}
+
+/**
+ * Returns the current fingerprint of `path` if its contents still match
+ * `recorded`. Only hashes the file again when the size matches but the
+ * modification time doesn't.
+ */
+Result<std::optional<FileFingerprint>> UnchangedFingerprint(
+    const std::string& path, const FileFingerprint& recorded) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || st.st_size != recorded.size) {
+    return std::nullopt;
+  }
+  if (MtimeNs(st) == recorded.mtime_ns) {
+    return recorded;
+  }
+  auto current = CF_EXPECT(Fingerprint(path));
+  if (current.sha256 != recorded.sha256) {
+    return std::nullopt;
+  }
+  return current;
+}
+
+void AddToFetchStep(Json::Value& dictionary, const std::string& fetch_step,
+                    const FileSource& purpose, const std::string& build_id,
+                    const std::string& build_target,
+                    const std::string& file_path) {
+  auto& step = dictionary[kFetchSteps][fetch_step];
+  step[kCvdFileSource] = SourceEnumToString(purpose);
+  step[kCvdFileBuildId] = build_id;
+  step[kCvdFileBuildTarget] = build_target;
+  step[kFetchStepFiles].append(file_path);
+}
+
 } // namespace
 
 CvdFile::CvdFile() {
@@ -193,6 +293,16 @@ CvdFile JsonToCvdFile(const std::string& file_path, const Json::Value& json) {
   if (json.isMember(kCvdFileBuildTarget)) {
     cvd_file.build_target = json[kCvdFileBuildTarget].asString();
   }
+  if (json.isMember(kCvdFileFetchStep)) {
+    cvd_file.fetch_step = json[kCvdFileFetchStep].asString();
+  }
+  if (json.isMember(kCvdFileSha256)) {
+    FileFingerprint fingerprint;
+    fingerprint.size = json[kCvdFileSize].asInt64();
+    fingerprint.mtime_ns = json[kCvdFileMtimeNs].asInt64();
+    fingerprint.sha256 = json[kCvdFileSha256].asString();
+    cvd_file.fingerprint = fingerprint;
+  }
   return cvd_file;
 }
 
@@ -201,6 +311,14 @@ Json::Value CvdFileToJson(const CvdFile& cvd_file) {
   json[kCvdFileSource] = SourceEnumToString(cvd_file.source);
   json[kCvdFileBuildId] = cvd_file.build_id;
   json[kCvdFileBuildTarget] = cvd_file.build_target;
+  if (!cvd_file.fetch_step.empty()) {
+    json[kCvdFileFetchStep] = cvd_file.fetch_step;
+  }
+  if (cvd_file.fingerprint) {
+    json[kCvdFileSize] = Json::Int64(cvd_file.fingerprint->size);
+    json[kCvdFileMtimeNs] = Json::Int64(cvd_file.fingerprint->mtime_ns);
+    json[kCvdFileSha256] = cvd_file.fingerprint->sha256;
+  }
   return json;
 }
 
@@ -248,7 +366,8 @@ std::string FetcherConfig::FindCvdFileWithSuffix(const std::string& suffix) cons
 Result<void> FetcherConfig::AddFilesToConfig(
     FileSource purpose, const std::string& build_id,
     const std::string& build_target, const std::vector<std::string>& paths,
-    const std::string& directory_prefix, bool override_entry) {
+    const std::string& directory_prefix, bool override_entry,
+    const std::string& fetch_step) {
   for (const std::string& path : paths) {
     std::string_view local_path(path);
     if (!android::base::ConsumePrefix(&local_path, directory_prefix)) {
@@ -260,10 +379,115 @@ Result<void> FetcherConfig::AddFilesToConfig(
     }
     // TODO(schuffelen): Do better for local builds here.
     CvdFile file(purpose, build_id, build_target, std::string(local_path));
+    file.fetch_step = fetch_step;
     CF_EXPECT(add_cvd_file(file, override_entry),
               "Duplicate file \""
                   << file << "\", Existing file: \"" << get_cvd_files()[path]
                   << "\". Failed to add path \"" << path << "\"");
+    if (!fetch_step.empty()) {
+      AddToFetchStep(*dictionary_, fetch_step, purpose, build_id, build_target,
+                     file.file_path);
+    }
+  }
+  return {};
+}
+
+Result<std::optional<std::vector<std::string>>> FetcherConfig::ReuseFetchStep(
+    const FetcherConfig& previous, const std::string& directory,
+    const std::string& fetch_step, FileSource purpose,
+    const std::string& build_id, const std::string& build_target,
+    const std::set<std::string>& planned_steps) {
+  const auto& steps = (*previous.dictionary_)[kFetchSteps];
+  if (!steps.isMember(fetch_step)) {
+    return std::nullopt;
+  }
+  const auto& step = steps[fetch_step];
+  if (SourceStringToEnum(step[kCvdFileSource].asString()) != purpose ||
+      step[kCvdFileBuildId].asString() != build_id ||
+      step[kCvdFileBuildTarget].asString() != build_target) {
+    return std::nullopt;
+  }
+  // LoadFromFile prefixes the paths with the directory of the config.
+  const std::string prefix = cpp_dirname(directory + "/.");
+  const auto previous_files = previous.get_cvd_files();
+  std::vector<CvdFile> reused;
+  for (const auto& file_json : step[kFetchStepFiles]) {
+    const std::string file_path = file_json.asString();
+    auto it = previous_files.find(
+        prefix == "." ? file_path : prefix + "/" + file_path);
+    if (it == previous_files.end()) {
+      return std::nullopt;
+    }
+    CvdFile file = it->second;
+    if (file.fetch_step != fetch_step) {
+      if (!Contains(planned_steps, file.fetch_step)) {
+        return std::nullopt;
+      }
+      continue;
+    }
+    if (file.source != purpose || file.build_id != build_id ||
+        file.build_target != build_target || !file.fingerprint) {
+      return std::nullopt;
+    }
+    const std::string full_path = directory + "/" + file_path;
+    file.fingerprint =
+        CF_EXPECT(UnchangedFingerprint(full_path, *file.fingerprint));
+    if (!file.fingerprint) {
+      LOG(INFO) << "\"" << full_path << "\" changed since the last fetch";
+      return std::nullopt;
+    }
+    file.file_path = file_path;
+    reused.emplace_back(std::move(file));
+  }
+
+  for (const auto& file_json : step[kFetchStepFiles]) {
+    AddToFetchStep(*dictionary_, fetch_step, purpose, build_id, build_target,
+                   file_json.asString());
+  }
+  std::vector<std::string> paths;
+  for (const auto& file : reused) {
+    add_cvd_file(file, /* override_entry */ true);
+    paths.emplace_back(directory + "/" + file.file_path);
+  }
+  return paths;
+}
+
+Result<void> FetcherConfig::FingerprintFiles(const std::string& directory) {
+  std::vector<CvdFile> files;
+  for (auto& [path, file] : get_cvd_files()) {
+    if (file.source != FileSource::GENERATED && !file.fingerprint) {
+      files.emplace_back(std::move(file));
+    }
+  }
+  // Hashing is bound by the disk for large images and by the CPU for small
+  // files, spread it over a few threads.
+  std::atomic<size_t> next = 0;
+  auto fingerprint_files = [&files, &next, &directory]() {
+    for (size_t i = next++; i < files.size(); i = next++) {
+      const std::string path = directory + "/" + files[i].file_path;
+      auto fingerprint = Fingerprint(path);
+      if (fingerprint.ok()) {
+        files[i].fingerprint = *fingerprint;
+      } else {
+        LOG(WARNING) << "Not fingerprinting \"" << path
+                     << "\": " << fingerprint.error().Message();
+      }
+    }
+  };
+  size_t thread_count = std::min<size_t>(
+      files.size(), std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; i++) {
+    threads.emplace_back(fingerprint_files);
+  }
+  fingerprint_files();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (const auto& file : files) {
+    if (file.fingerprint) {
+      add_cvd_file(file, /* override_entry */ true);
+    }
   }
   return {};
 }
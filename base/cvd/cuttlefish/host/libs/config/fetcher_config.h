@@ -15,10 +15,14 @@
  */
 #pragma once
 
+#include <cstdint>
 #include <map>
 #include <memory>
+#include <optional>
 #include <ostream>
+#include <set>
 #include <string>
+#include <vector>
 
 #include "common/libs/utils/result.h"
 
@@ -43,6 +47,13 @@ enum class FileSource {
   CHROME_OS_BUILD,
 };
 
+// Tells whether a file changed since it was fetched.
+struct FileFingerprint {
+  int64_t size = 0;
+  int64_t mtime_ns = 0;
+  std::string sha256;
+};
+
 /*
  * Attempts to answer the general question "where did this file come from, and
  * what purpose is it serving?
@@ -52,6 +63,10 @@ struct CvdFile {
   std::string build_id;
   std::string build_target;
   std::string file_path;
+  // The fetch_cvd step that produced the file, if it can be reused.
+  std::string fetch_step;
+  // Missing for generated files and in configs written by older fetches.
+  std::optional<FileFingerprint> fingerprint;
 
   CvdFile();
   CvdFile(const FileSource& source, const std::string& build_id,
@@ -90,11 +105,33 @@ class FetcherConfig {
 
   std::string FindCvdFileWithSuffix(const std::string& suffix) const;
 
+  // Files added with a `fetch_step` are recorded as the output of that step,
+  // see ReuseFetchStep.
   Result<void> AddFilesToConfig(FileSource purpose, const std::string& build_id,
                                 const std::string& build_target,
                                 const std::vector<std::string>& paths,
                                 const std::string& directory_prefix,
-                                bool override_entry = false);
+                                bool override_entry = false,
+                                const std::string& fetch_step = "");
+
+  /**
+   * Reuses the files that `fetch_step` added to `previous`, the config of the
+   * last fetch into `directory`, if that step fetched the same build and its
+   * files are unchanged. The files are added to this config and their paths
+   * are returned. Returns nothing when the step has to run again.
+   *
+   * Files of the step that another step overwrote are skipped, but only if
+   * that step is one of `planned_steps`, so that it writes them again.
+   */
+  Result<std::optional<std::vector<std::string>>> ReuseFetchStep(
+      const FetcherConfig& previous, const std::string& directory,
+      const std::string& fetch_step, FileSource purpose,
+      const std::string& build_id, const std::string& build_target,
+      const std::set<std::string>& planned_steps);
+
+  // Records the fingerprints of the files under `directory` that don't have
+  // one yet.
+  Result<void> FingerprintFiles(const std::string& directory);
 };
 
 } // namespace cuttlefish
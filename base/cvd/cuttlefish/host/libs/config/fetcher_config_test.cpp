@@ -0,0 +1,159 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "host/libs/config/fetcher_config.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "common/libs/utils/result_matchers.h"
+
+namespace cuttlefish {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Eq;
+using ::testing::Optional;
+
+constexpr char kImgStep[] = "img";
+constexpr char kBootStep[] = "boot";
+
+// Writes a config as a fetch of build 1 into the directory would: the img
+// step fetches system.img and boot.img, then the boot step overwrites boot.img
+// from build 2.
+class FetcherConfigReuseTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    dir_ = temp_dir_.path;
+    system_img_ = dir_ + "/system.img";
+    boot_img_ = dir_ + "/boot.img";
+    ASSERT_TRUE(android::base::WriteStringToFile("system", system_img_));
+    ASSERT_TRUE(android::base::WriteStringToFile("boot", boot_img_));
+
+    FetcherConfig config;
+    ASSERT_THAT(config.AddFilesToConfig(FileSource::DEFAULT_BUILD, "1",
+                                        "target", {system_img_, boot_img_},
+                                        dir_, false, kImgStep),
+                IsOk());
+    ASSERT_THAT(config.AddFilesToConfig(FileSource::BOOT_BUILD, "2", "target",
+                                        {boot_img_}, dir_, true, kBootStep),
+                IsOk());
+    ASSERT_THAT(config.FingerprintFiles(dir_), IsOk());
+    const std::string config_path = dir_ + "/fetcher_config.json";
+    ASSERT_TRUE(config.SaveToFile(config_path));
+    ASSERT_TRUE(previous_.LoadFromFile(config_path));
+  }
+
+  Result<std::optional<std::vector<std::string>>> ReuseImgStep(
+      const std::string& build_id, const std::set<std::string>& planned) {
+    return config_.ReuseFetchStep(previous_, dir_, kImgStep,
+                                  FileSource::DEFAULT_BUILD, build_id,
+                                  "target", planned);
+  }
+
+  // Sets a modification time that differs from the recorded one whatever the
+  // timestamp granularity of the file system.
+  void Touch(const std::string& path) {
+    struct timespec times[2] = {{0, UTIME_OMIT}, {1, 0}};
+    ASSERT_EQ(utimensat(AT_FDCWD, path.c_str(), times, 0), 0);
+  }
+
+  TemporaryDir temp_dir_;
+  std::string dir_;
+  std::string system_img_;
+  std::string boot_img_;
+  FetcherConfig previous_;
+  FetcherConfig config_;
+};
+
+TEST_F(FetcherConfigReuseTest, ReusesUnchangedFiles) {
+  auto reused = ReuseImgStep("1", {kImgStep, kBootStep});
+
+  // boot.img is left to the boot step, which writes it again.
+  EXPECT_THAT(reused, IsOkAndValue(Optional(ElementsAre(system_img_))));
+  auto files = config_.get_cvd_files();
+  ASSERT_EQ(files.count("system.img"), 1);
+  EXPECT_EQ(files["system.img"].build_id, "1");
+  EXPECT_EQ(files["system.img"].fetch_step, kImgStep);
+  EXPECT_TRUE(files["system.img"].fingerprint);
+}
+
+TEST_F(FetcherConfigReuseTest, ReusesFileWithSameContentsAndNewMtime) {
+  Touch(system_img_);
+
+  EXPECT_THAT(ReuseImgStep("1", {kImgStep, kBootStep}),
+              IsOkAndValue(Optional(ElementsAre(system_img_))));
+}
+
+TEST_F(FetcherConfigReuseTest, MissesOtherBuild) {
+  EXPECT_THAT(ReuseImgStep("3", {kImgStep, kBootStep}),
+              IsOkAndValue(Eq(std::nullopt)));
+}
+
+TEST_F(FetcherConfigReuseTest, MissesUnknownStep) {
+  auto reused = config_.ReuseFetchStep(previous_, dir_, "kernel",
+                                       FileSource::KERNEL_BUILD, "1", "target",
+                                       {kImgStep, kBootStep, "kernel"});
+
+  EXPECT_THAT(reused, IsOkAndValue(Eq(std::nullopt)));
+}
+
+TEST_F(FetcherConfigReuseTest, MissesChangedSize) {
+  ASSERT_TRUE(android::base::WriteStringToFile("system2", system_img_));
+
+  EXPECT_THAT(ReuseImgStep("1", {kImgStep, kBootStep}),
+              IsOkAndValue(Eq(std::nullopt)));
+}
+
+TEST_F(FetcherConfigReuseTest, MissesChangedContents) {
+  ASSERT_TRUE(android::base::WriteStringToFile("SYSTEM", system_img_));
+  Touch(system_img_);
+
+  EXPECT_THAT(ReuseImgStep("1", {kImgStep, kBootStep}),
+              IsOkAndValue(Eq(std::nullopt)));
+}
+
+TEST_F(FetcherConfigReuseTest, MissesMissingFile) {
+  ASSERT_EQ(unlink(system_img_.c_str()), 0);
+
+  EXPECT_THAT(ReuseImgStep("1", {kImgStep, kBootStep}),
+              IsOkAndValue(Eq(std::nullopt)));
+}
+
+TEST_F(FetcherConfigReuseTest, MissesFileOverwrittenByUnplannedStep) {
+  // Without the boot step, boot.img has to come from the img step again.
+  EXPECT_THAT(ReuseImgStep("1", {kImgStep}), IsOkAndValue(Eq(std::nullopt)));
+}
+
+TEST_F(FetcherConfigReuseTest, ReusesOverwritingStep) {
+  auto reused = config_.ReuseFetchStep(previous_, dir_, kBootStep,
+                                       FileSource::BOOT_BUILD, "2", "target",
+                                       {kBootStep});
+
+  EXPECT_THAT(reused, IsOkAndValue(Optional(ElementsAre(boot_img_))));
+}
+
+}  // namespace
+}  // namespace cuttlefish
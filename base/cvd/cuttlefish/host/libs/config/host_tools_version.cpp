@@ -15,69 +15,253 @@
 
 #include "host/libs/config/host_tools_version.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
-#include <fstream>
-#include <future>
+#include <atomic>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+#include <android-base/logging.h>
+#include <fmt/format.h>
+#include <json/json.h>
 #include <zlib.h>
 
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/fs/shared_fd.h"
 #include "common/libs/utils/files.h"
+#include "common/libs/utils/json.h"
+#include "common/libs/utils/result.h"
 #include "host/libs/config/config_utils.h"
 
 using std::uint32_t;
 
 namespace cuttlefish {
+namespace {
 
-uint32_t FileCrc(const std::string& path) {
+constexpr size_t kCrcBufferSize = 1 << 20;
+
+constexpr char kMemoDev[] = "dev";
+constexpr char kMemoInode[] = "inode";
+constexpr char kMemoSize[] = "size";
+constexpr char kMemoMtime[] = "mtime_ns";
+constexpr char kMemoCtime[] = "ctime_ns";
+constexpr char kMemoCrc[] = "crc";
+
+// Alongside the other per user cvd state, see PerUserDir().
+std::string CrcMemoPath() {
+  return fmt::format("/tmp/cvd/{}/host_tools_crc.json", getuid());
+}
+
+int64_t Nanoseconds(const struct timespec& time) {
+  return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+/**
+ * Identifies a version of a file without reading it. The change time is
+ * included because extracting an archive or `cp -p` restore the modification
+ * time of files with new contents.
+ */
+Json::Value Identity(const struct stat& st) {
+  Json::Value identity;
+  identity[kMemoDev] = Json::UInt64(st.st_dev);
+  identity[kMemoInode] = Json::UInt64(st.st_ino);
+  identity[kMemoSize] = Json::Int64(st.st_size);
+#ifdef __APPLE__
+  identity[kMemoMtime] = Json::Int64(Nanoseconds(st.st_mtimespec));
+  identity[kMemoCtime] = Json::Int64(Nanoseconds(st.st_ctimespec));
+#else
+  identity[kMemoMtime] = Json::Int64(Nanoseconds(st.st_mtim));
+  identity[kMemoCtime] = Json::Int64(Nanoseconds(st.st_ctim));
+#endif
+  return identity;
+}
+
+bool SameIdentity(const Json::Value& memo_entry, const Json::Value& identity) {
+  // Parsed numbers may have a different Json::ValueType than the ones built
+  // by Identity(), so compare them by value.
+  for (const char* key : {kMemoDev, kMemoInode}) {
+    if (!memo_entry[key].isUInt64() ||
+        memo_entry[key].asUInt64() != identity[key].asUInt64()) {
+      return false;
+    }
+  }
+  for (const char* key : {kMemoSize, kMemoMtime, kMemoCtime}) {
+    if (!memo_entry[key].isInt64() ||
+        memo_entry[key].asInt64() != identity[key].asInt64()) {
+      return false;
+    }
+  }
+  return memo_entry[kMemoCrc].isUInt();
+}
+
+std::optional<Json::Value> StatIdentity(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return std::nullopt;
+  }
+  return Identity(st);
+}
+
+// Returns the CRC along with the identity of the file it covers. The file is
+// identified before it's read, so a change while reading it can only cause
+// the CRC to be computed again the next time.
+std::pair<uint32_t, std::optional<Json::Value>> ComputeFileCrc(
+    const std::string& path) {
   uint32_t crc = crc32(0, (unsigned char*) path.c_str(), path.size());
-  std::ifstream file_stream(path, std::ifstream::binary);
-  std::vector<char> data(1024, 0);
-  while (file_stream) {
-    file_stream.read(data.data(), data.size());
-    crc = crc32(crc, (unsigned char*) data.data(), file_stream.gcount());
+  auto identity = StatIdentity(path);
+  auto fd = SharedFD::Open(path, O_RDONLY | O_CLOEXEC);
+  if (!fd->IsOpen()) {
+    return {crc, std::nullopt};
+  }
+  std::vector<char> data(kCrcBufferSize);
+  ssize_t bytes_read;
+  while ((bytes_read = fd->Read(data.data(), data.size())) > 0) {
+    crc = crc32(crc, (unsigned char*) data.data(), bytes_read);
+  }
+  if (bytes_read < 0) {
+    identity = std::nullopt;
+  }
+  return {crc, identity};
+}
+
+Json::Value LoadCrcMemo(const std::string& path) {
+  auto contents = ReadFileContents(path);
+  if (!contents.ok()) {
+    return Json::Value(Json::objectValue);
+  }
+  auto memo = ParseJson(*contents);
+  if (!memo.ok() || !memo->isObject()) {
+    return Json::Value(Json::objectValue);
   }
-  return crc;
+  return *memo;
 }
 
-static std::map<std::string, uint32_t> DirectoryCrc(const std::string& path) {
+Result<void> StoreCrcMemo(const std::string& path, const Json::Value& memo) {
+  CF_EXPECT(EnsureDirectoryExists(cpp_dirname(path), 0750));
+  // Concurrent writers each replace the whole file, the last one wins.
+  const auto temp_path = fmt::format("{}.{}", path, getpid());
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "";
+  const auto contents = Json::writeString(builder, memo);
+  auto fd = SharedFD::Open(temp_path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                           0640);
+  CF_EXPECTF(fd->IsOpen(), "Failed to open \"{}\": {}", temp_path,
+             fd->StrError());
+  if (WriteAll(fd, contents) != contents.size()) {
+    const auto error = fd->StrError();
+    unlink(temp_path.c_str());
+    return CF_ERRF("Failed to write \"{}\": {}", temp_path, error);
+  }
+  auto renamed = RenameFile(temp_path, path);
+  if (!renamed.ok()) {
+    unlink(temp_path.c_str());
+    CF_EXPECT(std::move(renamed));
+  }
+  return {};
+}
+
+std::vector<std::string> DirectoryFiles(const std::string& path) {
   auto full_path = DefaultHostArtifactsPath(path);
   if (!DirectoryExists(full_path)) {
     return {};
   }
   auto files_result = DirectoryContents(full_path);
   CHECK(files_result.ok()) << files_result.error().FormatForEnv();
-  std::vector<std::string> files = std::move(*files_result);
-  for (auto it = files.begin(); it != files.end();) {
-    if (*it == "." || *it == "..") {
-      it = files.erase(it);
+  std::vector<std::string> files;
+  for (const auto& file : *files_result) {
+    if (file != "." && file != "..") {
+      files.emplace_back(path + "/" + file);
+    }
+  }
+  return files;
+}
+
+}  // namespace
+
+std::vector<uint32_t> MemoizedFileCrcs(const std::vector<std::string>& paths,
+                                       const std::string& memo_path) {
+  Json::Value memo = LoadCrcMemo(memo_path);
+  std::vector<uint32_t> crcs(paths.size());
+  std::vector<std::optional<Json::Value>> identities(paths.size());
+  std::vector<size_t> misses;
+  for (size_t i = 0; i < paths.size(); i++) {
+    const auto& entry = std::as_const(memo)[paths[i]];
+    auto identity = StatIdentity(paths[i]);
+    if (identity && entry.isObject() && SameIdentity(entry, *identity)) {
+      crcs[i] = entry[kMemoCrc].asUInt();
     } else {
-      it++;
+      misses.emplace_back(i);
+    }
+  }
+  if (misses.empty()) {
+    return crcs;
+  }
+
+  std::atomic<size_t> next = 0;
+  auto compute_crcs = [&paths, &misses, &crcs, &identities, &next]() {
+    for (size_t i = next++; i < misses.size(); i = next++) {
+      std::tie(crcs[misses[i]], identities[misses[i]]) =
+          ComputeFileCrc(paths[misses[i]]);
+    }
+  };
+  size_t thread_count = std::min<size_t>(
+      misses.size(), std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; i++) {
+    threads.emplace_back(compute_crcs);
+  }
+  compute_crcs();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // Drop the entries of files that are gone or changed, so the memo doesn't
+  // grow with every host package ever used.
+  for (const auto& path : memo.getMemberNames()) {
+    auto identity = StatIdentity(path);
+    if (!identity || !SameIdentity(std::as_const(memo)[path], *identity)) {
+      memo.removeMember(path);
     }
   }
-  std::vector<std::future<uint32_t>> calculations;
-  calculations.reserve(files.size());
-  for (auto& file : files) {
-    file = path + "/" + file; // mutate in place in files vector
-    calculations.emplace_back(
-        std::async(FileCrc, DefaultHostArtifactsPath(file)));
+  for (auto i : misses) {
+    if (identities[i]) {
+      Json::Value entry = *identities[i];
+      entry[kMemoCrc] = crcs[i];
+      memo[paths[i]] = entry;
+    }
   }
-  std::map<std::string, uint32_t> crcs;
-  for (int i = 0; i < files.size(); i++) {
-    crcs[files[i]] = calculations[i].get();
+  auto stored = StoreCrcMemo(memo_path, memo);
+  if (!stored.ok()) {
+    LOG(DEBUG) << "Not memoizing host tool CRCs: "
+               << stored.error().FormatForEnv();
   }
   return crcs;
 }
 
+uint32_t FileCrc(const std::string& path) {
+  return MemoizedFileCrcs({path}, CrcMemoPath())[0];
+}
+
 std::map<std::string, uint32_t> HostToolsCrc() {
-  auto bin_future = std::async(DirectoryCrc, "bin");
-  auto lib_future = std::async(DirectoryCrc, "lib64");
-  std::map<std::string, uint32_t> all_crcs;
-  for (auto const& [file, crc] : bin_future.get()) {
-    all_crcs[file] = crc;
+  std::vector<std::string> files = DirectoryFiles("bin");
+  for (auto& file : DirectoryFiles("lib64")) {
+    files.emplace_back(std::move(file));
+  }
+  std::vector<std::string> paths;
+  paths.reserve(files.size());
+  for (const auto& file : files) {
+    paths.emplace_back(DefaultHostArtifactsPath(file));
   }
-  for (auto const& [file, crc] : lib_future.get()) {
-    all_crcs[file] = crc;
+  auto crcs = MemoizedFileCrcs(paths, CrcMemoPath());
+  std::map<std::string, uint32_t> all_crcs;
+  for (size_t i = 0; i < files.size(); i++) {
+    all_crcs[files[i]] = crcs[i];
   }
   return all_crcs;
 }
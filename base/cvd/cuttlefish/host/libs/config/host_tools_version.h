@@ -18,10 +18,20 @@
 #include <cstdint>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace cuttlefish {
 
 uint32_t FileCrc(const std::string& path);
 std::map<std::string, uint32_t> HostToolsCrc();
 
+/**
+ * Computes the CRCs of the files at `paths`. Files that didn't change since
+ * their CRC was last computed, according to the memo kept across runs in
+ * `memo_path`, are not read again. The rest are read in parallel by a bounded
+ * number of threads.
+ */
+std::vector<uint32_t> MemoizedFileCrcs(const std::vector<std::string>& paths,
+                                       const std::string& memo_path);
+
 } // namespace cuttlefish
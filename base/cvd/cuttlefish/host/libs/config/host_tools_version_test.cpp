@@ -0,0 +1,173 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "host/libs/config/host_tools_version.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <json/json.h>
+#include <zlib.h>
+
+#include "common/libs/utils/files.h"
+#include "common/libs/utils/json.h"
+
+namespace cuttlefish {
+namespace {
+
+// Not the CRC of any file in these tests.
+constexpr uint32_t kMadeUpCrc = 0x12345678;
+
+// What MemoizedFileCrcs computes when it reads the file.
+uint32_t ExpectedCrc(const std::string& path, const std::string& contents) {
+  uint32_t crc = crc32(0, (const unsigned char*)path.data(), path.size());
+  return crc32(crc, (const unsigned char*)contents.data(), contents.size());
+}
+
+class MemoizedFileCrcsTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    memo_path_ = dir_.path + std::string("/memo/crc.json");
+    file_ = dir_.path + std::string("/file");
+    ASSERT_TRUE(android::base::WriteStringToFile("contents", file_));
+  }
+
+  uint32_t Crc(const std::string& path) {
+    return MemoizedFileCrcs({path}, memo_path_)[0];
+  }
+
+  Json::Value Memo() {
+    std::string contents;
+    EXPECT_TRUE(android::base::ReadFileToString(memo_path_, &contents));
+    auto memo = ParseJson(contents);
+    EXPECT_TRUE(memo.ok());
+    return memo.ok() ? *memo : Json::Value();
+  }
+
+  void SetMemo(const Json::Value& memo) {
+    ASSERT_TRUE(android::base::WriteStringToFile(
+        Json::writeString(Json::StreamWriterBuilder(), memo), memo_path_));
+  }
+
+  // Memoizes `file_` with a made up CRC, so that getting it back shows the
+  // file wasn't read.
+  void MemoizeMadeUpCrc() {
+    ASSERT_EQ(Crc(file_), ExpectedCrc(file_, "contents"));
+    auto memo = Memo();
+    memo[file_]["crc"] = kMadeUpCrc;
+    SetMemo(memo);
+  }
+
+  TemporaryDir dir_;
+  std::string memo_path_;
+  std::string file_;
+};
+
+TEST_F(MemoizedFileCrcsTest, ComputesCrcs) {
+  const auto other = dir_.path + std::string("/other");
+  ASSERT_TRUE(android::base::WriteStringToFile("other contents", other));
+  const auto missing = dir_.path + std::string("/missing");
+
+  auto crcs = MemoizedFileCrcs({file_, other, missing}, memo_path_);
+
+  std::vector<uint32_t> expected{ExpectedCrc(file_, "contents"),
+                                 ExpectedCrc(other, "other contents"),
+                                 ExpectedCrc(missing, "")};
+  EXPECT_EQ(crcs, expected);
+  EXPECT_TRUE(Memo().isMember(file_));
+  EXPECT_FALSE(Memo().isMember(missing));
+}
+
+TEST_F(MemoizedFileCrcsTest, UsesMemoWithoutReadingFile) {
+  MemoizeMadeUpCrc();
+
+  EXPECT_EQ(Crc(file_), kMadeUpCrc);
+}
+
+TEST_F(MemoizedFileCrcsTest, RereadsWhenIdentityChanges) {
+  for (const char* key : {"size", "mtime_ns", "ctime_ns"}) {
+    SCOPED_TRACE(key);
+    MemoizeMadeUpCrc();
+    auto memo = Memo();
+    memo[file_][key] = memo[file_][key].asInt64() + 1;
+    SetMemo(memo);
+
+    EXPECT_EQ(Crc(file_), ExpectedCrc(file_, "contents"));
+  }
+}
+
+TEST_F(MemoizedFileCrcsTest, RereadsWhenContentsChangeWithMtimeRestored) {
+  ASSERT_EQ(Crc(file_), ExpectedCrc(file_, "contents"));
+  struct stat st {};
+  ASSERT_EQ(stat(file_.c_str(), &st), 0);
+
+  // Same size, and the modification time put back like `cp -p` does.
+  ASSERT_TRUE(android::base::WriteStringToFile("CONTENTS", file_));
+  struct timespec times[2] = {st.st_atim, st.st_mtim};
+  ASSERT_EQ(utimensat(AT_FDCWD, file_.c_str(), times, 0), 0);
+
+  EXPECT_EQ(Crc(file_), ExpectedCrc(file_, "CONTENTS"));
+}
+
+TEST_F(MemoizedFileCrcsTest, PrunesEntriesOfRemovedFiles) {
+  const auto removed = dir_.path + std::string("/removed");
+  ASSERT_TRUE(android::base::WriteStringToFile("removed", removed));
+  ASSERT_EQ(MemoizedFileCrcs({removed, file_}, memo_path_).size(), 2);
+  ASSERT_TRUE(Memo().isMember(removed));
+  ASSERT_EQ(unlink(removed.c_str()), 0);
+  const auto other = dir_.path + std::string("/other");
+  ASSERT_TRUE(android::base::WriteStringToFile("other", other));
+
+  ASSERT_EQ(Crc(other), ExpectedCrc(other, "other"));
+
+  auto memo = Memo();
+  EXPECT_FALSE(memo.isMember(removed));
+  EXPECT_TRUE(memo.isMember(file_));
+  EXPECT_TRUE(memo.isMember(other));
+}
+
+TEST_F(MemoizedFileCrcsTest, FallsBackToReadingOnCorruptMemo) {
+  MemoizeMadeUpCrc();
+  for (const std::string contents : {"{\"truncated", "[]", ""}) {
+    SCOPED_TRACE(contents);
+    ASSERT_TRUE(android::base::WriteStringToFile(contents, memo_path_));
+
+    EXPECT_EQ(Crc(file_), ExpectedCrc(file_, "contents"));
+    // And writes a good memo again.
+    EXPECT_TRUE(Memo().isMember(file_));
+  }
+}
+
+TEST_F(MemoizedFileCrcsTest, RemovesTemporaryFileWhenStoreFails) {
+  // A directory can't be replaced by a file.
+  ASSERT_TRUE(EnsureDirectoryExists(memo_path_ + "/dir").ok());
+
+  EXPECT_EQ(Crc(file_), ExpectedCrc(file_, "contents"));
+
+  auto contents = DirectoryContents(dir_.path + std::string("/memo"));
+  ASSERT_TRUE(contents.ok());
+  for (const auto& name : *contents) {
+    EXPECT_TRUE(name == "." || name == ".." || name == "crc.json") << name;
+  }
+}
+
+}  // namespace
+}  // namespace cuttlefish
@@ -26,6 +26,7 @@
 #include "common/libs/fs/shared_fd.h"
 #include "common/libs/fs/shared_select.h"
 #include "common/libs/utils/subprocess.h"
+#include "common/libs/utils/trace.h"
 #include "host/libs/config/cuttlefish_config.h"
 
 
@@ -82,6 +83,7 @@ bool ConvertToRawImage(const std::string& image_path) {
     return false;
   }
 
+  TraceSpan trace("simg2img", image_path);
   auto simg2img_path = HostBinaryPath("simg2img");
   Command simg2img_cmd(simg2img_path);
   std::string tmp_raw_image_path = image_path + ".raw";
@@ -0,0 +1,536 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/libs/image_aggregator/super_image_builder.h"
+
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <sparse/sparse.h>
+
+#include "common/libs/utils/contains.h"
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+namespace {
+
+// On-disk format from system/core/fs_mgr/liblp/include/liblp/metadata_format.h
+constexpr uint32_t kLpGeometryMagic = 0x616c4467;
+constexpr uint32_t kLpHeaderMagic = 0x414C5030;
+constexpr uint16_t kLpMajorVersion = 10;
+constexpr uint16_t kLpMinorVersionMin = 0;
+constexpr uint16_t kLpMinorVersionVirtualAb = 2;
+constexpr uint32_t kLpSectorSize = 512;
+constexpr uint64_t kLpPartitionReservedBytes = 4096;
+constexpr uint64_t kLpGeometrySize = 4096;
+constexpr uint32_t kLpLogicalBlockSize = 4096;
+constexpr uint32_t kLpPartitionAlignment = 1024 * 1024;
+constexpr uint32_t kLpPartitionAttrReadonly = 1 << 0;
+constexpr uint32_t kLpTargetTypeLinear = 0;
+constexpr uint32_t kLpHeaderFlagVirtualAbDevice = 1 << 0;
+constexpr size_t kLpNameLength = 36;
+
+constexpr uint32_t kSparseHeaderMagic = 0xed26ff3a;
+
+struct __attribute__((packed)) LpMetadataGeometry {
+  uint32_t magic;
+  uint32_t struct_size;
+  uint8_t checksum[32];
+  uint32_t metadata_max_size;
+  uint32_t metadata_slot_count;
+  uint32_t logical_block_size;
+};
+
+struct __attribute__((packed)) LpMetadataTableDescriptor {
+  uint32_t offset;
+  uint32_t num_entries;
+  uint32_t entry_size;
+};
+
+struct __attribute__((packed)) LpMetadataHeader {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  uint32_t header_size;
+  uint8_t header_checksum[32];
+  uint32_t tables_size;
+  uint8_t tables_checksum[32];
+  LpMetadataTableDescriptor partitions;
+  LpMetadataTableDescriptor extents;
+  LpMetadataTableDescriptor groups;
+  LpMetadataTableDescriptor block_devices;
+  // Fields below only exist in minor version 2 and later.
+  uint32_t flags;
+  uint8_t reserved[124];
+};
+constexpr uint32_t kLpHeaderV1_0Size =
+    offsetof(LpMetadataHeader, block_devices) +
+    sizeof(LpMetadataTableDescriptor);
+
+struct __attribute__((packed)) LpMetadataPartition {
+  char name[kLpNameLength];
+  uint32_t attributes;
+  uint32_t first_extent_index;
+  uint32_t num_extents;
+  uint32_t group_index;
+};
+
+struct __attribute__((packed)) LpMetadataExtent {
+  uint64_t num_sectors;
+  uint32_t target_type;
+  uint64_t target_data;
+  uint32_t target_source;
+};
+
+struct __attribute__((packed)) LpMetadataPartitionGroup {
+  char name[kLpNameLength];
+  uint32_t flags;
+  uint64_t maximum_size;
+};
+
+struct __attribute__((packed)) LpMetadataBlockDevice {
+  uint64_t first_logical_sector;
+  uint32_t alignment;
+  uint32_t alignment_offset;
+  uint64_t size;
+  char partition_name[kLpNameLength];
+  uint32_t flags;
+};
+
+struct __attribute__((packed)) SparseHeader {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  uint16_t file_hdr_sz;
+  uint16_t chunk_hdr_sz;
+  uint32_t blk_sz;
+  uint32_t total_blks;
+  uint32_t total_chunks;
+  uint32_t image_checksum;
+};
+
+uint64_t AlignTo(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+template <typename T>
+void AppendStruct(std::string& out, const T& value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+Result<void> CopyName(char (&dest)[kLpNameLength], const std::string& name) {
+  CF_EXPECT(name.size() < kLpNameLength, "Name too long: \"" << name << "\"");
+  memset(dest, 0, kLpNameLength);
+  memcpy(dest, name.data(), name.size());
+  return {};
+}
+
+Result<void> PWriteAll(int fd, const void* data, size_t size, off_t offset) {
+  auto buf = reinterpret_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t written = TEMP_FAILURE_RETRY(pwrite(fd, buf, size, offset));
+    CF_EXPECTF(written > 0, "pwrite failed: {}", strerror(errno));
+    buf += written;
+    size -= written;
+    offset += written;
+  }
+  return {};
+}
+
+/* Size of the partition contents, which for sparse images is the size after
+ * expanding them. */
+Result<uint64_t> ImageContentSize(int fd, const std::string& path) {
+  SparseHeader header;
+  ssize_t bytes = TEMP_FAILURE_RETRY(pread(fd, &header, sizeof(header), 0));
+  CF_EXPECTF(bytes >= 0, "Failed to read \"{}\": {}", path, strerror(errno));
+  if (bytes == sizeof(header) && header.magic == kSparseHeaderMagic) {
+    return static_cast<uint64_t>(header.total_blks) * header.blk_sz;
+  }
+  off_t size = lseek(fd, 0, SEEK_END);
+  CF_EXPECTF(size >= 0, "Failed to seek \"{}\": {}", path, strerror(errno));
+  return size;
+}
+
+Result<bool> IsSparse(int fd) {
+  uint32_t magic = 0;
+  ssize_t bytes = TEMP_FAILURE_RETRY(pread(fd, &magic, sizeof(magic), 0));
+  CF_EXPECTF(bytes >= 0, "pread failed: {}", strerror(errno));
+  return bytes == sizeof(magic) && magic == kSparseHeaderMagic;
+}
+
+Result<void> CopyRangeWithReadWrite(int in_fd, off_t in_offset, int out_fd,
+                                    off_t out_offset, uint64_t length) {
+  std::vector<char> buffer(1 << 20);
+  while (length > 0) {
+    size_t chunk = std::min<uint64_t>(buffer.size(), length);
+    ssize_t bytes =
+        TEMP_FAILURE_RETRY(pread(in_fd, buffer.data(), chunk, in_offset));
+    CF_EXPECTF(bytes > 0, "pread failed: {}", strerror(errno));
+    CF_EXPECT(PWriteAll(out_fd, buffer.data(), bytes, out_offset));
+    in_offset += bytes;
+    out_offset += bytes;
+    length -= bytes;
+  }
+  return {};
+}
+
+/* Copies [in_offset, in_offset + length) to out_offset, letting the kernel
+ * share extents between the files when the filesystem supports reflinks. */
+Result<void> CopyRange(int in_fd, off_t in_offset, int out_fd, off_t out_offset,
+                       uint64_t length) {
+  while (length > 0) {
+    ssize_t bytes = copy_file_range(in_fd, &in_offset, out_fd, &out_offset,
+                                    length, 0);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                      errno == EOPNOTSUPP)) {
+      CF_EXPECT(CopyRangeWithReadWrite(in_fd, in_offset, out_fd, out_offset,
+                                       length));
+      return {};
+    }
+    CF_EXPECTF(bytes > 0, "copy_file_range failed: {}", strerror(errno));
+    length -= bytes;
+  }
+  return {};
+}
+
+/* Copies only the data regions of a raw image, leaving holes unallocated. */
+Result<void> PlaceRawImage(int in_fd, uint64_t size, int out_fd,
+                           off_t out_offset) {
+  off_t offset = 0;
+  while (static_cast<uint64_t>(offset) < size) {
+    off_t data = lseek(in_fd, offset, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+      break;  // only a hole remains
+    }
+    CF_EXPECTF(data >= 0, "lseek(SEEK_DATA) failed: {}", strerror(errno));
+    off_t hole = lseek(in_fd, data, SEEK_HOLE);
+    CF_EXPECTF(hole >= 0, "lseek(SEEK_HOLE) failed: {}", strerror(errno));
+    CF_EXPECT(CopyRange(in_fd, data, out_fd, out_offset + data, hole - data));
+    offset = hole;
+  }
+  return {};
+}
+
+struct SparseWriteContext {
+  int out_fd;
+  off_t offset;
+  Result<void> result;
+};
+
+int SparseWriteCallback(void* priv, const void* data, size_t len) {
+  auto context = reinterpret_cast<SparseWriteContext*>(priv);
+  // The output was created with ftruncate, so skipped regions and zero fills
+  // are already holes reading back as zeros.
+  auto bytes = reinterpret_cast<const char*>(data);
+  if (data && std::any_of(bytes, bytes + len, [](char c) { return c != 0; })) {
+    context->result = PWriteAll(context->out_fd, data, len, context->offset);
+    if (!context->result.ok()) {
+      return -1;
+    }
+  }
+  context->offset += len;
+  return 0;
+}
+
+Result<void> PlaceSparseImage(int in_fd, int out_fd, off_t out_offset) {
+  std::unique_ptr<sparse_file, decltype(&sparse_file_destroy)> sparse(
+      sparse_file_import(in_fd, false, false), sparse_file_destroy);
+  CF_EXPECT(sparse.get() != nullptr, "Failed to parse sparse image");
+  SparseWriteContext context{out_fd, out_offset, {}};
+  int ret = sparse_file_callback(sparse.get(), false, false,
+                                 SparseWriteCallback, &context);
+  CF_EXPECT(std::move(context.result));
+  CF_EXPECT_EQ(ret, 0, "Failed to expand sparse image");
+  return {};
+}
+
+Result<std::string> SerializeMetadata(
+    const SuperImageLayout& layout, uint64_t first_logical_sector,
+    const std::vector<LpMetadataPartition>& partitions,
+    const std::vector<LpMetadataExtent>& extents,
+    const std::vector<LpMetadataPartitionGroup>& groups) {
+  LpMetadataBlockDevice block_device{};
+  block_device.first_logical_sector = first_logical_sector;
+  block_device.alignment = kLpPartitionAlignment;
+  block_device.alignment_offset = 0;
+  block_device.size = layout.device_size;
+  CF_EXPECT(CopyName(block_device.partition_name, layout.super_name));
+
+  std::string tables;
+  for (const auto& partition : partitions) {
+    AppendStruct(tables, partition);
+  }
+  for (const auto& extent : extents) {
+    AppendStruct(tables, extent);
+  }
+  for (const auto& group : groups) {
+    AppendStruct(tables, group);
+  }
+  AppendStruct(tables, block_device);
+
+  LpMetadataHeader header{};
+  header.magic = kLpHeaderMagic;
+  header.major_version = kLpMajorVersion;
+  header.minor_version =
+      layout.virtual_ab ? kLpMinorVersionVirtualAb : kLpMinorVersionMin;
+  header.header_size =
+      layout.virtual_ab ? sizeof(LpMetadataHeader) : kLpHeaderV1_0Size;
+  header.tables_size = tables.size();
+  uint32_t offset = 0;
+  header.partitions = {offset, static_cast<uint32_t>(partitions.size()),
+                       sizeof(LpMetadataPartition)};
+  offset += partitions.size() * sizeof(LpMetadataPartition);
+  header.extents = {offset, static_cast<uint32_t>(extents.size()),
+                    sizeof(LpMetadataExtent)};
+  offset += extents.size() * sizeof(LpMetadataExtent);
+  header.groups = {offset, static_cast<uint32_t>(groups.size()),
+                   sizeof(LpMetadataPartitionGroup)};
+  offset += groups.size() * sizeof(LpMetadataPartitionGroup);
+  header.block_devices = {offset, 1, sizeof(LpMetadataBlockDevice)};
+  header.flags = layout.virtual_ab ? kLpHeaderFlagVirtualAbDevice : 0;
+  SHA256(reinterpret_cast<const uint8_t*>(tables.data()), tables.size(),
+         header.tables_checksum);
+  SHA256(reinterpret_cast<const uint8_t*>(&header), header.header_size,
+         header.header_checksum);
+
+  std::string metadata(reinterpret_cast<const char*>(&header),
+                       header.header_size);
+  metadata += tables;
+  CF_EXPECTF(metadata.size() <= layout.metadata_max_size,
+             "Metadata is {} bytes, larger than the maximum of {}",
+             metadata.size(), layout.metadata_max_size);
+  return metadata;
+}
+
+}  // namespace
+
+Result<SuperImageLayout> SuperImageLayoutFromMiscInfo(
+    const std::string& misc_info_path,
+    const std::function<Result<std::string>(const std::string&)>& get_image) {
+  std::map<std::string, std::string> info;
+  std::ifstream input_fs(misc_info_path);
+  CF_EXPECT(input_fs.is_open(), "Failed to open file: " << misc_info_path);
+  std::string line;
+  while (getline(input_fs, line)) {
+    auto separator = line.find('=');
+    if (separator != std::string::npos) {
+      info[line.substr(0, separator)] = line.substr(separator + 1);
+    }
+  }
+  auto get = [&info](const std::string& key) -> std::string {
+    auto it = info.find(key);
+    return it == info.end() ? "" : android::base::Trim(it->second);
+  };
+  auto get_size = [&get](const std::string& key) -> Result<uint64_t> {
+    uint64_t value;
+    CF_EXPECTF(android::base::ParseUint(get(key), &value),
+               "Invalid or missing \"{}\" in misc_info", key);
+    return value;
+  };
+
+  CF_EXPECT(get("dynamic_partition_retrofit") != "true",
+            "Retrofit dynamic partitions are not supported");
+  auto block_devices = android::base::Tokenize(get("super_block_devices"), " ");
+  CF_EXPECT_EQ(block_devices.size(), 1u,
+               "Only a single super block device is supported");
+
+  SuperImageLayout layout;
+  if (!get("super_metadata_device").empty()) {
+    layout.super_name = get("super_metadata_device");
+  }
+  layout.device_size = CF_EXPECT(
+      get_size("super_" + block_devices[0] + "_device_size"));
+  const bool ab_update = get("ab_update") == "true";
+  layout.metadata_slot_count = ab_update ? 3 : 2;
+  layout.virtual_ab = get("virtual_ab") == "true" &&
+                      get("virtual_ab_retrofit") != "true";
+
+  for (const auto& group :
+       android::base::Tokenize(get("super_partition_groups"), " ")) {
+    uint64_t group_size = CF_EXPECT(get_size("super_" + group + "_group_size"));
+    auto partition_names = android::base::Tokenize(
+        get("super_" + group + "_partition_list"), " ");
+    if (!ab_update) {
+      layout.groups.push_back({group, group_size});
+      for (const auto& name : partition_names) {
+        layout.partitions.push_back({name, group, CF_EXPECT(get_image(name))});
+      }
+      continue;
+    }
+    // Like build_super_image, only the _a slot is populated. The image is
+    // meant for initializing a device, which boots from slot _a.
+    layout.groups.push_back({group + "_a", group_size});
+    layout.groups.push_back({group + "_b", group_size});
+    for (const auto& name : partition_names) {
+      layout.partitions.push_back(
+          {name + "_a", group + "_a", CF_EXPECT(get_image(name))});
+    }
+    for (const auto& name : partition_names) {
+      layout.partitions.push_back({name + "_b", group + "_b", ""});
+    }
+  }
+  return layout;
+}
+
+Result<void> BuildSuperImage(const SuperImageLayout& layout,
+                             const std::string& output_path) {
+  const uint64_t metadata_end =
+      kLpPartitionReservedBytes + kLpGeometrySize * 2 +
+      static_cast<uint64_t>(layout.metadata_max_size) *
+          layout.metadata_slot_count * 2;
+  const uint64_t first_logical_sector =
+      AlignTo(metadata_end, kLpPartitionAlignment) / kLpSectorSize;
+
+  std::vector<LpMetadataPartitionGroup> groups;
+  std::map<std::string, uint32_t> group_indices;
+  std::vector<uint64_t> group_usage;
+  // liblp always has the unlimited "default" group at index 0.
+  LpMetadataPartitionGroup default_group{};
+  CF_EXPECT(CopyName(default_group.name, "default"));
+  group_indices["default"] = groups.size();
+  groups.push_back(default_group);
+  group_usage.push_back(0);
+  for (const auto& group : layout.groups) {
+    CF_EXPECT(!Contains(group_indices, group.name),
+              "Duplicate group \"" << group.name << "\"");
+    LpMetadataPartitionGroup entry{};
+    CF_EXPECT(CopyName(entry.name, group.name));
+    entry.maximum_size = group.maximum_size;
+    group_indices[group.name] = groups.size();
+    groups.push_back(entry);
+    group_usage.push_back(0);
+  }
+
+  struct Placement {
+    android::base::unique_fd fd;
+    uint64_t offset;
+    uint64_t size;
+    bool sparse;
+  };
+  std::vector<Placement> placements;
+  std::vector<LpMetadataPartition> partitions;
+  std::vector<LpMetadataExtent> extents;
+  uint64_t next_offset = first_logical_sector * kLpSectorSize;
+  for (const auto& partition : layout.partitions) {
+    auto group_it = group_indices.find(partition.group_name);
+    CF_EXPECT(group_it != group_indices.end(),
+              "Unknown group \"" << partition.group_name << "\" for partition "
+                                 << partition.name);
+    LpMetadataPartition entry{};
+    CF_EXPECT(CopyName(entry.name, partition.name));
+    entry.attributes = kLpPartitionAttrReadonly;
+    entry.first_extent_index = extents.size();
+    entry.group_index = group_it->second;
+    if (!partition.image_path.empty()) {
+      android::base::unique_fd fd(
+          open(partition.image_path.c_str(), O_RDONLY | O_CLOEXEC));
+      CF_EXPECTF(fd.get() >= 0, "Failed to open \"{}\": {}",
+                 partition.image_path, strerror(errno));
+      uint64_t size =
+          CF_EXPECT(ImageContentSize(fd.get(), partition.image_path));
+      uint64_t allocated = AlignTo(size, kLpLogicalBlockSize);
+      if (allocated > 0) {
+        auto& usage = group_usage[group_it->second];
+        usage += allocated;
+        const uint64_t group_max = groups[group_it->second].maximum_size;
+        CF_EXPECTF(group_max == 0 || usage <= group_max,
+                   "Group \"{}\" exceeds its maximum size of {} bytes",
+                   partition.group_name, group_max);
+        CF_EXPECTF(next_offset + allocated <= layout.device_size,
+                   "Partition \"{}\" does not fit in the super device",
+                   partition.name);
+        LpMetadataExtent extent{};
+        extent.num_sectors = allocated / kLpSectorSize;
+        extent.target_type = kLpTargetTypeLinear;
+        extent.target_data = next_offset / kLpSectorSize;
+        extent.target_source = 0;
+        extents.push_back(extent);
+        entry.num_extents = 1;
+        bool sparse = CF_EXPECT(IsSparse(fd.get()));
+        placements.push_back({std::move(fd), next_offset, size, sparse});
+        next_offset = AlignTo(next_offset + allocated, kLpPartitionAlignment);
+      }
+    }
+    partitions.push_back(entry);
+  }
+
+  auto metadata = CF_EXPECT(SerializeMetadata(
+      layout, first_logical_sector, partitions, extents, groups));
+
+  LpMetadataGeometry geometry{};
+  geometry.magic = kLpGeometryMagic;
+  geometry.struct_size = sizeof(geometry);
+  geometry.metadata_max_size = layout.metadata_max_size;
+  geometry.metadata_slot_count = layout.metadata_slot_count;
+  geometry.logical_block_size = kLpLogicalBlockSize;
+  SHA256(reinterpret_cast<const uint8_t*>(&geometry), sizeof(geometry),
+         geometry.checksum);
+
+  android::base::unique_fd out(open(output_path.c_str(),
+                                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                    0644));
+  CF_EXPECTF(out.get() >= 0, "Failed to open \"{}\": {}", output_path,
+             strerror(errno));
+  // Everything not written explicitly stays a hole.
+  CF_EXPECTF(ftruncate64(out.get(), layout.device_size) == 0,
+             "Failed to resize \"{}\": {}", output_path, strerror(errno));
+
+  for (uint64_t copy = 0; copy < 2; copy++) {
+    CF_EXPECT(PWriteAll(out.get(), &geometry, sizeof(geometry),
+                        kLpPartitionReservedBytes + copy * kLpGeometrySize));
+  }
+  const uint64_t primary_metadata = kLpPartitionReservedBytes +
+                                    kLpGeometrySize * 2;
+  const uint64_t backup_metadata =
+      primary_metadata +
+      static_cast<uint64_t>(layout.metadata_max_size) *
+          layout.metadata_slot_count;
+  for (uint64_t slot = 0; slot < layout.metadata_slot_count; slot++) {
+    const uint64_t slot_offset = slot * layout.metadata_max_size;
+    CF_EXPECT(PWriteAll(out.get(), metadata.data(), metadata.size(),
+                        primary_metadata + slot_offset));
+    CF_EXPECT(PWriteAll(out.get(), metadata.data(), metadata.size(),
+                        backup_metadata + slot_offset));
+  }
+
+  for (const auto& placement : placements) {
+    if (placement.sparse) {
+      CF_EXPECT(
+          PlaceSparseImage(placement.fd.get(), out.get(), placement.offset));
+    } else {
+      CF_EXPECT(PlaceRawImage(placement.fd.get(), placement.size, out.get(),
+                              placement.offset));
+    }
+  }
+  return {};
+}
+
+}  // namespace cuttlefish
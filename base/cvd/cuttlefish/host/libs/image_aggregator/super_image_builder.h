@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+struct SuperImagePartitionGroup {
+  std::string name;
+  // 0 means unlimited.
+  uint64_t maximum_size;
+};
+
+struct SuperImagePartition {
+  std::string name;
+  std::string group_name;
+  // Raw or Android sparse image with the partition contents. When empty, the
+  // partition is created with no extents.
+  std::string image_path;
+};
+
+/*
+ * Describes the logical partitions (liblp metadata) of a single block device
+ * super image, equivalent to the arguments that build_super_image passes to
+ * lpmake.
+ */
+struct SuperImageLayout {
+  std::string super_name = "super";
+  uint64_t device_size = 0;
+  uint32_t metadata_max_size = 65536;
+  uint32_t metadata_slot_count = 2;
+  bool virtual_ab = false;
+  std::vector<SuperImagePartitionGroup> groups;
+  std::vector<SuperImagePartition> partitions;
+};
+
+/*
+ * Builds the layout described by a misc_info.txt file, resolving partition
+ * images through get_image. Fails for configurations that build_super_image
+ * supports but this builder doesn't, such as retrofit devices or multiple
+ * block devices.
+ */
+Result<SuperImageLayout> SuperImageLayoutFromMiscInfo(
+    const std::string& misc_info_path,
+    const std::function<Result<std::string>(const std::string&)>& get_image);
+
+/*
+ * Writes a raw super image with the given layout without going through lpmake.
+ *
+ * Partition contents are placed with copy_file_range, which lets the
+ * filesystem share extents with the source images where supported. Holes in
+ * raw images and "don't care" chunks in sparse images are preserved as holes
+ * in the output.
+ */
+Result<void> BuildSuperImage(const SuperImageLayout& layout,
+                             const std::string& output_path);
+
+}  // namespace cuttlefish
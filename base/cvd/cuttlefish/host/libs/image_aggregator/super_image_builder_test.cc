@@ -0,0 +1,323 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "host/libs/image_aggregator/super_image_builder.h"
+
+#include <openssl/sha.h>
+#include <string.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "common/libs/utils/result_matchers.h"
+
+namespace cuttlefish {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Field;
+
+// Offsets and structures from liblp's metadata_format.h, spelled out here
+// rather than shared with the builder so the tests check the format itself.
+constexpr uint64_t kPrimaryGeometryOffset = 4096;
+constexpr uint64_t kBackupGeometryOffset = 8192;
+constexpr uint64_t kPrimaryMetadataOffset = 12288;
+constexpr uint32_t kMetadataMaxSize = 65536;
+constexpr uint32_t kSlotCount = 2;
+constexpr uint64_t kBackupMetadataOffset =
+    kPrimaryMetadataOffset + kMetadataMaxSize * kSlotCount;
+constexpr uint64_t kDeviceSize = 16 << 20;
+// The metadata ends at 274432, rounded up to the 1 MiB partition alignment.
+constexpr uint64_t kFirstLogicalSector = (1 << 20) / 512;
+
+struct __attribute__((packed)) Geometry {
+  uint32_t magic;
+  uint32_t struct_size;
+  uint8_t checksum[32];
+  uint32_t metadata_max_size;
+  uint32_t metadata_slot_count;
+  uint32_t logical_block_size;
+};
+
+struct __attribute__((packed)) TableDescriptor {
+  uint32_t offset;
+  uint32_t num_entries;
+  uint32_t entry_size;
+};
+
+struct __attribute__((packed)) Header {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  uint32_t header_size;
+  uint8_t header_checksum[32];
+  uint32_t tables_size;
+  uint8_t tables_checksum[32];
+  TableDescriptor partitions;
+  TableDescriptor extents;
+  TableDescriptor groups;
+  TableDescriptor block_devices;
+};
+
+struct __attribute__((packed)) Partition {
+  char name[36];
+  uint32_t attributes;
+  uint32_t first_extent_index;
+  uint32_t num_extents;
+  uint32_t group_index;
+};
+
+struct __attribute__((packed)) Extent {
+  uint64_t num_sectors;
+  uint32_t target_type;
+  uint64_t target_data;
+  uint32_t target_source;
+};
+
+struct __attribute__((packed)) Group {
+  char name[36];
+  uint32_t flags;
+  uint64_t maximum_size;
+};
+
+struct __attribute__((packed)) BlockDevice {
+  uint64_t first_logical_sector;
+  uint32_t alignment;
+  uint32_t alignment_offset;
+  uint64_t size;
+  char partition_name[36];
+  uint32_t flags;
+};
+
+std::vector<uint8_t> Sha256(const void* data, size_t size) {
+  std::vector<uint8_t> digest(SHA256_DIGEST_LENGTH);
+  SHA256(reinterpret_cast<const uint8_t*>(data), size, digest.data());
+  return digest;
+}
+
+std::vector<uint8_t> Bytes(const uint8_t (&array)[32]) {
+  return std::vector<uint8_t>(array, array + 32);
+}
+
+template <typename T>
+std::vector<T> ReadTable(const std::string& metadata, const Header& header,
+                         const TableDescriptor& table) {
+  EXPECT_EQ(table.entry_size, sizeof(T));
+  std::vector<T> entries(table.num_entries);
+  memcpy(entries.data(), metadata.data() + header.header_size + table.offset,
+         table.num_entries * sizeof(T));
+  return entries;
+}
+
+class SuperImageBuilderTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    dir_ = temp_dir_.path;
+    output_ = dir_ + "/super.img";
+  }
+
+  std::string WriteImage(const std::string& name, const std::string& data) {
+    auto path = dir_ + "/" + name + ".img";
+    EXPECT_TRUE(android::base::WriteStringToFile(data, path));
+    return path;
+  }
+
+  SuperImageLayout Layout() {
+    SuperImageLayout layout;
+    layout.device_size = kDeviceSize;
+    layout.metadata_max_size = kMetadataMaxSize;
+    layout.metadata_slot_count = kSlotCount;
+    layout.groups.push_back({"group", 0});
+    layout.partitions.push_back(
+        {"system", "group", WriteImage("system", std::string(8192, 's'))});
+    layout.partitions.push_back({"vendor", "group", ""});
+    return layout;
+  }
+
+  std::string ReadOutput(uint64_t offset, size_t size) {
+    std::string contents;
+    EXPECT_TRUE(android::base::ReadFileToString(output_, &contents));
+    EXPECT_GE(contents.size(), offset + size);
+    return contents.substr(offset, size);
+  }
+
+  TemporaryDir temp_dir_;
+  std::string dir_;
+  std::string output_;
+};
+
+TEST_F(SuperImageBuilderTest, Geometry) {
+  ASSERT_THAT(BuildSuperImage(Layout(), output_), IsOk());
+
+  auto primary = ReadOutput(kPrimaryGeometryOffset, sizeof(Geometry));
+  ASSERT_EQ(primary, ReadOutput(kBackupGeometryOffset, sizeof(Geometry)));
+  Geometry geometry;
+  memcpy(&geometry, primary.data(), sizeof(geometry));
+  EXPECT_EQ(geometry.magic, 0x616c4467u);
+  EXPECT_EQ(geometry.struct_size, sizeof(Geometry));
+  EXPECT_EQ(geometry.metadata_max_size, kMetadataMaxSize);
+  EXPECT_EQ(geometry.metadata_slot_count, kSlotCount);
+  EXPECT_EQ(geometry.logical_block_size, 4096u);
+
+  auto checksum = Bytes(geometry.checksum);
+  memset(geometry.checksum, 0, sizeof(geometry.checksum));
+  EXPECT_EQ(checksum, Sha256(&geometry, sizeof(geometry)));
+}
+
+TEST_F(SuperImageBuilderTest, MetadataChecksumsAndCopies) {
+  ASSERT_THAT(BuildSuperImage(Layout(), output_), IsOk());
+
+  auto metadata = ReadOutput(kPrimaryMetadataOffset, kMetadataMaxSize);
+  for (uint64_t slot = 0; slot < kSlotCount; slot++) {
+    const uint64_t slot_offset = slot * kMetadataMaxSize;
+    EXPECT_EQ(ReadOutput(kPrimaryMetadataOffset + slot_offset,
+                         kMetadataMaxSize),
+              metadata)
+        << "primary slot " << slot;
+    EXPECT_EQ(ReadOutput(kBackupMetadataOffset + slot_offset,
+                         kMetadataMaxSize),
+              metadata)
+        << "backup slot " << slot;
+  }
+
+  Header header;
+  memcpy(&header, metadata.data(), sizeof(header));
+  EXPECT_EQ(header.magic, 0x414C5030u);
+  EXPECT_EQ(header.major_version, 10);
+  EXPECT_EQ(header.minor_version, 0);
+  EXPECT_EQ(header.header_size, sizeof(Header));
+
+  EXPECT_EQ(Bytes(header.tables_checksum),
+            Sha256(metadata.data() + header.header_size, header.tables_size));
+  std::string header_bytes = metadata.substr(0, header.header_size);
+  memset(header_bytes.data() + offsetof(Header, header_checksum), 0, 32);
+  EXPECT_EQ(Bytes(header.header_checksum),
+            Sha256(header_bytes.data(), header_bytes.size()));
+
+  auto block_devices =
+      ReadTable<BlockDevice>(metadata, header, header.block_devices);
+  ASSERT_EQ(block_devices.size(), 1);
+  EXPECT_EQ(block_devices[0].first_logical_sector, kFirstLogicalSector);
+  EXPECT_EQ(block_devices[0].size, kDeviceSize);
+  EXPECT_STREQ(block_devices[0].partition_name, "super");
+
+  auto partitions = ReadTable<Partition>(metadata, header, header.partitions);
+  ASSERT_EQ(partitions.size(), 2);
+  EXPECT_STREQ(partitions[0].name, "system");
+  EXPECT_EQ(partitions[0].num_extents, 1);
+  EXPECT_STREQ(partitions[1].name, "vendor");
+  EXPECT_EQ(partitions[1].num_extents, 0);
+
+  auto extents = ReadTable<Extent>(metadata, header, header.extents);
+  ASSERT_EQ(extents.size(), 1);
+  EXPECT_EQ(extents[0].target_data, kFirstLogicalSector);
+  EXPECT_EQ(extents[0].num_sectors, 8192 / 512);
+  EXPECT_EQ(ReadOutput(kFirstLogicalSector * 512, 8192),
+            std::string(8192, 's'));
+
+  auto groups = ReadTable<Group>(metadata, header, header.groups);
+  ASSERT_EQ(groups.size(), 2);
+  EXPECT_STREQ(groups[0].name, "default");
+  EXPECT_STREQ(groups[1].name, "group");
+}
+
+TEST_F(SuperImageBuilderTest, VirtualAbHeader) {
+  auto layout = Layout();
+  layout.virtual_ab = true;
+  ASSERT_THAT(BuildSuperImage(layout, output_), IsOk());
+
+  auto metadata = ReadOutput(kPrimaryMetadataOffset, kMetadataMaxSize);
+  Header header;
+  memcpy(&header, metadata.data(), sizeof(header));
+  EXPECT_EQ(header.minor_version, 2);
+  // Version 10.2 adds the flags and reserved bytes to the header.
+  EXPECT_EQ(header.header_size, sizeof(Header) + 4 + 124);
+  uint32_t flags;
+  memcpy(&flags, metadata.data() + sizeof(Header), sizeof(flags));
+  EXPECT_EQ(flags, 1u);
+  std::string header_bytes = metadata.substr(0, header.header_size);
+  memset(header_bytes.data() + offsetof(Header, header_checksum), 0, 32);
+  EXPECT_EQ(Bytes(header.header_checksum),
+            Sha256(header_bytes.data(), header_bytes.size()));
+}
+
+TEST_F(SuperImageBuilderTest, GroupSizeExceeded) {
+  auto layout = Layout();
+  layout.groups[0].maximum_size = 4096;
+  ASSERT_THAT(BuildSuperImage(layout, output_), IsError());
+}
+
+TEST_F(SuperImageBuilderTest, UnknownGroup) {
+  auto layout = Layout();
+  layout.partitions[0].group_name = "missing";
+  ASSERT_THAT(BuildSuperImage(layout, output_), IsError());
+}
+
+TEST_F(SuperImageBuilderTest, SlotSuffixesFromMiscInfo) {
+  auto misc_info = dir_ + "/misc_info.txt";
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      "ab_update=true\n"
+      "super_block_devices=super\n"
+      "super_super_device_size=16777216\n"
+      "super_partition_groups=group\n"
+      "super_group_group_size=8388608\n"
+      "super_group_partition_list=system vendor\n",
+      misc_info));
+  auto get_image = [this](const std::string& name) -> Result<std::string> {
+    return dir_ + "/" + name + ".img";
+  };
+
+  auto layout = SuperImageLayoutFromMiscInfo(misc_info, get_image);
+  ASSERT_THAT(layout, IsOk());
+  EXPECT_EQ(layout->metadata_slot_count, 3);
+  EXPECT_THAT(layout->groups,
+              ElementsAre(Field(&SuperImagePartitionGroup::name, "group_a"),
+                          Field(&SuperImagePartitionGroup::name, "group_b")));
+  // Only slot _a gets images.
+  EXPECT_THAT(
+      layout->partitions,
+      ElementsAre(
+          AllOf(Field(&SuperImagePartition::name, "system_a"),
+                Field(&SuperImagePartition::group_name, "group_a"),
+                Field(&SuperImagePartition::image_path,
+                      dir_ + "/system.img")),
+          AllOf(Field(&SuperImagePartition::name, "vendor_a"),
+                Field(&SuperImagePartition::image_path,
+                      dir_ + "/vendor.img")),
+          AllOf(Field(&SuperImagePartition::name, "system_b"),
+                Field(&SuperImagePartition::group_name, "group_b"),
+                Field(&SuperImagePartition::image_path, "")),
+          AllOf(Field(&SuperImagePartition::name, "vendor_b"),
+                Field(&SuperImagePartition::image_path, ""))));
+}
+
+TEST_F(SuperImageBuilderTest, RetrofitUnsupported) {
+  auto misc_info = dir_ + "/misc_info.txt";
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      "dynamic_partition_retrofit=true\nsuper_block_devices=system\n",
+      misc_info));
+  auto get_image = [](const std::string&) -> Result<std::string> {
+    return "";
+  };
+  ASSERT_THAT(SuperImageLayoutFromMiscInfo(misc_info, get_image), IsError());
+}
+
+}  // namespace
+}  // namespace cuttlefish
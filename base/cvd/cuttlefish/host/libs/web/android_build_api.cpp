@@ -37,6 +37,7 @@
 #include "common/libs/utils/environment.h"
 #include "common/libs/utils/files.h"
 #include "common/libs/utils/result.h"
+#include "common/libs/utils/trace.h"
 #include "host/libs/web/android_build_string.h"
 #include "host/libs/web/credential_source.h"
 
@@ -117,6 +118,7 @@ BuildApi::BuildApi(std::unique_ptr<HttpClient> http_client,
 
 Result<Build> BuildApi::GetBuild(const DeviceBuildString& build_string,
                                  const std::string& fallback_target) {
+  TraceSpan trace("BuildApi::GetBuild", build_string.branch_or_id);
   auto proposed_build = DeviceBuild(
       build_string.branch_or_id, build_string.target.value_or(fallback_target),
       build_string.filepath);
@@ -274,6 +276,7 @@ Result<std::string> BuildApi::ProductName(const DeviceBuild& build) {
 Result<std::unordered_set<std::string>> BuildApi::Artifacts(
     const DeviceBuild& build,
     const std::vector<std::string>& artifact_filenames) {
+  TraceSpan trace("BuildApi::Artifacts", build.id);
   std::string page_token = "";
   std::unordered_set<std::string> artifacts;
   do {
@@ -338,6 +341,7 @@ Result<std::unordered_set<std::string>> BuildApi::Artifacts(
 
 Result<std::string> BuildApi::GetArtifactDownloadUrl(
     const DeviceBuild& build, const std::string& artifact) {
+  TraceSpan trace("BuildApi::GetArtifactDownloadUrl", artifact);
   std::string download_url_endpoint =
       api_base_url_ + "/builds/" + http_client->UrlEscape(build.id) + "/" +
       http_client->UrlEscape(build.target) + "/attempts/latest/artifacts/" +
@@ -364,8 +368,8 @@ Result<std::string> BuildApi::GetArtifactDownloadUrl(
 Result<void> BuildApi::ArtifactToFile(const DeviceBuild& build,
                                       const std::string& artifact,
                                       const std::string& path) {
+  TraceSpan trace("BuildApi::ArtifactToFile", artifact);
   const auto url = CF_EXPECT(GetArtifactDownloadUrl(build, artifact));
-  CF_EXPECT(CF_EXPECT(http_client->DownloadToFile(url, path)).HttpSuccess());
   bool is_successful_download =
       CF_EXPECT(http_client->DownloadToFile(url, path)).HttpSuccess();
   CF_EXPECT_EQ(is_successful_download, true);
@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "host/libs/web/android_build_api.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <json/json.h>
+
+#include "common/libs/utils/result_matchers.h"
+#include "host/libs/web/http_client/http_client.h"
+
+namespace cuttlefish {
+namespace {
+
+using ::testing::_;
+using ::testing::HasSubstr;
+using ::testing::Return;
+
+class MockHttpClient : public HttpClient {
+ public:
+  MOCK_METHOD(Result<HttpResponse<std::string>>, GetToString,
+              (const std::string&, const std::vector<std::string>&),
+              (override));
+  MOCK_METHOD(Result<HttpResponse<std::string>>, PostToString,
+              (const std::string&, const std::string&,
+               const std::vector<std::string>&),
+              (override));
+  MOCK_METHOD(Result<HttpResponse<std::string>>, DeleteToString,
+              (const std::string&, const std::vector<std::string>&),
+              (override));
+  MOCK_METHOD(Result<HttpResponse<Json::Value>>, PostToJson,
+              (const std::string&, const std::string&,
+               const std::vector<std::string>&),
+              (override));
+  MOCK_METHOD(Result<HttpResponse<Json::Value>>, PostToJson,
+              (const std::string&, const Json::Value&,
+               const std::vector<std::string>&),
+              (override));
+  MOCK_METHOD(Result<HttpResponse<Json::Value>>, DownloadToJson,
+              (const std::string&, const std::vector<std::string>&),
+              (override));
+  MOCK_METHOD(Result<HttpResponse<Json::Value>>, DeleteToJson,
+              (const std::string&, const std::vector<std::string>&),
+              (override));
+  MOCK_METHOD(Result<HttpResponse<std::string>>, DownloadToFile,
+              (const std::string&, const std::string&,
+               const std::vector<std::string>&),
+              (override));
+  MOCK_METHOD(Result<HttpResponse<void>>, DownloadToCallback,
+              (DataCallback, const std::string&,
+               const std::vector<std::string>&),
+              (override));
+
+  std::string UrlEscape(const std::string& text) override { return text; }
+};
+
+HttpResponse<Json::Value> JsonResponse(Json::Value data) {
+  HttpResponse<Json::Value> response;
+  response.data = std::move(data);
+  response.http_code = 200;
+  return response;
+}
+
+TEST(BuildApiTest, DownloadFileFetchesArtifactOnce) {
+  auto client = std::make_unique<MockHttpClient>();
+  Json::Value listing;
+  listing["artifacts"][0]["name"] = "artifact.zip";
+  Json::Value url;
+  url["signedUrl"] = "https://storage/artifact.zip";
+  EXPECT_CALL(*client,
+              DownloadToJson(HasSubstr("/attempts/latest/artifacts?"), _))
+      .WillOnce(Return(JsonResponse(listing)));
+  EXPECT_CALL(*client, DownloadToJson(HasSubstr("/artifact.zip/url"), _))
+      .WillOnce(Return(JsonResponse(url)));
+  HttpResponse<std::string> file_response;
+  file_response.http_code = 200;
+  EXPECT_CALL(*client, DownloadToFile("https://storage/artifact.zip",
+                                      "/target/artifact.zip", _))
+      .WillOnce(Return(file_response));
+
+  BuildApi build_api(std::move(client), nullptr, nullptr, "",
+                     std::chrono::seconds(0), "https://build");
+  auto path = build_api.DownloadFile(
+      DeviceBuild("1234", "target", std::nullopt), "/target", "artifact.zip");
+
+  EXPECT_THAT(path, IsOkAndValue("/target/artifact.zip"));
+}
+
+TEST(BuildApiTest, DownloadFileFailsOnHttpError) {
+  auto client = std::make_unique<MockHttpClient>();
+  Json::Value listing;
+  listing["artifacts"][0]["name"] = "artifact.zip";
+  Json::Value url;
+  url["signedUrl"] = "https://storage/artifact.zip";
+  EXPECT_CALL(*client,
+              DownloadToJson(HasSubstr("/attempts/latest/artifacts?"), _))
+      .WillOnce(Return(JsonResponse(listing)));
+  EXPECT_CALL(*client, DownloadToJson(HasSubstr("/artifact.zip/url"), _))
+      .WillOnce(Return(JsonResponse(url)));
+  HttpResponse<std::string> file_response;
+  file_response.http_code = 404;
+  EXPECT_CALL(*client, DownloadToFile(_, _, _))
+      .WillOnce(Return(file_response));
+
+  BuildApi build_api(std::move(client), nullptr, nullptr, "",
+                     std::chrono::seconds(0), "https://build");
+  auto path = build_api.DownloadFile(
+      DeviceBuild("1234", "target", std::nullopt), "/target", "artifact.zip");
+
+  EXPECT_THAT(path, IsError());
+}
+
+}  // namespace
+}  // namespace cuttlefish
@@ -20,6 +20,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <atomic>
+#include <new>
+
 #include "backed_block.h"
 #include "sparse_defs.h"
 
@@ -44,16 +47,153 @@ struct backed_block {
     } fill;
   };
   struct backed_block* next;
+  struct backed_block_slab* slab;
+  /* Children in the treap of the list, ordered by block */
+  struct backed_block* left;
+  struct backed_block* right;
+  uint32_t priority;
 };
 
+#define BACKED_BLOCKS_PER_SLAB 256
+
+/*
+ * Blocks are carved out of slabs rather than allocated one at a time. Blocks
+ * can be moved to another list, so a slab is referenced by each of its blocks
+ * and by the list allocating from it, and is freed with the last reference.
+ */
+struct backed_block_slab {
+  std::atomic<unsigned int> refs;
+  struct backed_block blocks[BACKED_BLOCKS_PER_SLAB];
+};
+
+/*
+ * Blocks are linked in order by their next pointers, and also kept in a treap
+ * keyed by block so that blocks arriving out of order are placed, and lookups
+ * done, in logarithmic time. Reading the list never changes it.
+ */
 struct backed_block_list {
-  struct backed_block* data_blocks;
-  struct backed_block* last_used;
+  struct backed_block* head;
+  struct backed_block* root;
+  /* State of the generator of treap priorities */
+  uint32_t seed;
+  /* Blocks released by merges, reused before carving new ones */
+  struct backed_block* free_blocks;
+  struct backed_block_slab* slab;
+  unsigned int slab_used;
   unsigned int block_size;
 };
 
+/* Splits t into the blocks before `block`, and those at or after it */
+static void treap_split(struct backed_block* t, uint64_t block, struct backed_block** before,
+                        struct backed_block** after) {
+  if (!t) {
+    *before = *after = nullptr;
+  } else if (t->block < block) {
+    treap_split(t->right, block, &t->right, after);
+    *before = t;
+  } else {
+    treap_split(t->left, block, before, &t->left);
+    *after = t;
+  }
+}
+
+/* Joins two treaps, all the blocks of a being at or before those of b */
+static struct backed_block* treap_join(struct backed_block* a, struct backed_block* b) {
+  if (!a) {
+    return b;
+  }
+  if (!b) {
+    return a;
+  }
+  if (a->priority > b->priority) {
+    a->right = treap_join(a->right, b);
+    return a;
+  }
+  b->left = treap_join(a, b->left);
+  return b;
+}
+
+/* Removes bb from t, in which all blocks start at the same block */
+static struct backed_block* treap_remove(struct backed_block* t, struct backed_block* bb) {
+  if (!t) {
+    return nullptr;
+  }
+  if (t == bb) {
+    return treap_join(t->left, t->right);
+  }
+  t->left = treap_remove(t->left, bb);
+  t->right = treap_remove(t->right, bb);
+  return t;
+}
+
+/* Inserts bb before the blocks starting at or after it */
+static void treap_insert(struct backed_block_list* bbl, struct backed_block* bb) {
+  struct backed_block** link = &bbl->root;
+
+  /* xorshift32 */
+  bbl->seed ^= bbl->seed << 13;
+  bbl->seed ^= bbl->seed >> 17;
+  bbl->seed ^= bbl->seed << 5;
+  bb->priority = bbl->seed;
+
+  while (*link && (*link)->priority > bb->priority) {
+    link = bb->block <= (*link)->block ? &(*link)->left : &(*link)->right;
+  }
+  treap_split(*link, bb->block, &bb->left, &bb->right);
+  *link = bb;
+}
+
+static void treap_erase(struct backed_block_list* bbl, struct backed_block* bb) {
+  struct backed_block** link = &bbl->root;
+  struct backed_block *before, *same, *after;
+
+  while (*link != bb) {
+    if (bb->block < (*link)->block) {
+      link = &(*link)->left;
+    } else if (bb->block > (*link)->block) {
+      link = &(*link)->right;
+    } else {
+      /* Blocks starting at the same block can be on either side */
+      treap_split(bbl->root, bb->block, &before, &after);
+      treap_split(after, uint64_t{bb->block} + 1, &same, &after);
+      bbl->root = treap_join(treap_join(before, treap_remove(same, bb)), after);
+      return;
+    }
+  }
+  *link = treap_join(bb->left, bb->right);
+}
+
+static struct backed_block* treap_last(struct backed_block* t) {
+  while (t && t->right) {
+    t = t->right;
+  }
+  return t;
+}
+
+/* Last block of bbl starting before `block`, or nullptr */
+static struct backed_block* backed_block_find_before(struct backed_block_list* bbl,
+                                                     uint64_t block) {
+  struct backed_block* found = nullptr;
+
+  for (struct backed_block* t = bbl->root; t;) {
+    if (t->block < block) {
+      found = t;
+      t = t->right;
+    } else {
+      t = t->left;
+    }
+  }
+  return found;
+}
+
 struct backed_block* backed_block_iter_new(struct backed_block_list* bbl) {
-  return bbl->data_blocks;
+  return bbl->head;
+}
+
+struct backed_block* backed_block_find(struct backed_block_list* bbl, unsigned int block) {
+  struct backed_block* bb = backed_block_find_before(bbl, uint64_t{block} + 1);
+
+  return bb ? bb : bbl->head;
 }
 
 struct backed_block* backed_block_iter_next(struct backed_block* bb) {
@@ -101,170 +241,209 @@ enum backed_block_type backed_block_type(struct backed_block* bb) {
   return bb->type;
 }
 
-void backed_block_destroy(struct backed_block* bb) {
+static void backed_block_slab_release(struct backed_block_slab* slab) {
+  if (slab && --slab->refs == 0) {
+    delete slab;
+  }
+}
+
+static struct backed_block* backed_block_alloc(struct backed_block_list* bbl) {
+  struct backed_block* bb = bbl->free_blocks;
+
+  if (bb) {
+    bbl->free_blocks = bb->next;
+    return bb;
+  }
+
+  if (!bbl->slab || bbl->slab_used == BACKED_BLOCKS_PER_SLAB) {
+    struct backed_block_slab* slab = new (std::nothrow) backed_block_slab;
+    if (!slab) {
+      return nullptr;
+    }
+    slab->refs = 1;
+    backed_block_slab_release(bbl->slab);
+    bbl->slab = slab;
+    bbl->slab_used = 0;
+  }
+
+  bb = &bbl->slab->blocks[bbl->slab_used++];
+  bbl->slab->refs++;
+  bb->slab = bbl->slab;
+  return bb;
+}
+
+/* Copies everything but the slab bb was allocated from */
+static void backed_block_assign(struct backed_block* bb, const struct backed_block* from) {
+  struct backed_block_slab* slab = bb->slab;
+
+  *bb = *from;
+  bb->slab = slab;
+}
+
+/* Keeps the memory of bb for reuse by bbl */
+static void backed_block_destroy(struct backed_block_list* bbl, struct backed_block* bb) {
   if (bb->type == BACKED_BLOCK_FILE) {
     free(bb->file.filename);
   }
 
-  free(bb);
+  bb->next = bbl->free_blocks;
+  bbl->free_blocks = bb;
 }
 
 struct backed_block_list* backed_block_list_new(unsigned int block_size) {
-  struct backed_block_list* b =
-      reinterpret_cast<backed_block_list*>(calloc(sizeof(struct backed_block_list), 1));
-  b->block_size = block_size;
+  struct backed_block_list* b = new (std::nothrow) backed_block_list();
+  if (b) {
+    b->block_size = block_size;
+    b->seed = 2463534242;
+  }
   return b;
 }
 
 void backed_block_list_destroy(struct backed_block_list* bbl) {
-  if (bbl->data_blocks) {
-    struct backed_block* bb = bbl->data_blocks;
-    while (bb) {
-      struct backed_block* next = bb->next;
-      backed_block_destroy(bb);
-      bb = next;
+  while (bbl->head) {
+    struct backed_block* bb = bbl->head;
+    bbl->head = bb->next;
+    if (bb->type == BACKED_BLOCK_FILE) {
+      free(bb->file.filename);
     }
+    backed_block_slab_release(bb->slab);
   }
 
-  free(bbl);
+  while (bbl->free_blocks) {
+    struct backed_block* bb = bbl->free_blocks;
+    bbl->free_blocks = bb->next;
+    backed_block_slab_release(bb->slab);
+  }
+  backed_block_slab_release(bbl->slab);
+
+  delete bbl;
 }
 
 void backed_block_list_move(struct backed_block_list* from, struct backed_block_list* to,
                             struct backed_block* start, struct backed_block* end) {
-  struct backed_block* bb;
-
-  if (start == nullptr) {
-    start = from->data_blocks;
-  }
-
-  if (!end) {
-    for (end = start; end && end->next; end = end->next)
-      ;
-  }
+  struct backed_block *before, *moved, *after, *prev;
 
-  if (start == nullptr || end == nullptr) {
+  if (!from->head) {
     return;
   }
-
-  from->last_used = nullptr;
-  to->last_used = nullptr;
-  if (from->data_blocks == start) {
-    from->data_blocks = end->next;
+  start = start ? start : from->head;
+  end = end ? end : treap_last(from->root);
+
+  treap_split(from->root, start->block, &before, &after);
+  treap_split(after, uint64_t{end->block} + 1, &moved, &after);
+  from->root = treap_join(before, after);
+  prev = treap_last(before);
+  if (prev) {
+    prev->next = end->next;
   } else {
-    for (bb = from->data_blocks; bb; bb = bb->next) {
-      if (bb->next == start) {
-        bb->next = end->next;
-        break;
-      }
-    }
+    from->head = end->next;
   }
 
-  if (!to->data_blocks) {
-    to->data_blocks = start;
-    end->next = nullptr;
+  /* After the blocks of `to` starting at the same block */
+  treap_split(to->root, uint64_t{start->block} + 1, &before, &after);
+  prev = treap_last(before);
+  if (prev) {
+    end->next = prev->next;
+    prev->next = start;
   } else {
-    for (bb = to->data_blocks; bb; bb = bb->next) {
-      if (!bb->next || bb->next->block > start->block) {
-        end->next = bb->next;
-        bb->next = start;
-        break;
-      }
-    }
+    end->next = to->head;
+    to->head = start;
   }
+  to->root = treap_join(treap_join(before, moved), after);
 }
 
-/* may free b */
-static int merge_bb(struct backed_block_list* bbl, struct backed_block* a, struct backed_block* b) {
+/* Whether b directly follows a and can be merged into it */
+static bool can_merge_bb(struct backed_block_list* bbl, const struct backed_block* a,
+                         const struct backed_block* b) {
   unsigned int block_len;
 
-  /* Block doesn't exist (possible if one block is the last block) */
-  if (!a || !b) {
-    return -EINVAL;
-  }
-
   assert(a->block < b->block);
 
   /* Blocks are of different types */
   if (a->type != b->type) {
-    return -EINVAL;
+    return false;
   }
 
   /* Blocks are not adjacent */
   block_len = a->len / bbl->block_size; /* rounds down */
   if (a->block + block_len != b->block) {
-    return -EINVAL;
+    return false;
   }
 
   switch (a->type) {
     case BACKED_BLOCK_DATA:
       /* Don't support merging data for now */
-      return -EINVAL;
+      return false;
     case BACKED_BLOCK_FILL:
       if (a->fill.val != b->fill.val) {
-        return -EINVAL;
+        return false;
       }
       break;
     case BACKED_BLOCK_FILE:
       /* Already make sure b->type is BACKED_BLOCK_FILE */
       if (strcmp(a->file.filename, b->file.filename) || a->file.offset + a->len != b->file.offset) {
-        return -EINVAL;
+        return false;
       }
       break;
     case BACKED_BLOCK_FD:
       if (a->fd.fd != b->fd.fd || a->fd.offset + a->len != b->fd.offset) {
-        return -EINVAL;
+        return false;
       }
       break;
   }
 
-  /* Blocks are compatible and adjacent, with a before b.  Merge b into a,
-   * and free b */
+  return true;
+}
+
+/* Merges the block after a into a if they are compatible */
+static void merge_next_bb(struct backed_block_list* bbl, struct backed_block* a) {
+  struct backed_block* b = a->next;
+
+  if (!b || !can_merge_bb(bbl, a, b)) {
+    return;
+  }
+
   a->len += b->len;
   a->next = b->next;
+  treap_erase(bbl, b);
 
-  backed_block_destroy(b);
-
-  return 0;
+  backed_block_destroy(bbl, b);
 }
 
-static int queue_bb(struct backed_block_list* bbl, struct backed_block* new_bb) {
+/* Takes ownership of the filename of new_bb */
+static int queue_bb(struct backed_block_list* bbl, const struct backed_block* new_bb) {
+  struct backed_block* prev = backed_block_find_before(bbl, new_bb->block);
   struct backed_block* bb;
 
-  if (bbl->data_blocks == nullptr) {
-    bbl->data_blocks = new_bb;
+  /* Extend the previous block in place, without allocating a new one */
+  if (prev && can_merge_bb(bbl, prev, new_bb)) {
+    prev->len += new_bb->len;
+    if (new_bb->type == BACKED_BLOCK_FILE) {
+      free(new_bb->file.filename);
+    }
+    merge_next_bb(bbl, prev);
     return 0;
   }
 
-  if (bbl->data_blocks->block > new_bb->block) {
-    new_bb->next = bbl->data_blocks;
-    bbl->data_blocks = new_bb;
-    return 0;
+  bb = backed_block_alloc(bbl);
+  if (bb == nullptr) {
+    if (new_bb->type == BACKED_BLOCK_FILE) {
+      free(new_bb->file.filename);
+    }
+    return -ENOMEM;
   }
+  backed_block_assign(bb, new_bb);
 
-  /* Optimization: blocks are mostly queued in sequence, so save the
-     pointer to the last bb that was added, and start searching from
-     there if the next block number is higher */
-  if (bbl->last_used && new_bb->block > bbl->last_used->block)
-    bb = bbl->last_used;
-  else
-    bb = bbl->data_blocks;
-  bbl->last_used = new_bb;
-
-  for (; bb->next && bb->next->block < new_bb->block; bb = bb->next)
-    ;
-
-  if (bb->next == nullptr) {
-    bb->next = new_bb;
+  if (prev) {
+    bb->next = prev->next;
+    prev->next = bb;
   } else {
-    new_bb->next = bb->next;
-    bb->next = new_bb;
+    bb->next = bbl->head;
+    bbl->head = bb;
   }
+  treap_insert(bbl, bb);
 
-  merge_bb(bbl, new_bb, new_bb->next);
-  if (!merge_bb(bbl, bb, new_bb)) {
-    /* new_bb destroyed, point to retained as last_used */
-    bbl->last_used = bb;
-  }
+  merge_next_bb(bbl, bb);
 
   return 0;
 }
@@ -272,75 +451,58 @@ static int queue_bb(struct backed_block_list* bbl, struct backed_block* new_bb)
 /* Queues a fill block of memory to be written to the specified data blocks */
 int backed_block_add_fill(struct backed_block_list* bbl, unsigned int fill_val, uint64_t len,
                           unsigned int block) {
-  struct backed_block* bb = reinterpret_cast<backed_block*>(calloc(1, sizeof(struct backed_block)));
-  if (bb == nullptr) {
-    return -ENOMEM;
-  }
+  struct backed_block bb = {};
 
-  bb->block = block;
-  bb->len = len;
-  bb->type = BACKED_BLOCK_FILL;
-  bb->fill.val = fill_val;
-  bb->next = nullptr;
+  bb.block = block;
+  bb.len = len;
+  bb.type = BACKED_BLOCK_FILL;
+  bb.fill.val = fill_val;
 
-  return queue_bb(bbl, bb);
+  return queue_bb(bbl, &bb);
 }
 
 /* Queues a block of memory to be written to the specified data blocks */
 int backed_block_add_data(struct backed_block_list* bbl, void* data, uint64_t len,
                           unsigned int block) {
-  struct backed_block* bb = reinterpret_cast<backed_block*>(calloc(1, sizeof(struct backed_block)));
-  if (bb == nullptr) {
-    return -ENOMEM;
-  }
+  struct backed_block bb = {};
 
-  bb->block = block;
-  bb->len = len;
-  bb->type = BACKED_BLOCK_DATA;
-  bb->data.data = data;
-  bb->next = nullptr;
+  bb.block = block;
+  bb.len = len;
+  bb.type = BACKED_BLOCK_DATA;
+  bb.data.data = data;
 
-  return queue_bb(bbl, bb);
+  return queue_bb(bbl, &bb);
 }
 
 /* Queues a chunk of a file on disk to be written to the specified data blocks */
 int backed_block_add_file(struct backed_block_list* bbl, const char* filename, int64_t offset,
                           uint64_t len, unsigned int block) {
-  struct backed_block* bb = reinterpret_cast<backed_block*>(calloc(1, sizeof(struct backed_block)));
-  if (bb == nullptr) {
-    return -ENOMEM;
-  }
+  struct backed_block bb = {};
 
-  bb->block = block;
-  bb->len = len;
-  bb->type = BACKED_BLOCK_FILE;
-  bb->file.filename = strdup(filename);
-  if (!bb->file.filename) {
-    free(bb);
+  bb.block = block;
+  bb.len = len;
+  bb.type = BACKED_BLOCK_FILE;
+  bb.file.filename = strdup(filename);
+  if (!bb.file.filename) {
     return -ENOMEM;
   }
-  bb->file.offset = offset;
-  bb->next = nullptr;
+  bb.file.offset = offset;
 
-  return queue_bb(bbl, bb);
+  return queue_bb(bbl, &bb);
 }
 
 /* Queues a chunk of a fd to be written to the specified data blocks */
 int backed_block_add_fd(struct backed_block_list* bbl, int fd, int64_t offset, uint64_t len,
                         unsigned int block) {
-  struct backed_block* bb = reinterpret_cast<backed_block*>(calloc(1, sizeof(struct backed_block)));
-  if (bb == nullptr) {
-    return -ENOMEM;
-  }
+  struct backed_block bb = {};
 
-  bb->block = block;
-  bb->len = len;
-  bb->type = BACKED_BLOCK_FD;
-  bb->fd.fd = fd;
-  bb->fd.offset = offset;
-  bb->next = nullptr;
+  bb.block = block;
+  bb.len = len;
+  bb.type = BACKED_BLOCK_FD;
+  bb.fd.fd = fd;
+  bb.fd.offset = offset;
 
-  return queue_bb(bbl, bb);
+  return queue_bb(bbl, &bb);
 }
 
 int backed_block_split(struct backed_block_list* bbl, struct backed_block* bb,
@@ -353,12 +515,12 @@ int backed_block_split(struct backed_block_list* bbl, struct backed_block* bb,
     return 0;
   }
 
-  new_bb = reinterpret_cast<backed_block*>(malloc(sizeof(struct backed_block)));
+  new_bb = backed_block_alloc(bbl);
   if (new_bb == nullptr) {
     return -ENOMEM;
   }
 
-  *new_bb = *bb;
+  backed_block_assign(new_bb, bb);
 
   new_bb->len = bb->len - max_len;
   new_bb->block = bb->block + max_len / bbl->block_size;
@@ -371,7 +533,8 @@ int backed_block_split(struct backed_block_list* bbl, struct backed_block* bb,
     case BACKED_BLOCK_FILE:
       new_bb->file.filename = strdup(bb->file.filename);
       if (!new_bb->file.filename) {
-        free(new_bb);
+        new_bb->type = BACKED_BLOCK_DATA;
+        backed_block_destroy(bbl, new_bb);
         return -ENOMEM;
       }
       new_bb->file.offset += max_len;
@@ -383,6 +546,8 @@ int backed_block_split(struct backed_block_list* bbl, struct backed_block* bb,
       break;
   }
 
+  treap_insert(bbl, new_bb);
+
   bb->next = new_bb;
   bb->len = max_len;
   return 0;
@@ -49,6 +49,8 @@ int64_t backed_block_file_offset(struct backed_block* bb);
 uint32_t backed_block_fill_val(struct backed_block* bb);
 enum backed_block_type backed_block_type(struct backed_block* bb);
 int backed_block_split(struct backed_block_list* bbl, struct backed_block* bb, unsigned int max_len);
+/* Last block starting at or before block, the first one if there is none */
+struct backed_block* backed_block_find(struct backed_block_list* bbl, unsigned int block);
 
 struct backed_block* backed_block_iter_new(struct backed_block_list* bbl);
 struct backed_block* backed_block_iter_next(struct backed_block* bb);
@@ -0,0 +1,98 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+#include <sparse/sparse.h>
+
+namespace {
+
+constexpr unsigned int kBlockSize = 4096;
+
+// Fills one block out of two with alternating values, so that no two fills
+// can be merged and every other block is a "don't care" gap.
+void AddFragmentedFill(struct sparse_file* s, unsigned int chunk) {
+  CHECK_EQ(sparse_file_add_fill(s, chunk % 4, kBlockSize, chunk * 2), 0);
+}
+
+int64_t FragmentedLength(unsigned int chunks) {
+  return int64_t{chunks} * 2 * kBlockSize;
+}
+
+// An image as written by sparse_file_write, with a fill and a "don't care"
+// chunk per two blocks.
+std::string FragmentedImage(unsigned int chunks) {
+  struct sparse_file* s = sparse_file_new(kBlockSize, FragmentedLength(chunks));
+  for (unsigned int i = 0; i < chunks; i++) {
+    AddFragmentedFill(s, i);
+  }
+  TemporaryFile file;
+  CHECK_EQ(sparse_file_write(s, file.fd, false, true, false), 0);
+  sparse_file_destroy(s);
+  std::string image;
+  CHECK(android::base::ReadFileToString(file.path, &image));
+  return image;
+}
+
+void BM_ImportFragmentedImage(benchmark::State& state) {
+  std::string image = FragmentedImage(state.range(0));
+  for (auto _ : state) {
+    struct sparse_file* s =
+        sparse_file_import_buf(image.data(), image.size(), false, false);
+    CHECK(s != nullptr);
+    sparse_file_destroy(s);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ImportFragmentedImage)
+    ->Arg(1 << 10)
+    ->Arg(1 << 16)
+    ->Arg(1 << 20)
+    ->Unit(benchmark::kMillisecond);
+
+// Adds the blocks in random order, each one landing in the middle of the
+// ones added before, then reads them back in order.
+void BM_AddShuffledBlocks(benchmark::State& state) {
+  const unsigned int chunks = state.range(0);
+  std::vector<unsigned int> order(chunks);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), std::mt19937(0));
+  for (auto _ : state) {
+    struct sparse_file* s =
+        sparse_file_new(kBlockSize, FragmentedLength(chunks));
+    for (auto chunk : order) {
+      AddFragmentedFill(s, chunk);
+    }
+    benchmark::DoNotOptimize(sparse_file_len(s, true, false));
+    sparse_file_destroy(s);
+  }
+  state.SetItemsProcessed(state.iterations() * chunks);
+}
+BENCHMARK(BM_AddShuffledBlocks)
+    ->Arg(1 << 10)
+    ->Arg(1 << 16)
+    ->Arg(1 << 20)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
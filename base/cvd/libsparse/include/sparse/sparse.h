@@ -179,6 +179,29 @@ int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse,
  */
 int64_t sparse_file_len(struct sparse_file *s, bool sparse, bool crc);
 
+/**
+ * sparse_file_pread - read a range of the expanded sparse file
+ *
+ * @s - sparse file cookie
+ * @buf - buffer to read into
+ * @len - number of bytes to read
+ * @offset - offset into the expanded sparse file
+ *
+ * Reads [offset : offset + len) of the file as sparse_file_write would expand
+ * it, without expanding anything else.  Data chunks are read from their memory,
+ * file or fd, fill chunks are synthesized and regions not backed by any chunk
+ * read as zeros.  For a cookie from sparse_file_import, this only reads the
+ * raw chunks overlapping the range.  Blocks are kept sorted as they are added,
+ * so reading never modifies the cookie, and fd backed chunks are read with
+ * pread, which leaves the file offset alone.  Concurrent calls are therefore
+ * safe once all chunks have been added, but not while sparse_file_add_* or
+ * anything else that modifies the cookie runs.
+ *
+ * Returns the number of bytes read, which is less than len only at the end of
+ * the file, or negative errno on error.
+ */
+int64_t sparse_file_pread(struct sparse_file *s, void *buf, size_t len, int64_t offset);
+
 /**
  * sparse_file_block_size
  *
@@ -18,6 +18,8 @@
 #define _LARGEFILE64_SOURCE 1
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -30,6 +32,11 @@
 #include <unistd.h>
 #include <zlib.h>
 
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "defs.h"
 #include "output_file.h"
 #include "sparse_crc32.h"
@@ -65,7 +72,7 @@ struct output_file_ops {
   int (*skip)(struct output_file*, int64_t);
   int (*pad)(struct output_file*, int64_t);
   int (*write)(struct output_file*, void*, size_t);
-  void (*close)(struct output_file*);
+  int (*close)(struct output_file*);
 };
 
 struct sparse_file_ops {
@@ -90,9 +97,11 @@ struct output_file {
   char* buf;
 };
 
+struct gz_writer;
+
 struct output_file_gz {
   struct output_file out;
-  gzFile gz_fd;
+  struct gz_writer* writer;
 };
 
 #define to_output_file_gz(_o) container_of((_o), struct output_file_gz, out)
@@ -164,10 +173,11 @@ static int file_write(struct output_file* out, void* data, size_t len) {
   return 0;
 }
 
-static void file_close(struct output_file* out) {
+static int file_close(struct output_file* out) {
   struct output_file_normal* outn = to_output_file_normal(out);
 
   free(outn);
+  return 0;
 }
 
 static struct output_file_ops file_ops = {
@@ -178,75 +188,261 @@ static struct output_file_ops file_ops = {
     .close = file_close,
 };
 
-static int gz_file_open(struct output_file* out, int fd) {
-  struct output_file_gz* outgz = to_output_file_gz(out);
+/*
+ * Writes a single gzip member, compressing the input in blocks on a pool of
+ * threads like pigz does.  Each block is raw deflate primed with the last 32k
+ * of the previous block and ends with a sync flush, so the blocks concatenate
+ * into one deflate stream readable by any gzip implementation.
+ */
+#define GZ_BLOCK_SIZE (1024 * 1024)
+#define GZ_DICT_SIZE (32 * 1024)
+#define GZ_LEVEL 9
+
+struct gz_job {
+  std::vector<unsigned char> dict;
+  std::vector<unsigned char> in;
+  bool last;
+  std::vector<unsigned char> out;
+  uLong crc;
+  bool done;
+  bool failed;
+};
 
-  outgz->gz_fd = gzdopen(fd, "wb9");
-  if (!outgz->gz_fd) {
-    error_errno("gzopen");
-    return -errno;
+struct gz_writer {
+  int fd;
+  int64_t in_total;
+  uLong crc;
+  bool failed;
+  std::shared_ptr<gz_job> current;
+  /* Submitted jobs in output order */
+  std::deque<std::shared_ptr<gz_job>> in_flight;
+  size_t max_in_flight;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::shared_ptr<gz_job>> queue;
+  bool stopping;
+  std::vector<std::thread> threads;
+};
+
+static void gz_compress_job(struct gz_job* job) {
+  z_stream strm = {};
+  int ret;
+
+  job->crc = crc32(0, job->in.data(), job->in.size());
+
+  if (deflateInit2(&strm, GZ_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    job->failed = true;
+    return;
+  }
+  if (!job->dict.empty()) {
+    deflateSetDictionary(&strm, job->dict.data(), job->dict.size());
+  }
+
+  job->out.resize(deflateBound(&strm, job->in.size()) + 16);
+  strm.next_in = job->in.data();
+  strm.avail_in = job->in.size();
+  strm.next_out = job->out.data();
+  strm.avail_out = job->out.size();
+  while (true) {
+    ret = deflate(&strm, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ret == Z_STREAM_ERROR || (job->last ? ret == Z_STREAM_END : strm.avail_out > 0)) {
+      break;
+    }
+    /* Out of space, the flush markers aren't covered by deflateBound */
+    size_t used = job->out.size() - strm.avail_out;
+    job->out.resize(job->out.size() * 2);
+    strm.next_out = job->out.data() + used;
+    strm.avail_out = job->out.size() - used;
+  }
+  job->failed = ret == Z_STREAM_ERROR;
+  job->out.resize(job->out.size() - strm.avail_out);
+  deflateEnd(&strm);
+}
+
+static void gz_worker(struct gz_writer* w) {
+  std::unique_lock<std::mutex> lock(w->mutex);
+  while (true) {
+    w->cv.wait(lock, [w] { return w->stopping || !w->queue.empty(); });
+    if (w->queue.empty()) {
+      return;
+    }
+    std::shared_ptr<gz_job> job = w->queue.front();
+    w->queue.pop_front();
+    lock.unlock();
+    gz_compress_job(job.get());
+    lock.lock();
+    job->done = true;
+    w->cv.notify_all();
   }
+}
+
+static int gz_write_all(struct gz_writer* w, const void* data, size_t len) {
+  const char* ptr = reinterpret_cast<const char*>(data);
 
+  while (len > 0) {
+    ssize_t ret = write(w->fd, ptr, len);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error_errno("write");
+      return -1;
+    }
+    ptr += ret;
+    len -= ret;
+  }
   return 0;
 }
 
-static int gz_file_skip(struct output_file* out, int64_t cnt) {
-  off64_t ret;
-  struct output_file_gz* outgz = to_output_file_gz(out);
+/* Writes out the oldest job, waiting for it to be compressed */
+static int gz_retire_job(struct gz_writer* w) {
+  std::shared_ptr<gz_job> job = w->in_flight.front();
+  w->in_flight.pop_front();
+  {
+    std::unique_lock<std::mutex> lock(w->mutex);
+    w->cv.wait(lock, [&job] { return job->done; });
+  }
+  if (job->failed) {
+    error("deflate failed");
+    return -1;
+  }
+  w->crc = crc32_combine(w->crc, job->crc, job->in.size());
+  return gz_write_all(w, job->out.data(), job->out.size());
+}
 
-  ret = gzseek(outgz->gz_fd, cnt, SEEK_CUR);
-  if (ret < 0) {
-    error_errno("gzseek");
+static int gz_submit_job(struct gz_writer* w, bool last) {
+  std::shared_ptr<gz_job> job = w->current;
+  std::shared_ptr<gz_job> next = std::make_shared<gz_job>();
+
+  job->last = last;
+  size_t dict_len = std::min<size_t>(job->in.size(), GZ_DICT_SIZE);
+  next->dict.assign(job->in.end() - dict_len, job->in.end());
+  next->in.reserve(GZ_BLOCK_SIZE);
+  w->current = next;
+
+  {
+    std::lock_guard<std::mutex> lock(w->mutex);
+    w->queue.push_back(job);
+  }
+  w->cv.notify_all();
+  w->in_flight.push_back(job);
+
+  while (w->in_flight.size() > (last ? 0 : w->max_in_flight)) {
+    if (gz_retire_job(w) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int gz_writer_write(struct gz_writer* w, const void* data, size_t len) {
+  const unsigned char* ptr = reinterpret_cast<const unsigned char*>(data);
+
+  if (w->failed) {
     return -1;
   }
+  while (len > 0) {
+    size_t n = std::min(len, GZ_BLOCK_SIZE - w->current->in.size());
+    if (ptr) {
+      w->current->in.insert(w->current->in.end(), ptr, ptr + n);
+      ptr += n;
+    } else {
+      w->current->in.resize(w->current->in.size() + n);
+    }
+    len -= n;
+    w->in_total += n;
+    if (w->current->in.size() == GZ_BLOCK_SIZE && gz_submit_job(w, false) < 0) {
+      w->failed = true;
+      return -1;
+    }
+  }
   return 0;
 }
 
-static int gz_file_pad(struct output_file* out, int64_t len) {
-  off64_t ret;
+/* Stops the compression threads and frees the writer */
+static void gz_writer_free(struct gz_writer* w) {
+  {
+    std::lock_guard<std::mutex> lock(w->mutex);
+    w->stopping = true;
+  }
+  w->cv.notify_all();
+  for (std::thread& thread : w->threads) {
+    thread.join();
+  }
+  delete w;
+}
+
+static int gz_file_open(struct output_file* out, int fd) {
   struct output_file_gz* outgz = to_output_file_gz(out);
+  struct gz_writer* w = new (std::nothrow) gz_writer();
+  /* Header with no name or mtime, maximum compression, unix */
+  static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 2, 3};
 
-  ret = gztell(outgz->gz_fd);
-  if (ret < 0) {
-    return -1;
+  if (!w) {
+    return -ENOMEM;
   }
+  w->fd = fd;
+  w->crc = crc32(0, nullptr, 0);
+  w->current = std::make_shared<gz_job>();
+  w->current->in.reserve(GZ_BLOCK_SIZE);
 
-  if (ret >= len) {
-    return 0;
+  unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+  w->max_in_flight = 2 * threads;
+  for (unsigned int i = 0; i < threads; i++) {
+    w->threads.emplace_back(gz_worker, w);
   }
 
-  ret = gzseek(outgz->gz_fd, len - 1, SEEK_SET);
-  if (ret < 0) {
+  if (gz_write_all(w, header, sizeof(header)) < 0) {
+    gz_writer_free(w);
     return -1;
   }
-
-  gzwrite(outgz->gz_fd, "", 1);
+  outgz->writer = w;
 
   return 0;
 }
 
-static int gz_file_write(struct output_file* out, void* data, size_t len) {
-  int ret;
+static int gz_file_skip(struct output_file* out, int64_t cnt) {
   struct output_file_gz* outgz = to_output_file_gz(out);
 
-  while (len > 0) {
-    ret = gzwrite(outgz->gz_fd, data, std::min<unsigned int>(len, (unsigned int)INT_MAX));
-    if (ret == 0) {
-      error("gzwrite %s", gzerror(outgz->gz_fd, nullptr));
-      return -1;
-    }
-    len -= ret;
-    data = (char*)data + ret;
+  /* Skipped regions are compressed as zeros */
+  return gz_writer_write(outgz->writer, nullptr, cnt);
+}
+
+static int gz_file_pad(struct output_file* out, int64_t len) {
+  struct output_file_gz* outgz = to_output_file_gz(out);
+
+  if (outgz->writer->in_total >= len) {
+    return 0;
   }
+  return gz_writer_write(outgz->writer, nullptr, len - outgz->writer->in_total);
+}
 
-  return 0;
+static int gz_file_write(struct output_file* out, void* data, size_t len) {
+  struct output_file_gz* outgz = to_output_file_gz(out);
+
+  return gz_writer_write(outgz->writer, data, len);
 }
 
-static void gz_file_close(struct output_file* out) {
+static int gz_file_close(struct output_file* out) {
   struct output_file_gz* outgz = to_output_file_gz(out);
+  struct gz_writer* w = outgz->writer;
+  int ret = -1;
+
+  if (!w->failed && gz_submit_job(w, true) == 0) {
+    unsigned char trailer[8];
+    for (int i = 0; i < 4; i++) {
+      trailer[i] = (w->crc >> (8 * i)) & 0xff;
+      trailer[4 + i] = ((uint64_t)w->in_total >> (8 * i)) & 0xff;
+    }
+    ret = gz_write_all(w, trailer, sizeof(trailer));
+  }
 
-  gzclose(outgz->gz_fd);
+  /* gzclose used to close the fd, keep doing so */
+  close(w->fd);
+  gz_writer_free(w);
   free(outgz);
+  return ret;
 }
 
 static struct output_file_ops gz_file_ops = {
@@ -288,10 +484,11 @@ static int callback_file_write(struct output_file* out, void* data, size_t len)
   return outc->write(outc->priv, data, len);
 }
 
-static void callback_file_close(struct output_file* out) {
+static int callback_file_close(struct output_file* out) {
   struct output_file_callback* outc = to_output_file_callback(out);
 
   free(outc);
+  return 0;
 }
 
 static struct output_file_ops callback_file_ops = {
@@ -555,6 +752,7 @@ static int write_normal_fill_chunk(struct output_file* out, uint64_t len, uint32
   int ret;
   unsigned int i;
   uint64_t write_len;
+  uint64_t pad_len = ALIGN(len, out->block_size) - len;
 
   /* Initialize fill_buf with the fill_val */
   for (i = 0; i < FILL_ZERO_BUFSIZE / sizeof(uint32_t); i++) {
@@ -571,6 +769,11 @@ static int write_normal_fill_chunk(struct output_file* out, uint64_t len, uint32
     len -= write_len;
   }
 
+  /* Like the sparse fill chunk, cover the whole of the last block */
+  if (pad_len > 0) {
+    return out->ops->skip(out, pad_len);
+  }
+
   return 0;
 }
 
@@ -607,13 +810,13 @@ static struct sparse_file_ops normal_file_ops = {
     .write_fd_chunk = write_normal_fd_chunk,
 };
 
-void output_file_close(struct output_file* out) {
+int output_file_close(struct output_file* out) {
   out->sparse_ops->write_end_chunk(out);
   free(out->zero_buf);
   free(out->fill_buf);
   out->zero_buf = nullptr;
   out->fill_buf = nullptr;
-  out->ops->close(out);
+  return out->ops->close(out);
 }
 
 static int output_file_init(struct output_file* out, int block_size, int64_t len, bool sparse,
@@ -745,10 +948,17 @@ struct output_file* output_file_open_fd(int fd, unsigned int block_size, int64_t
     return nullptr;
   }
 
-  out->ops->open(out, fd);
+  ret = out->ops->open(out, fd);
+  if (ret < 0) {
+    free(out);
+    return nullptr;
+  }
 
   ret = output_file_init(out, block_size, len, sparse, chunks, crc);
   if (ret < 0) {
+    if (gz) {
+      gz_writer_free(to_output_file_gz(out)->writer);
+    }
     free(out);
     return nullptr;
   }
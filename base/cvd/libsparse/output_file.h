@@ -35,7 +35,7 @@ int write_fill_chunk(struct output_file* out, uint64_t len, uint32_t fill_val);
 int write_file_chunk(struct output_file* out, uint64_t len, const char* file, int64_t offset);
 int write_fd_chunk(struct output_file* out, uint64_t len, int fd, int64_t offset);
 int write_skip_chunk(struct output_file* out, uint64_t len);
-void output_file_close(struct output_file* out);
+int output_file_close(struct output_file* out);
 
 int read_all(int fd, void* buf, size_t len);
 
@@ -0,0 +1,76 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <fcntl.h>
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+#include <sparse/sparse.h>
+
+namespace {
+
+constexpr unsigned int kBlockSize = 4096;
+constexpr unsigned int kBlocks = 64 * 1024 * 1024 / kBlockSize;
+
+// Compresses to about a third of its size, like file system contents.
+std::vector<char> CompressibleData(size_t size) {
+  std::vector<char> data(size);
+  std::mt19937 rng(0);
+  for (auto& c : data) {
+    c = "aaaabbcdefghijklmnopqrstuvwxyz\n"[rng() % 31];
+  }
+  return data;
+}
+
+// Writes a 64 MiB image three quarters of which is data, in runs of 64
+// blocks with fills in between.
+void BM_WriteGz(benchmark::State& state) {
+  const bool sparse = state.range(0);
+  static auto data = new std::vector<char>(
+      CompressibleData(size_t{kBlocks} * kBlockSize * 3 / 4));
+  struct sparse_file* s =
+      sparse_file_new(kBlockSize, int64_t{kBlocks} * kBlockSize);
+  size_t offset = 0;
+  for (unsigned int block = 0; block < kBlocks; block += 64) {
+    if (block % 256 == 192) {
+      CHECK_EQ(sparse_file_add_fill(s, 0, 64 * kBlockSize, block), 0);
+      continue;
+    }
+    CHECK_EQ(sparse_file_add_data(s, data->data() + offset, 64 * kBlockSize,
+                                  block),
+             0);
+    offset += 64 * kBlockSize;
+  }
+  for (auto _ : state) {
+    // Closed by sparse_file_write when compressing.
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    CHECK_GE(fd, 0);
+    CHECK_EQ(sparse_file_write(s, fd, true, sparse, false), 0);
+  }
+  sparse_file_destroy(s);
+  state.SetBytesProcessed(state.iterations() * kBlocks * kBlockSize);
+}
+BENCHMARK(BM_WriteGz)
+    ->ArgName("sparse")
+    ->Arg(0)
+    ->Arg(1)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+}  // namespace
@@ -15,7 +15,13 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include <sparse/sparse.h>
 
@@ -160,9 +166,9 @@ int sparse_file_write(struct sparse_file* s, int fd, bool gz, bool sparse, bool
 
   ret = write_all_blocks(s, out);
 
-  output_file_close(out);
+  int close_ret = output_file_close(out);
 
-  return ret;
+  return ret < 0 ? ret : close_ret;
 }
 
 int sparse_file_callback(struct sparse_file* s, bool sparse, bool crc,
@@ -178,9 +184,9 @@ int sparse_file_callback(struct sparse_file* s, bool sparse, bool crc,
 
   ret = write_all_blocks(s, out);
 
-  output_file_close(out);
+  int close_ret = output_file_close(out);
 
-  return ret;
+  return ret < 0 ? ret : close_ret;
 }
 
 struct chunk_data {
@@ -222,38 +228,154 @@ int sparse_file_foreach_chunk(struct sparse_file* s, bool sparse, bool crc,
     if (ret) return ret;
   }
 
-  output_file_close(out);
-
-  return ret;
+  return output_file_close(out);
 }
 
-static int out_counter_write(void* priv, const void* data __unused, size_t len) {
-  int64_t* count = reinterpret_cast<int64_t*>(priv);
-  *count += len;
-  return 0;
+/*
+ * Number of bytes sparse_file_write_block emits for bb, computed from the
+ * block metadata so that file and fd backed blocks don't have to be read.
+ */
+static int64_t backed_block_output_len(struct backed_block* bb, unsigned int block_size,
+                                       bool sparse) {
+  int64_t len = backed_block_len(bb);
+
+  if (sparse && backed_block_type(bb) == BACKED_BLOCK_FILL) {
+    return sizeof(chunk_header_t) + sizeof(uint32_t);
+  }
+  /* Data, and raw fills, are padded to the block size with zeros or a skip */
+  return (sparse ? sizeof(chunk_header_t) : 0) + ALIGN(len, (int64_t)block_size);
 }
 
 int64_t sparse_file_len(struct sparse_file* s, bool sparse, bool crc) {
-  int ret;
-  int chunks = sparse_count_chunks(s);
-  int64_t count = 0;
-  struct output_file* out;
+  struct backed_block* bb;
+  unsigned int last_block = 0;
+  int64_t count = sparse ? sizeof(sparse_header_t) : 0;
+  int64_t pad;
 
-  out = output_file_open_callback(out_counter_write, &count, s->block_size, s->len, false, sparse,
-                                  chunks, crc);
-  if (!out) {
+  /* Mirrors write_all_blocks */
+  for (bb = backed_block_iter_new(s->backed_block_list); bb; bb = backed_block_iter_next(bb)) {
+    if (backed_block_block(bb) > last_block) {
+      unsigned int blocks = backed_block_block(bb) - last_block;
+      count += sparse ? sizeof(chunk_header_t) : (int64_t)blocks * s->block_size;
+    }
+    count += backed_block_output_len(bb, s->block_size, sparse);
+    last_block = backed_block_block(bb) + DIV_ROUND_UP(backed_block_len(bb), s->block_size);
+  }
+
+  pad = s->len - (int64_t)last_block * s->block_size;
+  if (pad < 0) {
     return -1;
   }
+  if (pad > 0) {
+    if (!sparse) {
+      count += pad;
+    } else if (pad % s->block_size == 0) {
+      /* A partial trailing block is rejected by write_sparse_skip_chunk */
+      count += sizeof(chunk_header_t);
+    }
+  }
 
-  ret = write_all_blocks(s, out);
+  if (sparse && crc) {
+    count += sizeof(chunk_header_t) + sizeof(uint32_t);
+  }
 
-  output_file_close(out);
+  return count;
+}
 
-  if (ret < 0) {
-    return -1;
+static int pread_all(int fd, void* buf, size_t len, int64_t offset) {
+  char* ptr = reinterpret_cast<char*>(buf);
+
+  while (len > 0) {
+    ssize_t ret = pread(fd, ptr, len, offset);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (ret == 0) {
+      return -EINVAL;
+    }
+    ptr += ret;
+    len -= ret;
+    offset += ret;
   }
 
-  return count;
+  return 0;
+}
+
+/* Reads len bytes of bb starting at offset bytes into it */
+static int backed_block_pread(struct backed_block* bb, char* buf, size_t len, int64_t offset) {
+  int ret = 0;
+
+  switch (backed_block_type(bb)) {
+    case BACKED_BLOCK_DATA:
+      memcpy(buf, reinterpret_cast<char*>(backed_block_data(bb)) + offset, len);
+      break;
+    case BACKED_BLOCK_FILL: {
+      /* Blocks start at a multiple of the block size, so the pattern does too */
+      uint32_t fill_val = backed_block_fill_val(bb);
+      const char* pattern = reinterpret_cast<const char*>(&fill_val);
+      for (size_t i = 0; i < len; i++) {
+        buf[i] = pattern[(offset + i) % sizeof(fill_val)];
+      }
+      break;
+    }
+    case BACKED_BLOCK_FD:
+      ret = pread_all(backed_block_fd(bb), buf, len, backed_block_file_offset(bb) + offset);
+      break;
+    case BACKED_BLOCK_FILE: {
+      int fd = open(backed_block_filename(bb), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        return -errno;
+      }
+      ret = pread_all(fd, buf, len, backed_block_file_offset(bb) + offset);
+      close(fd);
+      break;
+    }
+  }
+
+  return ret;
+}
+
+int64_t sparse_file_pread(struct sparse_file* s, void* buf, size_t len, int64_t offset) {
+  struct backed_block* bb;
+  char* out = reinterpret_cast<char*>(buf);
+  int64_t end;
+
+  if (offset < 0) {
+    return -EINVAL;
+  }
+  if (offset >= s->len) {
+    return 0;
+  }
+  len = std::min<int64_t>(len, s->len - offset);
+  end = offset + len;
+
+  /* Gaps between blocks and the padding after their last byte read as zeros */
+  memset(out, 0, len);
+
+  for (bb = backed_block_find(s->backed_block_list, offset / s->block_size); bb;
+       bb = backed_block_iter_next(bb)) {
+    int64_t bb_start = (int64_t)backed_block_block(bb) * s->block_size;
+    int64_t bb_end = bb_start + backed_block_len(bb);
+    int64_t from = std::max(offset, bb_start);
+    int64_t to = std::min(end, bb_end);
+
+    if (bb_start >= end) {
+      break;
+    }
+    if (from >= to) {
+      continue;
+    }
+
+    int ret = backed_block_pread(bb, out + (from - offset), to - from, from - bb_start);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  return len;
 }
 
 unsigned int sparse_file_block_size(struct sparse_file* s) {
@@ -263,13 +385,11 @@ unsigned int sparse_file_block_size(struct sparse_file* s) {
 static int move_chunks_up_to_len(struct sparse_file* from, struct sparse_file* to, unsigned int len,
                                  backed_block** out_bb) {
   int64_t count = 0;
-  struct output_file* out_counter;
   struct backed_block* last_bb = nullptr;
   struct backed_block* bb;
   struct backed_block* start;
   unsigned int last_block = 0;
   int64_t file_len = 0;
-  int ret;
 
   /*
    * overhead is sparse file header, the potential end skip
@@ -279,23 +399,13 @@ static int move_chunks_up_to_len(struct sparse_file* from, struct sparse_file* t
   len -= overhead;
 
   start = backed_block_iter_new(from->backed_block_list);
-  out_counter = output_file_open_callback(out_counter_write, &count, to->block_size, to->len, false,
-                                          true, 0, false);
-  if (!out_counter) {
-    return -1;
-  }
 
   for (bb = start; bb; bb = backed_block_iter_next(bb)) {
     count = 0;
     if (backed_block_block(bb) > last_block) count += sizeof(chunk_header_t);
     last_block = backed_block_block(bb) + DIV_ROUND_UP(backed_block_len(bb), to->block_size);
 
-    /* will call out_counter_write to update count */
-    ret = sparse_file_write_block(out_counter, bb);
-    if (ret) {
-      bb = nullptr;
-      goto out;
-    }
+    count += backed_block_output_len(bb, to->block_size, true);
     if (file_len + count > len) {
       /*
        * If the remaining available size is more than 1/8th of the
@@ -316,9 +426,6 @@ static int move_chunks_up_to_len(struct sparse_file* from, struct sparse_file* t
 move:
   backed_block_list_move(from->backed_block_list, to->backed_block_list, start, last_bb);
 
-out:
-  output_file_close(out_counter);
-
   *out_bb = bb;
   return 0;
 }
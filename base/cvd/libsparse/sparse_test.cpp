@@ -0,0 +1,388 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sparse/sparse.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Pair;
+
+constexpr unsigned int kBlockSize = 4096;
+
+struct SparseFileDeleter {
+  void operator()(struct sparse_file* s) const { sparse_file_destroy(s); }
+};
+using SparseFilePtr = std::unique_ptr<struct sparse_file, SparseFileDeleter>;
+
+SparseFilePtr NewSparseFile(unsigned int blocks) {
+  return SparseFilePtr(sparse_file_new(kBlockSize, int64_t{blocks} * kBlockSize));
+}
+
+// The first block and the number of blocks of every chunk, in output order.
+std::vector<std::pair<unsigned int, unsigned int>> Chunks(struct sparse_file* s) {
+  std::vector<std::pair<unsigned int, unsigned int>> chunks;
+  auto write = [](void* priv, const void*, size_t, unsigned int block,
+                  unsigned int nr_blocks) {
+    auto chunks = static_cast<std::vector<std::pair<unsigned int, unsigned int>>*>(priv);
+    // Large chunks are written in several pieces.
+    if (chunks->empty() || chunks->back().first != block) {
+      chunks->emplace_back(block, nr_blocks);
+    }
+    return 0;
+  };
+  EXPECT_EQ(sparse_file_foreach_chunk(s, false, false, write, &chunks), 0);
+  return chunks;
+}
+
+// The file as sparse_file_write would expand it.
+std::string Expand(struct sparse_file* s) {
+  std::string out;
+  auto write = [](void* priv, const void* data, size_t len) {
+    auto out = static_cast<std::string*>(priv);
+    if (data) {
+      out->append(static_cast<const char*>(data), len);
+    } else {
+      out->append(len, '\0');
+    }
+    return 0;
+  };
+  EXPECT_EQ(sparse_file_callback(s, false, false, write, &out), 0);
+  return out;
+}
+
+TEST(BackedBlockTest, AddsBlocksOutOfOrder) {
+  auto s = NewSparseFile(8);
+  std::string data(kBlockSize, 'd');
+
+  ASSERT_EQ(sparse_file_add_data(s.get(), data.data(), kBlockSize, 5), 0);
+  ASSERT_EQ(sparse_file_add_fill(s.get(), 0x07070707, 2 * kBlockSize, 2), 0);
+  ASSERT_EQ(sparse_file_add_data(s.get(), data.data(), kBlockSize, 0), 0);
+  // Both are merged with the fill at block 2.
+  ASSERT_EQ(sparse_file_add_fill(s.get(), 0x07070707, kBlockSize, 1), 0);
+  ASSERT_EQ(sparse_file_add_fill(s.get(), 0x07070707, kBlockSize, 4), 0);
+
+  EXPECT_THAT(Chunks(s.get()), ElementsAre(Pair(0, 1), Pair(1, 4), Pair(5, 1)));
+  std::string expected = data + std::string(4 * kBlockSize, '\x07') + data +
+                         std::string(2 * kBlockSize, '\0');
+  EXPECT_EQ(Expand(s.get()), expected);
+}
+
+TEST(BackedBlockTest, AddsShuffledBlocks) {
+  constexpr unsigned int kBlocks = 256;
+  auto s = NewSparseFile(2 * kBlocks);
+  std::vector<unsigned int> order(kBlocks);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), std::mt19937(0));
+
+  // Every other block, with fills that can't be merged.
+  for (unsigned int i : order) {
+    ASSERT_EQ(sparse_file_add_fill(s.get(), i, kBlockSize, 2 * i), 0);
+  }
+
+  std::vector<std::pair<unsigned int, unsigned int>> expected;
+  for (unsigned int i = 0; i < kBlocks; i++) {
+    expected.emplace_back(2 * i, 1);
+  }
+  EXPECT_EQ(Chunks(s.get()), expected);
+}
+
+TEST(BackedBlockTest, MergesShuffledBlocks) {
+  constexpr unsigned int kBlocks = 256;
+  auto s = NewSparseFile(kBlocks);
+  std::vector<unsigned int> order(kBlocks);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), std::mt19937(0));
+
+  for (unsigned int i : order) {
+    ASSERT_EQ(sparse_file_add_fill(s.get(), 0, kBlockSize, i), 0);
+  }
+
+  EXPECT_THAT(Chunks(s.get()), ElementsAre(Pair(0, kBlocks)));
+}
+
+// Random bytes, so that misplaced reads don't go unnoticed.
+std::string RandomData(size_t size, unsigned int seed) {
+  std::string data(size, '\0');
+  std::mt19937 rng(seed);
+  for (auto& c : data) {
+    c = static_cast<char>(rng());
+  }
+  return data;
+}
+
+// Blocks 0-1 hold data, 2 is a gap, 3-4 a fill, 5-6 come from an fd, 7 from a
+// file, 8 is a gap and 9 holds 100 bytes of data.
+class SparseFilePreadTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(android::base::WriteStringToFd(fd_data_, fd_file_.fd));
+    ASSERT_TRUE(android::base::WriteStringToFile(file_data_, file_.path));
+    s_ = NewSparseFile(10);
+    ASSERT_EQ(sparse_file_add_fd(s_.get(), fd_file_.fd, kBlockSize, 2 * kBlockSize, 5), 0);
+    ASSERT_EQ(sparse_file_add_data(s_.get(), tail_.data(), tail_.size(), 9), 0);
+    ASSERT_EQ(sparse_file_add_fill(s_.get(), 0x04030201, 2 * kBlockSize, 3), 0);
+    ASSERT_EQ(sparse_file_add_file(s_.get(), file_.path, 0, kBlockSize, 7), 0);
+    ASSERT_EQ(sparse_file_add_data(s_.get(), data_.data(), data_.size(), 0), 0);
+
+    expected_ = data_ + std::string(kBlockSize, '\0');
+    for (int i = 0; i < 2 * kBlockSize / 4; i++) {
+      expected_ += "\x01\x02\x03\x04";
+    }
+    expected_ += fd_data_.substr(kBlockSize, 2 * kBlockSize) + file_data_ +
+                 std::string(kBlockSize, '\0') + tail_ +
+                 std::string(kBlockSize - tail_.size(), '\0');
+  }
+
+  std::string Pread(int64_t offset, size_t len, int64_t* ret = nullptr) {
+    std::string buf(len, 'x');
+    int64_t read = sparse_file_pread(s_.get(), buf.data(), len, offset);
+    if (ret) {
+      *ret = read;
+    }
+    buf.resize(std::max<int64_t>(read, 0));
+    return buf;
+  }
+
+  TemporaryFile fd_file_;
+  TemporaryFile file_;
+  std::string data_ = RandomData(2 * kBlockSize, 1);
+  std::string fd_data_ = RandomData(3 * kBlockSize, 2);
+  std::string file_data_ = RandomData(kBlockSize, 3);
+  std::string tail_ = RandomData(100, 4);
+  SparseFilePtr s_;
+  std::string expected_;
+};
+
+TEST_F(SparseFilePreadTest, ReadsWholeFile) {
+  ASSERT_EQ(expected_.size(), 10 * kBlockSize);
+  EXPECT_EQ(Expand(s_.get()), expected_);
+
+  int64_t ret;
+  EXPECT_EQ(Pread(0, expected_.size(), &ret), expected_);
+  EXPECT_EQ(ret, expected_.size());
+}
+
+TEST_F(SparseFilePreadTest, ReadsAcrossChunkBoundaries) {
+  for (int64_t offset = 0; offset < expected_.size(); offset += 1021) {
+    for (size_t len : {1, 7, 4096, 5000, 3 * 4096 + 3}) {
+      size_t expected_len = std::min<size_t>(len, expected_.size() - offset);
+      ASSERT_EQ(Pread(offset, len), expected_.substr(offset, expected_len))
+          << "offset " << offset << ", len " << len;
+    }
+  }
+}
+
+TEST_F(SparseFilePreadTest, ReadsPastEnd) {
+  const int64_t size = expected_.size();
+  int64_t ret;
+
+  EXPECT_EQ(Pread(size - 10, 100, &ret), expected_.substr(size - 10));
+  EXPECT_EQ(ret, 10);
+  EXPECT_EQ(Pread(size, 100, &ret), "");
+  EXPECT_EQ(ret, 0);
+  EXPECT_EQ(Pread(size + kBlockSize, 100, &ret), "");
+  EXPECT_EQ(ret, 0);
+  EXPECT_EQ(Pread(-1, 100, &ret), "");
+  EXPECT_EQ(ret, -EINVAL);
+}
+
+TEST_F(SparseFilePreadTest, ReadsImportedFile) {
+  TemporaryFile image;
+  ASSERT_EQ(sparse_file_write(s_.get(), image.fd, false, true, false), 0);
+  ASSERT_EQ(lseek(image.fd, 0, SEEK_SET), 0);
+  SparseFilePtr imported(sparse_file_import(image.fd, false, false));
+  ASSERT_NE(imported, nullptr);
+
+  std::string buf(expected_.size(), 'x');
+  EXPECT_EQ(sparse_file_pread(imported.get(), buf.data(), buf.size(), 0), buf.size());
+  EXPECT_EQ(buf, expected_);
+  buf.resize(5000);
+  EXPECT_EQ(sparse_file_pread(imported.get(), buf.data(), buf.size(), 3 * kBlockSize - 7),
+            buf.size());
+  EXPECT_EQ(buf, expected_.substr(3 * kBlockSize - 7, 5000));
+}
+
+TEST_F(SparseFilePreadTest, ReadsConcurrently) {
+  std::vector<std::thread> threads;
+  for (unsigned int seed = 0; seed < 4; seed++) {
+    threads.emplace_back([this, seed]() {
+      std::mt19937 rng(seed);
+      for (int i = 0; i < 200; i++) {
+        int64_t offset = rng() % expected_.size();
+        size_t len = rng() % (3 * kBlockSize);
+        size_t expected_len = std::min<size_t>(len, expected_.size() - offset);
+        EXPECT_EQ(Pread(offset, len), expected_.substr(offset, expected_len));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// The size of the file sparse_file_write makes.
+int64_t WrittenLength(struct sparse_file* s, bool sparse, bool crc) {
+  TemporaryFile file;
+  EXPECT_EQ(sparse_file_write(s, file.fd, false, sparse, crc), 0);
+  struct stat st {};
+  EXPECT_EQ(fstat(file.fd, &st), 0);
+  return st.st_size;
+}
+
+// The number of bytes sparse_file_callback passes on, which unlike a file
+// isn't truncated to the length of the image.
+int64_t CallbackLength(struct sparse_file* s, bool sparse, bool crc) {
+  int64_t len = 0;
+  auto write = [](void* priv, const void*, size_t len) {
+    *static_cast<int64_t*>(priv) += len;
+    return 0;
+  };
+  EXPECT_EQ(sparse_file_callback(s, sparse, crc, write, &len), 0);
+  return len;
+}
+
+// Checks sparse_file_len against the bytes written, in every mode.
+void ExpectLenMatchesWrite(struct sparse_file* s) {
+  for (bool sparse : {false, true}) {
+    for (bool crc : {false, true}) {
+      SCOPED_TRACE(testing::Message() << "sparse " << sparse << ", crc " << crc);
+      EXPECT_EQ(sparse_file_len(s, sparse, crc), WrittenLength(s, sparse, crc));
+      EXPECT_EQ(sparse_file_len(s, sparse, crc), CallbackLength(s, sparse, crc));
+    }
+  }
+}
+
+class SparseFileLenTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(android::base::WriteStringToFd(RandomData(3 * kBlockSize, 5), fd_file_.fd));
+  }
+
+  // Leaves out block 0, 4-5 and 9 onwards, adding blocks out of order.
+  void AddChunks(struct sparse_file* s) {
+    ASSERT_EQ(sparse_file_add_fd(s, fd_file_.fd, kBlockSize, 2 * kBlockSize, 6), 0);
+    ASSERT_EQ(sparse_file_add_data(s, data_.data(), kBlockSize, 1), 0);
+    ASSERT_EQ(sparse_file_add_fill(s, 0xcafef00d, 2 * kBlockSize, 2), 0);
+    ASSERT_EQ(sparse_file_add_data(s, data_.data(), 100, 8), 0);
+  }
+
+  TemporaryFile fd_file_;
+  std::string data_ = RandomData(kBlockSize, 6);
+};
+
+TEST_F(SparseFileLenTest, MatchesWriteWithGaps) {
+  auto s = NewSparseFile(10);
+  AddChunks(s.get());
+  ExpectLenMatchesWrite(s.get());
+}
+
+TEST_F(SparseFileLenTest, MatchesWriteWithPartialLastBlock) {
+  SparseFilePtr s(sparse_file_new(kBlockSize, 9 * kBlockSize + 1000));
+  AddChunks(s.get());
+  ExpectLenMatchesWrite(s.get());
+}
+
+TEST_F(SparseFileLenTest, MatchesWriteEndingInData) {
+  auto s = NewSparseFile(9);
+  AddChunks(s.get());
+  ASSERT_EQ(sparse_file_add_data(s.get(), data_.data(), kBlockSize, 0), 0);
+  ExpectLenMatchesWrite(s.get());
+}
+
+TEST_F(SparseFileLenTest, MatchesWriteWithPartialFill) {
+  auto s = NewSparseFile(5);
+  ASSERT_EQ(sparse_file_add_fill(s.get(), 0x01010101, kBlockSize + 100, 1), 0);
+  ASSERT_EQ(sparse_file_add_data(s.get(), data_.data(), kBlockSize, 3), 0);
+  ExpectLenMatchesWrite(s.get());
+
+  // The rest of the fill's last block is zero, and the next block in place.
+  auto raw = Expand(s.get());
+  ASSERT_EQ(raw.size(), 5 * kBlockSize);
+  EXPECT_EQ(raw.substr(2 * kBlockSize + 100, kBlockSize - 100),
+            std::string(kBlockSize - 100, '\0'));
+  EXPECT_EQ(raw.substr(3 * kBlockSize, kBlockSize), data_);
+}
+
+TEST_F(SparseFileLenTest, MatchesWriteWhenEmpty) {
+  auto s = NewSparseFile(4);
+  ExpectLenMatchesWrite(s.get());
+}
+
+TEST(GzWriteTest, FailsWhenHeaderCantBeWritten) {
+  auto s = NewSparseFile(4);
+  std::string data = RandomData(kBlockSize, 7);
+  ASSERT_EQ(sparse_file_add_data(s.get(), data.data(), kBlockSize, 1), 0);
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  close(fds[0]);
+  auto old_handler = signal(SIGPIPE, SIG_IGN);
+
+  int ret = sparse_file_write(s.get(), fds[1], true, false, false);
+
+  signal(SIGPIPE, old_handler);
+  close(fds[1]);
+  EXPECT_LT(ret, 0);
+}
+
+TEST(GzWriteTest, FailsWhenTrailerCantBeWritten) {
+  auto s = NewSparseFile(4);
+  std::string data = RandomData(kBlockSize, 7);
+  ASSERT_EQ(sparse_file_add_data(s.get(), data.data(), kBlockSize, 1), 0);
+  TemporaryFile file;
+  // The gzip output closes the fd it's given.
+  ASSERT_EQ(sparse_file_write(s.get(), dup(file.fd), true, false, false), 0);
+  struct stat st {};
+  ASSERT_EQ(fstat(file.fd, &st), 0);
+
+  // Only the last bytes of the trailer go past the limit.
+  struct rlimit old_limit;
+  ASSERT_EQ(getrlimit(RLIMIT_FSIZE, &old_limit), 0);
+  struct rlimit limit = old_limit;
+  limit.rlim_cur = st.st_size - 4;
+  auto old_handler = signal(SIGXFSZ, SIG_IGN);
+  ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+
+  int ret = sparse_file_write(s.get(), open(file.path, O_WRONLY | O_TRUNC), true, false, false);
+
+  setrlimit(RLIMIT_FSIZE, &old_limit);
+  signal(SIGXFSZ, old_handler);
+  EXPECT_LT(ret, 0);
+  ASSERT_EQ(fstat(file.fd, &st), 0);
+  EXPECT_EQ(st.st_size, limit.rlim_cur);
+}
+
+}  // namespace
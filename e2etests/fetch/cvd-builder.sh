@@ -0,0 +1,91 @@
+#!/bin/bash
+
+# Copyright (C) 2024 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# --- begin runfiles.bash initialization ---
+# Copy-pasted from Bazel's Bash runfiles library (tools/bash/runfiles/runfiles.bash).
+set -euo pipefail
+if [[ ! -d "${RUNFILES_DIR:-/dev/null}" && ! -f "${RUNFILES_MANIFEST_FILE:-/dev/null}" ]]; then
+  if [[ -f "$0.runfiles_manifest" ]]; then
+    export RUNFILES_MANIFEST_FILE="$0.runfiles_manifest"
+  elif [[ -f "$0.runfiles/MANIFEST" ]]; then
+    export RUNFILES_MANIFEST_FILE="$0.runfiles/MANIFEST"
+  elif [[ -f "$0.runfiles/bazel_tools/tools/bash/runfiles/runfiles.bash" ]]; then
+    export RUNFILES_DIR="$0.runfiles"
+  fi
+fi
+if [[ -f "${RUNFILES_DIR:-/dev/null}/bazel_tools/tools/bash/runfiles/runfiles.bash" ]]; then
+  source "${RUNFILES_DIR}/bazel_tools/tools/bash/runfiles/runfiles.bash"
+elif [[ -f "${RUNFILES_MANIFEST_FILE:-/dev/null}" ]]; then
+  source "$(grep -m1 "^bazel_tools/tools/bash/runfiles/runfiles.bash " \
+            "$RUNFILES_MANIFEST_FILE" | cut -d ' ' -f 2-)"
+else
+  echo >&2 "ERROR: cannot find @bazel_tools//tools/bash/runfiles:runfiles.bash"
+  exit 1
+fi
+# --- end runfiles.bash initialization ---
+
+# Builds the cvd executable from base/cvd with meson, the same way the
+# cuttlefish-base package does, so the fetch benchmarks measure this tree's cvd.
+
+usage() {
+  echo "usage: $0 -o /path/to/cvd"
+}
+
+output=
+
+while getopts ":ho:" opt; do
+  case "${opt}" in
+    h)
+      usage
+      exit 0
+      ;;
+    o)
+      output="${OPTARG}"
+      ;;
+    \?)
+      echo "Invalid option: ${OPTARG}" >&2
+      usage
+      exit 1
+      ;;
+    :)
+      echo "Invalid option: ${OPTARG} requires an argument" >&2
+      usage
+      exit 1
+      ;;
+  esac
+done
+
+if [[ -z "${output}" ]]; then
+  usage
+  exit 1
+fi
+
+for tool in meson ninja; do
+  if ! command -v "${tool}" > /dev/null; then
+    echo "${tool} is required to build cvd" >&2
+    exit 1
+  fi
+done
+
+rlocation="$(rlocation _main/e2etests/fetch/cvd-builder.sh)"
+repo_root_dir=$(dirname $(dirname $(dirname $(readlink ${rlocation}))))
+
+build_dir="$(mktemp -d -t cvd_build.XXXXXX)"
+trap 'rm -rf "${build_dir}"' EXIT
+
+meson setup "${build_dir}" "${repo_root_dir}/base/cvd"
+ninja -C "${build_dir}" cvd
+cp "${build_dir}/cvd" "${output}"
@@ -0,0 +1,256 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2024 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Local stand-in for the Android Build API and its signed-URL storage.
+
+Serves the subset of the Build API used by `cvd fetch` with generated
+artifacts, so fetch can be measured without network access. Each response can
+be delayed, throttled or replaced with a server error to model real
+conditions. Request counts, bytes and timings are available at /stats.
+"""
+
+import argparse
+import io
+import json
+import os
+import random
+import struct
+import tarfile
+import threading
+import time
+import urllib.parse
+import zipfile
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+SPARSE_MAGIC = 0xED26FF3A
+CHUNK_TYPE_RAW = 0xCAC1
+CHUNK_TYPE_DONT_CARE = 0xCAC3
+BLOCK_SIZE = 4096
+
+
+def sparse_image(size, data_ratio, rng):
+  """Android sparse image alternating RAW and DONT_CARE chunks."""
+  total_blocks = size // BLOCK_SIZE
+  chunk_blocks = 256
+  chunks = []
+  block = 0
+  while block < total_blocks:
+    blocks = min(chunk_blocks, total_blocks - block)
+    if rng.random() < data_ratio:
+      data = rng.randbytes(blocks * BLOCK_SIZE)
+      chunks.append(struct.pack("<HHII", CHUNK_TYPE_RAW, 0, blocks,
+                                12 + len(data)) + data)
+    else:
+      chunks.append(struct.pack("<HHII", CHUNK_TYPE_DONT_CARE, 0, blocks, 12))
+    block += blocks
+  header = struct.pack("<IHHHHIIII", SPARSE_MAGIC, 1, 0, 28, 12, BLOCK_SIZE,
+                       total_blocks, len(chunks), 0)
+  return header + b"".join(chunks)
+
+
+def raw_image(size, data_ratio, rng):
+  data = int(size * data_ratio)
+  return rng.randbytes(data) + bytes(size - data)
+
+
+def generate_artifacts(args):
+  rng = random.Random(args.seed)
+  mib = 1024 * 1024
+  images = {
+      "super.img": sparse_image(args.image_size_mb * mib, args.data_ratio, rng),
+      "boot.img": raw_image(64 * mib, args.data_ratio, rng),
+      "vendor_boot.img": raw_image(32 * mib, args.data_ratio, rng),
+      "userdata.img": sparse_image(256 * mib, 0.0, rng),
+  }
+  img_zip = io.BytesIO()
+  compression = zipfile.ZIP_DEFLATED if args.compress else zipfile.ZIP_STORED
+  with zipfile.ZipFile(img_zip, "w", compression) as archive:
+    for name, data in images.items():
+      archive.writestr(name, data)
+
+  host_package = io.BytesIO()
+  with tarfile.open(fileobj=host_package, mode="w:gz") as archive:
+    for i in range(args.host_files):
+      data = rng.randbytes(args.host_file_kb * 1024)
+      info = tarfile.TarInfo(f"bin/tool_{i}")
+      info.size = len(data)
+      info.mode = 0o755
+      archive.addfile(info, io.BytesIO(data))
+
+  return {
+      f"{args.product}-img-{args.build_id}.zip": img_zip.getvalue(),
+      "cvd-host_package.tar.gz": host_package.getvalue(),
+  }
+
+
+class Stats:
+
+  def __init__(self):
+    self.lock = threading.Lock()
+    self.values = {
+        "metadata_requests": 0,
+        "metadata_seconds": 0.0,
+        "download_requests": 0,
+        "download_bytes": 0,
+        "download_seconds": 0.0,
+        "injected_errors": 0,
+        "first_request_time": None,
+        "last_response_time": None,
+    }
+
+  def record(self, kind, seconds, size=0):
+    with self.lock:
+      self.values[f"{kind}_requests"] += 1
+      self.values[f"{kind}_seconds"] += seconds
+      if kind == "download":
+        self.values["download_bytes"] += size
+      self.values["last_response_time"] = time.time()
+
+  def start_request(self):
+    with self.lock:
+      if self.values["first_request_time"] is None:
+        self.values["first_request_time"] = time.time()
+
+  def error(self):
+    with self.lock:
+      self.values["injected_errors"] += 1
+
+  def snapshot(self):
+    with self.lock:
+      return dict(self.values)
+
+
+def make_handler(args, artifacts, stats, error_rng):
+
+  class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *log_args):
+      if args.verbose:
+        super().log_message(format, *log_args)
+
+    def send_json(self, value, code=200):
+      body = json.dumps(value).encode()
+      self.send_response(code)
+      self.send_header("Content-Type", "application/json")
+      self.send_header("Content-Length", str(len(body)))
+      self.end_headers()
+      self.wfile.write(body)
+
+    def send_throttled(self, data):
+      self.send_response(200)
+      self.send_header("Content-Type", "application/octet-stream")
+      self.send_header("Content-Length", str(len(data)))
+      self.end_headers()
+      chunk = 256 * 1024
+      bytes_per_second = args.bandwidth_mbps * 1024 * 1024 / 8
+      start = time.monotonic()
+      for offset in range(0, len(data), chunk):
+        self.wfile.write(data[offset:offset + chunk])
+        if bytes_per_second > 0:
+          ahead = (offset + chunk) / bytes_per_second - (time.monotonic() -
+                                                         start)
+          if ahead > 0:
+            time.sleep(ahead)
+
+    def do_GET(self):
+      start = time.monotonic()
+      url = urllib.parse.urlparse(self.path)
+      parts = [urllib.parse.unquote(p) for p in url.path.split("/") if p]
+      if parts == ["stats"]:
+        self.send_json(stats.snapshot())
+        return
+      stats.start_request()
+      if args.latency_ms > 0:
+        time.sleep(args.latency_ms / 1000)
+      with stats.lock:
+        inject_error = error_rng.random() < args.error_rate
+      if inject_error:
+        stats.error()
+        self.send_json({"error": {"code": 503}}, 503)
+        return
+
+      if parts and parts[0] == "storage":
+        data = artifacts.get(parts[-1])
+        if data is None:
+          self.send_json({"error": {"code": 404}}, 404)
+          return
+        self.send_throttled(data)
+        stats.record("download", time.monotonic() - start, len(data))
+        return
+
+      response = self.build_api_response(parts)
+      if response is None:
+        self.send_json({"error": {"code": 404}}, 404)
+      else:
+        self.send_json(response)
+      stats.record("metadata", time.monotonic() - start)
+
+    def build_api_response(self, parts):
+      if parts == ["builds"]:
+        return {"builds": [{"buildId": args.build_id}]}
+      if len(parts) == 3 and parts[0] == "builds":
+        return {
+            "buildId": parts[1],
+            "buildAttemptStatus": "COMPLETE",
+            "target": {"name": parts[2], "product": args.product},
+        }
+      if parts[3:6] == ["attempts", "latest", "artifacts"]:
+        if len(parts) == 6:
+          return {"artifacts": [{"name": name} for name in artifacts]}
+        if len(parts) == 8 and parts[7] == "url":
+          host, port = self.server.server_address[:2]
+          name = urllib.parse.quote(parts[6])
+          return {"signedUrl": f"http://{host}:{port}/storage/{name}"}
+      return None
+
+  return Handler
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__)
+  parser.add_argument("--port", type=int, default=0)
+  parser.add_argument("--port_file", help="Where to write the bound port")
+  parser.add_argument("--build_id", default="1000000")
+  parser.add_argument("--product", default="aosp_cf_x86_64_phone")
+  parser.add_argument("--latency_ms", type=float, default=0)
+  parser.add_argument("--bandwidth_mbps", type=float, default=0,
+                      help="Per-download throughput limit, 0 is unlimited")
+  parser.add_argument("--error_rate", type=float, default=0,
+                      help="Fraction of requests answered with HTTP 503")
+  parser.add_argument("--image_size_mb", type=int, default=1024)
+  parser.add_argument("--data_ratio", type=float, default=0.25,
+                      help="Fraction of image blocks holding data")
+  parser.add_argument("--host_files", type=int, default=200)
+  parser.add_argument("--host_file_kb", type=int, default=256)
+  parser.add_argument("--compress", action="store_true")
+  parser.add_argument("--seed", type=int, default=0)
+  parser.add_argument("--verbose", action="store_true")
+  args = parser.parse_args()
+
+  artifacts = generate_artifacts(args)
+  stats = Stats()
+  handler = make_handler(args, artifacts, stats, random.Random(args.seed))
+  server = ThreadingHTTPServer(("127.0.0.1", args.port), handler)
+  if args.port_file:
+    with open(args.port_file + ".tmp", "w") as port_file:
+      port_file.write(str(server.server_address[1]))
+    os.rename(args.port_file + ".tmp", args.port_file)
+  server.serve_forever()
+
+
+if __name__ == "__main__":
+  main()
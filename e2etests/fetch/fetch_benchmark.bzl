@@ -0,0 +1,45 @@
+# Copyright (C) 2024 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+def fetch_benchmark(name, image_size_mb = 1024, latency_ms = 0,
+                    bandwidth_mbps = 0, error_rate = 0, compress = False):
+    server_args = [
+        "--image_size_mb=%d" % image_size_mb,
+        "--latency_ms=%d" % latency_ms,
+        "--bandwidth_mbps=%d" % bandwidth_mbps,
+        "--error_rate=%s" % error_rate,
+    ]
+    if compress:
+        server_args.append("--compress")
+    native.sh_test(
+        name = name,
+        size = "large",
+        srcs = ["fetch_benchmark.sh"],
+        args = [
+            "-c",
+            "$(rootpath :cvd_bin)",
+            "-s",
+            "e2etests/fetch/fake_build_api.py",
+            "--",
+        ] + server_args,
+        data = [
+            "fake_build_api.py",
+            ":cvd_bin",
+        ],
+        tags = [
+            "exclusive",
+            "manual",
+            "no-sandbox",
+        ],
+    )
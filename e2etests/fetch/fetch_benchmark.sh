@@ -0,0 +1,204 @@
+#!/bin/bash
+
+# Copyright (C) 2024 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Runs `cvd fetch` against a local fake Build API server and reports wall time,
+# CPU time, bytes and round trips, in total and per phase. Arguments after --
+# are passed to the server, e.g.
+# -- --latency_ms=50 --bandwidth_mbps=800 --image_size_mb=4096
+#
+# The phases come from the trace spans cvd records to CVD_TRACE_FILE. The CPU
+# time of a phase includes the subprocesses it waited for, like bsdtar.
+
+set -e
+
+CVD=""
+SERVER=""
+
+while getopts "c:s:" opt; do
+  case "${opt}" in
+    c)
+      CVD="${OPTARG}"
+      ;;
+    s)
+      SERVER="${OPTARG}"
+      ;;
+    *)
+      echo "Usage: $0 -c cvd -s fake_build_api.py [-- server args]" >&2
+      exit 1
+  esac
+done
+shift $((OPTIND - 1))
+
+if [[ "${CVD}" == "" ]]; then
+  echo "Missing required -c argument" >&2
+  exit 1
+fi
+
+if [[ ! -x "${CVD}" ]]; then
+  echo "\"${CVD}\" is not executable" >&2
+  exit 1
+fi
+
+if [[ "${SERVER}" == "" ]]; then
+  echo "Missing required -s argument" >&2
+  exit 1
+fi
+
+workdir="$(mktemp -d -t cvd_fetch_benchmark.XXXXXX)"
+server_pid=""
+
+function cleanup() {
+  set +e
+  if [[ -n "${server_pid}" ]]; then
+    kill "${server_pid}"
+  fi
+  if [[ -n "${TEST_UNDECLARED_OUTPUTS_DIR}" ]] && [[ -d "${TEST_UNDECLARED_OUTPUTS_DIR}" ]]; then
+    cp "${workdir}"/report.json "${workdir}"/trace.json \
+      "${workdir}"/fetch/fetch.log "${TEST_UNDECLARED_OUTPUTS_DIR}"
+  fi
+  rm -rf "${workdir}"
+}
+trap cleanup EXIT
+
+python3 "${SERVER}" --port_file="${workdir}/port" "$@" &
+server_pid=$!
+# Generating the artifacts takes a while for large images.
+for _ in $(seq 600); do
+  [[ -f "${workdir}/port" ]] && break
+  sleep 0.5
+done
+if [[ ! -f "${workdir}/port" ]]; then
+  echo "The fake Build API server didn't start" >&2
+  exit 1
+fi
+port="$(cat "${workdir}/port")"
+api="http://127.0.0.1:${port}"
+
+mkdir "${workdir}/home"
+start_ns="$(date +%s%N)"
+# Writes the user and system CPU seconds of cvd and all of its children, and
+# the largest resident set size among them, in KiB.
+HOME="${workdir}/home" CVD_TRACE_FILE="${workdir}/trace.json" python3 - \
+  "${workdir}/time" "${CVD}" fetch \
+    --api_base_url="${api}" \
+    --default_build="benchmark-branch/aosp_cf_x86_64_phone-userdebug" \
+    --target_directory="${workdir}/fetch" \
+    --credential_source="" <<'EOF'
+import resource
+import subprocess
+import sys
+
+status = subprocess.call(sys.argv[2:])
+usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+with open(sys.argv[1], "w") as time_file:
+  print(usage.ru_utime, usage.ru_stime, usage.ru_maxrss, file=time_file)
+sys.exit(status)
+EOF
+end_ns="$(date +%s%N)"
+
+curl -s "${api}/stats" > "${workdir}/stats.json"
+read -r user_s sys_s max_rss_kb < "${workdir}/time"
+
+python3 - "${workdir}/stats.json" "${start_ns}" "${end_ns}" "${user_s}" \
+  "${sys_s}" "${max_rss_kb}" "${workdir}/trace.json" \
+  > "${workdir}/report.json" <<'EOF'
+import collections
+import json
+import sys
+
+# Trace spans making up each phase.
+PHASES = {
+    "metadata": [
+        "BuildApi::GetBuild",
+        "BuildApi::Artifacts",
+        "BuildApi::GetArtifactDownloadUrl",
+    ],
+    "download": ["BuildApi::ArtifactToFile"],
+    "extraction": ["Archive::ExtractFiles", "Archive::ExtractToMemory"],
+    "desparse": ["DeAndroidSparse", "simg2img"],
+}
+
+
+def load_trace(path):
+  text = open(path).read().rstrip().rstrip(",")
+  if not text.endswith("]"):
+    text += "]"
+  return json.loads(text)
+
+
+def phase_times(events):
+  """Sums the wall and CPU time of the spans of each phase.
+
+  A span's time excludes that of spans of other phases nested in it, such as
+  the signed URL request in a download. Phases running on several threads at
+  once add up to more than the wall time of the fetch.
+  """
+  phase_of = {name: phase for phase, names in PHASES.items() for name in names}
+  spans = collections.defaultdict(list)
+  for event in events:
+    if event.get("ph") == "X" and event["name"] in phase_of:
+      spans[(event["pid"], event["tid"])].append(event)
+  times = {
+      phase: {"spans": 0, "wall_seconds": 0.0, "cpu_seconds": 0.0}
+      for phase in PHASES
+  }
+  for thread_spans in spans.values():
+    # Outer spans first, so the open ones form a stack.
+    thread_spans.sort(key=lambda e: (e["ts"], -e["dur"]))
+    stack = []
+    for event in thread_spans:
+      while stack and stack[-1]["ts"] + stack[-1]["dur"] <= event["ts"]:
+        stack.pop()
+      phase = phase_of[event["name"]]
+      parent = stack[-1] if stack else None
+      if parent is not None and phase_of[parent["name"]] == phase:
+        # Already counted as part of the enclosing span.
+        stack.append(event)
+        continue
+      times[phase]["spans"] += 1
+      times[phase]["wall_seconds"] += event["dur"] / 1e6
+      times[phase]["cpu_seconds"] += event.get("tdur", 0) / 1e6
+      if parent is not None:
+        parent_times = times[phase_of[parent["name"]]]
+        parent_times["wall_seconds"] -= event["dur"] / 1e6
+        parent_times["cpu_seconds"] -= event.get("tdur", 0) / 1e6
+      stack.append(event)
+  return times
+
+
+stats = json.load(open(sys.argv[1]))
+start = int(sys.argv[2]) / 1e9
+end = int(sys.argv[3]) / 1e9
+report = {
+    "wall_seconds": end - start,
+    "user_cpu_seconds": float(sys.argv[4]),
+    "system_cpu_seconds": float(sys.argv[5]),
+    "max_rss_kb": int(sys.argv[6]),
+    "round_trips": stats["metadata_requests"] + stats["download_requests"],
+    "metadata_requests": stats["metadata_requests"],
+    "metadata_server_seconds": stats["metadata_seconds"],
+    "download_requests": stats["download_requests"],
+    "download_bytes": stats["download_bytes"],
+    "download_server_seconds": stats["download_seconds"],
+    "injected_errors": stats["injected_errors"],
+    # Time before the first request: flag parsing and startup.
+    "startup_seconds": (stats["first_request_time"] or end) - start,
+    "phases": phase_times(load_trace(sys.argv[7])),
+}
+json.dump(report, sys.stdout, indent=2)
+print()
+EOF
+cat "${workdir}/report.json"